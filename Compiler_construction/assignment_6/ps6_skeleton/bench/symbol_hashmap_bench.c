@@ -0,0 +1,169 @@
+// Microbenchmark comparing the symbol hashmap in symbol_table.c against the
+// linear probing hashmap it replaced, on insertion and lookup of N_SYMBOLS names.
+//
+// Usage: symbol_hashmap_bench [n_symbols]
+
+#include "symbols.h"
+#include "intern.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define N_SYMBOLS 1000000
+
+// ============ The previous hashmap, kept for comparison ============
+// Hashes every name with a multiplicative hash, indexes using %, and compares names using strcmp
+
+typedef struct legacy_hashmap
+{
+    symbol_t **buckets;
+    size_t n_buckets;
+    size_t n_entries;
+} legacy_hashmap_t;
+
+static uint64_t legacy_hash_string ( const char* string )
+{
+    uint64_t hash = 31;
+    for (const char *c = string; *c != '\0'; c++)
+        hash = hash * 257 + *c;
+    return hash;
+}
+
+static insert_result_t legacy_insert ( legacy_hashmap_t *hashmap, symbol_t *symbol );
+
+static void legacy_resize ( legacy_hashmap_t *hashmap, size_t new_capacity )
+{
+    symbol_t **old_buckets = hashmap->buckets;
+    size_t old_capacity = hashmap->n_buckets;
+
+    hashmap->buckets = calloc ( new_capacity, sizeof(symbol_t*) );
+    hashmap->n_buckets = new_capacity;
+    hashmap->n_entries = 0;
+
+    for ( size_t i = 0; i < old_capacity; i++ )
+    {
+        if ( old_buckets[i] != NULL )
+            legacy_insert ( hashmap, old_buckets[i] );
+    }
+
+    free ( old_buckets );
+}
+
+static insert_result_t legacy_insert ( legacy_hashmap_t *hashmap, symbol_t *symbol )
+{
+    if ( ( hashmap->n_entries + 1 ) * 2 > hashmap->n_buckets )
+        legacy_resize ( hashmap, hashmap->n_buckets*2 + 8 );
+
+    size_t bucket = legacy_hash_string ( symbol->name ) % hashmap->n_buckets;
+    while ( hashmap->buckets[bucket] != NULL )
+    {
+        if ( strcmp ( hashmap->buckets[bucket]->name, symbol->name ) == 0 )
+            return INSERT_COLLISION;
+        bucket = (bucket + 1) % hashmap->n_buckets;
+    }
+
+    hashmap->buckets[bucket] = symbol;
+    hashmap->n_entries++;
+    return INSERT_OK;
+}
+
+static symbol_t* legacy_lookup ( legacy_hashmap_t *hashmap, const char *name )
+{
+    size_t bucket = legacy_hash_string ( name ) % hashmap->n_buckets;
+    while ( hashmap->buckets[bucket] != NULL )
+    {
+        if ( strcmp ( hashmap->buckets[bucket]->name, name ) == 0 )
+            return hashmap->buckets[bucket];
+        bucket = (bucket + 1) % hashmap->n_buckets;
+    }
+    return NULL;
+}
+
+// ============ Benchmark driver ============
+
+static double now ( void )
+{
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report ( const char *map, const char *operation, size_t n, double seconds )
+{
+    printf ( "%-8s %-14s %10.2f ms %8.1f ns/op\n", map, operation, seconds * 1e3, seconds * 1e9 / n );
+}
+
+int main ( int argc, char **argv )
+{
+    size_t n = argc > 1 ? strtoul ( argv[1], NULL, 10 ) : N_SYMBOLS;
+
+    // Names looking like the identifiers of a large generated program.
+    // The second half is never inserted, and is used for lookups that miss
+    char **names = malloc ( 2 * n * sizeof(char*) );
+    char buffer[32];
+    for ( size_t i = 0; i < 2 * n; i++ )
+    {
+        snprintf ( buffer, sizeof(buffer), "var_%zu", i );
+        names[i] = intern_string ( buffer );
+    }
+
+    symbol_t *symbols = calloc ( n, sizeof(symbol_t) );
+    for ( size_t i = 0; i < n; i++ )
+        symbols[i] = (symbol_t) { .name = names[i], .type = SYMBOL_LOCAL_VAR };
+
+    size_t found = 0;
+    double start;
+
+    // The previous hashmap
+    legacy_hashmap_t legacy = { 0 };
+    start = now ( );
+    for ( size_t i = 0; i < n; i++ )
+        legacy_insert ( &legacy, &symbols[i] );
+    report ( "legacy", "insert", n, now ( ) - start );
+
+    start = now ( );
+    for ( size_t i = 0; i < n; i++ )
+        found += legacy_lookup ( &legacy, names[i] ) != NULL;
+    report ( "legacy", "lookup hit", n, now ( ) - start );
+
+    start = now ( );
+    for ( size_t i = n; i < 2 * n; i++ )
+        found += legacy_lookup ( &legacy, names[i] ) != NULL;
+    report ( "legacy", "lookup miss", n, now ( ) - start );
+    free ( legacy.buckets );
+
+    // The Swiss table, inserting through a symbol table, like the compiler does
+    symbol_table_t *table = symbol_table_init ( );
+    start = now ( );
+    for ( size_t i = 0; i < n; i++ )
+        symbol_table_insert ( table, &symbols[i] );
+    report ( "swiss", "insert", n, now ( ) - start );
+
+    start = now ( );
+    for ( size_t i = 0; i < n; i++ )
+        found += symbol_hashmap_lookup ( table->hashmap, names[i] ) != NULL;
+    report ( "swiss", "lookup hit", n, now ( ) - start );
+
+    start = now ( );
+    for ( size_t i = n; i < 2 * n; i++ )
+        found += symbol_hashmap_lookup ( table->hashmap, names[i] ) != NULL;
+    report ( "swiss", "lookup miss", n, now ( ) - start );
+
+    // Every hit should have been found by both maps, and no misses
+    if ( found != 2 * n )
+    {
+        fprintf ( stderr, "error: expected %zu successful lookups, got %zu\n", 2 * n, found );
+        exit ( EXIT_FAILURE );
+    }
+
+    // The symbols are owned by this benchmark, not the table
+    free ( table->symbols );
+    symbol_hashmap_destroy ( table->hashmap );
+    free ( table );
+    free ( symbols );
+    free ( names );
+    destroy_intern_pool ( );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// A bump-pointer arena allocator.
+// Memory is handed out from large blocks, and can not be freed individually.
+// Instead, every allocation made from the arena is freed at once by arena_release.
+typedef struct arena_block
+{
+    struct arena_block *previous; // The block that was filled up before this one
+    size_t used;                  // Number of bytes handed out from this block
+    size_t capacity;              // Number of bytes available in this block
+    _Alignas(16) unsigned char memory[]; // The memory handed out by the arena
+} arena_block_t;
+
+typedef struct arena
+{
+    arena_block_t *current; // The block currently being allocated from, or NULL
+} arena_t;
+
+// Allocates size bytes from the arena, aligned to 16 bytes.
+// The memory is not initialized, and is valid until the arena is released.
+void* arena_alloc ( arena_t *arena, size_t size );
+
+// Copies the given string into memory owned by the arena
+char* arena_strdup ( arena_t *arena, const char *string );
+
+// Frees every block owned by the arena, leaving it empty and ready for reuse
+void arena_release ( arena_t *arena );
+
+#endif // ARENA_H
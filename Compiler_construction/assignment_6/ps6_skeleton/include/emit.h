@@ -1,5 +1,8 @@
 #ifndef EMIT_H_
 #define EMIT_H_
+#include "emitter.h"
+
+#include <assert.h>
 
 #define RAX "%rax"
 #define RBX "%rbx" // callee saved
@@ -20,38 +23,48 @@
 #define R15 "%r15" // callee saved
 #define RIP "%rip"
 
+// In the System V calling convention, the first 6 integer parameters are passed in registers
+#define NUM_REGISTER_PARAMS 6
+
 #define MEM(reg) "("reg")"
 #define ARRAY_MEM(array,index,stride) "("array","index","stride")"
 
-#define DIRECTIVE(fmt, ...) printf(fmt "\n" __VA_OPT__(,) __VA_ARGS__)
-#define LABEL(name, ...) printf(name":\n" __VA_OPT__(,) __VA_ARGS__)
-#define EMIT(fmt, ...) printf("\t" fmt "\n" __VA_OPT__(,) __VA_ARGS__)
+// All output goes to the buffer of the emitter, see emitter.h.
+// DIRECTIVE, LABEL and EMIT take printf-style format strings,
+// while the instruction macros below use the faster, unformatted emit functions
+#define DIRECTIVE(fmt, ...) emit_format(fmt "\n" __VA_OPT__(,) __VA_ARGS__)
+#define LABEL(name, ...) emit_format(name":\n" __VA_OPT__(,) __VA_ARGS__)
+#define EMIT(fmt, ...) emit_instruction_format("\t" fmt "\n" __VA_OPT__(,) __VA_ARGS__)
 
-#define MOVQ(src,dst)     EMIT("movq %s, %s", (src), (dst))
-#define PUSHQ(src)        EMIT("pushq %s", (src))
-#define POPQ(src)         EMIT("popq %s", (src))
+#define MOVQ(src,dst)     emit_instruction("movq", (src), (dst))
+#define MOVQ_IMM(imm,dst) emit_immediate("movq", (imm), (dst)) // Move the integer imm into dst
+#define PUSHQ(src)        emit_push((src))
+#define POPQ(src)         emit_pop((src))
 
-#define ADDQ(src,dst)     EMIT("addq %s, %s", (src), (dst))
-#define SUBQ(src,dst)     EMIT("subq %s, %s", (src), (dst))
-#define NEGQ(reg)         EMIT("negq %s", (reg))
+#define ADDQ(src,dst)     emit_instruction("addq", (src), (dst))
+#define SUBQ(src,dst)     emit_instruction("subq", (src), (dst))
+#define NEGQ(reg)         emit_instruction("negq", (reg), NULL)
 
-#define IMULQ(src,dst)    EMIT("imulq %s, %s", (src), (dst))
-#define CQO               EMIT("cqo"); // Sign extend RAX -> RDX:RAX
-#define IDIVQ(by)         EMIT("idivq %s", (by)) // Divide RDX:RAX by "by", store result in RAX
+#define IMULQ(src,dst)    emit_instruction("imulq", (src), (dst))
+#define CQO               emit_instruction("cqo", NULL, NULL); // Sign extend RAX -> RDX:RAX
+#define IDIVQ(by)         emit_instruction("idivq", (by), NULL) // Divide RDX:RAX by "by", store result in RAX
 
 // Bitwise and
-#define ANDQ(src,dst)     EMIT("andq %s, %s", (src), (dst))
+#define ANDQ(src,dst)     emit_instruction("andq", (src), (dst))
 // Arithmetic shift left and shift right by cnt bits.
 // if cnt is a register, it must be one of the original 1-byte IA32 registers,
 // such as %cl, which are the lowest 8 bits of %rcx
-#define SAL(cnt,dst)      EMIT("salq %s, %s", (cnt), (dst))
-#define SAR(cnt,dst)      EMIT("sarq %s, %s", (cnt), (dst))
+#define SAL(cnt,dst)      emit_instruction("salq", (cnt), (dst))
+#define SAR(cnt,dst)      emit_instruction("sarq", (cnt), (dst))
 
-#define RET               EMIT("ret")
+#define RET               emit_instruction("ret", NULL, NULL)
+// Calls a function, which must be where %rsp is aligned to 16 bytes, see emitter.stack_depth
+#define CALL(fmt, ...)    ( assert ( emitter.stack_depth % 16 == 0 ), EMIT("call " fmt __VA_OPT__(,) __VA_ARGS__) )
 
-#define CMPQ(op1,op2)     EMIT("cmpq %s, %s", (op1), (op2))
-#define JNE(label)        EMIT("jne %s", (label)) // Conditional jump (not equal)
-#define JMP(label)        EMIT("jmp %s", (label)) // Unconditional jump
+#define CMPQ(op1,op2)     emit_instruction("cmpq", (op1), (op2))
+// Jumps to labels made by new_label ( )
+#define JCC(cc,label)     emit_jump((cc), (label)) // Conditional jump, such as JCC("jne", label)
+#define JMP(label)        emit_jump("jmp", (label)) // Unconditional jump
 
 // These directives are set based on platform,
 // allowing the compiler to work on macOS as well
@@ -61,9 +74,8 @@
 #define ASM_BSS_SECTION "__DATA, __bss"
 #define ASM_STRING_SECTION "__TEXT, __cstring"
 #define ASM_DECLARE_SYMBOLS                     \
-    ".set printf, _printf"                 "\n" \
-    ".set putchar, _putchar"               "\n" \
-    ".set puts, _puts"                     "\n" \
+    ".set write, _write"                   "\n" \
+    ".set isatty, _isatty"                 "\n" \
     ".set strtol, _strtol"                 "\n" \
     ".set exit, _exit"                     "\n" \
     ".set _main, main"                     "\n" \
@@ -0,0 +1,90 @@
+#ifndef EMITTER_H
+#define EMITTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The emitter collects all generated assembly in one growable buffer,
+// which is written out with a single call once code generation is done.
+// The macros in emit.h are the normal way of adding instructions to it.
+typedef struct emitter
+{
+    char *buffer;    // The assembly emitted so far, not '\0' terminated
+    size_t length;   // Number of bytes used in buffer
+    size_t capacity; // Number of bytes allocated for buffer
+
+    // Counters for --stats
+    size_t n_instructions; // Instructions emitted so far
+    size_t n_labels;       // Labels made by new_label
+    size_t n_written;      // Bytes written by emitter_write
+    size_t n_removed;      // Instructions removed by peephole_optimize
+
+    // The number of bytes the code being emitted has pushed onto the stack, counted from where %rsp was aligned
+    // to 16 bytes. PUSHQ, POPQ and emit_stack_adjust keep it up to date, so calls can be made with %rsp aligned,
+    // as the calling convention requires. The code generators set it at the start of every function
+    int64_t stack_depth;
+} emitter_t;
+
+extern emitter_t emitter;
+
+// Labels made by the compiler are plain numbers, which are printed as .L<number>
+typedef uint32_t label_t;
+
+// Returns a label that has never been returned before. Labels are numbered in the order they are made
+label_t new_label ( void );
+
+// Appends printf-style formatted text. Used for anything without a specialised function below
+void emit_format ( const char *format, ... ) __attribute__ (( format ( printf, 1, 2 ) ));
+
+// Same as emit_format, but counts the text as an instruction
+void emit_instruction_format ( const char *format, ... ) __attribute__ (( format ( printf, 1, 2 ) ));
+
+// Appends "\t<mnemonic> <src>, <dst>\n". Operands that are NULL are left out,
+// so this covers instructions with zero, one or two operands
+void emit_instruction ( const char *mnemonic, const char *src, const char *dst );
+
+// Appends "\t<mnemonic> $<immediate>, <dst>\n"
+void emit_immediate ( const char *mnemonic, int64_t immediate, const char *dst );
+
+// Appends "\t<mnemonic> .L<label>\n", for jumps to compiler made labels
+void emit_jump ( const char *mnemonic, label_t label );
+
+// Appends ".L<label>:\n"
+void emit_label ( label_t label );
+
+// Appends "\tpushq <src>\n" or "\tpopq <dst>\n", and follows the 8 bytes they move %rsp by
+void emit_push ( const char *src );
+void emit_pop ( const char *dst );
+
+// Moves %rsp down by bytes with subq, or up with addq if bytes is negative. Nothing is emitted for 0
+void emit_stack_adjust ( int64_t bytes );
+
+// Moves %rsp down by 8 bytes if that is needed for it to be aligned to 16 bytes at a call,
+// once the arguments passed on the stack, pushed bytes in all, have been pushed.
+// Returns the bytes of padding, which the caller removes again along with the arguments
+int64_t emit_call_padding ( int64_t pushed );
+
+// Writes the decimal digits of value to out, without a '\0'. Returns the number of characters written
+size_t format_int ( char *out, int64_t value );
+
+// Operands of instructions, each kind in its own buffer, which is reused by the next call of the same function.
+// Returns offset(%rbp)
+const char* frame_operand ( int offset );
+// Returns .name+displacement(%rip), where name is an interned string
+const char* global_operand ( const char *name, int64_t displacement );
+// Returns $value
+const char* immediate_operand ( int64_t value );
+// Returns displacement(base, index, 8)
+const char* indexed_operand ( int64_t displacement, const char *base, const char *index );
+
+// Removes instructions that are redundant or never run from everything emitted so far, in peephole.c.
+// Compiler made labels nothing jumps to are removed as well
+void peephole_optimize ( void );
+
+// Writes everything emitted to the file at path, or to stdout if path is NULL, and empties the buffer
+void emitter_write ( const char *path );
+
+// Frees the buffer of the emitter
+void emitter_destroy ( void );
+
+#endif // EMITTER_H
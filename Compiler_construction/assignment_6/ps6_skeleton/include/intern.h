@@ -0,0 +1,35 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The intern pool keeps exactly one copy of every distinct string handed to it.
+// Interning the same spelling twice gives back the same pointer,
+// so interned strings can be compared for equality using ==.
+//
+// Every interned string is stored right after a small header,
+// holding the string's unique id and a precomputed hash.
+typedef struct interned_header
+{
+    uint64_t hash;   // Hash of the string's characters
+    uint32_t id;     // Unique id, counting up from 0 in the order strings were first interned
+    uint32_t length; // Length of the string, not including the '\0'
+} interned_header_t;
+
+// Returns the header of a string returned by intern_string
+#define INTERNED_HEADER(string) ((const interned_header_t *)(string) - 1)
+#define INTERNED_HASH(string) (INTERNED_HEADER(string)->hash)
+#define INTERNED_ID(string) (INTERNED_HEADER(string)->id)
+
+// Returns the unique copy of the given string, adding it to the pool if it is new.
+// The returned string is valid until destroy_intern_pool is called, and must not be modified.
+char* intern_string ( const char *string );
+
+// Returns the number of distinct strings in the pool
+size_t intern_pool_size ( void );
+
+// Frees every interned string, and the pool itself
+void destroy_intern_pool ( void );
+
+#endif // INTERN_H
@@ -0,0 +1,240 @@
+#ifndef IR_H
+#define IR_H
+#include "symbols.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Three-address code, between the syntax tree and x86.
+// Every function is a list of basic blocks, and every block a list of instructions ending in a jump, branch or return.
+// Instructions read at most two operands, and write at most one virtual register.
+// Virtual registers are unlimited in number, and only given machine registers by the backend in ir_generator.c
+
+// Virtual registers are numbered from 1, so 0 can mean none.
+// The parameters and local variables of a function are the virtual registers 1 + their sequence number,
+// and the temporaries made by the lowering come after them
+typedef uint32_t vreg_t;
+#define NO_VREG ((vreg_t) 0)
+#define VARIABLE_VREG(symbol) ((vreg_t) (symbol)->sequence_number + 1)
+
+typedef enum { IR_OPERAND_NONE, IR_OPERAND_VREG, IR_OPERAND_CONSTANT } ir_operand_kind_t;
+
+// An operand is either a virtual register or a constant
+typedef struct ir_operand
+{
+    ir_operand_kind_t kind;
+    union
+    {
+        vreg_t vreg;
+        int64_t constant;
+    };
+} ir_operand_t;
+
+#define IR_NO_OPERAND ((ir_operand_t) { .kind = IR_OPERAND_NONE })
+#define IR_VREG(v) ((ir_operand_t) { .kind = IR_OPERAND_VREG, .vreg = (v) })
+#define IR_CONSTANT(c) ((ir_operand_t) { .kind = IR_OPERAND_CONSTANT, .constant = (c) })
+
+typedef enum
+{
+    IR_COPY,          // dst = a
+    IR_NEG,           // dst = -a
+    IR_BINARY,        // dst = a op b, where op is one of OP_ADD to OP_SHR
+    IR_LOAD,          // dst = symbol, a global variable
+    IR_STORE,         // symbol = a
+    IR_LOAD_ELEMENT,  // dst = symbol[a], an element of a global array
+    IR_STORE_ELEMENT, // symbol[a] = b
+    IR_PARAM,         // param a. The arguments of a call are the PARAMs right before it, from the first to the last
+    IR_CALL,          // dst = call symbol. dst may be NO_VREG, when the result is not used
+    IR_PRINT_NUMBER,  // print a
+    IR_PRINT_STRING,  // print string_list[string_index]
+    IR_PRINT_NEWLINE, // print '\n'
+    IR_JUMP,          // goto targets[0]
+    IR_BRANCH,        // if a op b goto targets[0] else goto targets[1], where op is one of OP_EQ to OP_GT
+    IR_RETURN,        // return a
+    IR_PHI,           // dst = phi arguments. Only in SSA form, at the start of blocks, see ssa.c
+    IR_ADDRESS,       // dst = &symbol[a], the address of an element of a global array
+    IR_LOAD_POINTER,  // dst = *a, where a is an address
+    IR_STORE_POINTER, // *a = b
+} ir_opcode_t;
+
+// Whether an instruction ends its block, and how many blocks it may go to
+#define IR_IS_TERMINATOR(opcode) ( (opcode) == IR_JUMP || (opcode) == IR_BRANCH || (opcode) == IR_RETURN )
+#define IR_N_TARGETS(opcode) ( (opcode) == IR_BRANCH ? 2 : (opcode) == IR_JUMP ? 1 : 0 )
+
+// The value a phi takes when its block is entered from the given predecessor
+typedef struct ir_phi_argument
+{
+    uint32_t block;
+    ir_operand_t value;
+} ir_phi_argument_t;
+
+typedef struct ir_instruction
+{
+    ir_opcode_t opcode;
+    operator_t op;            // IR_BINARY and IR_BRANCH
+    vreg_t dst;               // The virtual register written, or NO_VREG
+    uint32_t n_arguments;     // IR_PHI
+    ir_operand_t a, b;
+    union
+    {
+        symbol_t *symbol;     // The global variable, array or function of loads, stores and calls
+        size_t string_index;  // IR_PRINT_STRING
+        ir_phi_argument_t *arguments; // IR_PHI, one for each predecessor of the block
+    };
+    uint32_t targets[2];      // The blocks IR_JUMP and IR_BRANCH go to
+} ir_instruction_t;
+
+typedef struct ir_block
+{
+    ir_instruction_t *instructions;
+    uint32_t n_instructions;
+    uint32_t capacity;
+    uint32_t loop_depth;      // The number of while loops the block is inside of
+    uint32_t *predecessors;   // The blocks jumping or branching here, set by ir_compute_predecessors
+    uint32_t n_predecessors;
+} ir_block_t;
+
+// The instruction ending a block
+#define IR_TERMINATOR(block) (&(block)->instructions[(block)->n_instructions - 1])
+
+typedef struct ir_function
+{
+    symbol_t *symbol;
+    ir_block_t *blocks;       // Blocks in the order they are generated. Block 0 is the entry
+    uint32_t n_blocks;
+    uint32_t blocks_capacity;
+    uint32_t n_vregs;         // Virtual registers are below n_vregs
+    uint32_t n_variables;     // The parameters and local variables, see VARIABLE_VREG
+    uint32_t n_parameters;    // Parameters hold the arguments of the call when the function is entered
+    uint32_t *predecessor_list; // Where the predecessors of every block are kept
+    // In SSA form, the variable every virtual register made by renaming is a version of, for printing.
+    // Virtual registers from n_versions and up are temporaries, though optimizations may give temporaries versions
+    // of their own, see ir_set_version
+    vreg_t *versions;
+    uint32_t n_versions;
+    bool in_ssa;
+} ir_function_t;
+
+// Sets of small numbers, such as blocks or variables, as arrays of bits
+typedef uint64_t bitset_word_t;
+#define BITSET_WORDS(n) ( ( (n) + 63 ) / 64 )
+#define BITSET_HAS(set, i) ( ( (set)[(i) / 64] >> ( (i) % 64 ) ) & 1 )
+#define BITSET_ADD(set, i) ( (set)[(i) / 64] |= UINT64_C(1) << ( (i) % 64 ) )
+
+// The dominator tree of a function, where block a dominates b if every path from the entry to b goes through a
+typedef struct ir_dominators
+{
+    uint32_t *idom;           // The immediate dominator of every block. The entry is its own
+    uint32_t *order;          // The blocks in reverse postorder, so every block comes after its dominators
+    uint32_t *children;       // The children of every block in the tree, from first_child[b] to first_child[b+1]
+    uint32_t *first_child;
+    uint32_t *enter, *leave;  // When a walk of the tree enters and leaves every block
+} ir_dominators_t;
+
+#define IR_DOMINATES(dominators, a, b) \
+    ( (dominators)->enter[a] <= (dominators)->enter[b] && (dominators)->leave[b] <= (dominators)->leave[a] )
+
+// A natural loop: the header, and the blocks that can reach a jump back to it without passing it
+typedef struct ir_loop
+{
+    uint32_t header;
+    uint32_t preheader;       // The only block entering the loop, ending in a jump to the header, or UINT32_MAX
+    uint32_t parent;          // The innermost loop around this one, or UINT32_MAX
+    uint32_t first;           // The loops inside this one are the ones from first up to it, see ir_loops_t
+    uint32_t *blocks;         // The blocks in no loop inside this one, in reverse postorder, starting with the header
+    uint32_t n_blocks;
+    uint32_t size;            // The number of blocks in the loop, counting those of the loops inside it
+} ir_loop_t;
+
+// The loops of a function, inner loops before the loops around them. The loops inside a loop come right before it,
+// so every block of the loop has its innermost loop among them
+typedef struct ir_loops
+{
+    ir_loop_t *loops;
+    uint32_t n_loops;
+    uint32_t n_blocks;        // The number of blocks when the loops were found. Blocks made since are in no loop
+    uint32_t *innermost;      // The innermost loop every block is in, or UINT32_MAX
+    uint32_t *block_list;     // Where the blocks of every loop are kept
+} ir_loops_t;
+
+#define IR_IN_LOOP(found, loop, block) \
+    ( (block) < (found)->n_blocks && (found)->innermost[block] >= (found)->loops[loop].first \
+      && (found)->innermost[block] <= (loop) )
+
+// Lowers the body of a function to three-address code, in lower.c
+void lower_function ( symbol_t *function, ir_function_t *ir );
+
+// Adds an empty block to the function, and returns its index
+uint32_t ir_new_block ( ir_function_t *function, uint32_t loop_depth );
+// Returns a virtual register that has never been used in the function
+vreg_t ir_new_vreg ( ir_function_t *function );
+// Appends an instruction to a block, and returns where it was placed. The pointer is valid until the next append
+ir_instruction_t* ir_append ( ir_function_t *function, uint32_t block, ir_instruction_t instruction );
+// Inserts an instruction before the one at index in block
+void ir_insert ( ir_function_t *function, uint32_t block, uint32_t index, ir_instruction_t instruction );
+
+// Computes lhs op rhs for one of OP_ADD to OP_SHR, as the generated code would. Returns false for divisions that fault
+bool ir_fold_binary ( operator_t op, int64_t lhs, int64_t rhs, int64_t *result );
+// Returns whether lhs op rhs holds, for one of OP_EQ to OP_GT
+bool ir_relation_holds ( operator_t op, int64_t lhs, int64_t rhs );
+
+// Lowers a function and optimizes it at the given level. At level 1 and up, the result is in SSA form
+void build_ir_function ( symbol_t *function, ir_function_t *ir, int optimization_level );
+
+// Control flow, in cfg.c.
+// Finds the predecessors of every block. Branches to the same block twice become jumps
+void ir_compute_predecessors ( ir_function_t *function );
+// Moves every block b to new_index[b], or removes it if that is UINT32_MAX, and updates all references to blocks.
+// The predecessors must be computed again after
+void ir_renumber_blocks ( ir_function_t *function, const uint32_t *new_index );
+// Removes the blocks that can not be reached from the entry
+void ir_remove_unreachable_blocks ( ir_function_t *function );
+// Removes the arguments coming from predecessor, from the phis of block, once it no longer jumps there
+void ir_remove_phi_arguments ( ir_function_t *function, uint32_t block, uint32_t predecessor );
+// Finds the dominator tree. Every block must be reachable, and the predecessors computed
+void ir_compute_dominators ( const ir_function_t *function, ir_dominators_t *dominators );
+void ir_destroy_dominators ( ir_dominators_t *dominators );
+// Finds the loops of the function. Every block must be reachable, and the predecessors computed
+void ir_find_loops ( const ir_function_t *function, ir_loops_t *loops );
+void ir_destroy_loops ( ir_loops_t *loops );
+
+// Static single assignment form, in ssa.c.
+// Gives every parameter and local variable a new version at each assignment, and joins them with phis
+void build_ssa ( ir_function_t *function );
+// Replaces the phis by copies at the end of the predecessors
+void leave_ssa ( ir_function_t *function );
+// Makes vreg a version of variable, so leave_ssa can give them the same virtual register.
+// variable may also be a temporary made by an optimization, which is then its own first version
+void ir_set_version ( ir_function_t *function, vreg_t vreg, vreg_t variable );
+
+// Loop unrolling and rotation, in unroll.c, done before the function is put in SSA form.
+// Loops counting towards a limit by a constant step run unroll_factor copies of their body for every test,
+// while that many iterations are left
+void unroll_loops ( ir_function_t *function );
+// Tests the condition of every loop after its body instead of before, with a copy of the test in front of the loop
+void rotate_loops ( ir_function_t *function );
+
+// Optimizations of functions in SSA form.
+// Sparse conditional constant propagation, in sccp.c. Replaces values known to be constant by the constants,
+// and removes the branches never taken, and the blocks only they lead to
+void propagate_constants ( ir_function_t *function );
+// Loop-invariant code motion, in licm.c. Moves expressions computing the same value every iteration of a loop
+// to the block before it. Counts them in hoisted_expressions
+void hoist_loop_invariants ( ir_function_t *function );
+// Induction variable strength reduction, in induction.c. Array elements indexed by a variable counting through a loop
+// are reached through a pointer moving along with it, which may also replace the variable in the loop condition
+void reduce_induction_variables ( ir_function_t *function );
+// Removes the instructions whose results are never used, and that have no other effect, in dce.c
+void remove_dead_code ( ir_function_t *function );
+
+// Prints the function in a readable form, to stdout
+void ir_print_function ( const ir_function_t *function );
+// Frees the instructions of a block, and leaves it empty
+void ir_free_block ( ir_block_t *block );
+// Frees the blocks of the function, and everything in them
+void ir_destroy_function ( ir_function_t *function );
+
+// Generates x86 code for the function, in ir_generator.c
+void generate_ir_function ( const ir_function_t *function );
+
+#endif // IR_H
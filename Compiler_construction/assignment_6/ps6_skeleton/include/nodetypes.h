@@ -8,7 +8,7 @@
 // of each node type, in the same order they appear in node_type_t.
 // This allows printing node_type_t values as their node name like so:
 //
-// printf("my_node is of type %s\n", node_strings[my_node->type]);
+// printf("my_node is of type %s\n", node_strings[NODE_TYPE(my_node)]);
 //
 // When this file is included like so:
 //     #define NODETYPES_IMPLEMENTATION
@@ -39,13 +39,13 @@ NODELIST_BEGIN
     NODE(BREAK_STATEMENT),
     NODE(IF_STATEMENT),
     NODE(WHILE_STATEMENT),
-    NODE(RELATION), // data is a string defining relation type
-    NODE(EXPRESSION), // data is a string defining operation type
+    NODE(RELATION), // data.op is the operator_t defining relation type
+    NODE(EXPRESSION), // data.op is the operator_t defining operation type
     NODE(FUNCTION_CALL),
-    NODE(IDENTIFIER_DATA), // data is an owned string
-    NODE(NUMBER_DATA), // data is an owned int64_t*
-    NODE(STRING_DATA), // data is an owned string literal, including the ""
-    NODE(STRING_LIST_REFERENCE) // data is the string's index casted to void*
+    NODE(IDENTIFIER_DATA), // data.string is an interned string
+    NODE(NUMBER_DATA), // data.number is the value of the number
+    NODE(STRING_DATA), // data.string is an interned string literal, including the ""
+    NODE(STRING_LIST_REFERENCE) // data.string_index is the string's position in the string list
 NODELIST_END
 
 #undef NODELIST_BEGIN
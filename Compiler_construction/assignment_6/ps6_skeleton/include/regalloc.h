@@ -0,0 +1,38 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Linear scan register allocation, as described by Poletto and Sarkar.
+// The code is numbered in a linear order, and each value is live in an interval of those positions.
+// The allocator only sees intervals and register numbers. What they mean is up to the code generator
+
+// The location of an interval that did not get a register
+#define SPILLED (-1)
+
+typedef struct live_interval
+{
+    uint32_t start;    // The first position where the value is live
+    uint32_t end;      // The last position where the value is live, inclusive
+    uint32_t id;       // Identifies the value to the caller. Not used by the allocator
+    uint32_t uses;     // How often the value is used, weighted by how often the code is expected to run
+    uint32_t calls;    // How many calls the value is live at, weighted the same way.
+                       // Calls clobber caller-saved registers, so values in them are saved and restored around calls
+    int32_t location;  // Set by linear_scan: the register given to the value, or SPILLED
+} live_interval_t;
+
+// Gives each interval a register number below n_registers, such that no overlapping intervals share a register.
+// When there are not enough registers, the intervals ending last are SPILLED.
+// Intervals live at calls prefer registers not in the caller_saved set, and the others prefer those in it.
+// An interval is spilled rather than put in a caller-saved register, if saving it costs more than its uses do.
+// The intervals are sorted by their start. Returns the set of registers given to any interval
+uint32_t linear_scan ( live_interval_t *intervals, size_t n_intervals, uint32_t n_registers, uint32_t caller_saved );
+
+// Gives each interval a stack slot number in location, such that no overlapping intervals share a slot,
+// the same way linear_scan gives registers, but with as many slots as needed.
+// The intervals must be sorted by their start, as linear_scan leaves them. Returns the number of slots
+uint32_t allocate_slots ( live_interval_t *intervals, size_t n_intervals );
+
+#endif // REGALLOC_H
@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+// Compilation statistics, printed by the --stats flag.
+// The driver marks the start of each phase, and every allocation is counted towards the current phase.
+typedef enum
+{
+    PHASE_PARSE, PHASE_SIMPLIFY, PHASE_SYMBOLS, PHASE_CODEGEN, PHASE_TEARDOWN, N_PHASES
+} phase_t;
+
+// Use as a normal array, to get the name of a phase: PHASE_NAMES[phase]
+#define PHASE_NAMES ((const char *[]){    \
+        [PHASE_PARSE] = "parse",          \
+        [PHASE_SIMPLIFY] = "simplify",    \
+        [PHASE_SYMBOLS] = "symbols",      \
+        [PHASE_CODEGEN] = "codegen",      \
+        [PHASE_TEARDOWN] = "teardown"})
+
+// Ends the current phase, if any, and starts measuring the given phase
+void stats_begin_phase ( phase_t phase );
+
+// Ends the current phase, if any
+void stats_end_phase ( void );
+
+// The size of what the compiler built, filled in by the driver before anything is destroyed
+typedef struct stats_counts
+{
+    size_t nodes;
+    size_t symbols;
+    size_t strings;
+    size_t interned_strings;
+    size_t labels;
+    size_t instructions;
+    size_t assembly_bytes;
+    size_t hoisted_expressions;
+    size_t peephole_removed;
+} stats_counts_t;
+
+// Prints the table of phases, followed by the counts, to stderr. Phases that never ran are left out
+void stats_print ( const stats_counts_t *counts );
+
+// Allocation functions that count every call and requested byte towards the current phase
+void* stats_malloc ( size_t size );
+void* stats_calloc ( size_t count, size_t size );
+void* stats_realloc ( void *pointer, size_t size );
+void* stats_aligned_alloc ( size_t alignment, size_t size );
+
+// Every source file that allocates includes this header after <stdlib.h>,
+// so these replace the standard allocation functions everywhere in vslc
+#ifndef STATS_IMPLEMENTATION
+#define malloc(size) stats_malloc ( (size) )
+#define calloc(count, size) stats_calloc ( (count), (size) )
+#define realloc(pointer, size) stats_realloc ( (pointer), (size) )
+#define aligned_alloc(alignment, size) stats_aligned_alloc ( (alignment), (size) )
+#endif
+
+#endif // STATS_H
@@ -8,12 +8,14 @@
 
 // We use hashmaps to make lookups quick.
 // The entries are symbols, using the name of the symbol as the key.
-// The hashmap logic is already implemented in symbol_table.c
+// Names must be interned strings, so keys are compared by pointer, using the hash stored by the intern pool.
+// The hashmap logic is already implemented in symbol_table.c, as an open addressing Swiss table
 // NOTE that this hashmap does not support removing entries.
 typedef struct symbol_hashmap
 {
+    uint8_t *control;        // One tag per bucket, either empty, or 7 bits of the hash of its entry
     struct symbol **buckets; // A bucket may contain 0 or 1 entries
-    size_t n_buckets;
+    size_t n_buckets;        // Always 0, or a power of two of at least 16
     size_t n_entries;
 
     // If a key is not found, the lookup function will consult this as a backup
@@ -47,13 +49,18 @@ symbol_table_t* symbol_table_init ( void );
 // DO NOT change the symbol's name after insertion.
 insert_result_t symbol_table_insert ( symbol_table_t *table, struct symbol *symbol );
 
+// Adds the given symbol to the symbol table's list, without entering it into the hashmap.
+// Used for symbols whose names are resolved some other way, such as the local variables of nested scopes.
+// The symbol table takes ownership of the symbol, and assigns it a sequence number.
+void symbol_table_append ( symbol_table_t *table, struct symbol *symbol );
+
 // Destroys the given symbol table, its hashmap, and all the symbols it owns
 void symbol_table_destroy ( symbol_table_t *table );
 
 // Initalizes a new, empty hashmap
 symbol_hashmap_t* symbol_hashmap_init ( void );
 
-// Looks for a symbol in the symbol hashmap, matching the given name.
+// Looks for a symbol in the symbol hashmap, matching the given interned name.
 // If no symbol is found, the hashmap's backup hashmap is checked.
 // If the name can't be found in the backup chain either, NULL is returned.
 struct symbol* symbol_hashmap_lookup ( symbol_hashmap_t *hashmap, const char *name );
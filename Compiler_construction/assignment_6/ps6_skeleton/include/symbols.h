@@ -19,17 +19,23 @@ typedef enum
 
 typedef struct symbol
 {
-    char *name;             // Symbol name ( not owned )
+    char *name;             // Symbol name, an interned string ( not owned )
     symtype_t type;         // Symbol type
-    node_t *node;           // The AST node that defined this symbol ( not owned )
+    node_id_t node;         // The AST node that defined this symbol
     size_t sequence_number; // Sequence number in the symbol table this symbol belongs to
 
     /* Global variables and arrays have function_symtable = NULL
      * Functions point to their own symbol tables here, but the function itself is a global symbol
      * Parameters and local variables point to the function_symtable they belong to */
     struct symbol_table *function_symtable;
+
+    // While this symbol is in scope, it shadows any outer symbol with the same name. That symbol is kept here
+    struct symbol *shadowed;
 } symbol_t;
 
+// Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
+#define FUNC_PARAM_COUNT(func) (N_CHILDREN(CHILD((func)->node, 1)))
+
 /* Global symbol table and string list */
 extern symbol_table_t *global_symbols;
 extern char **string_list;
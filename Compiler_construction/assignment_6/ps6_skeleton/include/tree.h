@@ -1,27 +1,105 @@
 #ifndef TREE_H
 #define TREE_H
 #include "nodetypes.h"
+#include "intern.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 
-/* This is the tree node structure for the abstract syntax tree */
-typedef struct node
+/* Nodes in the abstract syntax tree are referred to by 32-bit indices into the syntax tree's columns.
+ * Index 0 is never used by a real node, so NO_NODE can be used like a NULL pointer */
+typedef uint32_t node_id_t;
+#define NO_NODE ((node_id_t) 0)
+
+/* The operator of an EXPRESSION or RELATION node */
+typedef enum
+{
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_SHL, OP_SHR, OP_NEG, // Operators of EXPRESSION nodes
+    OP_EQ, OP_NE, OP_LT, OP_GT,                             // Operators of RELATION nodes
+} operator_t;
+
+// Use as a normal array, to get the source spelling of an operator: OPERATOR_NAMES[op]
+#define OPERATOR_NAMES ((const char *[]){ \
+        [OP_ADD] = "+",                   \
+        [OP_SUB] = "-",                   \
+        [OP_MUL] = "*",                   \
+        [OP_DIV] = "/",                   \
+        [OP_SHL] = "<<",                  \
+        [OP_SHR] = ">>",                  \
+        [OP_NEG] = "-",                   \
+        [OP_EQ] = "=",                    \
+        [OP_NE] = "!=",                   \
+        [OP_LT] = "<",                    \
+        [OP_GT] = ">"})
+
+/* The extra data stored inline with every node. Which member is used depends on the node type */
+typedef union node_data
+{
+    int64_t number;      // NUMBER_DATA
+    char *string;        // IDENTIFIER_DATA and STRING_DATA, always interned
+    operator_t op;       // EXPRESSION and RELATION
+    size_t string_index; // STRING_LIST_REFERENCE
+} node_data_t;
+
+#define NO_DATA ((node_data_t) { .string = NULL })
+
+/* The abstract syntax tree is stored as a struct of arrays.
+ * Each node is an index into the columns type, first_child, n_children, data and symbol.
+ * The children of a node are stored as a contiguous range in child_list,
+ * starting at first_child, so walking the tree touches very few cache lines */
+typedef struct syntax_tree
 {
-    node_type_t type;
-    struct node** children; // An owned list of pointers to child nodes
-    size_t n_children; // The length of the list of child nodes
+    uint8_t *type;           // The node_type_t of each node
+    uint32_t *first_child;   // Position of each node's first child in child_list
+    uint32_t *n_children;    // The number of children of each node
+    node_data_t *data;       // Extra data, inline in the column
+    struct symbol **symbol;  // The symbol each node is bound to, or NULL
+    uint32_t n_nodes;
+    uint32_t node_capacity;
 
-    void* data; // Extra data, only owned if type ends in _DATA
-    struct symbol* symbol;
-} node_t;
+    node_id_t *child_list;   // The children of every node, each node owning a contiguous range
+    uint32_t child_list_len;
+    uint32_t child_list_capacity;
+} syntax_tree_t;
+
+/* The global syntax tree, and its root node */
+extern syntax_tree_t syntax_tree;
+extern node_id_t root;
+
+/* Accessors for the columns of a node. They can all be assigned to as well */
+#define NODE_TYPE(node)       (syntax_tree.type[(node)])
+#define NODE_DATA(node)       (syntax_tree.data[(node)])
+#define NODE_SYMBOL(node)     (syntax_tree.symbol[(node)])
+#define N_CHILDREN(node)      (syntax_tree.n_children[(node)])
+#define CHILD(node, i)        (syntax_tree.child_list[syntax_tree.first_child[(node)] + (i)])
+
+/* The tree is walked without recursion, using explicit stacks of frames, so deep trees can not overflow the C stack.
+ * A frame remembers which node is being visited, and how far the visit has come */
+typedef struct walk_frame
+{
+    node_id_t node;
+    uint32_t stage; // How far the visit has come, such as the index of the next child to visit
+    uint32_t data;  // Any extra state the walker needs to keep until the node is done
+} walk_frame_t;
+
+typedef struct walk_stack
+{
+    walk_frame_t *frames;
+    size_t depth;
+    size_t capacity;
+} walk_stack_t;
 
-/* Global root for parse tree and abstract syntax tree */
-extern node_t *root;
+// Pushes a frame for node at stage 0, growing the stack if needed. Returns the new frame
+walk_frame_t* walk_push ( walk_stack_t *stack, node_id_t node );
+// Frees the frames of the stack
+void walk_stack_destroy ( walk_stack_t *stack );
+// The frame on the top of the stack. Only valid until the next push
+#define WALK_TOP(stack) (&(stack)->frames[(stack)->depth - 1])
 
 // The node creation function, needed by the parser
-node_t* node_create ( node_type_t type, void *data, size_t n_children, ... );
+node_id_t node_create ( node_type_t type, node_data_t data, size_t n_children, ... );
 // Append an element to the given LIST node, returns the list node
-node_t* append_to_list_node( node_t* list_node, node_t* element );
+node_id_t append_to_list_node( node_id_t list_node, node_id_t element );
 
 void print_syntax_tree ( void );
 void destroy_syntax_tree ( void );
@@ -29,6 +107,6 @@ void simplify_tree ( void );
 
 // Special function used when syntax trees are output as graphviz graphs.
 // Implemented in graphviz_output.c
-void graphviz_node_print ( node_t *root );
+void graphviz_node_print ( node_id_t root );
 
 #endif // TREE_H
@@ -4,6 +4,8 @@
 #include "tree.h"
 /* Definition of the symbol table, and functions for building it */
 #include "symbols.h"
+/* The buffer generated assembly is written to, before it is output */
+#include "emitter.h"
 
 #include <assert.h>
 #include <stdarg.h>
@@ -13,8 +15,39 @@
 #include <stdlib.h>
 #include <string.h>
 
-/* Function for generating machine code, in generator.c */
-void generate_program ( void );
+/* Counts allocations and time per phase for --stats. Must come after <stdlib.h> */
+#include "stats.h"
+
+/* Function for generating machine code, in generator.c.
+ * At optimization level 0 code is generated from the syntax tree, and at higher levels from three-address code,
+ * see ir.h */
+void generate_program ( int optimization_level );
+
+/* Emits the runtime library print statements call, with its output buffer, in runtime.c */
+void generate_runtime ( void );
+/* Whether programs are generated to run without the C library, starting at _start and making system calls directly.
+ * They are linked with -nostdlib -static, in runtime.c */
+extern bool freestanding;
+
+/* Multiplication and division by constants without imulq and idivq, used by both code generators, in strength.c.
+ * Whether a register can be multiplied by factor in place with a few leaq, shifts and negations */
+bool multiplies_in_place ( int64_t factor );
+/* Multiplies reg by factor in place, for a factor accepted by multiplies_in_place */
+void emit_multiplication ( const char *reg, int64_t factor );
+/* Whether division by divisor can be done without idivq. All can, except 0 and -1 where idivq faults */
+bool divides_without_idivq ( int64_t divisor );
+/* Divides dividend by divisor, rounding towards zero like idivq, and places the quotient in RDX.
+ * The dividend is a register other than RAX and RDX, or a memory operand. RAX is overwritten */
+void emit_division ( const char *dividend, int64_t divisor );
+
+/* The number of expressions moved out of loops, for --stats, in licm.c */
+extern size_t hoisted_expressions;
+
+/* How many copies of the body loops counting by a constant step are unrolled to, in unroll.c. Below 2 turns it off */
+extern int unroll_factor;
+
+/* Prints the three-address code of every function, after the optimizations of the level, in ir.c */
+void print_ir_program ( int optimization_level );
 
 /* The main driver function of the parser generated by bison */
 int yyparse ();
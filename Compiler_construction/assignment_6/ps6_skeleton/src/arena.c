@@ -0,0 +1,63 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Size of the blocks the arena normally allocates. Larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE ( 64 * 1024 )
+#define ARENA_ALIGNMENT 16
+
+// Allocates a new block with room for at least min_capacity bytes, and makes it the current block
+static arena_block_t* arena_grow ( arena_t *arena, size_t min_capacity )
+{
+    size_t capacity = ARENA_BLOCK_SIZE;
+    if ( capacity < min_capacity )
+        capacity = min_capacity;
+
+    arena_block_t *block = malloc ( sizeof(arena_block_t) + capacity );
+    *block = (arena_block_t) {
+        .previous = arena->current,
+        .used = 0,
+        .capacity = capacity
+    };
+    arena->current = block;
+    return block;
+}
+
+// Bumps the used counter of the current block, or moves to a new block if there is no room
+void* arena_alloc ( arena_t *arena, size_t size )
+{
+    // Round the size up, to keep the next allocation aligned
+    size = ( size + ARENA_ALIGNMENT - 1 ) & ~(size_t)( ARENA_ALIGNMENT - 1 );
+
+    arena_block_t *block = arena->current;
+    if ( block == NULL || block->capacity - block->used < size )
+        block = arena_grow ( arena, size );
+
+    void *result = block->memory + block->used;
+    block->used += size;
+    return result;
+}
+
+char* arena_strdup ( arena_t *arena, const char *string )
+{
+    size_t length = strlen ( string ) + 1;
+    char *result = arena_alloc ( arena, length );
+    memcpy ( result, string, length );
+    return result;
+}
+
+// Walks the chain of blocks backwards, freeing each one
+void arena_release ( arena_t *arena )
+{
+    arena_block_t *block = arena->current;
+    while ( block != NULL )
+    {
+        arena_block_t *previous = block->previous;
+        free ( block );
+        block = previous;
+    }
+    arena->current = NULL;
+}
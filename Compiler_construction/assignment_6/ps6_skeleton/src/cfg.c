@@ -0,0 +1,487 @@
+#include "vslc.h"
+#include "ir.h"
+
+// The control flow graph of a function is given by the jumps and branches ending its blocks.
+// The predecessors are found from them when needed, and the dominator tree from the predecessors
+
+void ir_compute_predecessors ( ir_function_t *function )
+{
+    uint32_t n_blocks = function->n_blocks;
+    uint32_t *counts = calloc ( n_blocks + 1, sizeof(uint32_t) );
+    uint32_t n_edges = 0;
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        ir_instruction_t *last = IR_TERMINATOR(&function->blocks[b]);
+        if ( last->opcode == IR_BRANCH && last->targets[0] == last->targets[1] )
+            *last = (ir_instruction_t) { .opcode = IR_JUMP, .targets = { last->targets[0] } };
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        {
+            counts[last->targets[t]]++;
+            n_edges++;
+        }
+    }
+
+    free ( function->predecessor_list );
+    function->predecessor_list = malloc ( ( n_edges + 1 ) * sizeof(uint32_t) );
+    uint32_t *next = function->predecessor_list;
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        function->blocks[b].predecessors = next;
+        function->blocks[b].n_predecessors = 0;
+        next += counts[b];
+    }
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[b]);
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        {
+            ir_block_t *target = &function->blocks[last->targets[t]];
+            target->predecessors[target->n_predecessors++] = b;
+        }
+    }
+    free ( counts );
+}
+
+void ir_renumber_blocks ( ir_function_t *function, const uint32_t *new_index )
+{
+    uint32_t n_kept = 0;
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+        if ( new_index[b] != UINT32_MAX )
+            n_kept++;
+
+    ir_block_t *blocks = malloc ( ( n_kept + 1 ) * sizeof(ir_block_t) );
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        ir_block_t *block = &function->blocks[b];
+        if ( new_index[b] == UINT32_MAX )
+        {
+            ir_free_block ( block );
+            continue;
+        }
+
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->opcode != IR_PHI )
+                continue;
+            // Arguments from removed blocks are dropped
+            uint32_t n_arguments = 0;
+            for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+            {
+                ir_phi_argument_t argument = instruction->arguments[j];
+                if ( new_index[argument.block] == UINT32_MAX )
+                    continue;
+                argument.block = new_index[argument.block];
+                instruction->arguments[n_arguments++] = argument;
+            }
+            instruction->n_arguments = n_arguments;
+        }
+
+        ir_instruction_t *last = IR_TERMINATOR(block);
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        {
+            assert ( new_index[last->targets[t]] != UINT32_MAX && "Block is removed, but is still jumped to" );
+            last->targets[t] = new_index[last->targets[t]];
+        }
+
+        block->predecessors = NULL;
+        block->n_predecessors = 0;
+        blocks[new_index[b]] = *block;
+    }
+
+    free ( function->blocks );
+    free ( function->predecessor_list );
+    function->predecessor_list = NULL;
+    function->blocks = blocks;
+    function->n_blocks = function->blocks_capacity = n_kept;
+}
+
+void ir_remove_unreachable_blocks ( ir_function_t *function )
+{
+    uint32_t n_blocks = function->n_blocks;
+    uint32_t *new_index = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *stack = malloc ( n_blocks * sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        new_index[b] = UINT32_MAX;
+
+    uint32_t depth = 0;
+    stack[depth++] = 0;
+    new_index[0] = 0;
+    while ( depth > 0 )
+    {
+        const ir_block_t *block = &function->blocks[stack[--depth]];
+        const ir_instruction_t *last = IR_TERMINATOR(block);
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        {
+            if ( new_index[last->targets[t]] == UINT32_MAX )
+            {
+                new_index[last->targets[t]] = 0;
+                stack[depth++] = last->targets[t];
+            }
+        }
+    }
+
+    // The blocks that are left keep their order
+    uint32_t n_kept = 0;
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        if ( new_index[b] != UINT32_MAX )
+            new_index[b] = n_kept++;
+    if ( n_kept < n_blocks )
+        ir_renumber_blocks ( function, new_index );
+
+    free ( new_index );
+    free ( stack );
+}
+
+void ir_remove_phi_arguments ( ir_function_t *function, uint32_t block, uint32_t predecessor )
+{
+    ir_block_t *b = &function->blocks[block];
+    for ( uint32_t i = 0; i < b->n_instructions && b->instructions[i].opcode == IR_PHI; i++ )
+    {
+        ir_instruction_t *phi = &b->instructions[i];
+        uint32_t n_arguments = 0;
+        for ( uint32_t j = 0; j < phi->n_arguments; j++ )
+            if ( phi->arguments[j].block != predecessor )
+                phi->arguments[n_arguments++] = phi->arguments[j];
+        phi->n_arguments = n_arguments;
+    }
+}
+
+/* Returns the nearest common dominator of a and b, given the dominators found so far.
+ * number is the position of every block in reverse postorder */
+static uint32_t intersect ( const uint32_t *idom, const uint32_t *number, uint32_t a, uint32_t b )
+{
+    while ( a != b )
+    {
+        while ( number[a] > number[b] )
+            a = idom[a];
+        while ( number[b] > number[a] )
+            b = idom[b];
+    }
+    return a;
+}
+
+/* Puts the blocks in reverse postorder of a depth-first search from the entry */
+static void find_reverse_postorder ( const ir_function_t *function, uint32_t *order )
+{
+    uint32_t n_blocks = function->n_blocks;
+    bool *seen = calloc ( n_blocks, sizeof(bool) );
+    // Every block on the stack, with the number of its successors visited so far
+    uint32_t (*stack)[2] = malloc ( n_blocks * sizeof(*stack) );
+    uint32_t depth = 0;
+    uint32_t n_finished = 0;
+
+    stack[depth][0] = 0;
+    stack[depth++][1] = 0;
+    seen[0] = true;
+    while ( depth > 0 )
+    {
+        uint32_t b = stack[depth - 1][0];
+        const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[b]);
+        if ( stack[depth - 1][1] < IR_N_TARGETS(last->opcode) )
+        {
+            uint32_t successor = last->targets[stack[depth - 1][1]++];
+            if ( !seen[successor] )
+            {
+                seen[successor] = true;
+                stack[depth][0] = successor;
+                stack[depth++][1] = 0;
+            }
+            continue;
+        }
+        depth--;
+        order[n_blocks - 1 - n_finished++] = b;
+    }
+    assert ( n_finished == n_blocks && "Unreachable blocks must be removed first" );
+    free ( seen );
+    free ( stack );
+}
+
+/* Finds the dominators with the iterative algorithm of Cooper, Harvey and Kennedy,
+ * which visits the blocks in reverse postorder until no immediate dominator changes */
+void ir_compute_dominators ( const ir_function_t *function, ir_dominators_t *dominators )
+{
+    uint32_t n_blocks = function->n_blocks;
+    uint32_t *idom = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *order = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *number = malloc ( n_blocks * sizeof(uint32_t) );
+    find_reverse_postorder ( function, order );
+    for ( uint32_t i = 0; i < n_blocks; i++ )
+    {
+        number[order[i]] = i;
+        idom[i] = UINT32_MAX;
+    }
+    idom[0] = 0;
+
+    bool changed = true;
+    while ( changed )
+    {
+        changed = false;
+        for ( uint32_t i = 1; i < n_blocks; i++ )
+        {
+            const ir_block_t *block = &function->blocks[order[i]];
+            uint32_t new_idom = UINT32_MAX;
+            for ( uint32_t p = 0; p < block->n_predecessors; p++ )
+            {
+                uint32_t predecessor = block->predecessors[p];
+                if ( idom[predecessor] == UINT32_MAX )
+                    continue;
+                new_idom = new_idom == UINT32_MAX ? predecessor : intersect ( idom, number, predecessor, new_idom );
+            }
+            if ( idom[order[i]] != new_idom )
+            {
+                idom[order[i]] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    // The children of every block, in reverse postorder
+    uint32_t *first_child = calloc ( n_blocks + 1, sizeof(uint32_t) );
+    uint32_t *children = malloc ( n_blocks * sizeof(uint32_t) );
+    for ( uint32_t b = 1; b < n_blocks; b++ )
+        first_child[idom[b] + 1]++;
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        first_child[b + 1] += first_child[b];
+    uint32_t *filled = calloc ( n_blocks, sizeof(uint32_t) );
+    for ( uint32_t i = 1; i < n_blocks; i++ )
+    {
+        uint32_t b = order[i];
+        children[first_child[idom[b]] + filled[idom[b]]++] = b;
+    }
+
+    // Walk the tree to number when each block is entered and left, so dominance can be checked in constant time.
+    // number is reused as the stack of the walk, with the next child to visit of each block in filled
+    uint32_t *enter = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *leave = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *stack = number;
+    uint32_t depth = 0;
+    uint32_t clock = 0;
+    memset ( filled, 0, n_blocks * sizeof(uint32_t) );
+    stack[depth++] = 0;
+    enter[0] = clock++;
+    while ( depth > 0 )
+    {
+        uint32_t b = stack[depth - 1];
+        if ( first_child[b] + filled[b] < first_child[b + 1] )
+        {
+            uint32_t child = children[first_child[b] + filled[b]++];
+            enter[child] = clock++;
+            stack[depth++] = child;
+            continue;
+        }
+        leave[b] = clock++;
+        depth--;
+    }
+
+    free ( number );
+    free ( filled );
+    *dominators = (ir_dominators_t) {
+        .idom = idom,
+        .order = order,
+        .children = children,
+        .first_child = first_child,
+        .enter = enter,
+        .leave = leave
+    };
+}
+
+void ir_destroy_dominators ( ir_dominators_t *dominators )
+{
+    free ( dominators->idom );
+    free ( dominators->order );
+    free ( dominators->children );
+    free ( dominators->first_child );
+    free ( dominators->enter );
+    free ( dominators->leave );
+    *dominators = (ir_dominators_t) { 0 };
+}
+
+/* Orders loops by their size, in the upper half, and then header */
+static int compare_sizes ( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Returns the header of the outermost loop found so far around the block, or the block itself if it is in none.
+ * outermost links every block in a loop towards it, and is shortened on the way */
+static uint32_t find_outermost ( uint32_t *outermost, uint32_t block )
+{
+    uint32_t root = block;
+    while ( outermost[root] != root )
+        root = outermost[root];
+    while ( outermost[block] != root )
+    {
+        uint32_t next = outermost[block];
+        outermost[block] = root;
+        block = next;
+    }
+    return root;
+}
+
+/* Returns the only block entering the loop from outside, if it ends in a jump to the header, otherwise UINT32_MAX.
+ * Loops from while statements are entered by one jump, so they all have one */
+static uint32_t find_preheader ( const ir_function_t *function, uint32_t header, uint32_t *outermost )
+{
+    const ir_block_t *block = &function->blocks[header];
+    uint32_t preheader = UINT32_MAX;
+    for ( uint32_t p = 0; p < block->n_predecessors; p++ )
+    {
+        uint32_t predecessor = block->predecessors[p];
+        if ( find_outermost ( outermost, predecessor ) == header )
+            continue;
+        if ( preheader != UINT32_MAX )
+            return UINT32_MAX;
+        preheader = predecessor;
+    }
+    if ( preheader == UINT32_MAX || IR_TERMINATOR(&function->blocks[preheader])->opcode != IR_JUMP )
+        return UINT32_MAX;
+    return preheader;
+}
+
+/* Adds block to the loop with the given header, which is found with index loop, and lists it to have its
+ * predecessors added next. A loop found before, around the block, is added whole, through its header */
+static void add_to_loop ( uint32_t *outermost, uint32_t *innermost, ir_loop_t *found, uint32_t header, uint32_t loop,
+                          uint32_t block, uint32_t *stack, uint32_t *depth )
+{
+    uint32_t root = find_outermost ( outermost, block );
+    if ( root == header )
+        return;
+    if ( innermost[root] == UINT32_MAX )
+        innermost[root] = loop;
+    else
+        found[innermost[root]].parent = loop;
+    outermost[root] = header;
+    stack[( *depth )++] = root;
+}
+
+/* Finds the loops from the innermost out, walking back from the jumps to every header as in Havlak's algorithm.
+ * A loop found before is added whole, by going on from its header, so every block is walked once, by its innermost
+ * loop, and every header once more, by the loop right around it */
+void ir_find_loops ( const ir_function_t *function, ir_loops_t *result )
+{
+    uint32_t n_blocks = function->n_blocks;
+    ir_dominators_t dominators;
+    ir_compute_dominators ( function, &dominators );
+
+    uint32_t *outermost = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *innermost = malloc ( n_blocks * sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        outermost[b] = b;
+        innermost[b] = UINT32_MAX;
+    }
+    uint32_t *stack = malloc ( n_blocks * sizeof(uint32_t) );
+    ir_loop_t *found = malloc ( n_blocks * sizeof(ir_loop_t) );
+    uint32_t n_loops = 0;
+
+    // Headers come after the headers of the loops around them in reverse postorder, so the last is handled first
+    for ( uint32_t i = n_blocks; i-- > 0; )
+    {
+        // The header is the target of jumps back from the blocks it dominates
+        uint32_t h = dominators.order[i];
+        const ir_block_t *header = &function->blocks[h];
+        uint32_t depth = 0;
+        for ( uint32_t p = 0; p < header->n_predecessors; p++ )
+            if ( IR_DOMINATES(&dominators, h, header->predecessors[p]) )
+                add_to_loop ( outermost, innermost, found, h, n_loops, header->predecessors[p], stack, &depth );
+        bool is_header = depth > 0;
+        for ( uint32_t p = 0; p < header->n_predecessors && !is_header; p++ )
+            is_header = header->predecessors[p] == h;
+        if ( !is_header )
+            continue;
+
+        // Every block in the loop besides the header only has predecessors in the loop
+        innermost[h] = n_loops;
+        while ( depth > 0 )
+        {
+            const ir_block_t *block = &function->blocks[stack[--depth]];
+            for ( uint32_t p = 0; p < block->n_predecessors; p++ )
+                add_to_loop ( outermost, innermost, found, h, n_loops, block->predecessors[p], stack, &depth );
+        }
+        found[n_loops++] = (ir_loop_t) {
+            .header = h, .preheader = find_preheader ( function, h, outermost ), .parent = UINT32_MAX };
+    }
+
+    // The sizes add up from the inner loops, found first
+    uint32_t *n_inner = calloc ( n_loops, sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        if ( innermost[b] != UINT32_MAX )
+            found[innermost[b]].n_blocks++;
+    for ( uint32_t l = 0; l < n_loops; l++ )
+    {
+        found[l].size += found[l].n_blocks;
+        n_inner[l]++;
+        if ( found[l].parent != UINT32_MAX )
+        {
+            found[found[l].parent].size += found[l].size;
+            n_inner[found[l].parent] += n_inner[l];
+        }
+    }
+
+    // Every loop gets a range of positions for itself and the loops inside it, and takes the last.
+    // The loops inside one are placed from the smallest, with ties broken by header, which is also how the loops that
+    // are not inside each other are ordered when they are smaller. Loops are smaller than those around them,
+    // so going from the largest, every loop has its range before the loops inside it take parts of it
+    uint64_t *by_size = malloc ( n_loops * sizeof(uint64_t) );
+    for ( uint32_t l = 0; l < n_loops; l++ )
+    {
+        by_size[l] = (uint64_t) found[l].size << 32 | found[l].header;
+        outermost[found[l].header] = l;
+    }
+    qsort ( by_size, n_loops, sizeof(uint64_t), compare_sizes );
+    uint32_t *position = malloc ( n_loops * sizeof(uint32_t) );
+    uint32_t *free_end = malloc ( n_loops * sizeof(uint32_t) );
+    uint32_t outermost_end = n_loops;
+    for ( uint32_t i = n_loops; i-- > 0; )
+    {
+        uint32_t l = outermost[(uint32_t) by_size[i]];
+        uint32_t *end = found[l].parent == UINT32_MAX ? &outermost_end : &free_end[found[l].parent];
+        found[l].first = *end - n_inner[l];
+        position[l] = free_end[l] = *end - 1;
+        *end -= n_inner[l];
+    }
+
+    ir_loop_t *loops = malloc ( n_loops * sizeof(ir_loop_t) );
+    uint32_t *block_list = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t n_listed = 0;
+    for ( uint32_t l = 0; l < n_loops; l++ )
+    {
+        ir_loop_t *loop = &loops[position[l]];
+        *loop = found[l];
+        if ( loop->parent != UINT32_MAX )
+            loop->parent = position[loop->parent];
+        loop->blocks = &block_list[n_listed];
+        n_listed += loop->n_blocks;
+        loop->n_blocks = 0;
+    }
+    for ( uint32_t i = 0; i < n_blocks; i++ )
+    {
+        uint32_t b = dominators.order[i];
+        if ( innermost[b] == UINT32_MAX )
+            continue;
+        innermost[b] = position[innermost[b]];
+        ir_loop_t *loop = &loops[innermost[b]];
+        loop->blocks[loop->n_blocks++] = b;
+    }
+
+    ir_destroy_dominators ( &dominators );
+    free ( outermost );
+    free ( stack );
+    free ( found );
+    free ( n_inner );
+    free ( by_size );
+    free ( position );
+    free ( free_end );
+    *result = (ir_loops_t) {
+        .loops = loops, .n_loops = n_loops, .n_blocks = n_blocks, .innermost = innermost, .block_list = block_list };
+}
+
+void ir_destroy_loops ( ir_loops_t *loops )
+{
+    free ( loops->loops );
+    free ( loops->innermost );
+    free ( loops->block_list );
+    *loops = (ir_loops_t) { 0 };
+}
@@ -0,0 +1,111 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Dead code elimination. The instructions with effects beyond their result are kept, along with every instruction
+// computing a value they use, directly or through others. The rest are removed, including values that only feed
+// each other around a loop, like a counter that is no longer compared
+
+/* Returns whether the instruction must run even if its result is not used */
+static bool has_effect ( const ir_instruction_t *instruction )
+{
+    switch ( instruction->opcode )
+    {
+        case IR_COPY:
+        case IR_NEG:
+        case IR_LOAD:
+        case IR_LOAD_ELEMENT:
+        case IR_ADDRESS:
+        case IR_LOAD_POINTER:
+        case IR_PHI:
+            return false;
+        case IR_BINARY:
+            // Division can fault
+            return instruction->op == OP_DIV && ( instruction->b.kind != IR_OPERAND_CONSTANT
+                                                  || instruction->b.constant == 0 || instruction->b.constant == -1 );
+        default:
+            return true;
+    }
+}
+
+void remove_dead_code ( ir_function_t *function )
+{
+    // Every virtual register must have a single definition
+    assert ( function->in_ssa );
+    uint32_t n_vregs = function->n_vregs;
+    // Where every virtual register is defined, as a block and an index
+    uint32_t (*definition)[2] = malloc ( n_vregs * sizeof(*definition) );
+    bool *used = calloc ( n_vregs, sizeof(bool) );
+    vreg_t *worklist = malloc ( n_vregs * sizeof(vreg_t) );
+    uint32_t n_listed = 0;
+    for ( vreg_t v = 0; v < n_vregs; v++ )
+        definition[v][0] = UINT32_MAX;
+
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+            if ( block->instructions[i].dst != NO_VREG )
+            {
+                definition[block->instructions[i].dst][0] = b;
+                definition[block->instructions[i].dst][1] = i;
+            }
+    }
+
+    // Marks the virtual registers an instruction reads as used, and lists them so their definitions are visited
+    #define USE(operand) \
+        if ( (operand).kind == IR_OPERAND_VREG && !used[(operand).vreg] ) \
+        { \
+            used[(operand).vreg] = true; \
+            worklist[n_listed++] = (operand).vreg; \
+        }
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            if ( !has_effect ( instruction ) )
+                continue;
+            if ( instruction->dst != NO_VREG )
+                used[instruction->dst] = true;
+            USE ( instruction->a );
+            USE ( instruction->b );
+        }
+    }
+    while ( n_listed > 0 )
+    {
+        vreg_t vreg = worklist[--n_listed];
+        if ( definition[vreg][0] == UINT32_MAX )
+            continue; // Parameters are defined by the caller
+        const ir_instruction_t *instruction =
+            &function->blocks[definition[vreg][0]].instructions[definition[vreg][1]];
+        if ( instruction->opcode == IR_PHI )
+            for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+                USE ( instruction->arguments[j].value );
+        USE ( instruction->a );
+        USE ( instruction->b );
+    }
+    #undef USE
+
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        ir_block_t *block = &function->blocks[b];
+        uint32_t n_kept = 0;
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->dst != NO_VREG && !used[instruction->dst] && !has_effect ( instruction ) )
+            {
+                if ( instruction->opcode == IR_PHI )
+                    free ( instruction->arguments );
+                continue;
+            }
+            block->instructions[n_kept++] = *instruction;
+        }
+        block->n_instructions = n_kept;
+    }
+
+    free ( definition );
+    free ( used );
+    free ( worklist );
+}
@@ -0,0 +1,277 @@
+#include "emitter.h"
+#include "emit.h"
+#include "intern.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// The global emitter, used by every EMIT macro
+emitter_t emitter;
+
+// Size of the buffer when the first byte is emitted. It doubles whenever it is full
+#define EMITTER_INITIAL_CAPACITY ( 1024 * 1024 )
+
+// Makes sure there is room for at least size more bytes, and returns where they should be written
+static char* emitter_reserve ( size_t size )
+{
+    if ( emitter.length + size > emitter.capacity )
+    {
+        size_t capacity = emitter.capacity == 0 ? EMITTER_INITIAL_CAPACITY : emitter.capacity * 2;
+        while ( capacity < emitter.length + size )
+            capacity *= 2;
+        emitter.buffer = realloc ( emitter.buffer, capacity );
+        emitter.capacity = capacity;
+    }
+    return &emitter.buffer[emitter.length];
+}
+
+// Copies length bytes from string to out, and returns the position right after them
+static inline char* append ( char *out, const char *string, size_t length )
+{
+    memcpy ( out, string, length );
+    return out + length;
+}
+
+// Marks everything up to out as emitted. out must be within the room made by emitter_reserve
+static inline void emitter_commit ( char *out )
+{
+    emitter.length = out - emitter.buffer;
+}
+
+label_t new_label ( void )
+{
+    return emitter.n_labels++;
+}
+
+// Formats straight into the buffer, and only reserves more room if it did not fit
+static void emit_vformat ( const char *format, va_list args )
+{
+    va_list retry;
+    va_copy ( retry, args );
+
+    char *out = emitter_reserve ( 1 );
+    size_t available = emitter.capacity - emitter.length;
+    int length = vsnprintf ( out, available, format, args );
+
+    if ( (size_t) length >= available )
+    {
+        out = emitter_reserve ( length + 1 );
+        vsnprintf ( out, length + 1, format, retry );
+    }
+    va_end ( retry );
+    emitter_commit ( out + length );
+}
+
+void emit_format ( const char *format, ... )
+{
+    va_list args;
+    va_start ( args, format );
+    emit_vformat ( format, args );
+    va_end ( args );
+}
+
+void emit_instruction_format ( const char *format, ... )
+{
+    va_list args;
+    va_start ( args, format );
+    emit_vformat ( format, args );
+    va_end ( args );
+    emitter.n_instructions++;
+}
+
+// The functions below measure their output, reserve room for all of it at once,
+// and copy the pieces straight into the buffer
+void emit_instruction ( const char *mnemonic, const char *src, const char *dst )
+{
+    size_t mnemonic_length = strlen ( mnemonic );
+    size_t src_length = src != NULL ? strlen ( src ) : 0;
+    size_t dst_length = dst != NULL ? strlen ( dst ) : 0;
+
+    char *out = emitter_reserve ( mnemonic_length + src_length + dst_length + 5 );
+    *out++ = '\t';
+    out = append ( out, mnemonic, mnemonic_length );
+    if ( src != NULL )
+    {
+        *out++ = ' ';
+        out = append ( out, src, src_length );
+    }
+    if ( dst != NULL )
+        out = append ( append ( out, ", ", 2 ), dst, dst_length );
+    *out++ = '\n';
+    emitter_commit ( out );
+    emitter.n_instructions++;
+}
+
+void emit_immediate ( const char *mnemonic, int64_t immediate, const char *dst )
+{
+    size_t mnemonic_length = strlen ( mnemonic );
+    size_t dst_length = strlen ( dst );
+
+    // An int64_t has at most 20 characters, including the sign
+    char *out = emitter_reserve ( mnemonic_length + dst_length + 26 );
+    *out++ = '\t';
+    out = append ( out, mnemonic, mnemonic_length );
+    out = append ( out, " $", 2 );
+    out += format_int ( out, immediate );
+    out = append ( append ( out, ", ", 2 ), dst, dst_length );
+    *out++ = '\n';
+    emitter_commit ( out );
+    emitter.n_instructions++;
+}
+
+void emit_jump ( const char *mnemonic, label_t label )
+{
+    size_t mnemonic_length = strlen ( mnemonic );
+
+    char *out = emitter_reserve ( mnemonic_length + 16 );
+    *out++ = '\t';
+    out = append ( out, mnemonic, mnemonic_length );
+    out = append ( out, " .L", 3 );
+    out += format_int ( out, label );
+    *out++ = '\n';
+    emitter_commit ( out );
+    emitter.n_instructions++;
+}
+
+void emit_label ( label_t label )
+{
+    char *out = emitter_reserve ( 16 );
+    out = append ( out, ".L", 2 );
+    out += format_int ( out, label );
+    out = append ( out, ":\n", 2 );
+    emitter_commit ( out );
+}
+
+void emit_push ( const char *src )
+{
+    emit_instruction ( "pushq", src, NULL );
+    emitter.stack_depth += 8;
+}
+
+void emit_pop ( const char *dst )
+{
+    emit_instruction ( "popq", dst, NULL );
+    emitter.stack_depth -= 8;
+}
+
+void emit_stack_adjust ( int64_t bytes )
+{
+    if ( bytes > 0 )
+        emit_immediate ( "subq", bytes, RSP );
+    else if ( bytes < 0 )
+        emit_immediate ( "addq", -bytes, RSP );
+    emitter.stack_depth += bytes;
+}
+
+int64_t emit_call_padding ( int64_t pushed )
+{
+    int64_t padding = ( emitter.stack_depth + pushed ) % 16 != 0 ? 8 : 0;
+    emit_stack_adjust ( padding );
+    return padding;
+}
+
+size_t format_int ( char *out, int64_t value )
+{
+    // Work on the magnitude as unsigned, so INT64_MIN does not overflow
+    uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+    // Write the digits backwards into a temporary buffer
+    char reversed[20];
+    size_t n_digits = 0;
+    do {
+        reversed[n_digits++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while ( magnitude != 0 );
+
+    size_t length = 0;
+    if ( value < 0 )
+        out[length++] = '-';
+    while ( n_digits > 0 )
+        out[length++] = reversed[--n_digits];
+    return length;
+}
+
+const char* frame_operand ( int offset )
+{
+    static char result[32];
+    size_t length = format_int ( result, offset );
+    memcpy ( &result[length], MEM(RBP), sizeof(MEM(RBP)) );
+    return result;
+}
+
+const char* global_operand ( const char *name, int64_t displacement )
+{
+    static char *result = NULL;
+    static size_t capacity = 0;
+
+    // Interned names know their own length. The displacement takes at most 21 characters, with its sign
+    size_t name_length = INTERNED_HEADER(name)->length;
+    size_t length = 1 + name_length + 21 + sizeof(MEM(RIP));
+    if ( length > capacity )
+    {
+        capacity = length * 2;
+        result = realloc ( result, capacity );
+    }
+
+    result[0] = '.';
+    memcpy ( &result[1], name, name_length );
+    length = 1 + name_length;
+    if ( displacement > 0 )
+        result[length++] = '+';
+    if ( displacement != 0 )
+        length += format_int ( &result[length], displacement );
+    memcpy ( &result[length], MEM(RIP), sizeof(MEM(RIP)) );
+    return result;
+}
+
+const char* immediate_operand ( int64_t value )
+{
+    static char result[24];
+    result[0] = '$';
+    result[1 + format_int ( &result[1], value )] = '\0';
+    return result;
+}
+
+const char* indexed_operand ( int64_t displacement, const char *base, const char *index )
+{
+    static char result[64];
+    size_t length = displacement != 0 ? format_int ( result, displacement ) : 0;
+    snprintf ( &result[length], sizeof(result) - length, "(%s, %s, 8)", base, index );
+    return result;
+}
+
+void emitter_write ( const char *path )
+{
+    FILE *file = stdout;
+    if ( path != NULL )
+    {
+        file = fopen ( path, "w" );
+        if ( file == NULL )
+        {
+            fprintf ( stderr, "error: could not open output file '%s'\n", path );
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    if ( fwrite ( emitter.buffer, 1, emitter.length, file ) != emitter.length || fflush ( file ) != 0 )
+    {
+        fprintf ( stderr, "error: could not write the generated assembly\n" );
+        exit ( EXIT_FAILURE );
+    }
+
+    if ( path != NULL )
+        fclose ( file );
+    emitter.n_written += emitter.length;
+    emitter.length = 0;
+}
+
+void emitter_destroy ( void )
+{
+    free ( emitter.buffer );
+    emitter.buffer = NULL;
+    emitter.length = emitter.capacity = 0;
+}
@@ -2,30 +2,59 @@
 
 // This header defines a bunch of macros we can use to emit assembly to stdout
 #include "emit.h"
+// Linear scan register allocation, used for parameters and local variables
+#include "regalloc.h"
+// Three-address code, used instead of the syntax tree when generate_program is asked to
+#include "ir.h"
 
-// In the System V calling convention, the first 6 integer parameters are passed in registers
-#define NUM_REGISTER_PARAMS 6
-static const char *REGISTER_PARAMS[6] = {RDI, RSI, RDX, RCX, R8, R9};
-
-// Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
-#define FUNC_PARAM_COUNT(func) ((func)->node->children[1]->n_children)
+static const char *REGISTER_PARAMS[NUM_REGISTER_PARAMS] = {RDI, RSI, RDX, RCX, R8, R9};
 
 static void generate_stringtable ( void );
 static void generate_global_variables ( void );
 static void generate_function ( symbol_t *function );
-static void generate_expression ( node_t *expression );
-static void generate_statement ( node_t *node );
+static const char* generate_expression ( node_id_t expression, uint32_t level );
+static void generate_statement ( node_id_t node );
 static void generate_main ( symbol_t *first );
+static void allocate_variables ( symbol_t *function );
+static void generate_epilogue ( void );
+static void destroy_allocation ( void );
+
+// Expressions and statements are generated without recursion, using explicit stacks.
+// The stacks are kept between functions, and freed once the program is generated
+static walk_stack_t expression_stack;
+static walk_stack_t statement_stack;
+
+// The ENDWHILE label of every while loop being generated, with the innermost last
+static label_t *while_end_labels;
+static size_t while_end_labels_len;
+static size_t while_end_labels_capacity;
+
+// Expressions are evaluated in the argument registers, in their order. A node evaluated at level k places its result
+// in REGISTER_PARAMS[k], and may use the registers from there up, but not those below, which hold values still needed.
+// The argument at position k of a call can thus be evaluated straight into its register.
+// RAX is only used inside the instructions of a single operation, and for the results of calls
+#define N_SCRATCH_REGISTERS NUM_REGISTER_PARAMS
+// The levels of the registers idivq and the shift instructions use implicitly
+#define RDX_LEVEL 2
+#define RCX_LEVEL 3
+
+// What the evaluation order of an expression depends on, found for every node by label_expression
+typedef struct
+{
+    uint8_t need;      // Registers needed to evaluate the node without spilling, as counted by Sethi and Ullman
+    bool has_call;     // Whether the node contains a function call
+    bool reads_memory; // Whether the node reads a global variable or array, which a call may change
+    uint8_t pattern;   // How a binary operation is done, see select_pattern
+} expression_info_t;
 
-const char *unique_label() {
-    static int counter = 0;
-    char *label = (char *)malloc(20 * sizeof(char)); // Allocate memory for the label
-    snprintf(label, 20, ".L%d", counter++); // Format the label
-    return label;
-}
+// A call clobbers every scratch register, so it needs more than there are, and values live across it are spilled
+#define CALL_NEED ( N_SCRATCH_REGISTERS + 1 )
+
+// Indexed by node, and allocated once for the whole tree
+static expression_info_t *expression_info;
 
 /* Entry point for code generation */
-void generate_program ( void )
+void generate_program ( int optimization_level )
 {
     generate_stringtable ( );
     generate_global_variables ( );
@@ -39,7 +68,16 @@ void generate_program ( void )
             continue;
         if ( !first_function )
             first_function = symbol;
-        generate_function ( symbol );
+        if ( optimization_level > 0 )
+        {
+            ir_function_t ir = { 0 };
+            build_ir_function ( symbol, &ir, optimization_level );
+            leave_ssa ( &ir );
+            generate_ir_function ( &ir );
+            ir_destroy_function ( &ir );
+        }
+        else
+            generate_function ( symbol );
     }
 
     if ( first_function == NULL )
@@ -48,20 +86,32 @@ void generate_program ( void )
         exit ( EXIT_FAILURE );
     }
     generate_main ( first_function );
+    generate_runtime ( );
+
+    destroy_allocation ( );
+    free ( expression_info );
+    expression_info = NULL;
+    walk_stack_destroy ( &expression_stack );
+    walk_stack_destroy ( &statement_stack );
+    free ( while_end_labels );
+    while_end_labels = NULL;
+    while_end_labels_len = while_end_labels_capacity = 0;
 }
 
 /* Prints one .asciz entry for each string in the global string_list */
 static void generate_stringtable ( void )
 {
     DIRECTIVE ( ".section %s", ASM_STRING_SECTION );
-    // These strings are used by printf
-    DIRECTIVE ( "intout: .asciz \"%s\"", "%ld" );
-    DIRECTIVE ( "strout: .asciz \"%s\"", "%s" );
     // This string is used by the entry point-wrapper
     DIRECTIVE ( "errout: .asciz \"%s\"", "Wrong number of arguments" );
+    DIRECTIVE ( ".set errout_length, . - errout - 1" );
 
+    // The assembler counts the length of each string, escapes and all, which is passed to vsl_print_string
     for ( size_t i = 0; i < string_list_len; i++ )
+    {
         DIRECTIVE ( "string%ld: \t.asciz %s", i, string_list[i] );
+        DIRECTIVE ( ".set string%ld_length, . - string%ld - 1", i, i );
+    }
 }
 
 /* Prints .zero entries in the .bss section to allocate room for global variables and arrays */
@@ -78,12 +128,12 @@ static void generate_global_variables ( void )
         }
         else if ( symbol->type == SYMBOL_GLOBAL_ARRAY )
         {
-            if ( symbol->node->children[1]->type != NUMBER_DATA)
+            if ( NODE_TYPE(CHILD(symbol->node, 1)) != NUMBER_DATA)
             {
                 fprintf ( stderr, "error: length of array '%s' is not compile time known", symbol->name );
                 exit ( EXIT_FAILURE );
             }
-            int64_t length = *(int64_t*) symbol->node->children[1]->data;
+            int64_t length = NODE_DATA(CHILD(symbol->node, 1)).number;
             DIRECTIVE ( ".%s: \t.zero %ld", symbol->name, length*8 );
         }
     }
@@ -92,105 +142,829 @@ static void generate_global_variables ( void )
 /* Global variable used to make the functon currently being generated accessible from anywhere */
 static symbol_t *current_function;
 
+/* Register allocation */
+
+// Registers parameters and local variables can live in.
+// RAX and the argument registers are used to evaluate expressions
+static const char *VARIABLE_REGISTERS[] = { RBX, R12, R13, R14, R15, R10, R11 };
+#define N_VARIABLE_REGISTERS 7
+// The set of VARIABLE_REGISTERS that calls may clobber: R10 and R11
+#define CALLER_SAVED_VARIABLE_REGISTERS 0x60
+
+// Each statement in a function body is given a position, in the order the statements are generated.
+// A statement reads its variables and makes its calls at the even position 2p, and assigns at 2p+1,
+// so a variable that dies in a statement can share a register with the variable it assigns.
+// Position 0 is the entry of the function
+#define READ_POSITION(p) (2 * (p))
+#define WRITE_POSITION(p) (2 * (p) + 1)
+
+// A parameter or local variable of the current function
+typedef struct variable
+{
+    bool used;          // Whether the variable occurs in the function body at all
+    bool written_first; // Whether the variable is assigned before being read, whenever its block runs
+    uint32_t scope_depth; // The number of ifs and whiles around the block declaring the variable
+    uint32_t uses;      // The number of occurrences, weighted by loop depth
+    uint32_t start;     // The live interval of the variable, in positions
+    uint32_t end;
+    int32_t location;   // Index into VARIABLE_REGISTERS, or SPILLED
+    int frame_offset;   // Where a spilled variable lives, relative to %rbp
+} variable_t;
+
+// The variables of the current function, indexed by sequence number
+static variable_t *variables;
+static size_t n_variables;
+static size_t variables_capacity;
+
+// The set of VARIABLE_REGISTERS given to variables of the current function
+static uint32_t used_registers;
+
+// The number of stack slots for spilled variables in the frame of the current function
+static uint32_t n_frame_slots;
+
+// The position of every statement of the program, indexed by node
+static uint32_t *statement_positions;
+// The position of the statement currently being generated
+static uint32_t current_position;
+
+// Code in a loop is expected to run this many times more often than the code around it
+#define LOOP_WEIGHT_SHIFT 3
+#define MAX_LOOP_WEIGHT_DEPTH 4
+// The weight of the statement being numbered
+static uint32_t statement_weight;
+// The number of ifs and whiles around the statement being numbered
+static uint32_t conditional_depth;
+
+// Every while loop in the current function, as the first and last position of the loop
+typedef struct { uint32_t start, end; } loop_t;
+static loop_t *loops;
+static size_t n_loops;
+static size_t loops_capacity;
+
+// Every statement making calls in the current function, with the summed weight of its calls and all earlier calls
+typedef struct { uint32_t position, weight_sum; } call_t;
+static call_t *calls;
+static size_t n_calls;
+static size_t calls_capacity;
+
+static live_interval_t *intervals;
+
+/* Records that a variable occurs at the given position */
+static void note_occurrence ( symbol_t *symbol, uint32_t position, bool write )
+{
+    if ( symbol->type != SYMBOL_LOCAL_VAR && symbol->type != SYMBOL_PARAMETER )
+        return;
+
+    variable_t *variable = &variables[symbol->sequence_number];
+    if ( !variable->used )
+    {
+        variable->used = true;
+        // Only a write that happens whenever the block of the variable runs comes before all reads
+        variable->written_first = write && conditional_depth == variable->scope_depth;
+        variable->start = position;
+    }
+    variable->end = position;
+    variable->uses += statement_weight;
+}
+
+/* Records that the statement at position makes a call */
+static void note_call ( uint32_t position )
+{
+    if ( n_calls > 0 && calls[n_calls - 1].position == READ_POSITION(position) )
+    {
+        calls[n_calls - 1].weight_sum += statement_weight;
+        return;
+    }
+
+    if ( n_calls == calls_capacity )
+    {
+        calls_capacity = calls_capacity * 2 + 64;
+        calls = realloc ( calls, calls_capacity * sizeof(call_t) );
+    }
+    uint32_t weight_sum = n_calls > 0 ? calls[n_calls - 1].weight_sum : 0;
+    calls[n_calls++] = (call_t) { READ_POSITION(position), weight_sum + statement_weight };
+}
+
+/* Returns the index of the first call at or after position */
+static size_t first_call_from ( uint32_t position )
+{
+    size_t low = 0, high = n_calls;
+    while ( low < high )
+    {
+        size_t middle = ( low + high ) / 2;
+        if ( calls[middle].position < position )
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/* Records the variables read and the calls made when evaluating an expression, in the statement at position */
+static void note_reads ( node_id_t expression, uint32_t position )
+{
+    walk_stack_t *stack = &expression_stack;
+    walk_push ( stack, expression );
+
+    while ( stack->depth > 0 )
+    {
+        node_id_t node = WALK_TOP(stack)->node;
+        stack->depth--;
+
+        if ( NODE_TYPE(node) == IDENTIFIER_DATA )
+            note_occurrence ( NODE_SYMBOL(node), READ_POSITION(position), false );
+
+        if ( NODE_TYPE(node) == FUNCTION_CALL )
+            note_call ( position );
+
+        for ( uint32_t i = 0; i < N_CHILDREN(node); i++ )
+            walk_push ( stack, CHILD(node, i) );
+    }
+}
+
+/* Finds the live interval of every parameter and local variable in the function, and gives them registers.
+ * Variables that do not get a register are spilled to the stack frame.
+ *
+ * Liveness is approximated without a control flow graph:
+ *  - A variable is live from its first to its last occurrence.
+ *  - Parameters arrive at the function entry, and local variables are 0 until assigned,
+ *    so unless a variable is first assigned outside of any if or while, it is live from the entry.
+ *  - A variable live anywhere in a loop may be needed by the next iteration, so it is live in the whole loop.
+ */
+static void allocate_variables ( symbol_t *function )
+{
+    symbol_table_t *symtable = function->function_symtable;
+    n_variables = symtable->n_symbols;
+    if ( n_variables > variables_capacity )
+    {
+        variables_capacity = n_variables * 2;
+        variables = realloc ( variables, variables_capacity * sizeof(variable_t) );
+        intervals = realloc ( intervals, variables_capacity * sizeof(live_interval_t) );
+    }
+    for ( size_t i = 0; i < n_variables; i++ )
+        variables[i] = (variable_t) { .location = SPILLED };
+    n_loops = n_calls = 0;
+    if ( statement_positions == NULL )
+        statement_positions = calloc ( syntax_tree.n_nodes, sizeof(uint32_t) );
+
+    // Number the statements in the order they are generated, see generate_statement
+    uint32_t next_position = 1;
+    conditional_depth = 0;
+    // Local variables are numbered in the order their blocks are reached, after the parameters
+    size_t next_local = FUNC_PARAM_COUNT(function);
+    uint32_t loop_depth = 0;
+    walk_stack_t *stack = &statement_stack;
+    walk_push ( stack, CHILD(function->node, 2) );
+
+    while ( stack->depth > 0 )
+    {
+        walk_frame_t *frame = WALK_TOP(stack);
+        node_id_t statement = frame->node;
+        uint32_t stage = frame->stage++;
+        node_id_t next = NO_NODE;
+
+        if ( stage == 0 && NODE_TYPE(statement) != BLOCK )
+            statement_positions[statement] = next_position++;
+        uint32_t position = statement_positions[statement];
+
+        // The relation of a while loop is evaluated in every iteration, so it belongs to the loop
+        if ( NODE_TYPE(statement) == WHILE_STATEMENT && stage == 0 )
+            loop_depth++;
+        uint32_t weight_depth = loop_depth < MAX_LOOP_WEIGHT_DEPTH ? loop_depth : MAX_LOOP_WEIGHT_DEPTH;
+        statement_weight = UINT32_C(1) << ( LOOP_WEIGHT_SHIFT * weight_depth );
+
+        switch ( NODE_TYPE(statement) )
+        {
+            case BLOCK: {
+                // The symbols of a block's declarations were added to the table in the same order, see bind_names
+                if ( stage == 0 && N_CHILDREN(statement) == 2 )
+                {
+                    node_id_t declarations = CHILD(statement, 0);
+                    for ( uint32_t i = 0; i < N_CHILDREN(declarations); i++ )
+                        for ( uint32_t j = 0; j < N_CHILDREN(CHILD(declarations, i)); j++ )
+                        {
+                            assert ( symtable->symbols[next_local]->node == CHILD(CHILD(declarations, i), j) );
+                            variables[next_local++].scope_depth = conditional_depth;
+                        }
+                }
+                node_id_t statement_list = CHILD(statement, N_CHILDREN(statement)-1);
+                if ( stage < N_CHILDREN(statement_list) )
+                    next = CHILD(statement_list, stage);
+                break;
+            }
+            case ASSIGNMENT_STATEMENT: {
+                note_reads ( CHILD(statement, 1), position );
+                node_id_t dest = CHILD(statement, 0);
+                if ( NODE_TYPE(dest) == IDENTIFIER_DATA )
+                    note_occurrence ( NODE_SYMBOL(dest), WRITE_POSITION(position), true );
+                else
+                    note_reads ( dest, position );
+                break;
+            }
+            case PRINT_STATEMENT:
+                // Printing calls the runtime library for each item, and then for the newline
+                note_reads ( statement, position );
+                for ( uint32_t i = 0; i <= N_CHILDREN(CHILD(statement, 0)); i++ )
+                    note_call ( position );
+                break;
+            case RETURN_STATEMENT:
+            case FUNCTION_CALL:
+                note_reads ( statement, position );
+                break;
+            case IF_STATEMENT:
+                if ( stage == 0 )
+                {
+                    note_reads ( CHILD(statement, 0), position );
+                    conditional_depth++;
+                    next = CHILD(statement, 1);
+                }
+                else if ( stage == 1 && N_CHILDREN(statement) > 2 )
+                    next = CHILD(statement, 2);
+                else
+                    conditional_depth--;
+                break;
+            case WHILE_STATEMENT:
+                if ( stage == 0 )
+                {
+                    note_reads ( CHILD(statement, 0), position );
+                    conditional_depth++;
+                    next = CHILD(statement, 1);
+                    break;
+                }
+                conditional_depth--;
+                loop_depth--;
+                // Inner loops end first, so the loops are sorted by their end
+                if ( n_loops == loops_capacity )
+                {
+                    loops_capacity = loops_capacity * 2 + 16;
+                    loops = realloc ( loops, loops_capacity * sizeof(loop_t) );
+                }
+                loops[n_loops++] = (loop_t) { READ_POSITION(position), WRITE_POSITION(next_position - 1) };
+                break;
+            default:
+                break;
+        }
+
+        if ( next != NO_NODE )
+            walk_push ( stack, next );
+        else
+            stack->depth--;
+    }
+
+    for ( size_t i = 0; i < n_variables; i++ )
+    {
+        variable_t *variable = &variables[i];
+        if ( variable->used && ( symtable->symbols[i]->type == SYMBOL_PARAMETER || !variable->written_first ) )
+            variable->start = 0;
+    }
+
+    // Extending a variable to an inner loop never makes it overlap an outer loop it did not overlap before,
+    // so one pass over the loops, inner loops first, is enough.
+    // A variable assigned first in a loop is declared in it, and assigned again before it is read in every iteration,
+    // so it needs nothing from the iteration before
+    for ( size_t l = 0; l < n_loops; l++ )
+    {
+        for ( size_t i = 0; i < n_variables; i++ )
+        {
+            variable_t *variable = &variables[i];
+            if ( !variable->used || variable->start > loops[l].end || variable->end < loops[l].start )
+                continue;
+            if ( variable->written_first && variable->start > loops[l].start )
+                continue;
+            if ( variable->start > loops[l].start )
+                variable->start = loops[l].start;
+            if ( variable->end < loops[l].end )
+                variable->end = loops[l].end;
+        }
+    }
+
+    size_t n_intervals = 0;
+    for ( size_t i = 0; i < n_variables; i++ )
+    {
+        variable_t *variable = &variables[i];
+        if ( !variable->used )
+            continue;
+
+        // The calls are sorted by position, so the weight of the calls in the interval is a difference of sums
+        size_t first = first_call_from ( variable->start );
+        size_t last = first_call_from ( variable->end + 1 );
+        uint32_t calls_before = first > 0 ? calls[first - 1].weight_sum : 0;
+        uint32_t calls_until = last > 0 ? calls[last - 1].weight_sum : 0;
+
+        intervals[n_intervals++] = (live_interval_t) {
+            .start = variable->start,
+            .end = variable->end,
+            .id = i,
+            .uses = variable->uses,
+            .calls = calls_until - calls_before
+        };
+    }
+
+    used_registers = linear_scan ( intervals, n_intervals, N_VARIABLE_REGISTERS, CALLER_SAVED_VARIABLE_REGISTERS );
+    for ( size_t i = 0; i < n_intervals; i++ )
+        variables[intervals[i].id].location = intervals[i].location;
+
+    // Parameters passed on the stack stay where the caller put them.
+    // The other spilled variables are kept at the front of intervals, still sorted by start, to be given slots
+    size_t n_spilled = 0;
+    for ( size_t i = 0; i < n_intervals; i++ )
+    {
+        uint32_t id = intervals[i].id;
+        if ( intervals[i].location != SPILLED )
+            continue;
+        if ( symtable->symbols[id]->type == SYMBOL_PARAMETER && id >= NUM_REGISTER_PARAMS )
+            // Parameter 6 is at 16(%rbp), with further parameters moving up from there
+            variables[id].frame_offset = 16 + ( id - NUM_REGISTER_PARAMS ) * 8;
+        else
+            intervals[n_spilled++] = intervals[i];
+    }
+
+    // Spilled variables get the stack slots below the saved callee-saved registers.
+    // Variables that are never live at the same time, such as those of sibling blocks, share a slot
+    int saved_registers = __builtin_popcount ( used_registers & ~CALLER_SAVED_VARIABLE_REGISTERS );
+    n_frame_slots = allocate_slots ( intervals, n_spilled );
+    // Calls are made from a frame that is a multiple of 16 bytes, so they only need padding when there are temporaries
+    // on the stack. Below %rbp are the saved registers and the slots
+    if ( n_calls > 0 && ( saved_registers + n_frame_slots ) % 2 != 0 )
+        n_frame_slots++;
+    for ( size_t i = 0; i < n_spilled; i++ )
+        variables[intervals[i].id].frame_offset = -8 * ( saved_registers + 1 + intervals[i].location );
+}
+
+/* Frees the memory used for register allocation */
+static void destroy_allocation ( void )
+{
+    free ( variables );
+    free ( intervals );
+    free ( statement_positions );
+    free ( loops );
+    free ( calls );
+    variables = NULL;
+    intervals = NULL;
+    statement_positions = NULL;
+    loops = NULL;
+    calls = NULL;
+    n_variables = variables_capacity = n_loops = loops_capacity = n_calls = calls_capacity = 0;
+}
+
+/* Pushes the caller-saved registers of the variables live in the current statement, since a call clobbers them.
+ * Returns the set of pushed registers, for restore_caller_saved */
+static uint32_t save_caller_saved ( void )
+{
+    uint32_t saved = 0;
+    if ( ( used_registers & CALLER_SAVED_VARIABLE_REGISTERS ) == 0 )
+        return saved;
+
+    uint32_t position = READ_POSITION(current_position);
+    for ( size_t i = 0; i < n_variables; i++ )
+    {
+        variable_t *variable = &variables[i];
+        if ( variable->location == SPILLED || variable->start > position || variable->end < position )
+            continue;
+        saved |= ( UINT32_C(1) << variable->location ) & CALLER_SAVED_VARIABLE_REGISTERS;
+    }
+
+    for ( int r = 0; r < N_VARIABLE_REGISTERS; r++ )
+        if ( saved & ( UINT32_C(1) << r ) )
+            PUSHQ ( VARIABLE_REGISTERS[r] );
+    return saved;
+}
+
+/* Pops the registers pushed by save_caller_saved */
+static void restore_caller_saved ( uint32_t saved )
+{
+    for ( int r = N_VARIABLE_REGISTERS - 1; r >= 0; r-- )
+        if ( saved & ( UINT32_C(1) << r ) )
+            POPQ ( VARIABLE_REGISTERS[r] );
+}
+
 /* Prints the entry point. preamble, statements and epilouge of the given function */
 static void generate_function ( symbol_t *function )
 {
     LABEL( ".%s", function->name );
     current_function = function;
+    allocate_variables ( function );
 
+    // The call pushed the return address onto the aligned stack
+    emitter.stack_depth = 8;
     PUSHQ ( RBP );
     MOVQ ( RSP, RBP );
 
-    // Up to 6 prameters have been passed in registers. Place them on the stack instead
-    for ( size_t i = 0; i < FUNC_PARAM_COUNT(function) && i < NUM_REGISTER_PARAMS; i++ )
-        PUSHQ ( REGISTER_PARAMS[i] );
+    // Save the callee-saved registers given to variables, and make room for the spilled ones
+    for ( int r = 0; r < N_VARIABLE_REGISTERS; r++ )
+        if ( used_registers & ~CALLER_SAVED_VARIABLE_REGISTERS & ( UINT32_C(1) << r ) )
+            PUSHQ ( VARIABLE_REGISTERS[r] );
+
+    emit_stack_adjust ( n_frame_slots * 8 );
+
+    // Up to 6 prameters have been passed in registers. Move them to their variable's register or stack slot.
+    // Local variables start out as 0, unless they are always assigned before they are read
+    for ( size_t i = 0; i < n_variables; i++ )
+    {
+        variable_t *variable = &variables[i];
+        if ( !variable->used )
+            continue;
 
-    // Now, for each local variable, push 8-byte 0 values to the stack
-    for ( size_t i = 0; i < function->function_symtable->n_symbols; i++ )
-        if ( function->function_symtable->symbols[i]->type == SYMBOL_LOCAL_VAR )
-            PUSHQ("$0");
+        bool parameter = function->function_symtable->symbols[i]->type == SYMBOL_PARAMETER;
+        if ( variable->location == SPILLED )
+        {
+            if ( parameter && i < NUM_REGISTER_PARAMS )
+                MOVQ ( REGISTER_PARAMS[i], frame_operand ( variable->frame_offset ) );
+            else if ( !parameter && !variable->written_first )
+                MOVQ ( "$0", frame_operand ( variable->frame_offset ) );
+        }
+        else
+        {
+            const char *reg = VARIABLE_REGISTERS[variable->location];
+            if ( parameter && i < NUM_REGISTER_PARAMS )
+                MOVQ ( REGISTER_PARAMS[i], reg );
+            else if ( parameter )
+                MOVQ ( frame_operand ( 16 + ( i - NUM_REGISTER_PARAMS ) * 8 ), reg );
+            else if ( !variable->written_first )
+                MOVQ ( "$0", reg );
+        }
+    }
 
-    generate_statement( function->node->children[2] );
+    generate_statement( CHILD(function->node, 2) );
 
     // In case the function didn't return, return 0 here
     MOVQ ( "$0", RAX );
-    // leaveq is written out manually, to increase clarity of what happens
-    MOVQ ( RBP, RSP );
-    POPQ ( RBP );
-    RET;
+    generate_epilogue ( );
 }
 
-static void generate_function_call ( node_t *call )
+/* Instruction selection */
+
+// How a node can be used as the operand of an instruction as it is, without evaluating it into a register first
+typedef enum { OPERAND_NONE, OPERAND_IMMEDIATE, OPERAND_REGISTER, OPERAND_MEMORY } operand_kind_t;
+
+// Most instructions take immediates and displacements of at most 32 bits
+#define FITS_INT32(value) ( (value) >= INT32_MIN && (value) <= INT32_MAX )
+
+/* Returns the index expression of an ARRAY_INDEXING node. A constant added to or subtracted from it is taken out,
+ * and placed in *displacement as a number of bytes. Returns NO_NODE if the whole index is constant */
+static node_id_t array_index ( node_id_t node, int64_t *displacement )
 {
-    symbol_t *symbol = call->children[0]->symbol;
-    if ( symbol->type != SYMBOL_FUNCTION ) {
-        fprintf ( stderr, "error: '%s' is not a function\n", symbol->name );
-        exit ( EXIT_FAILURE );
+    node_id_t index = CHILD(node, 1);
+    *displacement = 0;
+
+    if ( NODE_TYPE(index) == NUMBER_DATA && FITS_INT32(NODE_DATA(index).number * 8) )
+    {
+        *displacement = NODE_DATA(index).number * 8;
+        return NO_NODE;
+    }
+    if ( NODE_TYPE(index) != EXPRESSION || N_CHILDREN(index) != 2 )
+        return index;
+
+    operator_t op = NODE_DATA(index).op;
+    node_id_t left = CHILD(index, 0);
+    node_id_t right = CHILD(index, 1);
+    if ( ( op == OP_ADD || op == OP_SUB ) && NODE_TYPE(right) == NUMBER_DATA
+        && FITS_INT32(NODE_DATA(right).number * 8) )
+    {
+        *displacement = ( op == OP_ADD ? 8 : -8 ) * NODE_DATA(right).number;
+        return left;
+    }
+    if ( op == OP_ADD && NODE_TYPE(left) == NUMBER_DATA && FITS_INT32(NODE_DATA(left).number * 8) )
+    {
+        *displacement = 8 * NODE_DATA(left).number;
+        return right;
+    }
+    return index;
+}
+
+/* Returns how the node can be used directly as an operand: an immediate that fits in 32 bits,
+ * a variable in a register or in memory, or an array element at a constant index */
+static operand_kind_t operand_kind ( node_id_t node )
+{
+    switch ( NODE_TYPE(node) )
+    {
+        case NUMBER_DATA:
+            return FITS_INT32(NODE_DATA(node).number) ? OPERAND_IMMEDIATE : OPERAND_NONE;
+        case IDENTIFIER_DATA:
+        {
+            symbol_t *symbol = NODE_SYMBOL(node);
+            if ( symbol->type == SYMBOL_GLOBAL_VAR )
+                return OPERAND_MEMORY;
+            if ( symbol->type != SYMBOL_LOCAL_VAR && symbol->type != SYMBOL_PARAMETER )
+                return OPERAND_NONE;
+            return variables[symbol->sequence_number].location == SPILLED ? OPERAND_MEMORY : OPERAND_REGISTER;
+        }
+        case ARRAY_INDEXING:
+        {
+            int64_t displacement;
+            if ( NODE_SYMBOL(CHILD(node, 0))->type != SYMBOL_GLOBAL_ARRAY )
+                return OPERAND_NONE;
+            return array_index ( node, &displacement ) == NO_NODE ? OPERAND_MEMORY : OPERAND_NONE;
+        }
+        default:
+            return OPERAND_NONE;
+    }
+}
+
+// Patterns of binary operations, chosen by select_pattern.
+// LEFT_DIRECT and RIGHT_DIRECT mark operands the instruction uses as they are, as given by operand_kind.
+// SCALED_ADD is an ADD done by leaq, which scales its right operand by 1, 2, 4 or 8.
+// Its operands are only direct when they are variables in registers
+#define LEFT_DIRECT 1
+#define RIGHT_DIRECT 2
+#define SCALED_ADD 4
+
+/* Matches x + (y << k) for k from 1 to 3, in either order, and x + y for two variables in registers.
+ * Returns the factor y is scaled by, after setting *x and *y, or 0 if the node does not match */
+static int64_t match_scaled_add ( node_id_t node, node_id_t *x, node_id_t *y )
+{
+    if ( NODE_TYPE(node) != EXPRESSION || NODE_DATA(node).op != OP_ADD )
+        return 0;
+
+    for ( uint32_t i = 0; i < 2; i++ )
+    {
+        node_id_t scaled = CHILD(node, i);
+        if ( NODE_TYPE(scaled) != EXPRESSION || NODE_DATA(scaled).op != OP_SHL
+            || NODE_TYPE(CHILD(scaled, 1)) != NUMBER_DATA )
+            continue;
+        int64_t shift = NODE_DATA(CHILD(scaled, 1)).number;
+        if ( shift < 1 || shift > 3 )
+            continue;
+        *x = CHILD(node, 1 - i);
+        *y = CHILD(scaled, 0);
+        return INT64_C(1) << shift;
+    }
+
+    if ( operand_kind ( CHILD(node, 0) ) == OPERAND_REGISTER && operand_kind ( CHILD(node, 1) ) == OPERAND_REGISTER )
+    {
+        *x = CHILD(node, 0);
+        *y = CHILD(node, 1);
+        return 1;
     }
+    return 0;
+}
+
+/* Sets *left and *right to the operands of a binary EXPRESSION or RELATION node, once it has its pattern.
+ * Returns the scale of a SCALED_ADD, or 1 */
+static int64_t binary_operands ( node_id_t node, node_id_t *left, node_id_t *right )
+{
+    if ( expression_info[node].pattern & SCALED_ADD )
+        return match_scaled_add ( node, left, right );
+    *left = CHILD(node, 0);
+    *right = CHILD(node, 1);
+    return 1;
+}
 
-    node_t *argument_list = call->children[1];
+/* Returns whether the left operand of a binary EXPRESSION or RELATION is evaluated before the right one */
+static bool evaluates_left_first ( node_id_t node, node_id_t left_operand, node_id_t right_operand )
+{
+    expression_info_t *left = &expression_info[left_operand];
+    expression_info_t *right = &expression_info[right_operand];
 
-    int parameter_count = FUNC_PARAM_COUNT( symbol );
-    if ( parameter_count != argument_list->n_children )
+    // Calls can print and change globals, so they keep their order relative to other calls and memory reads:
+    // relations, ADD and MUL evaluate their left operand first, and the other operations their right operand
+    if ( ( left->has_call && ( right->has_call || right->reads_memory ) )
+        || ( right->has_call && left->reads_memory ) )
     {
-        fprintf ( stderr, "error: function '%s' expects '%d' arguments, but '%ld' were given\n",
-                  symbol->name, parameter_count, argument_list->n_children );
-        exit(EXIT_FAILURE);
+        operator_t op = NODE_DATA(node).op;
+        return NODE_TYPE(node) == RELATION || op == OP_ADD || op == OP_MUL;
     }
 
-    // We evaluate all parameters from right to left, pushing them to the stack
-    for ( int i = parameter_count-1; i >= 0; i-- ) {
-        generate_expression( argument_list->children[i] );
-        PUSHQ ( RAX );
+    // Otherwise the operand needing the most registers goes first, while all of them are free.
+    // Ties go to the left operand, which then ends up where the result goes
+    return left->need >= right->need;
+}
+
+/* Chooses the pattern of a binary EXPRESSION or RELATION node, once its children are labelled */
+static uint8_t select_pattern ( node_id_t node )
+{
+    node_id_t left = CHILD(node, 0);
+    node_id_t right = CHILD(node, 1);
+    operator_t op = NODE_DATA(node).op;
+
+    node_id_t x, y;
+    if ( !expression_info[node].has_call && match_scaled_add ( node, &x, &y ) != 0 )
+        return SCALED_ADD
+            | ( operand_kind ( x ) == OPERAND_REGISTER ? LEFT_DIRECT : 0 )
+            | ( operand_kind ( y ) == OPERAND_REGISTER ? RIGHT_DIRECT : 0 );
+
+    // A direct operand is read by the instruction, after the other operand has been evaluated.
+    // Memory may only be read that late if the other operand makes no call, or if it would be read last anyway
+    operand_kind_t left_kind = operand_kind ( left );
+    operand_kind_t right_kind = operand_kind ( right );
+    bool source_order = NODE_TYPE(node) == RELATION || op == OP_ADD || op == OP_MUL;
+    if ( left_kind == OPERAND_MEMORY && expression_info[right].has_call )
+        left_kind = OPERAND_NONE;
+    if ( right_kind == OPERAND_MEMORY && expression_info[left].has_call && !source_order )
+        right_kind = OPERAND_NONE;
+
+    switch ( op )
+    {
+        case OP_ADD:
+        case OP_MUL:
+            if ( right_kind != OPERAND_NONE )
+                return RIGHT_DIRECT;
+            return left_kind != OPERAND_NONE ? LEFT_DIRECT : 0;
+        case OP_SUB:
+            return right_kind != OPERAND_NONE ? RIGHT_DIRECT : 0;
+        case OP_DIV:
+            // Constant divisors are never evaluated, since division by them is done without idivq.
+            // idivq takes no immediate
+            if ( NODE_TYPE(right) == NUMBER_DATA && divides_without_idivq ( NODE_DATA(right).number ) )
+                return RIGHT_DIRECT;
+            return right_kind == OPERAND_REGISTER || right_kind == OPERAND_MEMORY ? RIGHT_DIRECT : 0;
+        case OP_SHL:
+        case OP_SHR:
+            // Shift counts are immediates, or in CL
+            return NODE_TYPE(right) == NUMBER_DATA ? RIGHT_DIRECT : 0;
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_GT:
+            // cmpq can not compare against an immediate, and only one of its operands may be in memory
+            if ( left_kind == OPERAND_IMMEDIATE )
+                left_kind = OPERAND_NONE;
+            if ( left_kind != OPERAND_NONE && right_kind != OPERAND_NONE
+                && ( left_kind == OPERAND_REGISTER || right_kind != OPERAND_MEMORY ) )
+                return LEFT_DIRECT | RIGHT_DIRECT;
+            if ( right_kind != OPERAND_NONE )
+                return RIGHT_DIRECT;
+            return left_kind != OPERAND_NONE ? LEFT_DIRECT : 0;
+        default:
+            return 0;
     }
+}
+
+/* Fills in expression_info for every node of the expression, children before their parents */
+static void label_expression ( node_id_t expression )
+{
+    if ( expression_info == NULL )
+        expression_info = calloc ( syntax_tree.n_nodes, sizeof(expression_info_t) );
 
-    // Up to 6 parameters should be passed through registers instead. Pop them off the stack
-    for ( size_t i = 0; i < parameter_count && i < NUM_REGISTER_PARAMS; i++ )
-        POPQ ( REGISTER_PARAMS[i] );
+    walk_stack_t *stack = &expression_stack;
+    walk_push ( stack, expression );
 
-    EMIT ( "call .%s", symbol->name );
+    while ( stack->depth > 0 )
+    {
+        walk_frame_t *frame = WALK_TOP(stack);
+        node_id_t node = frame->node;
+        if ( frame->stage < N_CHILDREN(node) )
+        {
+            walk_push ( stack, CHILD(node, frame->stage++) );
+            continue;
+        }
+        stack->depth--;
 
-    // Now pop away any stack passed parameters still left on the stack, by moving %rsp upwards
-    if ( parameter_count > NUM_REGISTER_PARAMS )
-        EMIT ( "addq $%d, %s", (parameter_count-NUM_REGISTER_PARAMS)*8, RSP );
+        expression_info_t *info = &expression_info[node];
+        *info = (expression_info_t) { .need = 1 };
+        switch ( NODE_TYPE(node) )
+        {
+            case IDENTIFIER_DATA:
+                info->reads_memory = NODE_SYMBOL(node)->type == SYMBOL_GLOBAL_VAR;
+                break;
+            case ARRAY_INDEXING:
+            {
+                // An index that is not constant, or a variable in a register, is evaluated,
+                // and the address of the array is placed in the register above it
+                int64_t displacement;
+                node_id_t index = array_index ( node, &displacement );
+                if ( index != NO_NODE && operand_kind ( index ) != OPERAND_REGISTER )
+                {
+                    info->need = expression_info[index].need < 2 ? 2 : expression_info[index].need;
+                    info->has_call = expression_info[index].has_call;
+                }
+                info->reads_memory = true;
+                break;
+            }
+            case FUNCTION_CALL:
+                *info = (expression_info_t) { .need = CALL_NEED, .has_call = true, .reads_memory = true };
+                break;
+            case EXPRESSION:
+            case RELATION:
+            {
+                if ( N_CHILDREN(node) == 1 )
+                {
+                    *info = expression_info[CHILD(node, 0)];
+                    info->pattern = 0;
+                    break;
+                }
+                info->has_call = expression_info[CHILD(node, 0)].has_call || expression_info[CHILD(node, 1)].has_call;
+                info->reads_memory = expression_info[CHILD(node, 0)].reads_memory
+                                     || expression_info[CHILD(node, 1)].reads_memory;
+                info->pattern = select_pattern ( node );
+
+                // Direct operands need no register.
+                // The result of the first evaluated operand is held while the second is evaluated
+                node_id_t left, right;
+                binary_operands ( node, &left, &right );
+                bool evaluate_left = !( info->pattern & LEFT_DIRECT );
+                bool evaluate_right = !( info->pattern & RIGHT_DIRECT );
+                uint32_t need = 1;
+                if ( evaluate_left && evaluate_right )
+                {
+                    bool left_first = evaluates_left_first ( node, left, right );
+                    uint32_t first = expression_info[left_first ? left : right].need;
+                    uint32_t second = expression_info[left_first ? right : left].need;
+                    need = first > second ? first : second + 1;
+                }
+                else if ( evaluate_left )
+                    need = expression_info[left].need;
+                else if ( evaluate_right )
+                    need = expression_info[right].need;
+                info->need = need < CALL_NEED ? need : CALL_NEED;
+                break;
+            }
+            default:
+                break;
+        }
+    }
 }
 
-/* Returns a string for accessing the quadword referenced by node */
-static const char* generate_variable_access ( node_t* node )
+// Set in the saved registers of a call, when the stack was padded by 8 bytes before its arguments were pushed
+#define PADDED_CALL 0x40000000
+
+/* Generates code for a FUNCTION_CALL node, placing the result in %rax.
+ * Called once for each stage, starting at 0. saved_registers is kept between stages.
+ * Returns the argument to evaluate before the next stage, and sets *level to the level to evaluate it at,
+ * or returns NO_NODE once the call is done */
+static node_id_t generate_function_call ( node_id_t call, uint32_t stage, uint32_t *saved_registers, uint32_t *level )
 {
-    static char result[100];
+    symbol_t *symbol = NODE_SYMBOL(CHILD(call, 0));
+    node_id_t argument_list = CHILD(call, 1);
+
+    if ( stage == 0 )
+    {
+        if ( symbol->type != SYMBOL_FUNCTION ) {
+            fprintf ( stderr, "error: '%s' is not a function\n", symbol->name );
+            exit ( EXIT_FAILURE );
+        }
+
+        if ( FUNC_PARAM_COUNT( symbol ) != N_CHILDREN(argument_list) )
+        {
+            fprintf ( stderr, "error: function '%s' expects '%d' arguments, but '%u' were given\n",
+                      symbol->name, FUNC_PARAM_COUNT( symbol ), N_CHILDREN(argument_list) );
+            exit(EXIT_FAILURE);
+        }
+
+        *saved_registers = save_caller_saved ( );
+    }
+
+    uint32_t parameter_count = FUNC_PARAM_COUNT( symbol );
+    uint32_t stack_count = parameter_count > NUM_REGISTER_PARAMS ? parameter_count - NUM_REGISTER_PARAMS : 0;
+
+    // An argument containing a call would clobber the registers of the arguments evaluated before it.
+    // In that case all parameters are evaluated from right to left and pushed to the stack, like the stack parameters
+    bool push_all = false;
+    for ( uint32_t i = 0; i < parameter_count && !push_all; i++ )
+        push_all = expression_info[CHILD(argument_list, i)].has_call;
+    uint32_t push_count = push_all ? parameter_count : stack_count;
+
+    // The stack is aligned at the call, with the stack parameters on top
+    if ( stage == 0 && emit_call_padding ( stack_count * 8 ) > 0 )
+        *saved_registers |= PADDED_CALL;
+
+    if ( stage > 0 && stage <= push_count )
+        PUSHQ ( REGISTER_PARAMS[0] );
+    if ( stage < push_count )
+    {
+        *level = 0;
+        return CHILD(argument_list, parameter_count - 1 - stage);
+    }
+
+    if ( push_all )
+    {
+        // Up to 6 parameters should be passed through registers instead. Pop them off the stack
+        for ( size_t i = 0; i < parameter_count && i < NUM_REGISTER_PARAMS; i++ )
+            POPQ ( REGISTER_PARAMS[i] );
+    }
+    else if ( stage < parameter_count )
+    {
+        // The register parameters are evaluated from left to right, each at the level of its own register
+        *level = stage - stack_count;
+        return CHILD(argument_list, *level);
+    }
+
+    CALL ( ".%s", symbol->name );
+
+    // Now pop away any stack passed parameters still left on the stack, and the padding, by moving %rsp upwards
+    emit_stack_adjust ( -8 * (int64_t) stack_count - ( *saved_registers & PADDED_CALL ? 8 : 0 ) );
+
+    restore_caller_saved ( *saved_registers & ~PADDED_CALL );
+    return NO_NODE;
+}
 
-    assert ( node->type == IDENTIFIER_DATA );
+/* Returns a string for accessing the quadword referenced by node.
+ * The string is only valid until the next call */
+static const char* generate_variable_access ( node_id_t node )
+{
+    assert ( NODE_TYPE(node) == IDENTIFIER_DATA );
 
-    symbol_t *symbol = node->symbol;
+    symbol_t *symbol = NODE_SYMBOL(node);
     switch ( symbol->type )
     {
         case SYMBOL_GLOBAL_VAR:
-            snprintf ( result, sizeof(result), ".%s(%s)", symbol->name, RIP );
-            return result;
-        case SYMBOL_LOCAL_VAR: {
-            // If we have more than 6 parameters, subtract away the hole in the sequence numbers
-            int call_frame_offset = symbol->sequence_number;
-            if ( FUNC_PARAM_COUNT(current_function) > NUM_REGISTER_PARAMS )
-                call_frame_offset -= FUNC_PARAM_COUNT(current_function) - NUM_REGISTER_PARAMS;
-            // The stack grows down, in multiples of 8, and sequence number 0 corresponds to -8
-            call_frame_offset = (-call_frame_offset - 1) * 8;
-
-            snprintf ( result, sizeof(result), "%d(%s)", call_frame_offset, RBP );
-            return result;
-        }
+            return global_operand ( symbol->name, 0 );
+        case SYMBOL_LOCAL_VAR:
         case SYMBOL_PARAMETER: {
-            int call_frame_offset;
-            // Handle the first 6 parameters differently
-            if (symbol->sequence_number < NUM_REGISTER_PARAMS)
-                // Move along down the stack, with parameter 0 at position -8(%rbp)
-                call_frame_offset = (-symbol->sequence_number - 1) * 8;
-            else
-                // Parameter 6 is at 16(%rbp), with further parameters moving up from there
-                call_frame_offset = 16 + (symbol->sequence_number - NUM_REGISTER_PARAMS) * 8;
-
-            snprintf ( result, sizeof(result), "%d(%s)", call_frame_offset, RBP );
-            return result;
+            variable_t *variable = &variables[symbol->sequence_number];
+            if ( variable->location != SPILLED )
+                return VARIABLE_REGISTERS[variable->location];
+            return frame_operand ( variable->frame_offset );
         }
         case SYMBOL_FUNCTION:
             fprintf ( stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name );
@@ -202,177 +976,538 @@ static const char* generate_variable_access ( node_t* node )
     }
 }
 
-/* Takes in an ARRAY_INDEXING node, such as array[x]
- * The function emits code to evaluate x, which may clobber all registers.
- * Once x is evaluated, the address of array[x] is calculated, and stored in the RCX register.
- * The return value is the string "(%rcx)", the assembly for using RCX as an address.
- */
-static const char* generate_array_access ( node_t* node ) {
-    assert ( node->type == ARRAY_INDEXING );
+/* Returns the symbol of the array in an ARRAY_INDEXING node, which must be a global array */
+static symbol_t* array_symbol ( node_id_t node )
+{
+    assert ( NODE_TYPE(node) == ARRAY_INDEXING );
 
-    symbol_t *symbol = node->children[0]->symbol;
+    symbol_t *symbol = NODE_SYMBOL(CHILD(node, 0));
     if ( symbol->type != SYMBOL_GLOBAL_ARRAY ) {
         fprintf ( stderr, "error: symbol '%s' is not an array\n", symbol->name );
         exit (EXIT_FAILURE);
     }
+    return symbol;
+}
+
+/* Returns the operand of a node that operand_kind allows to be used directly.
+ * Operands of the same kind share a buffer, which is reused by the next call */
+static const char* direct_operand ( node_id_t node )
+{
+    switch ( NODE_TYPE(node) )
+    {
+        case NUMBER_DATA:
+            return immediate_operand ( NODE_DATA(node).number );
+        case IDENTIFIER_DATA:
+            return generate_variable_access ( node );
+        case ARRAY_INDEXING:
+        {
+            int64_t displacement;
+            array_index ( node, &displacement );
+            return global_operand ( array_symbol ( node )->name, displacement );
+        }
+        default: assert ( false && "Node can not be used as an operand" );
+    }
+}
+
+/* Takes in an ARRAY_INDEXING node, such as array[x], in two stages.
+ * Stage 0 returns x, which must then be evaluated at the node's level.
+ * Stage 1 loads array[x] into the register of the level, using the register above it for the address of the array.
+ * Constant indices, and variables in registers, are used directly, in a single stage.
+ * Global arrays are addressed relative to %rip, which can not be combined with an index register,
+ * so the address of the array is loaded with leaq first
+ */
+static node_id_t generate_array_access ( node_id_t node, uint32_t stage, uint32_t level ) {
+    symbol_t *symbol = array_symbol ( node );
+    const char *result = REGISTER_PARAMS[level];
+
+    int64_t displacement;
+    node_id_t index = array_index ( node, &displacement );
+    if ( index == NO_NODE )
+    {
+        MOVQ ( global_operand ( symbol->name, displacement ), result );
+        return NO_NODE;
+    }
+
+    bool in_register = operand_kind ( index ) == OPERAND_REGISTER;
+    if ( stage == 0 && !in_register )
+        return index;
+
+    const char *base = in_register ? result : REGISTER_PARAMS[level + 1];
+    const char *index_register = in_register ? generate_variable_access ( index ) : result;
+    EMIT ( "leaq .%s(%s), %s", symbol->name, RIP, base );
+    MOVQ ( indexed_operand ( displacement, base, index_register ), result );
+    return NO_NODE;
+}
+
+/* Divides dividend, a register, by divisor, a register or memory operand, placing the result at level.
+ * idivq divides RDX:RAX, so RDX is pushed if it holds a value from below level */
+static void generate_division ( const char *dividend, const char *divisor, uint32_t level )
+{
+    bool save_rdx = level > RDX_LEVEL;
+    if ( save_rdx )
+        PUSHQ ( RDX );
+
+    MOVQ ( dividend, RAX );
+
+    // CQO overwrites RDX, so a divisor in RDX is moved to RCX, which is then free
+    if ( divisor == REGISTER_PARAMS[RDX_LEVEL] )
+    {
+        MOVQ ( RDX, RCX );
+        divisor = RCX;
+    }
+    CQO;
+    IDIVQ ( divisor );
+    MOVQ ( RAX, REGISTER_PARAMS[level] );
 
-    // Calculate the index of the array into %rax
-    generate_expression ( node->children[1] );
+    if ( save_rdx )
+        POPQ ( RDX );
+}
 
-    // Place the base of the array into %rcx
-    EMIT ( "leaq .%s(%s), %s", symbol->name, RIP, RCX );
+/* Divides dividend, the register at level, by a constant divisor accepted by divides_without_idivq.
+ * The quotient is computed in RDX, so RDX is pushed if it holds a value from below level */
+static void generate_constant_division ( const char *dividend, int64_t divisor, uint32_t level )
+{
+    bool save_rdx = level > RDX_LEVEL;
+    if ( save_rdx )
+        PUSHQ ( RDX );
 
-    // Place the exact position of the element we wish to access, into %rcx
-    EMIT ( "leaq (%s, %s, 8), %s", RCX, RAX, RCX );
+    // A dividend in RDX is moved to RCX, which is then free
+    if ( dividend == REGISTER_PARAMS[RDX_LEVEL] )
+    {
+        MOVQ ( RDX, RCX );
+        dividend = RCX;
+    }
+    emit_division ( dividend, divisor );
+    if ( level != RDX_LEVEL )
+        MOVQ ( RDX, REGISTER_PARAMS[level] );
 
-    // Now, the address of the element is stored at %rcx, so just use MEM() to reference it
-    return MEM(RCX);
+    if ( save_rdx )
+        POPQ ( RDX );
 }
 
-/* Generates code to evaluate the expression, and place the result in %rax */
-static void generate_expression ( node_t *expression )
+/* Shifts the register at level lhs by the one at level rhs, placing the result at level.
+ * The shift count must be in CL, so RCX is pushed if it holds a value from below level */
+static void generate_shift ( operator_t op, uint32_t lhs, uint32_t rhs, uint32_t level )
 {
-    switch ( expression->type )
+    const char *value = REGISTER_PARAMS[lhs];
+    if ( lhs == RCX_LEVEL )
     {
-        case NUMBER_DATA:
-            // Simply place the number into %rax
-            EMIT ( "movq $%ld, %s", *(int64_t*)expression->data, RAX );
+        // The value is in the way of the count, so it is shifted in RAX
+        MOVQ ( value, RAX );
+        value = RAX;
+    }
+
+    bool save_rcx = level > RCX_LEVEL;
+    if ( save_rcx )
+        PUSHQ ( RCX );
+    if ( rhs != RCX_LEVEL )
+        MOVQ ( REGISTER_PARAMS[rhs], RCX );
+
+    if ( op == OP_SHL )
+        SAL ( CL, value ); // value = value<<CL
+    else
+        SAR ( CL, value ); // value = value>>CL
+
+    if ( value != REGISTER_PARAMS[level] )
+        MOVQ ( value, REGISTER_PARAMS[level] );
+    if ( save_rcx )
+        POPQ ( RCX );
+}
+
+/* Generates code for an EXPRESSION or RELATION node at level, in the register REGISTER_PARAMS[level].
+ * Relations only compare their operands, setting the flags.
+ * Called once for each stage, starting at 0.
+ * Returns the operand to evaluate before the next stage, and sets *next_level to the level to evaluate it at,
+ * or returns NO_NODE once the operation is done */
+static node_id_t generate_operation ( node_id_t expression, uint32_t stage, uint32_t level, uint32_t *next_level )
+{
+    operator_t op = NODE_DATA(expression).op;
+    const char *result = REGISTER_PARAMS[level];
+
+    if ( op == OP_NEG )
+    {
+        if ( stage == 0 )
+            return CHILD(expression, 0);
+        NEGQ ( result );
+        return NO_NODE;
+    }
+
+    node_id_t left, right;
+    int64_t scale = binary_operands ( expression, &left, &right );
+    uint8_t pattern = expression_info[expression].pattern;
+    bool left_direct = pattern & LEFT_DIRECT;
+    bool right_direct = pattern & RIGHT_DIRECT;
+
+    // The operands that are not direct are evaluated, the first at the level of the node and the second above it
+    node_id_t evaluated[2];
+    uint32_t n_evaluated = 0;
+    bool left_first = evaluates_left_first ( expression, left, right );
+    if ( !left_direct && left_first )
+        evaluated[n_evaluated++] = left;
+    if ( !right_direct )
+        evaluated[n_evaluated++] = right;
+    if ( !left_direct && !left_first )
+        evaluated[n_evaluated++] = left;
+    if ( stage < n_evaluated )
+    {
+        *next_level = level + stage;
+        return evaluated[stage];
+    }
+
+    uint32_t lhs_level = n_evaluated == 2 && evaluated[1] == left ? level + 1 : level;
+    uint32_t rhs_level = n_evaluated == 2 && evaluated[1] == right ? level + 1 : level;
+    bool lhs_in_result = !left_direct && lhs_level == level;
+    const char *lhs = left_direct ? direct_operand ( left ) : REGISTER_PARAMS[lhs_level];
+    const char *rhs = right_direct ? direct_operand ( right ) : REGISTER_PARAMS[rhs_level];
+
+    switch ( op )
+    {
+        case OP_ADD:
+            if ( pattern & SCALED_ADD )
+                EMIT ( "leaq (%s, %s, %ld), %s", lhs, rhs, scale, result );
+            else
+                ADDQ ( lhs_in_result ? rhs : lhs, result );
             break;
-        case IDENTIFIER_DATA:
-            // Load the variable, and put the result in RAX
-            MOVQ ( generate_variable_access ( expression ), RAX );
+        case OP_MUL:
+            if ( lhs_in_result && right_direct && NODE_TYPE(right) == NUMBER_DATA
+                && multiplies_in_place ( NODE_DATA(right).number ) )
+                emit_multiplication ( result, NODE_DATA(right).number );
+            else
+                IMULQ ( lhs_in_result ? rhs : lhs, result );
             break;
-        case ARRAY_INDEXING:
-            // Load the value pointed to by array[idx], and put the result in RAX
-            MOVQ ( generate_array_access ( expression ), RAX );
+        case OP_SUB:
+            SUBQ ( rhs, lhs );
+            if ( !lhs_in_result )
+                MOVQ ( lhs, result );
             break;
-        case EXPRESSION: {
-            char* data = expression->data;
-            if ( strcmp ( data, "+" ) == 0 )
-            {
-                generate_expression ( expression->children[0] );
-                PUSHQ ( RAX );
-                generate_expression ( expression->children[1] );
-                POPQ ( RCX );
-                ADDQ ( RCX, RAX );
-            }
-            else if ( strcmp ( data, "-" ) == 0)
-            {
-                if ( expression->n_children == 1 ) {
-                    // Unary minus
-                    generate_expression ( expression->children[0] );
-                    NEGQ ( RAX );
-                }
-                else
-                {
-                    // Binary minus. Evaluate RHS first, to get the result in RAX easier
-                    generate_expression ( expression->children[1] );
-                    PUSHQ ( RAX );
-                    generate_expression ( expression->children[0] );
-                    POPQ ( RCX );
-                    SUBQ ( RCX, RAX );
-                }
-            }
-            else if ( strcmp ( data, "*" ) == 0 )
-            {
-                // Multiplication does not need to do sign extend
-                generate_expression ( expression->children[0] );
-                PUSHQ ( RAX );
-                generate_expression ( expression->children[1] );
-                POPQ ( RCX );
-                IMULQ ( RCX, RAX );
-            }
-            else if ( strcmp ( data, "/" ) == 0 )
-            {
-                generate_expression ( expression->children[1] );
-                PUSHQ ( RAX );
-                generate_expression ( expression->children[0] );
-                CQO; // Sign extend RAX -> RDX:RAX
-                POPQ ( RCX );
-                IDIVQ ( RCX ); // Didivde RDX:RAX by RCX, placing the result in RAX
-            }
-            else if ( strcmp ( data, "<<" ) == 0 )
+        case OP_DIV:
+            if ( right_direct && NODE_TYPE(right) == NUMBER_DATA )
+                generate_constant_division ( lhs, NODE_DATA(right).number, level );
+            else
+                generate_division ( lhs, rhs, level );
+            break;
+        case OP_SHL:
+        case OP_SHR:
+            if ( !right_direct )
+                generate_shift ( op, lhs_level, rhs_level, level );
+            else if ( op == OP_SHL )
+                SAL ( immediate_operand ( NODE_DATA(right).number & 63 ), result );
+            else
+                SAR ( immediate_operand ( NODE_DATA(right).number & 63 ), result );
+            break;
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_GT: CMPQ ( rhs, lhs ); break;
+        default: assert ( false && "Unknown expression operation" );
+    }
+    return NO_NODE;
+}
+
+// Frames of the expression stack hold the level of their node in data.
+// A spill frame pushes the registers below its level, and evaluates its node from level 0.
+// Calls are always evaluated at level 0, so their frames keep the registers saved for the call in data instead
+#define SPILL_FRAME 0x80000000
+
+/* Pushes a frame evaluating node at level. Nodes needing more registers than are left from level up
+ * get a spill frame instead */
+static void push_value ( walk_stack_t *stack, node_id_t node, uint32_t level )
+{
+    walk_frame_t *frame = walk_push ( stack, node );
+    frame->data = level;
+    if ( level > 0 && expression_info[node].need > N_SCRATCH_REGISTERS - level )
+        frame->data |= SPILL_FRAME;
+}
+
+/* Generates code to evaluate the expression at level, leaving REGISTER_PARAMS[level] and the levels below intact.
+ * Returns the register holding the result: REGISTER_PARAMS[level], or RAX for a call at level 0.
+ * Each node on the stack is revisited once the subexpression it asked for has been evaluated */
+static const char* generate_expression ( node_id_t expression, uint32_t level )
+{
+    label_expression ( expression );
+
+    walk_stack_t *stack = &expression_stack;
+    push_value ( stack, expression, level );
+    const char *result = REGISTER_PARAMS[level];
+
+    while ( stack->depth > 0 )
+    {
+        walk_frame_t *frame = WALK_TOP(stack);
+        node_id_t node = frame->node;
+        uint32_t stage = frame->stage++;
+        bool spill = frame->data & SPILL_FRAME;
+        uint32_t level = spill || NODE_TYPE(node) != FUNCTION_CALL ? frame->data & ~SPILL_FRAME : 0;
+        const char *destination = REGISTER_PARAMS[level];
+
+        // A subexpression to evaluate before the node's next stage, and its level
+        node_id_t next = NO_NODE;
+        uint32_t next_level = level;
+
+        if ( spill )
+        {
+            if ( stage == 0 )
             {
-                // Evaluate the shift amount first, and push it to stack
-                generate_expression ( expression->children[1] );
-                PUSHQ ( RAX );
-                generate_expression ( expression->children[0] );
-                POPQ ( RCX ); // Pop the shift amount
-                SAL ( CL, RAX ); // RAX = RAX<<CL
+                for ( uint32_t i = 0; i < level; i++ )
+                    PUSHQ ( REGISTER_PARAMS[i] );
+                next = node;
+                next_level = 0;
             }
-            else if ( strcmp ( data, ">>" ) == 0 )
+            else
             {
-                // Evaluate the shift amount first, and push it to stack
-                generate_expression ( expression->children[1] );
-                PUSHQ ( RAX );
-                generate_expression ( expression->children[0] );
-                POPQ ( RCX ); // Pop the shift amount
-                SAR ( CL, RAX ); // RAX = RAX>>CL
+                MOVQ ( NODE_TYPE(node) == FUNCTION_CALL ? RAX : REGISTER_PARAMS[0], destination );
+                for ( uint32_t i = level; i-- > 0; )
+                    POPQ ( REGISTER_PARAMS[i] );
             }
-            else assert ( false && "Unknown expression operation" );
-            break;
         }
-        case FUNCTION_CALL:
-            generate_function_call ( expression );
+        else switch ( NODE_TYPE(node) )
+        {
+            case NUMBER_DATA:
+                // Simply place the number into the register
+                MOVQ_IMM ( NODE_DATA(node).number, destination );
+                break;
+            case IDENTIFIER_DATA:
+                // Load the variable into the register
+                MOVQ ( generate_variable_access ( node ), destination );
+                break;
+            case ARRAY_INDEXING:
+                next = generate_array_access ( node, stage, level );
+                break;
+            case EXPRESSION:
+            case RELATION:
+                next = generate_operation ( node, stage, level, &next_level );
+                break;
+            case FUNCTION_CALL:
+                next = generate_function_call ( node, stage, &frame->data, &next_level );
+                // The result is left in RAX when nothing else is evaluated before it is used
+                if ( next == NO_NODE && stack->depth == 1 )
+                    result = RAX;
+                else if ( next == NO_NODE && !( stack->frames[stack->depth - 2].data & SPILL_FRAME ) )
+                    MOVQ ( RAX, destination );
+                break;
+            default: assert ( false && "Unknown expression type" );
+        }
+
+        if ( next != NO_NODE )
+            push_value ( stack, next, next_level );
+        else
+            stack->depth--;
+    }
+    return result;
+}
+
+/* If expression is an operation on the variable dest that can be done in place, such as x := x + 1,
+ * returns the other operand of the operation. Otherwise returns NO_NODE */
+static node_id_t in_place_operand ( node_id_t dest, node_id_t expression )
+{
+    if ( NODE_TYPE(expression) != EXPRESSION || N_CHILDREN(expression) != 2 )
+        return NO_NODE;
+
+    node_id_t left = CHILD(expression, 0);
+    node_id_t right = CHILD(expression, 1);
+    bool left_is_dest = NODE_TYPE(left) == IDENTIFIER_DATA && NODE_SYMBOL(left) == NODE_SYMBOL(dest);
+    bool right_is_dest = NODE_TYPE(right) == IDENTIFIER_DATA && NODE_SYMBOL(right) == NODE_SYMBOL(dest);
+
+    node_id_t operand = NO_NODE;
+    switch ( NODE_DATA(expression).op )
+    {
+        case OP_MUL:
+            // imulq can only multiply into a register
+            if ( operand_kind ( dest ) != OPERAND_REGISTER )
+                return NO_NODE;
+            // Fall through
+        case OP_ADD:
+            operand = left_is_dest ? right : right_is_dest ? left : NO_NODE;
             break;
-        default: assert ( false && "Unknown expression type" );
+        case OP_SUB:
+            operand = left_is_dest ? right : NO_NODE;
+            break;
+        case OP_SHL:
+        case OP_SHR:
+            operand = left_is_dest && NODE_TYPE(right) == NUMBER_DATA ? right : NO_NODE;
+            break;
+        default:
+            return NO_NODE;
+    }
+
+    // A call in the operand could change a global variable before it is updated
+    if ( operand != NO_NODE && NODE_SYMBOL(dest)->type == SYMBOL_GLOBAL_VAR && expression_info[operand].has_call )
+        return NO_NODE;
+    return operand;
+}
+
+static void generate_variable_assignment ( node_id_t dest, node_id_t expression )
+{
+    operand_kind_t dest_kind = operand_kind ( dest );
+    operand_kind_t source_kind = operand_kind ( expression );
+
+    // Immediates and variables are moved directly, unless both sides are in memory
+    if ( dest_kind != OPERAND_NONE && source_kind != OPERAND_NONE
+        && ( dest_kind == OPERAND_REGISTER || source_kind != OPERAND_MEMORY ) )
+    {
+        const char *source = direct_operand ( expression );
+        MOVQ ( source, generate_variable_access ( dest ) );
+        return;
+    }
+
+    label_expression ( expression );
+    node_id_t operand = dest_kind != OPERAND_NONE ? in_place_operand ( dest, expression ) : NO_NODE;
+    if ( operand == NO_NODE )
+    {
+        const char *value = generate_expression ( expression, 0 );
+        MOVQ ( value, generate_variable_access ( dest ) );
+        return;
+    }
+
+    // The operation is done on the variable itself, with the other operand direct or evaluated into a register
+    operator_t op = NODE_DATA(expression).op;
+    operand_kind_t kind = operand_kind ( operand );
+    const char *source;
+    if ( op == OP_SHL || op == OP_SHR )
+        source = immediate_operand ( NODE_DATA(operand).number & 63 );
+    else if ( kind != OPERAND_NONE && ( dest_kind == OPERAND_REGISTER || kind != OPERAND_MEMORY ) )
+        source = direct_operand ( operand );
+    else
+        source = generate_expression ( operand, 0 );
+
+    const char *target = generate_variable_access ( dest );
+    switch ( op )
+    {
+        case OP_ADD: ADDQ ( source, target ); break;
+        case OP_SUB: SUBQ ( source, target ); break;
+        case OP_MUL: IMULQ ( source, target ); break;
+        case OP_SHL: SAL ( source, target ); break;
+        case OP_SHR: SAR ( source, target ); break;
+        default: assert ( false && "Operation can not be done in place" );
     }
 }
 
-static void generate_assignment_statement ( node_t *statement )
+/* Stores the expression into an array element. The value is evaluated before the index */
+static void generate_array_assignment ( node_id_t dest, node_id_t expression )
 {
-    node_t *dest = statement->children[0];
-    node_t *expression = statement->children[1];
+    // Immediates and variables in registers are stored directly.
+    // Anything else is evaluated at level 0, and kept there while the index is evaluated
+    operand_kind_t value_kind = operand_kind ( expression );
+    bool value_direct = value_kind == OPERAND_IMMEDIATE || value_kind == OPERAND_REGISTER;
+    uint32_t level = 0;
+    if ( !value_direct )
+    {
+        const char *value = generate_expression ( expression, 0 );
+        if ( value != REGISTER_PARAMS[0] )
+            MOVQ ( value, REGISTER_PARAMS[0] );
+        level = 1;
+    }
+
+    symbol_t *symbol = array_symbol ( dest );
+    int64_t displacement;
+    node_id_t index = array_index ( dest, &displacement );
 
-    // First the right hand side of the assignment is evaluated
-    generate_expression ( expression );
+    const char *element;
+    if ( index == NO_NODE )
+        element = global_operand ( symbol->name, displacement );
+    else
+    {
+        const char *index_register;
+        if ( operand_kind ( index ) == OPERAND_REGISTER )
+            index_register = generate_variable_access ( index );
+        else
+            index_register = generate_expression ( index, level++ );
 
-    if ( dest->type == IDENTIFIER_DATA )
-        // Store rax into the memory location corresponding to the variable
-        MOVQ ( RAX, generate_variable_access( dest ) );
-    else {
-        // Store rax until the final address of the array element is found,
-        // since array index calculation can potentially modify all registers
-        PUSHQ ( RAX );
-        const char* dest_mem = generate_array_access( dest );
-        POPQ ( RAX );
-        MOVQ ( RAX, dest_mem );
+        const char *base = REGISTER_PARAMS[level];
+        EMIT ( "leaq .%s(%s), %s", symbol->name, RIP, base );
+        element = indexed_operand ( displacement, base, index_register );
     }
+
+    // The operand of the value is made last, since evaluating the index may reuse the buffer of an immediate
+    MOVQ ( value_direct ? direct_operand ( expression ) : REGISTER_PARAMS[0], element );
+}
+
+static void generate_assignment_statement ( node_id_t statement )
+{
+    node_id_t dest = CHILD(statement, 0);
+    node_id_t expression = CHILD(statement, 1);
+
+    if ( NODE_TYPE(dest) == IDENTIFIER_DATA )
+        generate_variable_assignment ( dest, expression );
+    else
+        generate_array_assignment ( dest, expression );
 }
 
-static void generate_print_statement ( node_t *statement )
+static void generate_print_statement ( node_id_t statement )
 {
-    node_t *print_items = statement->children[0];
-    for ( size_t i = 0; i < print_items->n_children; i++ )
+    node_id_t print_items = CHILD(statement, 0);
+    for ( size_t i = 0; i < N_CHILDREN(print_items); i++ )
     {
-        node_t *item = print_items->children[i];
-        if ( item->type == STRING_LIST_REFERENCE )
+        node_id_t item = CHILD(print_items, i);
+        uint32_t saved_registers;
+        int64_t padding;
+        if ( NODE_TYPE(item) == STRING_LIST_REFERENCE )
         {
-            EMIT ( "leaq strout(%s), %s", RIP, RDI );
-            EMIT ( "leaq string%zu(%s), %s", (size_t) item->data, RIP, RSI );
+            saved_registers = save_caller_saved ( );
+            padding = emit_call_padding ( 0 );
+            size_t string_index = NODE_DATA(item).string_index;
+            EMIT ( "leaq string%zu(%s), %s", string_index, RIP, RDI );
+            EMIT ( "movq $string%zu_length, %s", string_index, RSI );
+            CALL ( "vsl_print_string" );
         }
         else
         {
-            generate_expression ( item );
-            MOVQ ( RAX, RSI );
-            EMIT ( "leaq intout(%s), %s", RIP, RDI );
+            // Direct operands are moved into place without using a scratch register
+            const char *value = operand_kind ( item ) != OPERAND_NONE ? direct_operand ( item )
+                                                                     : generate_expression ( item, 0 );
+            saved_registers = save_caller_saved ( );
+            padding = emit_call_padding ( 0 );
+            MOVQ ( value, RDI );
+            CALL ( "vsl_print_int" );
         }
-        EMIT ( "call safe_printf" );
+        emit_stack_adjust ( -padding );
+        restore_caller_saved ( saved_registers );
     }
 
-    MOVQ ( "$'\\n'", RDI );
-    EMIT ( "call putchar" );
+    uint32_t saved_registers = save_caller_saved ( );
+    int64_t padding = emit_call_padding ( 0 );
+    CALL ( "vsl_print_newline" );
+    emit_stack_adjust ( -padding );
+    restore_caller_saved ( saved_registers );
+}
+
+static void generate_return_statement ( node_id_t statement )
+{
+    node_id_t expression = CHILD(statement, 0);
+    if ( operand_kind ( expression ) != OPERAND_NONE )
+        MOVQ ( direct_operand ( expression ), RAX );
+    else
+    {
+        const char *value = generate_expression ( expression, 0 );
+        if ( value == REGISTER_PARAMS[0] )
+            MOVQ ( value, RAX );
+    }
+    generate_epilogue ( );
 }
 
-static void generate_return_statement ( node_t *statement )
+/* Restores the callee-saved registers and the caller's frame, and returns */
+static void generate_epilogue ( void )
 {
-    generate_expression ( statement->children[0] );
-    MOVQ ( RBP, RSP );
+    // Code after a return is still generated with the frame in place
+    int64_t stack_depth = emitter.stack_depth;
+
+    // The saved registers were pushed right below the saved %rbp
+    int saved_registers = __builtin_popcount ( used_registers & ~CALLER_SAVED_VARIABLE_REGISTERS );
+    if ( saved_registers > 0 )
+    {
+        EMIT ( "leaq %d(%s), %s", -8 * saved_registers, RBP, RSP );
+        for ( int r = N_VARIABLE_REGISTERS - 1; r >= 0; r-- )
+            if ( used_registers & ~CALLER_SAVED_VARIABLE_REGISTERS & ( UINT32_C(1) << r ) )
+                POPQ ( VARIABLE_REGISTERS[r] );
+    }
+    else
+        // leaveq is written out manually, to increase clarity of what happens
+        MOVQ ( RBP, RSP );
     POPQ ( RBP );
     RET;
+    emitter.stack_depth = stack_depth;
 }
 
-static void generate_relation ( node_t *relation )
+static void generate_relation ( node_id_t relation )
 {
     // TODO (2.1):
     // Generate code for evaluating the relation's LHS and RHS, and compare them.
@@ -381,54 +1516,33 @@ static void generate_relation ( node_t *relation )
     // Remember that conditional jumps have different suffixes for
     // signed inequalities and unsigned inequalities. Use the signed variety
 
-    // Evaluate the left-hand side expression and store the result in RAX
-
-    // Evaluate the left-hand side expression and store the result in RAX
-    generate_expression(relation->children[0]);
-
-    // Push the result onto the stack
-    PUSHQ(RAX);
-
-    // Evaluate the right-hand side expression and store the result in RAX
-    generate_expression(relation->children[1]);
-
-    // Pop the left-hand side result from the stack into RCX
-    POPQ(RCX);
-
-    // Compare the values and store the result in processor flags using CMPQ
-    CMPQ(RCX, RAX);
-
+    // Both sides are evaluated into registers, and compared by generate_operation
+    generate_expression ( relation, 0 );
 }
 
-
-static void print_jump_else_statement(node_t *relation, const char *else_label){
-    const char *jmp_instruction;
-
-    if (strcmp(relation->data, "=") == 0) {
-        jmp_instruction = "jne";
-    } else if (strcmp(relation->data, "!=") == 0) {
-        jmp_instruction = "je";
-    }
-    else if (strcmp(relation->data, ">=") == 0) {
-        jmp_instruction = "jg";
-    }
-    else if (strcmp(relation->data, ">") == 0) {
-        jmp_instruction = "jge";
-    }
-    else if (strcmp(relation->data, "<=") == 0) {
-        jmp_instruction = "jl";
-    }
-    else if (strcmp(relation->data, "<") == 0) {
-        jmp_instruction = "jle";
-    } else {
-        fprintf(stderr, "error: unsupported relation type\n");
-        exit(EXIT_FAILURE);
-    }
-
-    EMIT("%s %s", jmp_instruction, else_label);
+// The conditional jump taken when a relation does NOT hold, after generate_relation has compared it.
+// CMPQ ( RHS, LHS ) compares LHS against RHS
+#define JUMP_IF_FALSE ((const char *[]){ \
+        [OP_EQ] = "jne",                 \
+        [OP_NE] = "je",                  \
+        [OP_LT] = "jge",                 \
+        [OP_GT] = "jle"})
+
+// The conditional jump taken when a relation holds
+#define JUMP_IF_TRUE ((const char *[]){ \
+        [OP_EQ] = "je",                 \
+        [OP_NE] = "jne",                \
+        [OP_LT] = "jl",                 \
+        [OP_GT] = "jg"})
+
+static void print_jump_else_statement(node_id_t relation, label_t else_label){
+    JCC(JUMP_IF_FALSE[NODE_DATA(relation).op], else_label);
 }
 
-static void generate_if_statement ( node_t *statement )
+/* Generates an IF_STATEMENT node, called once for each stage, starting at 0.
+ * Returns the branch to generate before the next stage, or NO_NODE once the statement is done.
+ * first_label is kept between stages, and holds the first of the statement's labels */
+static node_id_t generate_if_statement ( node_id_t statement, uint32_t stage, label_t *first_label )
 {
     // TODO (2.1):
     // Generate code for emitting both if-then statements, and if-then-else statements.
@@ -439,63 +1553,95 @@ static void generate_if_statement ( node_t *statement )
     // You will need to define your own unique labels for this if statement,
     // so consider using a global variable as a counter to give each label a unique suffix.
 
-    generate_relation(statement->children[0]);
+    if ( stage == 0 )
+    {
+        generate_relation(CHILD(statement, 0));
 
-    const char *then_label = unique_label();
-    const char *else_label = unique_label();
-    const char *endif_label = unique_label();
+        label_t then_label = new_label();
+        label_t else_label = new_label();
+        new_label(); // endif_label
 
-    node_t *relation = statement->children[0];
+        node_id_t relation = CHILD(statement, 0);
 
-    print_jump_else_statement(relation, else_label);
+        print_jump_else_statement(relation, else_label);
 
-    LABEL("%s", then_label);
-    generate_statement(statement->children[1]);
-    JMP(endif_label);
+        emit_label(then_label);
+        *first_label = then_label;
+        return CHILD(statement, 1);
+    }
 
+    // The labels were made one after the other
+    label_t else_label = *first_label + 1;
+    label_t endif_label = *first_label + 2;
 
-    LABEL("%s", else_label);
-    if (statement->n_children > 2)
+    if ( stage == 1 )
     {
-        generate_statement(statement->children[2]);
-    }
+        JMP(endif_label);
 
-    LABEL("%s", endif_label);
+        emit_label(else_label);
+        if (N_CHILDREN(statement) > 2)
+            return CHILD(statement, 2);
+    }
 
-    free((void *)then_label);
-    free((void *)else_label);
-    free((void *)endif_label);
+    emit_label(endif_label);
+    return NO_NODE;
 }
 
-static const char *innermost_while_end_label = NULL;
-
-static void generate_while_statement ( node_t *statement )
+/* Generates a WHILE_STATEMENT node, called once for each stage, starting at 0.
+ * Returns the body to generate before the next stage, or NO_NODE once the statement is done.
+ * first_label is kept between stages, and holds the first of the statement's labels.
+ * The loop is rotated: the relation is tested once before the body, as a guard, and again after it,
+ * jumping back to the body while it holds. Every iteration then takes a single branch */
+static node_id_t generate_while_statement ( node_id_t statement, uint32_t stage, label_t *first_label )
 {
     // TODO (2.2):
     // Implement while loops, similarily to the way if statements were generated.
     // Remember to make label names unique, and to handle nested while loops.
-    const char *loop_start_label = unique_label();
-    const char *loop_end_label = unique_label();
-
-    const char *previous_innermost_while_end_label = innermost_while_end_label;
-    innermost_while_end_label = loop_end_label;
 
-    LABEL("%s", loop_start_label);
+    // A relation that always holds was folded to 1 by simplify_tree, and the loop is only left by break
+    node_id_t relation = CHILD(statement, 0);
+    bool always = NODE_TYPE(relation) == NUMBER_DATA;
+    if ( stage == 0 )
+    {
+        label_t loop_start_label = new_label();
+        label_t loop_end_label = new_label();
+        *first_label = loop_start_label;
 
-    generate_relation(statement->children[0]);
+        if ( while_end_labels_len == while_end_labels_capacity )
+        {
+            while_end_labels_capacity = while_end_labels_capacity * 2 + 64;
+            while_end_labels = realloc ( while_end_labels, while_end_labels_capacity * sizeof(label_t) );
+        }
+        while_end_labels[while_end_labels_len++] = loop_end_label;
 
-    print_jump_else_statement(statement->children[0], loop_end_label);
+        if ( !always )
+        {
+            generate_relation(relation);
+            print_jump_else_statement(relation, loop_end_label);
+        }
+        emit_label(loop_start_label);
 
-    generate_statement(statement->children[1]);
+        return CHILD(statement, 1);
+    }
 
-    JMP(loop_start_label);
+    // The labels were made one after the other
+    label_t loop_start_label = *first_label;
+    label_t loop_end_label = *first_label + 1;
 
-    LABEL("%s", loop_end_label);
+    if ( always )
+        JMP(loop_start_label);
+    else
+    {
+        // The relation is evaluated where the loop starts, so calls in it save the registers live there
+        current_position = statement_positions[statement];
+        generate_relation(relation);
+        JCC(JUMP_IF_TRUE[NODE_DATA(relation).op], loop_start_label);
+    }
 
-    free((void *)loop_start_label);
-    free((void *)loop_end_label);
+    emit_label(loop_end_label);
 
-    innermost_while_end_label = previous_innermost_while_end_label;
+    while_end_labels_len--;
+    return NO_NODE;
 }
 
 // Leaves the currently innermost while loop using its ENDWHILE label
@@ -504,61 +1650,66 @@ static void generate_break_statement ( )
     // TODO (2.3):
     // Generate the break statement, jumping out past the end of the innermost while loop.
     // You can use a global variable to keep track of the current innermost call to generate_while_statement().
-    JMP(innermost_while_end_label);
+    JMP(while_end_labels[while_end_labels_len - 1]);
 }
 
-/* Recursively generate the given statement node, and all sub-statements. */
-static void generate_statement ( node_t *node )
+/* Generates the given statement node, and all sub-statements.
+ * Each node on the stack is revisited once the sub-statement it asked for has been generated */
+static void generate_statement ( node_id_t node )
 {
-    switch ( node->type )
+    walk_stack_t *stack = &statement_stack;
+    walk_push ( stack, node );
+
+    while ( stack->depth > 0 )
     {
-        case BLOCK: {
-            // All handling of pushing and popping scopes has already been done
-            // Just generate the statements that make up the statement body, one by one
-            node_t *statement_list = node->children[node->n_children-1];
-            for ( size_t i = 0; i < statement_list->n_children; i++ )
-                generate_statement( statement_list->children[i] );
-            break;
-        }
-        case ASSIGNMENT_STATEMENT:
-            generate_assignment_statement ( node );
-            break;
-        case PRINT_STATEMENT:
-            generate_print_statement ( node );
-            break;
-        case RETURN_STATEMENT:
-            generate_return_statement ( node );
-            break;
-        case IF_STATEMENT:
-            generate_if_statement ( node );
-            break;
-        case WHILE_STATEMENT:
-            generate_while_statement ( node );
-            break;
-        case BREAK_STATEMENT:
-            generate_break_statement ( );
-            break;
-        case FUNCTION_CALL:
-            generate_function_call ( node );
-            break;
-        default: assert( false && "Unknown statement type" );
-    }
-}
+        walk_frame_t *frame = WALK_TOP(stack);
+        node_id_t statement = frame->node;
+        uint32_t stage = frame->stage++;
+        node_id_t next = NO_NODE; // A sub-statement to generate before the node's next stage
 
-static void generate_safe_printf ( void )
-{
-    LABEL ( "safe_printf" );
+        // Calls save the caller-saved registers of the variables live at the current position
+        if ( stage == 0 && NODE_TYPE(statement) != BLOCK )
+            current_position = statement_positions[statement];
 
-    PUSHQ ( RBP );
-    MOVQ ( RSP, RBP );
-    // This is a bitmask that abuses how negative numbers work, to clear the last 4 bits
-    // A stack pointer that is not 16-byte aligned, will be moved down to a 16-byte boundary
-    ANDQ ( "$-16", RSP );
-    EMIT ( "call printf" );
-    // Cleanup the stack back to how it was
-    MOVQ ( RBP, RSP );
-    POPQ ( RBP );
-    RET;
+        switch ( NODE_TYPE(statement) )
+        {
+            case BLOCK: {
+                // All handling of pushing and popping scopes has already been done
+                // Just generate the statements that make up the statement body, one by one
+                node_id_t statement_list = CHILD(statement, N_CHILDREN(statement)-1);
+                if ( stage < N_CHILDREN(statement_list) )
+                    next = CHILD(statement_list, stage);
+                break;
+            }
+            case ASSIGNMENT_STATEMENT:
+                generate_assignment_statement ( statement );
+                break;
+            case PRINT_STATEMENT:
+                generate_print_statement ( statement );
+                break;
+            case RETURN_STATEMENT:
+                generate_return_statement ( statement );
+                break;
+            case IF_STATEMENT:
+                next = generate_if_statement ( statement, stage, &frame->data );
+                break;
+            case WHILE_STATEMENT:
+                next = generate_while_statement ( statement, stage, &frame->data );
+                break;
+            case BREAK_STATEMENT:
+                generate_break_statement ( );
+                break;
+            case FUNCTION_CALL:
+                generate_expression ( statement, 0 );
+                break;
+            default: assert( false && "Unknown statement type" );
+        }
+
+        if ( next != NO_NODE )
+            walk_push ( stack, next );
+        else
+            stack->depth--;
+    }
 }
 
 static void generate_main ( symbol_t *first )
@@ -566,7 +1717,8 @@ static void generate_main ( symbol_t *first )
     // Make the globally available main function
     LABEL ( "main" );
 
-    // Save old base pointer, and set new base pointer
+    // Save old base pointer, and set new base pointer. The stack is then aligned, with the return address above
+    emitter.stack_depth = 8;
     PUSHQ ( RBP );
     MOVQ ( RSP, RBP );
 
@@ -575,16 +1727,26 @@ static void generate_main ( symbol_t *first )
     const char* argv = RSI;
 
     const size_t expected_args = FUNC_PARAM_COUNT ( first );
+    // Freestanding programs can not call the exit of the C library, which also runs its cleanup
+    const char *exit_function = freestanding ? "vsl_exit" : "exit";
+
+    PUSHQ ( argc );
+    PUSHQ ( argv );
+    CALL ( "vsl_init" );
+    POPQ ( argv );
+    POPQ ( argc );
 
     SUBQ ( "$1", argc ); // argc counts the name of the binary, so subtract that
     EMIT ( "cmpq $%ld, %s", expected_args, argc );
-    JNE ( "ABORT" ); // If the provdied number of arguments is not equal, go to the abort label
+    EMIT ( "jne ABORT" ); // If the provdied number of arguments is not equal, go to the abort label
 
     if (expected_args == 0)
         goto skip_args; // No need to parse argv
 
-    // Now we emit a loop to parse all parameters, and push them to the stack,
-    // in right-to-left order
+    // Make room for the parameters on the stack, the first on top, padded to keep the stack aligned.
+    // Now we emit a loop to parse all parameters into their place, in right-to-left order
+    int64_t padding = expected_args % 2 != 0 ? 8 : 0;
+    emit_stack_adjust ( expected_args * 8 + padding );
 
     // First move the argv pointer to the vert rightmost parameter
     EMIT( "addq $%ld, %s", expected_args*8, argv );
@@ -595,38 +1757,56 @@ static void generate_main ( symbol_t *first )
     PUSHQ ( argv ); // push registers to caller save them
     PUSHQ ( RCX );
 
-    // Now call strtol to parse the argument
+    // Now call strtol to parse the argument, or vsl_parse_int of the runtime library, which only needs the first
     EMIT ( "movq (%s), %s", argv, RDI ); // 1st argument, the char *
-    MOVQ ( "$0", RSI ); // 2nd argument, a null pointer
-    MOVQ ( "$10", RDX ); //3rd argument, we want base 10
-    EMIT ( "call strtol" );
+    if ( freestanding )
+        CALL ( "vsl_parse_int" );
+    else
+    {
+        MOVQ ( "$0", RSI ); // 2nd argument, a null pointer
+        MOVQ ( "$10", RDX ); //3rd argument, we want base 10
+        CALL ( "strtol" );
+    }
 
     // Restore caller saved registers
     POPQ ( RCX );
     POPQ ( argv );
-    PUSHQ ( RAX ); // Store the parsed argument on the stack
+    EMIT ( "movq %s, -8(%s, %s, 8)", RAX, RSP, RCX ); // Store the parsed argument in its place on the stack
 
     SUBQ ( "$8", argv ); // Point to the previous char*
     EMIT ( "loop PARSE_ARGV" ); // Loop uses RCX as a counter automatically
 
-    // Now, pop up to 6 arguments into registers instead of stack
+    // Now, move up to 6 arguments into registers, and leave the rest on top of the stack
     for ( size_t i = 0; i < expected_args && i < NUM_REGISTER_PARAMS; i++ )
-        POPQ ( REGISTER_PARAMS[i] );
+        EMIT ( "movq %zu(%s), %s", i * 8, RSP, REGISTER_PARAMS[i] );
+    if ( expected_args > NUM_REGISTER_PARAMS )
+        emit_stack_adjust ( -8 * NUM_REGISTER_PARAMS );
 
     skip_args:
 
-    EMIT ( "call .%s", first->name );
-    MOVQ ( RAX, RDI ); // Move the return value of the function into RDI
-    EMIT ( "call exit" ); // Exit with the return value as exit code
+    CALL ( ".%s", first->name );
+    // Write out what the program printed, keeping the return value across the call
+    PUSHQ ( RAX );
+    int64_t flush_padding = emit_call_padding ( 0 );
+    CALL ( "vsl_flush" );
+    emit_stack_adjust ( -flush_padding );
+    POPQ ( RDI ); // Move the return value of the function into RDI
+    CALL ( "%s", exit_function ); // Exit with the return value as exit code
 
     LABEL ( "ABORT" ); // In case of incorrect number of arguments
-    EMIT ( "leaq errout(%s), %s", RIP, RDI );
-    EMIT ( "call puts" ); // print the errout string
+    emitter.stack_depth = 16; // As it was at the jump
+    EMIT ( "leaq errout(%s), %s", RIP, RDI ); // print the errout string
+    EMIT ( "movq $errout_length, %s", RSI );
+    CALL ( "vsl_print_string" );
+    CALL ( "vsl_print_newline" );
+    CALL ( "vsl_flush" );
     MOVQ ( "$1", RDI );
-    EMIT ( "call exit" ); // Exit with return code 1
-
-    generate_safe_printf();
-
-    // Declares global symbols we use or emit, such as main, printf and putchar
-    DIRECTIVE ( "%s", ASM_DECLARE_SYMBOLS );
+    CALL ( "%s", exit_function ); // Exit with return code 1
+
+    // Declares global symbols we use or emit, such as main, strtol and write.
+    // Freestanding programs start at _start of the runtime library instead of main
+    if ( freestanding )
+        DIRECTIVE ( ".global _start" );
+    else
+        DIRECTIVE ( "%s", ASM_DECLARE_SYMBOLS );
 }
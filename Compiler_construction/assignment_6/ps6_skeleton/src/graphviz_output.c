@@ -1,13 +1,16 @@
 #include "vslc.h"
 
-static void graphviz_node_print_internal ( node_t *node ) {
-    printf ( "node%p [label=\"%s", node, node_strings[node->type] );
-    if ( node->type == IDENTIFIER_DATA || node->type == STRING_DATA || node->type == EXPRESSION || node->type == RELATION ) {
+static void graphviz_node_print_one ( node_id_t node ) {
+    node_type_t type = NODE_TYPE(node);
+    printf ( "node%u [label=\"%s", node, node_strings[type] );
+    if ( type == EXPRESSION || type == RELATION ) {
+        printf ( "\\n%s", OPERATOR_NAMES[NODE_DATA(node).op] );
+    } else if ( type == IDENTIFIER_DATA || type == STRING_DATA ) {
         printf ( "\\n" );
-        if ( node->data == NULL ) {
+        if ( NODE_DATA(node).string == NULL ) {
             printf ( "NULL" );
         } else {
-            for ( char* c = (char*)node->data; *c != '\0'; c++ ) {
+            for ( char* c = NODE_DATA(node).string; *c != '\0'; c++ ) {
                 switch(*c) {
                     case '\\': printf ( "\\\\" ); break;
                     case '"': printf ( "\\\"" ); break;
@@ -15,22 +18,41 @@ static void graphviz_node_print_internal ( node_t *node ) {
                 }
             }
         }
-    } else if ( node->type == NUMBER_DATA ) {
-        printf ( "\\n%ld", *(int64_t*)node->data );
+    } else if ( type == NUMBER_DATA ) {
+        printf ( "\\n%ld", NODE_DATA(node).number );
     }
     printf ( "\"];\n" );
-    for ( int i = 0; i < node->n_children; i++ ) {
-        node_t *child = node->children[i];
-        if ( child == NULL )
-            printf ( "node%p -- node%pNULL%d ;\n", node, node, i );
+}
+
+// Prints each node, followed by the edge to each child and the child's subtree
+static void graphviz_node_print_internal ( node_id_t node ) {
+    walk_stack_t stack = { 0 };
+    walk_push ( &stack, node );
+    graphviz_node_print_one ( node );
+
+    while ( stack.depth > 0 ) {
+        walk_frame_t *frame = WALK_TOP(&stack);
+        node_id_t current = frame->node;
+        if ( frame->stage == N_CHILDREN(current) ) {
+            stack.depth--;
+            continue;
+        }
+
+        uint32_t i = frame->stage++;
+        node_id_t child = CHILD(current, i);
+        if ( child == NO_NODE )
+            printf ( "node%u -- node%uNULL%u ;\n", current, current, i );
         else {
-            printf ( "node%p -- node%p ;\n", node, child );
-            graphviz_node_print_internal(child);
+            printf ( "node%u -- node%u ;\n", current, child );
+            graphviz_node_print_one ( child );
+            walk_push ( &stack, child );
         }
     }
+
+    walk_stack_destroy ( &stack );
 }
 
-void graphviz_node_print ( node_t *root ) {
+void graphviz_node_print ( node_id_t root ) {
     printf ( "graph \"\" {\n node[shape=box];\n" );
     graphviz_node_print_internal ( root );
     printf( "}\n" );
@@ -0,0 +1,374 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Induction variable strength reduction. A basic induction variable is a phi in a loop header that is increased or
+// decreased by the same amount every iteration, like the counter of a while loop.
+// An array element indexed by one, possibly plus a constant, is at an address that moves by 8 times that amount,
+// so instead of computing the address from the array and the index every iteration, a pointer is kept that moves
+// along with the variable.
+// If the variable is then only used to decide when the loop ends, the condition is replaced by a comparison of the
+// pointer against the address the variable would stop at (linear function test replacement), and the variable is
+// left for remove_dead_code. This assumes eight times the variable and the limit fit in 64 bits,
+// which holds for any index of an array
+
+// The function being optimized
+static ir_function_t *function;
+
+// The loops of the function
+static ir_loops_t loops;
+
+// The block and index every virtual register is defined at, or UINT32_MAX for parameters
+static uint32_t (*definition)[2];
+// The number of instructions and phi arguments reading every virtual register
+static uint32_t *n_uses;
+
+// i = phi [init, preheader], [next, latch], where next = i + step or i - step
+typedef struct induction_variable
+{
+    vreg_t phi, next;
+    ir_operand_t init;
+    ir_operand_t step;
+    operator_t op;             // OP_ADD or OP_SUB
+    uint32_t init_argument;    // The index of the argument from the preheader in the phi
+    ir_operand_t scaled_step;  // 8 times the step, once a pointer moves along with the variable
+} induction_variable_t;
+
+// p = &array[i + offset] for an induction variable i, with next the value of p after i is stepped
+typedef struct pointer
+{
+    uint32_t variable;
+    symbol_t *array;
+    int64_t offset;
+    vreg_t phi, next;
+} pointer_t;
+
+static induction_variable_t *variables;
+static uint32_t n_variables;
+static pointer_t *pointers;
+static uint32_t n_pointers;
+
+static void find_definitions ( void )
+{
+    for ( vreg_t v = 0; v < function->n_vregs; v++ )
+    {
+        definition[v][0] = UINT32_MAX;
+        n_uses[v] = 0;
+    }
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->dst != NO_VREG )
+            {
+                definition[instruction->dst][0] = b;
+                definition[instruction->dst][1] = i;
+            }
+            if ( instruction->opcode == IR_PHI )
+            {
+                for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+                    if ( instruction->arguments[j].value.kind == IR_OPERAND_VREG )
+                        n_uses[instruction->arguments[j].value.vreg]++;
+                continue;
+            }
+            if ( instruction->a.kind == IR_OPERAND_VREG )
+                n_uses[instruction->a.vreg]++;
+            if ( instruction->b.kind == IR_OPERAND_VREG )
+                n_uses[instruction->b.vreg]++;
+        }
+    }
+}
+
+/* Returns the instruction defining vreg, or NULL for parameters */
+static ir_instruction_t* defining_instruction ( vreg_t vreg )
+{
+    if ( definition[vreg][0] == UINT32_MAX )
+        return NULL;
+    return &function->blocks[definition[vreg][0]].instructions[definition[vreg][1]];
+}
+
+static bool is_invariant ( ir_operand_t operand, uint32_t loop )
+{
+    return operand.kind != IR_OPERAND_VREG || definition[operand.vreg][0] == UINT32_MAX
+        || !IR_IN_LOOP(&loops, loop, definition[operand.vreg][0]);
+}
+
+static bool is_vreg ( ir_operand_t operand, vreg_t vreg )
+{
+    return operand.kind == IR_OPERAND_VREG && operand.vreg == vreg;
+}
+
+/* Finds the basic induction variables among the phis of the loop header */
+static void find_induction_variables ( uint32_t l )
+{
+    n_variables = 0;
+    const ir_loop_t *loop = &loops.loops[l];
+    const ir_block_t *header = &function->blocks[loop->header];
+    for ( uint32_t i = 0; i < header->n_instructions && header->instructions[i].opcode == IR_PHI; i++ )
+    {
+        const ir_instruction_t *phi = &header->instructions[i];
+        if ( phi->n_arguments != 2 )
+            continue;
+        uint32_t init_argument = phi->arguments[0].block == loop->preheader ? 0 : 1;
+        ir_operand_t back = phi->arguments[1 - init_argument].value;
+        if ( back.kind != IR_OPERAND_VREG )
+            continue;
+        const ir_instruction_t *step = defining_instruction ( back.vreg );
+        if ( step == NULL || step->opcode != IR_BINARY || !IR_IN_LOOP(&loops, l, definition[back.vreg][0]) )
+            continue;
+
+        induction_variable_t variable = {
+            .phi = phi->dst,
+            .next = back.vreg,
+            .init = phi->arguments[init_argument].value,
+            .op = step->op,
+            .init_argument = init_argument
+        };
+        if ( step->op == OP_ADD && is_vreg ( step->a, phi->dst ) && is_invariant ( step->b, l ) )
+            variable.step = step->b;
+        else if ( step->op == OP_ADD && is_vreg ( step->b, phi->dst ) && is_invariant ( step->a, l ) )
+            variable.step = step->a;
+        else if ( step->op == OP_SUB && is_vreg ( step->a, phi->dst ) && is_invariant ( step->b, l ) )
+            variable.step = step->b;
+        else
+            continue;
+        variables[n_variables++] = variable;
+    }
+}
+
+/* Returns the pointer to array moving along with variable at offset, making it if there is none yet */
+static pointer_t* find_pointer ( uint32_t variable, symbol_t *array, int64_t offset )
+{
+    for ( uint32_t p = 0; p < n_pointers; p++ )
+        if ( pointers[p].variable == variable && pointers[p].array == array && pointers[p].offset == offset )
+            return &pointers[p];
+    pointers = realloc ( pointers, ( n_pointers + 1 ) * sizeof(pointer_t) );
+    pointers[n_pointers] = (pointer_t) {
+        .variable = variable,
+        .array = array,
+        .offset = offset,
+        .phi = ir_new_vreg ( function ),
+        .next = ir_new_vreg ( function )
+    };
+    return &pointers[n_pointers++];
+}
+
+/* Replaces the array access by an access through a pointer, if it is indexed by an induction variable */
+static void reduce_access ( ir_instruction_t *access, uint32_t loop )
+{
+    if ( access->a.kind != IR_OPERAND_VREG )
+        return;
+    vreg_t index = access->a.vreg;
+    const ir_instruction_t *sum = defining_instruction ( index );
+
+    for ( uint32_t v = 0; v < n_variables; v++ )
+    {
+        const induction_variable_t *variable = &variables[v];
+        vreg_t pointer;
+        if ( index == variable->phi )
+            pointer = find_pointer ( v, access->symbol, 0 )->phi;
+        else if ( index == variable->next )
+            pointer = find_pointer ( v, access->symbol, 0 )->next;
+        else if ( sum != NULL && sum->opcode == IR_BINARY && IR_IN_LOOP(&loops, loop, definition[index][0])
+                  && ( sum->op == OP_ADD || sum->op == OP_SUB ) )
+        {
+            // An element at a constant distance from the variable, like array[i+1]
+            int64_t offset;
+            if ( is_vreg ( sum->a, variable->phi ) && sum->b.kind == IR_OPERAND_CONSTANT )
+                offset = sum->op == OP_ADD ? sum->b.constant : (int64_t) ( 0 - (uint64_t) sum->b.constant );
+            else if ( sum->op == OP_ADD && is_vreg ( sum->b, variable->phi ) && sum->a.kind == IR_OPERAND_CONSTANT )
+                offset = sum->a.constant;
+            else
+                continue;
+            pointer = find_pointer ( v, access->symbol, offset )->phi;
+        }
+        else
+            continue;
+
+        access->opcode = access->opcode == IR_LOAD_ELEMENT ? IR_LOAD_POINTER : IR_STORE_POINTER;
+        access->a = IR_VREG(pointer);
+        return;
+    }
+}
+
+/* Inserts an instruction at the end of the preheader, before its jump, and returns the operand it defines */
+static ir_operand_t append_to_preheader ( const ir_loop_t *loop, ir_instruction_t instruction )
+{
+    instruction.dst = ir_new_vreg ( function );
+    ir_insert ( function, loop->preheader, function->blocks[loop->preheader].n_instructions - 1, instruction );
+    return IR_VREG(instruction.dst);
+}
+
+/* Returns the address of array[value + offset], computed in the preheader */
+static ir_operand_t address_in_preheader ( const ir_loop_t *loop, symbol_t *array, ir_operand_t value, int64_t offset )
+{
+    if ( value.kind == IR_OPERAND_CONSTANT )
+        value = IR_CONSTANT((int64_t) ( (uint64_t) value.constant + (uint64_t) offset ));
+    else if ( offset != 0 )
+        value = append_to_preheader ( loop, (ir_instruction_t) {
+            .opcode = IR_BINARY, .op = OP_ADD, .a = value, .b = IR_CONSTANT(offset) } );
+    return append_to_preheader ( loop, (ir_instruction_t) { .opcode = IR_ADDRESS, .a = value, .symbol = array } );
+}
+
+/* Starts every pointer in the preheader, and steps it along with its variable */
+static void place_pointers ( const ir_loop_t *loop )
+{
+    for ( uint32_t p = 0; p < n_pointers; p++ )
+    {
+        pointer_t *pointer = &pointers[p];
+        induction_variable_t *variable = &variables[pointer->variable];
+        if ( variable->scaled_step.kind == IR_OPERAND_NONE )
+        {
+            if ( variable->step.kind == IR_OPERAND_CONSTANT )
+                variable->scaled_step = IR_CONSTANT((int64_t) ( (uint64_t) variable->step.constant * 8 ));
+            else
+                variable->scaled_step = append_to_preheader ( loop, (ir_instruction_t) {
+                    .opcode = IR_BINARY, .op = OP_SHL, .a = variable->step, .b = IR_CONSTANT(3) } );
+        }
+
+        ir_operand_t start = address_in_preheader ( loop, pointer->array, variable->init, pointer->offset );
+        ir_phi_argument_t *arguments = malloc ( 2 * sizeof(ir_phi_argument_t) );
+        arguments[variable->init_argument] = (ir_phi_argument_t) { loop->preheader, start };
+        arguments[1 - variable->init_argument] = (ir_phi_argument_t) {
+            function->blocks[loop->header].predecessors[0] == loop->preheader
+                ? function->blocks[loop->header].predecessors[1] : function->blocks[loop->header].predecessors[0],
+            IR_VREG(pointer->next) };
+        ir_insert ( function, loop->header, 0, (ir_instruction_t) {
+            .opcode = IR_PHI, .dst = pointer->phi, .n_arguments = 2, .arguments = arguments } );
+
+        // The pointer is stepped right after the variable. Instructions have moved, so it is looked up again
+        uint32_t block = definition[variable->next][0];
+        uint32_t index = 0;
+        while ( function->blocks[block].instructions[index].dst != variable->next )
+            index++;
+        ir_insert ( function, block, index + 1, (ir_instruction_t) {
+            .opcode = IR_BINARY, .op = variable->op, .dst = pointer->next,
+            .a = IR_VREG(pointer->phi), .b = variable->scaled_step } );
+
+        // The start, the pointer and its next value can share a register
+        ir_set_version ( function, pointer->phi, pointer->phi );
+        ir_set_version ( function, start.vreg, pointer->phi );
+        ir_set_version ( function, pointer->next, pointer->phi );
+    }
+}
+
+/* Compares a pointer instead of an induction variable in the loop condition, if that is all the variable is used for.
+ * The condition is tested either in the header, on the variable, or in the latch of a rotated loop, on its next value.
+ * Must be called after place_pointers, with dead code removed and the uses counted again */
+static void replace_test ( uint32_t l )
+{
+    const ir_loop_t *loop = &loops.loops[l];
+    const ir_block_t *header = &function->blocks[loop->header];
+    uint32_t latch = header->predecessors[0] == loop->preheader ? header->predecessors[1] : header->predecessors[0];
+    ir_instruction_t *test = IR_TERMINATOR(&function->blocks[loop->header]);
+    bool rotated = test->opcode != IR_BRANCH;
+    if ( rotated )
+        test = IR_TERMINATOR(&function->blocks[latch]);
+    if ( test->opcode != IR_BRANCH )
+        return;
+    for ( uint32_t p = 0; p < n_pointers; p++ )
+    {
+        const pointer_t *pointer = &pointers[p];
+        const induction_variable_t *variable = &variables[pointer->variable];
+        vreg_t compared = rotated ? variable->next : variable->phi;
+        bool on_left = is_vreg ( test->a, compared );
+        ir_operand_t *limit = on_left ? &test->b : &test->a;
+        if ( ( !on_left && !is_vreg ( test->b, compared ) ) || !is_invariant ( *limit, l ) )
+            continue;
+        // The variable is read by the test and its step, and its next value by the phi, and by the test if rotated.
+        // The pointer itself may be gone, if the accesses through it were never used
+        if ( n_uses[variable->phi] != ( rotated ? 1 : 2 ) || n_uses[variable->next] != ( rotated ? 2 : 1 )
+             || definition[pointer->phi][0] == UINT32_MAX )
+            continue;
+
+        *limit = address_in_preheader ( loop, pointer->array, *limit, pointer->offset );
+        *( on_left ? &test->a : &test->b ) = IR_VREG(rotated ? pointer->next : pointer->phi);
+        return;
+    }
+}
+
+void reduce_induction_variables ( ir_function_t *ir )
+{
+    function = ir;
+    ir_find_loops ( function, &loops );
+    // Whether the definitions must be found again, since a loop has moved instructions and made new virtual registers
+    bool changed = true;
+
+    // The array accesses in every loop, counting those of the loops inside it, which come before it.
+    // Loops without any are not searched for them
+    uint32_t *n_accesses = calloc ( loops.n_loops, sizeof(uint32_t) );
+    for ( uint32_t l = 0; l < loops.n_loops; l++ )
+    {
+        const ir_loop_t *loop = &loops.loops[l];
+        for ( uint32_t i = 0; i < loop->n_blocks; i++ )
+        {
+            const ir_block_t *block = &function->blocks[loop->blocks[i]];
+            for ( uint32_t j = 0; j < block->n_instructions; j++ )
+                if ( block->instructions[j].opcode == IR_LOAD_ELEMENT
+                     || block->instructions[j].opcode == IR_STORE_ELEMENT )
+                    n_accesses[l]++;
+        }
+        if ( loop->parent != UINT32_MAX )
+            n_accesses[loop->parent] += n_accesses[l];
+    }
+
+    for ( uint32_t l = 0; l < loops.n_loops; l++ )
+    {
+        const ir_loop_t *loop = &loops.loops[l];
+        if ( loop->preheader == UINT32_MAX || function->blocks[loop->header].n_predecessors != 2
+             || n_accesses[l] == 0 )
+            continue;
+
+        if ( changed )
+        {
+            definition = realloc ( definition, function->n_vregs * sizeof(*definition) );
+            n_uses = realloc ( n_uses, function->n_vregs * sizeof(uint32_t) );
+            find_definitions ( );
+            changed = false;
+        }
+
+        variables = realloc ( variables, function->blocks[loop->header].n_instructions * sizeof(induction_variable_t) );
+        find_induction_variables ( l );
+        if ( n_variables == 0 )
+            continue;
+
+        n_pointers = 0;
+        for ( uint32_t inner = loop->first; inner <= l; inner++ )
+        {
+            for ( uint32_t i = 0; i < loops.loops[inner].n_blocks; i++ )
+            {
+                ir_block_t *block = &function->blocks[loops.loops[inner].blocks[i]];
+                for ( uint32_t j = 0; j < block->n_instructions; j++ )
+                {
+                    ir_instruction_t *instruction = &block->instructions[j];
+                    if ( instruction->opcode == IR_LOAD_ELEMENT || instruction->opcode == IR_STORE_ELEMENT )
+                        reduce_access ( instruction, l );
+                }
+            }
+        }
+        if ( n_pointers == 0 )
+            continue;
+
+        // The indices computed for the accesses that were replaced are removed, so they no longer count as uses
+        place_pointers ( loop );
+        changed = true;
+        remove_dead_code ( function );
+        definition = realloc ( definition, function->n_vregs * sizeof(*definition) );
+        n_uses = realloc ( n_uses, function->n_vregs * sizeof(uint32_t) );
+        find_definitions ( );
+        replace_test ( l );
+    }
+
+    ir_destroy_loops ( &loops );
+    free ( n_accesses );
+    free ( definition );
+    free ( n_uses );
+    free ( variables );
+    free ( pointers );
+    definition = NULL;
+    n_uses = NULL;
+    variables = NULL;
+    pointers = NULL;
+    function = NULL;
+}
@@ -0,0 +1,102 @@
+#include "intern.h"
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Every header and string in the pool is allocated from this arena
+static arena_t intern_arena;
+
+// An open addressing hash table of interned strings. The number of slots is always a power of two
+static char **slots;
+static size_t n_slots;
+static size_t n_strings;
+
+// FNV-1a over the characters, followed by a final mix so that every bit of the hash is usable
+static uint64_t hash_characters ( const char *string, size_t length )
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        hash ^= (unsigned char) string[i];
+        hash *= 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Doubles the number of slots, and places all interned strings again using their stored hashes
+static void intern_pool_grow ( void )
+{
+    char **old_slots = slots;
+    size_t old_n_slots = n_slots;
+
+    n_slots = n_slots == 0 ? 256 : n_slots * 2;
+    slots = calloc ( n_slots, sizeof(char*) );
+
+    for ( size_t i = 0; i < old_n_slots; i++ )
+    {
+        if ( old_slots[i] == NULL )
+            continue;
+        size_t slot = INTERNED_HASH(old_slots[i]) & ( n_slots - 1 );
+        while ( slots[slot] != NULL )
+            slot = ( slot + 1 ) & ( n_slots - 1 );
+        slots[slot] = old_slots[i];
+    }
+
+    free ( old_slots );
+}
+
+// Looks for the string in the pool using linear probing, and adds it to the first empty slot if not found
+char* intern_string ( const char *string )
+{
+    // Keep the fill ratio of the table at most 1/2
+    if ( ( n_strings + 1 ) * 2 > n_slots )
+        intern_pool_grow ( );
+
+    size_t length = strlen ( string );
+    uint64_t hash = hash_characters ( string, length );
+
+    size_t slot = hash & ( n_slots - 1 );
+    while ( slots[slot] != NULL )
+    {
+        const interned_header_t *header = INTERNED_HEADER(slots[slot]);
+        if ( header->hash == hash && header->length == length && memcmp ( slots[slot], string, length ) == 0 )
+            return slots[slot];
+        slot = ( slot + 1 ) & ( n_slots - 1 );
+    }
+
+    // The string is new, so copy it into the arena, right after its header
+    interned_header_t *header = arena_alloc ( &intern_arena, sizeof(interned_header_t) + length + 1 );
+    *header = (interned_header_t) {
+        .hash = hash,
+        .id = n_strings,
+        .length = length
+    };
+    char *result = (char *) ( header + 1 );
+    memcpy ( result, string, length + 1 );
+
+    slots[slot] = result;
+    n_strings++;
+    return result;
+}
+
+size_t intern_pool_size ( void )
+{
+    return n_strings;
+}
+
+void destroy_intern_pool ( void )
+{
+    free ( slots );
+    slots = NULL;
+    n_slots = 0;
+    n_strings = 0;
+    arena_release ( &intern_arena );
+}
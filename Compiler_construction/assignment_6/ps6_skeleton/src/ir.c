@@ -0,0 +1,264 @@
+#include "vslc.h"
+#include "ir.h"
+
+uint32_t ir_new_block ( ir_function_t *function, uint32_t loop_depth )
+{
+    if ( function->n_blocks == function->blocks_capacity )
+    {
+        function->blocks_capacity = function->blocks_capacity * 2 + 16;
+        function->blocks = realloc ( function->blocks, function->blocks_capacity * sizeof(ir_block_t) );
+    }
+    function->blocks[function->n_blocks] = (ir_block_t) { .loop_depth = loop_depth };
+    return function->n_blocks++;
+}
+
+vreg_t ir_new_vreg ( ir_function_t *function )
+{
+    return function->n_vregs++;
+}
+
+ir_instruction_t* ir_append ( ir_function_t *function, uint32_t block, ir_instruction_t instruction )
+{
+    ir_block_t *b = &function->blocks[block];
+    if ( b->n_instructions == b->capacity )
+    {
+        b->capacity = b->capacity * 2 + 8;
+        b->instructions = realloc ( b->instructions, b->capacity * sizeof(ir_instruction_t) );
+    }
+    b->instructions[b->n_instructions] = instruction;
+    return &b->instructions[b->n_instructions++];
+}
+
+void ir_insert ( ir_function_t *function, uint32_t block, uint32_t index, ir_instruction_t instruction )
+{
+    ir_append ( function, block, instruction );
+    ir_block_t *b = &function->blocks[block];
+    memmove ( &b->instructions[index + 1], &b->instructions[index],
+              ( b->n_instructions - 1 - index ) * sizeof(ir_instruction_t) );
+    b->instructions[index] = instruction;
+}
+
+bool ir_fold_binary ( operator_t op, int64_t lhs, int64_t rhs, int64_t *result )
+{
+    // Arithmetic wraps around, and shift counts are taken modulo 64, as the generated instructions do
+    uint64_t left = lhs, right = rhs;
+    switch ( op )
+    {
+        case OP_ADD: *result = (int64_t) ( left + right ); return true;
+        case OP_SUB: *result = (int64_t) ( left - right ); return true;
+        case OP_MUL: *result = (int64_t) ( left * right ); return true;
+        case OP_DIV:
+            // These fault when the program runs, so they are left for it to do
+            if ( rhs == 0 || ( lhs == INT64_MIN && rhs == -1 ) )
+                return false;
+            *result = lhs / rhs;
+            return true;
+        case OP_SHL: *result = (int64_t) ( left << ( right & 63 ) ); return true;
+        case OP_SHR:
+            // Right shifts of negative numbers are arithmetic, like sarq
+            *result = lhs < 0 ? ~( ~lhs >> ( right & 63 ) ) : lhs >> ( right & 63 );
+            return true;
+        default: assert ( false && "Unknown binary operator" );
+    }
+}
+
+bool ir_relation_holds ( operator_t op, int64_t lhs, int64_t rhs )
+{
+    switch ( op )
+    {
+        case OP_EQ: return lhs == rhs;
+        case OP_NE: return lhs != rhs;
+        case OP_LT: return lhs < rhs;
+        case OP_GT: return lhs > rhs;
+        default: assert ( false && "Unknown relation operator" );
+    }
+}
+
+void build_ir_function ( symbol_t *function, ir_function_t *ir, int optimization_level )
+{
+    lower_function ( function, ir );
+    if ( optimization_level > 0 )
+    {
+        unroll_loops ( ir );
+        rotate_loops ( ir );
+        build_ssa ( ir );
+        propagate_constants ( ir );
+        hoist_loop_invariants ( ir );
+        reduce_induction_variables ( ir );
+        remove_dead_code ( ir );
+    }
+}
+
+/* Prints a virtual register as the name of its variable, or as t<number> for temporaries.
+ * Versions of variables in SSA form are printed as name.number */
+static void print_vreg ( const ir_function_t *function, vreg_t vreg )
+{
+    symbol_t **variables = function->symbol->function_symtable->symbols;
+    if ( vreg <= function->n_variables )
+        printf ( "%s", variables[vreg - 1]->name );
+    else if ( vreg < function->n_versions && function->versions[vreg] != NO_VREG
+              && function->versions[vreg] <= function->n_variables )
+        printf ( "%s.%u", variables[function->versions[vreg] - 1]->name, vreg );
+    else
+        printf ( "t%u", vreg );
+}
+
+static void print_operand ( const ir_function_t *function, ir_operand_t operand )
+{
+    if ( operand.kind == IR_OPERAND_VREG )
+        print_vreg ( function, operand.vreg );
+    else
+        printf ( "%ld", operand.constant );
+}
+
+static void print_instruction ( const ir_function_t *function, const ir_instruction_t *instruction )
+{
+    printf ( "    " );
+    if ( instruction->dst != NO_VREG )
+    {
+        print_vreg ( function, instruction->dst );
+        printf ( " = " );
+    }
+
+    switch ( instruction->opcode )
+    {
+        case IR_COPY:
+            print_operand ( function, instruction->a );
+            break;
+        case IR_NEG:
+            printf ( "-" );
+            print_operand ( function, instruction->a );
+            break;
+        case IR_BINARY:
+            print_operand ( function, instruction->a );
+            printf ( " %s ", OPERATOR_NAMES[instruction->op] );
+            print_operand ( function, instruction->b );
+            break;
+        case IR_LOAD:
+            printf ( "load %s", instruction->symbol->name );
+            break;
+        case IR_STORE:
+            printf ( "store %s, ", instruction->symbol->name );
+            print_operand ( function, instruction->a );
+            break;
+        case IR_LOAD_ELEMENT:
+            printf ( "load %s[", instruction->symbol->name );
+            print_operand ( function, instruction->a );
+            printf ( "]" );
+            break;
+        case IR_STORE_ELEMENT:
+            printf ( "store %s[", instruction->symbol->name );
+            print_operand ( function, instruction->a );
+            printf ( "], " );
+            print_operand ( function, instruction->b );
+            break;
+        case IR_ADDRESS:
+            printf ( "&%s[", instruction->symbol->name );
+            print_operand ( function, instruction->a );
+            printf ( "]" );
+            break;
+        case IR_LOAD_POINTER:
+            printf ( "load *" );
+            print_operand ( function, instruction->a );
+            break;
+        case IR_STORE_POINTER:
+            printf ( "store *" );
+            print_operand ( function, instruction->a );
+            printf ( ", " );
+            print_operand ( function, instruction->b );
+            break;
+        case IR_PARAM:
+            printf ( "param " );
+            print_operand ( function, instruction->a );
+            break;
+        case IR_CALL:
+            printf ( "call %s, %u", instruction->symbol->name, FUNC_PARAM_COUNT(instruction->symbol) );
+            break;
+        case IR_PRINT_NUMBER:
+            printf ( "print " );
+            print_operand ( function, instruction->a );
+            break;
+        case IR_PRINT_STRING:
+            printf ( "print %s", string_list[instruction->string_index] );
+            break;
+        case IR_PRINT_NEWLINE:
+            printf ( "print newline" );
+            break;
+        case IR_JUMP:
+            printf ( "goto L%u", instruction->targets[0] );
+            break;
+        case IR_BRANCH:
+            printf ( "if " );
+            print_operand ( function, instruction->a );
+            printf ( " %s ", OPERATOR_NAMES[instruction->op] );
+            print_operand ( function, instruction->b );
+            printf ( " goto L%u else goto L%u", instruction->targets[0], instruction->targets[1] );
+            break;
+        case IR_RETURN:
+            printf ( "return " );
+            print_operand ( function, instruction->a );
+            break;
+        case IR_PHI:
+            printf ( "phi" );
+            for ( uint32_t i = 0; i < instruction->n_arguments; i++ )
+            {
+                printf ( "%s [", i > 0 ? "," : "" );
+                print_operand ( function, instruction->arguments[i].value );
+                printf ( ", L%u]", instruction->arguments[i].block );
+            }
+            break;
+    }
+    putchar ( '\n' );
+}
+
+void ir_print_function ( const ir_function_t *function )
+{
+    symbol_table_t *symtable = function->symbol->function_symtable;
+    printf ( "func %s(", function->symbol->name );
+    for ( uint32_t i = 0; i < function->n_parameters; i++ )
+        printf ( "%s%s", i > 0 ? ", " : "", symtable->symbols[i]->name );
+    printf ( ")\n" );
+
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        printf ( "  L%u:\n", b );
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+            print_instruction ( function, &block->instructions[i] );
+    }
+    putchar ( '\n' );
+}
+
+void print_ir_program ( int optimization_level )
+{
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if ( symbol->type != SYMBOL_FUNCTION )
+            continue;
+        ir_function_t ir = { 0 };
+        build_ir_function ( symbol, &ir, optimization_level );
+        ir_print_function ( &ir );
+        ir_destroy_function ( &ir );
+    }
+}
+
+void ir_free_block ( ir_block_t *block )
+{
+    for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        if ( block->instructions[i].opcode == IR_PHI )
+            free ( block->instructions[i].arguments );
+    free ( block->instructions );
+    block->instructions = NULL;
+    block->n_instructions = block->capacity = 0;
+}
+
+void ir_destroy_function ( ir_function_t *function )
+{
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+        ir_free_block ( &function->blocks[b] );
+    free ( function->blocks );
+    free ( function->predecessor_list );
+    free ( function->versions );
+    *function = (ir_function_t) { 0 };
+}
@@ -0,0 +1,1102 @@
+#include "vslc.h"
+#include "ir.h"
+
+// This header defines a bunch of macros we can use to emit assembly to stdout
+#include "emit.h"
+// Linear scan register allocation, used for the virtual registers
+#include "regalloc.h"
+
+// Generates x86 from three-address code. The live interval of every virtual register is found by liveness analysis
+// over the blocks, and the intervals are given machine registers by linear scan.
+// Virtual registers that get no register live in the stack frame
+
+// The machine registers the backend works with, as indices, so they can be compared
+typedef enum
+{
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSI, REG_RDI, REG_R8, REG_R9,
+    REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+} machine_register_t;
+
+static const char *REGISTER_NAMES[] = { RAX, RCX, RDX, RBX, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// The registers arguments are passed in
+static const machine_register_t ARGUMENT_REGISTERS[NUM_REGISTER_PARAMS] = {
+    REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
+
+// The registers virtual registers can be given. RAX, RCX and RDX are left as scratch registers,
+// since the results of calls, idivq and shifts use them. The callee-saved registers come first
+static const machine_register_t ALLOCATABLE_REGISTERS[] = {
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11 };
+#define N_ALLOCATABLE_REGISTERS 11
+// The set of ALLOCATABLE_REGISTERS that calls may clobber: RSI, RDI and R8 to R11
+#define CALLER_SAVED_ALLOCATABLE 0x7e0
+#define IS_CALLER_SAVED(r) ( ( CALLER_SAVED_ALLOCATABLE >> (r) ) & 1 )
+
+// Code in a loop is expected to run this many times more often than the code around it
+#define LOOP_WEIGHT_SHIFT 3
+#define MAX_LOOP_WEIGHT_DEPTH 4
+#define BLOCK_WEIGHT(block) \
+    ( UINT32_C(1) << ( LOOP_WEIGHT_SHIFT * ( (block)->loop_depth < MAX_LOOP_WEIGHT_DEPTH \
+                                             ? (block)->loop_depth : MAX_LOOP_WEIGHT_DEPTH ) ) )
+
+// Every instruction is given a number, in the order the reachable blocks are generated, starting at 1.
+// Instruction k reads its operands at the position 2k, and writes its result at 2k+1,
+// so a value that dies in an instruction can share a register with the result.
+// Position 0 is the entry of the function, where the parameters are written
+#define READ_POSITION(k) (2 * (k))
+#define WRITE_POSITION(k) (2 * (k) + 1)
+
+// Most instructions take immediates and displacements of at most 32 bits
+#define FITS_INT32(value) ( (value) >= INT32_MIN && (value) <= INT32_MAX )
+
+// Where a virtual register lives
+typedef struct location
+{
+    int32_t reg;          // A machine_register_t, or SPILLED
+    int32_t frame_offset; // The slot of a spilled virtual register, relative to %rbp
+} location_t;
+
+// The function being generated
+static const ir_function_t *function;
+
+// The blocks reachable from the entry, in the order they are generated
+static uint32_t *reachable;
+static uint32_t n_reachable;
+// The label of every reachable block, and the first and last position of its instructions
+static label_t *block_labels;
+static uint32_t *block_start;
+static uint32_t *block_end;
+
+// Indexed by virtual register
+static location_t *locations;
+static uint32_t *reads;        // The number of instructions reading the virtual register
+
+// The allocated registers of the function, as indices into ALLOCATABLE_REGISTERS
+static uint32_t used_registers;
+
+// The intervals of the values in caller-saved registers, grouped by register, and sorted by their start.
+// While the code is generated, cursors move through each group to find the values live across a call
+static live_interval_t *caller_saved_intervals;
+static uint32_t caller_saved_first[N_ALLOCATABLE_REGISTERS + 1];
+static uint32_t caller_saved_cursor[N_ALLOCATABLE_REGISTERS];
+
+/* Finds the blocks reachable from the entry, and gives them labels */
+static void find_reachable_blocks ( void )
+{
+    uint32_t n_blocks = function->n_blocks;
+    bool *seen = calloc ( n_blocks, sizeof(bool) );
+    uint32_t *stack = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t depth = 0;
+    stack[depth++] = 0;
+    seen[0] = true;
+    while ( depth > 0 )
+    {
+        const ir_block_t *block = &function->blocks[stack[--depth]];
+        const ir_instruction_t *last = IR_TERMINATOR(block);
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        {
+            if ( !seen[last->targets[t]] )
+            {
+                seen[last->targets[t]] = true;
+                stack[depth++] = last->targets[t];
+            }
+        }
+    }
+
+    reachable = malloc ( n_blocks * sizeof(uint32_t) );
+    block_labels = malloc ( n_blocks * sizeof(label_t) );
+    block_start = malloc ( n_blocks * sizeof(uint32_t) );
+    block_end = malloc ( n_blocks * sizeof(uint32_t) );
+    n_reachable = 0;
+    uint32_t position = 1;
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        if ( !seen[b] )
+            continue;
+        reachable[n_reachable++] = b;
+        block_labels[b] = new_label ( );
+        block_start[b] = READ_POSITION(position);
+        position += function->blocks[b].n_instructions;
+        block_end[b] = WRITE_POSITION(position - 1);
+    }
+    free ( seen );
+    free ( stack );
+}
+
+
+/* Liveness and register allocation */
+
+// The first and last position of every virtual register, and its occurrences weighted by loop depth
+static uint32_t *first_position;
+static uint32_t *last_position;
+static uint32_t *weighted_uses;
+// The first block every virtual register occurs in, and its bit in the live sets if it occurs in others as well
+static uint32_t *home_block;
+static uint32_t *global_index;
+static vreg_t *global_vregs;
+static uint32_t n_globals;
+
+// The position of every call, where the result is written, with the summed weight of it and all earlier calls.
+// Printing calls the runtime library, so print instructions count as calls
+typedef struct { uint32_t position, weight_sum; } call_t;
+static call_t *calls;
+static size_t n_calls;
+static size_t calls_capacity;
+
+#define NOT_GLOBAL UINT32_MAX
+
+/* Records that vreg occurs at position, in block */
+static void note_occurrence ( vreg_t vreg, uint32_t position, uint32_t block, uint32_t weight )
+{
+    if ( first_position[vreg] > position )
+        first_position[vreg] = position;
+    if ( last_position[vreg] < position )
+        last_position[vreg] = position;
+    weighted_uses[vreg] += weight;
+
+    if ( home_block[vreg] == UINT32_MAX )
+        home_block[vreg] = block;
+    else if ( home_block[vreg] != block && global_index[vreg] == NOT_GLOBAL )
+    {
+        global_index[vreg] = n_globals;
+        global_vregs[n_globals++] = vreg;
+    }
+}
+
+static void note_call ( uint32_t position, uint32_t weight )
+{
+    if ( n_calls == calls_capacity )
+    {
+        calls_capacity = calls_capacity * 2 + 64;
+        calls = realloc ( calls, calls_capacity * sizeof(call_t) );
+    }
+    uint32_t weight_sum = n_calls > 0 ? calls[n_calls - 1].weight_sum : 0;
+    calls[n_calls++] = (call_t) { position, weight_sum + weight };
+}
+
+/* Returns the number of calls before position */
+static size_t calls_before ( uint32_t position )
+{
+    size_t low = 0, high = n_calls;
+    while ( low < high )
+    {
+        size_t middle = ( low + high ) / 2;
+        if ( calls[middle].position < position )
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/* Records where every virtual register occurs, and where the calls are */
+static void scan_occurrences ( void )
+{
+    for ( vreg_t v = 0; v < function->n_vregs; v++ )
+    {
+        first_position[v] = home_block[v] = UINT32_MAX;
+        last_position[v] = weighted_uses[v] = reads[v] = 0;
+        global_index[v] = NOT_GLOBAL;
+    }
+    n_globals = 0;
+    n_calls = 0;
+
+    // Parameters are written at the entry
+    for ( vreg_t v = 1; v <= function->n_parameters; v++ )
+        note_occurrence ( v, 0, 0, 0 );
+
+    for ( uint32_t r = 0; r < n_reachable; r++ )
+    {
+        uint32_t b = reachable[r];
+        const ir_block_t *block = &function->blocks[b];
+        uint32_t weight = BLOCK_WEIGHT(block);
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            uint32_t position = block_start[b] + 2 * i;
+            const ir_operand_t *operands[2] = { &instruction->a, &instruction->b };
+            for ( int o = 0; o < 2; o++ )
+            {
+                if ( operands[o]->kind != IR_OPERAND_VREG )
+                    continue;
+                note_occurrence ( operands[o]->vreg, position, b, weight );
+                reads[operands[o]->vreg]++;
+            }
+            if ( instruction->dst != NO_VREG )
+                note_occurrence ( instruction->dst, position + 1, b, weight );
+
+            switch ( instruction->opcode )
+            {
+                case IR_CALL:
+                case IR_PRINT_NUMBER:
+                case IR_PRINT_STRING:
+                case IR_PRINT_NEWLINE:
+                    note_call ( position + 1, weight );
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+/* Extends the intervals of the virtual registers occurring in several blocks, to every block they are live in.
+ * The registers live at the start and end of each block are found by iterating until nothing changes.
+ * Blocks mostly come after the blocks jumping to them, so they are visited from last to first */
+static void extend_global_intervals ( void )
+{
+    if ( n_globals == 0 )
+        return;
+
+    size_t words = BITSET_WORDS(n_globals);
+    size_t n_blocks = function->n_blocks;
+    // Per block: the registers read before being written, those written, and those live at the start and end
+    bitset_word_t *sets = calloc ( 4 * n_blocks * words, sizeof(bitset_word_t) );
+    #define USED(b) ( &sets[( 4 * (size_t) (b) + 0 ) * words] )
+    #define WRITTEN(b) ( &sets[( 4 * (size_t) (b) + 1 ) * words] )
+    #define LIVE_IN(b) ( &sets[( 4 * (size_t) (b) + 2 ) * words] )
+    #define LIVE_OUT(b) ( &sets[( 4 * (size_t) (b) + 3 ) * words] )
+
+    for ( uint32_t r = 0; r < n_reachable; r++ )
+    {
+        uint32_t b = reachable[r];
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            const ir_operand_t *operands[2] = { &instruction->a, &instruction->b };
+            for ( int o = 0; o < 2; o++ )
+            {
+                if ( operands[o]->kind != IR_OPERAND_VREG )
+                    continue;
+                uint32_t g = global_index[operands[o]->vreg];
+                if ( g != NOT_GLOBAL && !BITSET_HAS ( WRITTEN(b), g ) )
+                    BITSET_ADD ( USED(b), g );
+            }
+            if ( instruction->dst != NO_VREG && global_index[instruction->dst] != NOT_GLOBAL )
+                BITSET_ADD ( WRITTEN(b), global_index[instruction->dst] );
+        }
+    }
+
+    bool changed = true;
+    while ( changed )
+    {
+        changed = false;
+        for ( uint32_t r = n_reachable; r-- > 0; )
+        {
+            uint32_t b = reachable[r];
+            const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[b]);
+            for ( size_t w = 0; w < words; w++ )
+            {
+                bitset_word_t out = 0;
+                for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+                    out |= LIVE_IN(last->targets[t])[w];
+                bitset_word_t in = USED(b)[w] | ( out & ~WRITTEN(b)[w] );
+                changed |= in != LIVE_IN(b)[w];
+                LIVE_OUT(b)[w] = out;
+                LIVE_IN(b)[w] = in;
+            }
+        }
+    }
+
+    // A register live at the start or end of a block is live at its first or last position
+    for ( uint32_t r = 0; r < n_reachable; r++ )
+    {
+        uint32_t b = reachable[r];
+        for ( size_t w = 0; w < words; w++ )
+        {
+            for ( bitset_word_t bits = LIVE_IN(b)[w]; bits != 0; bits &= bits - 1 )
+            {
+                vreg_t v = global_vregs[w * 64 + __builtin_ctzll ( bits )];
+                if ( first_position[v] > block_start[b] )
+                    first_position[v] = block_start[b];
+            }
+            for ( bitset_word_t bits = LIVE_OUT(b)[w]; bits != 0; bits &= bits - 1 )
+            {
+                vreg_t v = global_vregs[w * 64 + __builtin_ctzll ( bits )];
+                if ( last_position[v] < block_end[b] )
+                    last_position[v] = block_end[b];
+            }
+        }
+    }
+    #undef USED
+    #undef WRITTEN
+    #undef LIVE_IN
+    #undef LIVE_OUT
+    free ( sets );
+}
+
+/* Finds the live interval of every virtual register, and gives them registers. Each interval goes from the first
+ * to the last position the register is live at, including any holes in between.
+ * Most virtual registers are temporaries, only used in the block they are made in,
+ * so their interval is simply from their definition to their last use.
+ * Virtual registers that do not get a register are given slots in the stack frame.
+ * Returns the number of slots */
+static uint32_t allocate_registers ( void )
+{
+    uint32_t n_vregs = function->n_vregs;
+    first_position = malloc ( n_vregs * sizeof(uint32_t) );
+    last_position = malloc ( n_vregs * sizeof(uint32_t) );
+    weighted_uses = malloc ( n_vregs * sizeof(uint32_t) );
+    home_block = malloc ( n_vregs * sizeof(uint32_t) );
+    global_index = malloc ( n_vregs * sizeof(uint32_t) );
+    global_vregs = malloc ( n_vregs * sizeof(vreg_t) );
+
+    scan_occurrences ( );
+    extend_global_intervals ( );
+
+    live_interval_t *intervals = malloc ( n_vregs * sizeof(live_interval_t) );
+    size_t n_intervals = 0;
+    for ( vreg_t v = 1; v < n_vregs; v++ )
+    {
+        locations[v] = (location_t) { .reg = SPILLED };
+        if ( first_position[v] == UINT32_MAX )
+            continue;
+
+        // The calls are sorted by position, so the weight of the calls in the interval is a difference of sums.
+        // Calls that only read the register, or write it, are not counted, since it is not live across them
+        size_t first = calls_before ( first_position[v] + 1 );
+        size_t last = calls_before ( last_position[v] );
+        uint32_t weight_before = first > 0 ? calls[first - 1].weight_sum : 0;
+        uint32_t weight_until = last > 0 ? calls[last - 1].weight_sum : 0;
+
+        intervals[n_intervals++] = (live_interval_t) {
+            .start = first_position[v],
+            .end = last_position[v],
+            .id = v,
+            .uses = weighted_uses[v],
+            .calls = last > first ? weight_until - weight_before : 0
+        };
+    }
+
+    used_registers = linear_scan ( intervals, n_intervals, N_ALLOCATABLE_REGISTERS, CALLER_SAVED_ALLOCATABLE );
+
+    // Group the intervals in caller-saved registers by register, keeping them sorted by start
+    uint32_t counts[N_ALLOCATABLE_REGISTERS + 1] = { 0 };
+    for ( size_t i = 0; i < n_intervals; i++ )
+        if ( intervals[i].location != SPILLED && IS_CALLER_SAVED(intervals[i].location) )
+            counts[intervals[i].location + 1]++;
+    for ( int r = 0; r < N_ALLOCATABLE_REGISTERS; r++ )
+    {
+        caller_saved_first[r + 1] = caller_saved_first[r] + counts[r + 1];
+        caller_saved_cursor[r] = caller_saved_first[r];
+    }
+    caller_saved_intervals = malloc ( ( caller_saved_first[N_ALLOCATABLE_REGISTERS] + 1 ) * sizeof(live_interval_t) );
+    for ( size_t i = 0; i < n_intervals; i++ )
+    {
+        int32_t r = intervals[i].location;
+        if ( r != SPILLED && IS_CALLER_SAVED(r) )
+            caller_saved_intervals[caller_saved_cursor[r]++] = intervals[i];
+    }
+    for ( int r = 0; r < N_ALLOCATABLE_REGISTERS; r++ )
+        caller_saved_cursor[r] = caller_saved_first[r];
+
+    // Parameters passed on the stack stay where the caller put them.
+    // The other spilled registers are kept at the front of intervals, still sorted by start, to be given slots
+    size_t n_spilled = 0;
+    for ( size_t i = 0; i < n_intervals; i++ )
+    {
+        vreg_t v = intervals[i].id;
+        if ( intervals[i].location != SPILLED )
+            locations[v].reg = ALLOCATABLE_REGISTERS[intervals[i].location];
+        else if ( v <= function->n_parameters && v > NUM_REGISTER_PARAMS )
+            // Parameter 6 is at 16(%rbp), with further parameters moving up from there
+            locations[v].frame_offset = 16 + ( v - 1 - NUM_REGISTER_PARAMS ) * 8;
+        else
+            intervals[n_spilled++] = intervals[i];
+    }
+
+    // Spilled registers get the stack slots below the saved callee-saved registers.
+    // Registers that are never live at the same time share a slot
+    int saved_registers = __builtin_popcount ( used_registers & ~CALLER_SAVED_ALLOCATABLE );
+    uint32_t n_slots = allocate_slots ( intervals, n_spilled );
+    for ( size_t i = 0; i < n_spilled; i++ )
+        locations[intervals[i].id].frame_offset = -8 * ( saved_registers + 1 + intervals[i].location );
+
+    free ( intervals );
+    free ( first_position );
+    free ( last_position );
+    free ( weighted_uses );
+    free ( home_block );
+    free ( global_index );
+    free ( global_vregs );
+    return n_slots;
+}
+
+/* Operands */
+
+static bool same_location ( location_t a, location_t b )
+{
+    return a.reg == b.reg && ( a.reg != SPILLED || a.frame_offset == b.frame_offset );
+}
+
+static const char* location_operand ( location_t location )
+{
+    return location.reg != SPILLED ? REGISTER_NAMES[location.reg] : frame_operand ( location.frame_offset );
+}
+
+/* Returns the machine register holding operand, or SPILLED if it is a constant or in the stack frame */
+static int32_t operand_register ( ir_operand_t operand )
+{
+    return operand.kind == IR_OPERAND_VREG ? locations[operand.vreg].reg : SPILLED;
+}
+
+static bool is_memory ( ir_operand_t operand )
+{
+    return operand.kind == IR_OPERAND_VREG && locations[operand.vreg].reg == SPILLED;
+}
+
+/* Whether operand can be used by instructions as it is: a register, a slot in the stack frame,
+ * or a constant fitting in 32 bits */
+static bool is_direct ( ir_operand_t operand )
+{
+    return operand.kind == IR_OPERAND_VREG || FITS_INT32(operand.constant);
+}
+
+/* Returns the operand as it is used by instructions. It must be direct */
+static const char* operand_string ( ir_operand_t operand )
+{
+    assert ( is_direct ( operand ) );
+    if ( operand.kind == IR_OPERAND_CONSTANT )
+        return immediate_operand ( operand.constant );
+    return location_operand ( locations[operand.vreg] );
+}
+
+/* Places the value of operand in reg, unless it is there already */
+static void load_operand ( ir_operand_t operand, machine_register_t reg )
+{
+    if ( operand.kind == IR_OPERAND_CONSTANT )
+        MOVQ_IMM ( operand.constant, REGISTER_NAMES[reg] );
+    else if ( operand_register ( operand ) != (int32_t) reg )
+        MOVQ ( location_operand ( locations[operand.vreg] ), REGISTER_NAMES[reg] );
+}
+
+/* Returns the register a result written to dst is computed in: its own register, or RAX if it is spilled */
+static machine_register_t result_register ( vreg_t dst )
+{
+    return locations[dst].reg != SPILLED ? (machine_register_t) locations[dst].reg : REG_RAX;
+}
+
+/* Moves a result computed in reg to dst, unless it is there already */
+static void store_result ( machine_register_t reg, vreg_t dst )
+{
+    if ( locations[dst].reg != (int32_t) reg )
+        MOVQ ( REGISTER_NAMES[reg], location_operand ( locations[dst] ) );
+}
+
+/* Parallel moves */
+
+// A move of a value into a register or stack slot, from a location or a constant
+typedef struct move
+{
+    location_t to;
+    location_t from;
+    bool constant;
+    int64_t value;
+} move_t;
+
+/* Does all the moves as if at once, so no move overwrites the source of another before it is read.
+ * Moves that form a cycle are broken up by copying one of the registers to RAX */
+static void parallel_move ( move_t *moves, size_t n_moves )
+{
+    while ( n_moves > 0 )
+    {
+        bool progress = false;
+        for ( size_t i = 0; i < n_moves; )
+        {
+            move_t *move = &moves[i];
+            bool blocked = false;
+            for ( size_t j = 0; j < n_moves && !blocked && move->to.reg != SPILLED; j++ )
+                blocked = j != i && !moves[j].constant && moves[j].from.reg == move->to.reg;
+            if ( blocked )
+            {
+                i++;
+                continue;
+            }
+
+            if ( move->constant )
+                MOVQ_IMM ( move->value, location_operand ( move->to ) );
+            else if ( !same_location ( move->to, move->from ) )
+            {
+                // Stack slots are never moved to other stack slots
+                assert ( move->to.reg != SPILLED || move->from.reg != SPILLED );
+                const char *from = location_operand ( move->from );
+                MOVQ ( from, location_operand ( move->to ) );
+            }
+            *move = moves[--n_moves];
+            progress = true;
+        }
+
+        if ( !progress )
+        {
+            // Every move left writes a register another one reads
+            int32_t reg = moves[0].to.reg;
+            MOVQ ( REGISTER_NAMES[reg], RAX );
+            for ( size_t j = 0; j < n_moves; j++ )
+                if ( !moves[j].constant && moves[j].from.reg == reg )
+                    moves[j].from.reg = REG_RAX;
+        }
+    }
+}
+
+/* Returns the move of operand to the location */
+static move_t operand_move ( ir_operand_t operand, location_t to )
+{
+    if ( operand.kind == IR_OPERAND_CONSTANT )
+        return (move_t) { .to = to, .constant = true, .value = operand.constant };
+    return (move_t) { .to = to, .from = locations[operand.vreg] };
+}
+
+/* Code generation */
+
+/* Pushes the caller-saved registers holding values live across a call at position, since the call clobbers them.
+ * Calls must be generated in order, since the intervals of each register are searched from the last call.
+ * Returns the set of pushed registers, for restore_live_registers */
+static uint32_t save_live_registers ( uint32_t position )
+{
+    uint32_t saved = 0;
+    for ( int r = 0; r < N_ALLOCATABLE_REGISTERS; r++ )
+    {
+        if ( !IS_CALLER_SAVED(r) )
+            continue;
+        uint32_t *cursor = &caller_saved_cursor[r];
+        while ( *cursor < caller_saved_first[r + 1] && caller_saved_intervals[*cursor].end <= position )
+            ( *cursor )++;
+        if ( *cursor < caller_saved_first[r + 1] && caller_saved_intervals[*cursor].start < position )
+            saved |= UINT32_C(1) << r;
+    }
+
+    for ( int r = 0; r < N_ALLOCATABLE_REGISTERS; r++ )
+        if ( saved & ( UINT32_C(1) << r ) )
+            PUSHQ ( REGISTER_NAMES[ALLOCATABLE_REGISTERS[r]] );
+    return saved;
+}
+
+/* Pops the registers pushed by save_live_registers */
+static void restore_live_registers ( uint32_t saved )
+{
+    for ( int r = N_ALLOCATABLE_REGISTERS - 1; r >= 0; r-- )
+        if ( saved & ( UINT32_C(1) << r ) )
+            POPQ ( REGISTER_NAMES[ALLOCATABLE_REGISTERS[r]] );
+}
+
+/* Restores the callee-saved registers and the caller's frame, and returns */
+static void generate_epilogue ( void )
+{
+    // Code after a return is still generated with the frame in place
+    int64_t stack_depth = emitter.stack_depth;
+
+    // The saved registers were pushed right below the saved %rbp
+    uint32_t callee_saved = used_registers & ~CALLER_SAVED_ALLOCATABLE;
+    if ( callee_saved != 0 )
+    {
+        EMIT ( "leaq %d(%s), %s", -8 * __builtin_popcount ( callee_saved ), RBP, RSP );
+        for ( int r = N_ALLOCATABLE_REGISTERS - 1; r >= 0; r-- )
+            if ( callee_saved & ( UINT32_C(1) << r ) )
+                POPQ ( REGISTER_NAMES[ALLOCATABLE_REGISTERS[r]] );
+    }
+    else
+        MOVQ ( RBP, RSP );
+    POPQ ( RBP );
+    RET;
+    emitter.stack_depth = stack_depth;
+}
+
+static void generate_copy ( const ir_instruction_t *instruction )
+{
+    location_t to = locations[instruction->dst];
+    ir_operand_t value = instruction->a;
+    if ( value.kind == IR_OPERAND_VREG && same_location ( locations[value.vreg], to ) )
+        return;
+
+    if ( to.reg != SPILLED )
+        load_operand ( value, to.reg );
+    else if ( is_direct ( value ) && !is_memory ( value ) )
+    {
+        const char *from = operand_string ( value );
+        MOVQ ( from, frame_operand ( to.frame_offset ) );
+    }
+    else
+    {
+        load_operand ( value, REG_RAX );
+        store_result ( REG_RAX, instruction->dst );
+    }
+}
+
+static void generate_negation ( const ir_instruction_t *instruction )
+{
+    machine_register_t result = result_register ( instruction->dst );
+    load_operand ( instruction->a, result );
+    NEGQ ( REGISTER_NAMES[result] );
+    store_result ( result, instruction->dst );
+}
+
+static void generate_binary ( const ir_instruction_t *instruction )
+{
+    ir_operand_t lhs = instruction->a;
+    ir_operand_t rhs = instruction->b;
+    vreg_t dst = instruction->dst;
+    machine_register_t result = result_register ( dst );
+    const char *result_name = REGISTER_NAMES[result];
+
+    switch ( instruction->op )
+    {
+        case OP_DIV:
+            if ( rhs.kind == IR_OPERAND_CONSTANT && divides_without_idivq ( rhs.constant ) )
+            {
+                // The dividend is read where it is, which is never RAX or RDX
+                if ( rhs.constant == 1 )
+                    load_operand ( lhs, result );
+                else
+                {
+                    if ( lhs.kind == IR_OPERAND_CONSTANT )
+                        load_operand ( lhs, REG_RCX );
+                    emit_division ( lhs.kind == IR_OPERAND_CONSTANT ? RCX : operand_string ( lhs ), rhs.constant );
+                    result = REG_RDX;
+                }
+                store_result ( result, dst );
+                return;
+            }
+            load_operand ( lhs, REG_RAX );
+            CQO;
+            // idivq takes no immediate
+            if ( rhs.kind == IR_OPERAND_CONSTANT )
+            {
+                load_operand ( rhs, REG_RCX );
+                IDIVQ ( RCX );
+            }
+            else
+                IDIVQ ( operand_string ( rhs ) );
+            store_result ( REG_RAX, dst );
+            return;
+
+        case OP_SHL:
+        case OP_SHR: {
+            const char *mnemonic = instruction->op == OP_SHL ? "salq" : "sarq";
+            // Shift counts are immediates, or in CL. The count is taken modulo 64, as the instructions do
+            if ( rhs.kind == IR_OPERAND_CONSTANT )
+            {
+                load_operand ( lhs, result );
+                emit_immediate ( mnemonic, rhs.constant & 63, result_name );
+            }
+            else
+            {
+                load_operand ( rhs, REG_RCX );
+                load_operand ( lhs, result );
+                emit_instruction ( mnemonic, CL, result_name );
+            }
+            store_result ( result, dst );
+            return;
+        }
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL: {
+            // Multiplication by some constants is cheaper as leaq and shifts, with the constant on either side
+            if ( instruction->op == OP_MUL && lhs.kind == IR_OPERAND_CONSTANT && rhs.kind != IR_OPERAND_CONSTANT )
+            {
+                lhs = rhs;
+                rhs = instruction->a;
+            }
+            if ( instruction->op == OP_MUL && rhs.kind == IR_OPERAND_CONSTANT && multiplies_in_place ( rhs.constant ) )
+            {
+                load_operand ( lhs, result );
+                emit_multiplication ( result_name, rhs.constant );
+                store_result ( result, dst );
+                return;
+            }
+            const char *mnemonic = instruction->op == OP_ADD ? "addq" : instruction->op == OP_SUB ? "subq" : "imulq";
+            int32_t lhs_register = operand_register ( lhs );
+            int32_t rhs_register = operand_register ( rhs );
+
+            // The right operand may be in the register of the result, when it dies here
+            if ( rhs_register == (int32_t) result && lhs_register != (int32_t) result )
+            {
+                if ( !is_direct ( lhs ) )
+                    load_operand ( lhs, REG_RAX );
+                const char *left = is_direct ( lhs ) ? operand_string ( lhs ) : RAX;
+                emit_instruction ( mnemonic, left, result_name );
+                // rhs - lhs is the negation of the result
+                if ( instruction->op == OP_SUB )
+                    NEGQ ( result_name );
+                return;
+            }
+
+            // leaq adds a register to another register, or to a constant, and writes any register
+            if ( instruction->op == OP_ADD && lhs_register != SPILLED && lhs_register != (int32_t) result
+                && ( rhs_register != SPILLED || ( rhs.kind == IR_OPERAND_CONSTANT && FITS_INT32(rhs.constant) ) ) )
+            {
+                if ( rhs_register != SPILLED )
+                    EMIT ( "leaq (%s, %s), %s", REGISTER_NAMES[lhs_register], REGISTER_NAMES[rhs_register], result_name );
+                else
+                    EMIT ( "leaq %ld(%s), %s", rhs.constant, REGISTER_NAMES[lhs_register], result_name );
+                store_result ( result, dst );
+                return;
+            }
+
+            // A spilled result can be updated in its slot, such as by x := x + 1
+            if ( locations[dst].reg == SPILLED && instruction->op != OP_MUL && lhs.kind == IR_OPERAND_VREG
+                && same_location ( locations[lhs.vreg], locations[dst] ) && is_direct ( rhs ) && !is_memory ( rhs ) )
+            {
+                const char *right = operand_string ( rhs );
+                emit_instruction ( mnemonic, right, frame_operand ( locations[dst].frame_offset ) );
+                return;
+            }
+
+            load_operand ( lhs, result );
+            if ( !is_direct ( rhs ) )
+                load_operand ( rhs, REG_RCX );
+            emit_instruction ( mnemonic, is_direct ( rhs ) ? operand_string ( rhs ) : RCX, result_name );
+            store_result ( result, dst );
+            return;
+        }
+
+        default: assert ( false && "Unknown binary operator" );
+    }
+}
+
+/* Returns the operand of the element of array at the constant index, or NULL if the displacement is too large */
+static const char* constant_element ( const symbol_t *array, ir_operand_t index )
+{
+    if ( index.kind != IR_OPERAND_CONSTANT || !FITS_INT32(index.constant) || !FITS_INT32(index.constant * 8) )
+        return NULL;
+    return global_operand ( array->name, index.constant * 8 );
+}
+
+/* Returns the operand of the element of array at a variable index. The address of the array is placed in RAX,
+ * and an index that is not in a register in RCX */
+static const char* indexed_element ( const symbol_t *array, ir_operand_t index )
+{
+    int32_t index_register = operand_register ( index );
+    if ( index_register == SPILLED )
+    {
+        load_operand ( index, REG_RCX );
+        index_register = REG_RCX;
+    }
+    EMIT ( "leaq %s, %s", global_operand ( array->name, 0 ), RAX );
+    return indexed_operand ( 0, RAX, REGISTER_NAMES[index_register] );
+}
+
+static void generate_load_element ( const ir_instruction_t *instruction )
+{
+    machine_register_t result = result_register ( instruction->dst );
+    const char *element = constant_element ( instruction->symbol, instruction->a );
+    if ( element == NULL )
+        element = indexed_element ( instruction->symbol, instruction->a );
+    MOVQ ( element, REGISTER_NAMES[result] );
+    store_result ( result, instruction->dst );
+}
+
+static void generate_store_element ( const ir_instruction_t *instruction )
+{
+    // The value is placed in RDX if it can not be stored as it is
+    ir_operand_t value = instruction->b;
+    if ( !is_direct ( value ) || is_memory ( value ) )
+    {
+        load_operand ( value, REG_RDX );
+        value = (ir_operand_t) { .kind = IR_OPERAND_VREG, .vreg = NO_VREG };
+    }
+
+    const char *element = constant_element ( instruction->symbol, instruction->a );
+    if ( element == NULL )
+        element = indexed_element ( instruction->symbol, instruction->a );
+    MOVQ ( value.vreg == NO_VREG && value.kind == IR_OPERAND_VREG ? RDX : operand_string ( value ), element );
+}
+
+static void generate_address ( const ir_instruction_t *instruction )
+{
+    machine_register_t result = result_register ( instruction->dst );
+    const char *element = constant_element ( instruction->symbol, instruction->a );
+    if ( element == NULL )
+        element = indexed_element ( instruction->symbol, instruction->a );
+    EMIT ( "leaq %s, %s", element, REGISTER_NAMES[result] );
+    store_result ( result, instruction->dst );
+}
+
+/* Returns the register holding the address in operand, loading it into RAX if it is not in one */
+static const char* pointer_register ( ir_operand_t pointer )
+{
+    if ( operand_register ( pointer ) == SPILLED )
+    {
+        load_operand ( pointer, REG_RAX );
+        return RAX;
+    }
+    return REGISTER_NAMES[operand_register ( pointer )];
+}
+
+static void generate_load_pointer ( const ir_instruction_t *instruction )
+{
+    machine_register_t result = result_register ( instruction->dst );
+    EMIT ( "movq (%s), %s", pointer_register ( instruction->a ), REGISTER_NAMES[result] );
+    store_result ( result, instruction->dst );
+}
+
+static void generate_store_pointer ( const ir_instruction_t *instruction )
+{
+    ir_operand_t value = instruction->b;
+    const char *pointer = pointer_register ( instruction->a );
+    if ( !is_direct ( value ) || is_memory ( value ) )
+    {
+        load_operand ( value, REG_RDX );
+        EMIT ( "movq %s, (%s)", RDX, pointer );
+    }
+    else
+        EMIT ( "movq %s, (%s)", operand_string ( value ), pointer );
+}
+
+/* Generates the call ending at the instruction at index in block, with its arguments in the PARAMs before it */
+static void generate_call ( const ir_block_t *block, uint32_t index, uint32_t position )
+{
+    const ir_instruction_t *instruction = &block->instructions[index];
+    uint32_t n_arguments = FUNC_PARAM_COUNT(instruction->symbol);
+    const ir_instruction_t *arguments = &block->instructions[index - n_arguments];
+
+    uint32_t saved = save_live_registers ( position );
+    uint32_t stack_count = n_arguments > NUM_REGISTER_PARAMS ? n_arguments - NUM_REGISTER_PARAMS : 0;
+    int64_t padding = emit_call_padding ( stack_count * 8 );
+
+    // Arguments after the sixth are pushed from right to left
+    for ( uint32_t i = n_arguments; i-- > NUM_REGISTER_PARAMS; )
+    {
+        if ( !is_direct ( arguments[i].a ) )
+        {
+            load_operand ( arguments[i].a, REG_RAX );
+            PUSHQ ( RAX );
+        }
+        else
+            PUSHQ ( operand_string ( arguments[i].a ) );
+    }
+
+    move_t moves[NUM_REGISTER_PARAMS];
+    uint32_t n_moves = 0;
+    for ( uint32_t i = 0; i < n_arguments && i < NUM_REGISTER_PARAMS; i++ )
+        moves[n_moves++] = operand_move ( arguments[i].a, (location_t) { .reg = ARGUMENT_REGISTERS[i] } );
+    parallel_move ( moves, n_moves );
+
+    CALL ( ".%s", instruction->symbol->name );
+    emit_stack_adjust ( -8 * (int64_t) stack_count - padding );
+
+    restore_live_registers ( saved );
+    if ( instruction->dst != NO_VREG && reads[instruction->dst] > 0 )
+        store_result ( REG_RAX, instruction->dst );
+}
+
+static void generate_print ( const ir_instruction_t *instruction, uint32_t position )
+{
+    uint32_t saved = save_live_registers ( position );
+    int64_t padding = emit_call_padding ( 0 );
+    switch ( instruction->opcode )
+    {
+        case IR_PRINT_NUMBER:
+            load_operand ( instruction->a, REG_RDI );
+            CALL ( "vsl_print_int" );
+            break;
+        case IR_PRINT_STRING:
+            EMIT ( "leaq string%zu(%s), %s", instruction->string_index, RIP, RDI );
+            EMIT ( "movq $string%zu_length, %s", instruction->string_index, RSI );
+            CALL ( "vsl_print_string" );
+            break;
+        case IR_PRINT_NEWLINE:
+            CALL ( "vsl_print_newline" );
+            break;
+        default: assert ( false && "Not a print instruction" );
+    }
+    emit_stack_adjust ( -padding );
+    restore_live_registers ( saved );
+}
+
+// The conditional jumps taken when a relation holds, and when it does not, after CMPQ ( RHS, LHS )
+#define JUMP_IF_TRUE ((const char *[]){ [OP_EQ] = "je", [OP_NE] = "jne", [OP_LT] = "jl", [OP_GT] = "jg" })
+#define JUMP_IF_FALSE ((const char *[]){ [OP_EQ] = "jne", [OP_NE] = "je", [OP_LT] = "jge", [OP_GT] = "jle" })
+// The relation that holds when the operands are swapped
+#define MIRRORED ((operator_t[]){ [OP_EQ] = OP_EQ, [OP_NE] = OP_NE, [OP_LT] = OP_GT, [OP_GT] = OP_LT })
+
+/* Generates a branch, leaving out any jump to next, the block generated right after */
+static void generate_branch ( const ir_instruction_t *instruction, uint32_t next )
+{
+    ir_operand_t lhs = instruction->a;
+    ir_operand_t rhs = instruction->b;
+    operator_t op = instruction->op;
+
+    // cmpq can not compare against an immediate, and only one of its operands may be in memory
+    if ( lhs.kind == IR_OPERAND_CONSTANT && rhs.kind == IR_OPERAND_VREG )
+    {
+        ir_operand_t swapped = lhs;
+        lhs = rhs;
+        rhs = swapped;
+        op = MIRRORED[op];
+    }
+    const char *left;
+    if ( lhs.kind == IR_OPERAND_CONSTANT || ( is_memory ( lhs ) && is_memory ( rhs ) ) )
+    {
+        load_operand ( lhs, REG_RAX );
+        left = RAX;
+    }
+    else
+        left = location_operand ( locations[lhs.vreg] );
+    if ( !is_direct ( rhs ) )
+        load_operand ( rhs, REG_RCX );
+    CMPQ ( is_direct ( rhs ) ? operand_string ( rhs ) : RCX, left );
+
+    uint32_t if_true = instruction->targets[0];
+    uint32_t if_false = instruction->targets[1];
+    if ( if_false == next )
+        JCC ( JUMP_IF_TRUE[op], block_labels[if_true] );
+    else if ( if_true == next )
+        JCC ( JUMP_IF_FALSE[op], block_labels[if_false] );
+    else
+    {
+        JCC ( JUMP_IF_TRUE[op], block_labels[if_true] );
+        JMP ( block_labels[if_false] );
+    }
+}
+
+/* Generates the instructions of a block. next is the block generated after it, or UINT32_MAX */
+static void generate_block ( uint32_t b, uint32_t next )
+{
+    const ir_block_t *block = &function->blocks[b];
+    for ( uint32_t i = 0; i < block->n_instructions; i++ )
+    {
+        const ir_instruction_t *instruction = &block->instructions[i];
+        uint32_t position = block_start[b] + 2 * i;
+
+        // Operations whose result is never read are left out. Division is kept, since it can fault,
+        // unless it is by a constant where it can not
+        bool unused = instruction->dst != NO_VREG && reads[instruction->dst] == 0;
+        bool may_fault = instruction->opcode == IR_BINARY && instruction->op == OP_DIV
+                      && ( instruction->b.kind != IR_OPERAND_CONSTANT || !divides_without_idivq ( instruction->b.constant ) );
+        switch ( instruction->opcode )
+        {
+            case IR_COPY:
+                if ( !unused )
+                    generate_copy ( instruction );
+                break;
+            case IR_NEG:
+                if ( !unused )
+                    generate_negation ( instruction );
+                break;
+            case IR_BINARY:
+                if ( !unused || may_fault )
+                    generate_binary ( instruction );
+                break;
+            case IR_LOAD:
+                if ( !unused )
+                {
+                    machine_register_t result = result_register ( instruction->dst );
+                    MOVQ ( global_operand ( instruction->symbol->name, 0 ), REGISTER_NAMES[result] );
+                    store_result ( result, instruction->dst );
+                }
+                break;
+            case IR_STORE:
+                if ( !is_direct ( instruction->a ) || is_memory ( instruction->a ) )
+                {
+                    load_operand ( instruction->a, REG_RAX );
+                    MOVQ ( RAX, global_operand ( instruction->symbol->name, 0 ) );
+                }
+                else
+                {
+                    const char *value = operand_string ( instruction->a );
+                    MOVQ ( value, global_operand ( instruction->symbol->name, 0 ) );
+                }
+                break;
+            case IR_LOAD_ELEMENT:
+                if ( !unused )
+                    generate_load_element ( instruction );
+                break;
+            case IR_STORE_ELEMENT:
+                generate_store_element ( instruction );
+                break;
+            case IR_ADDRESS:
+                if ( !unused )
+                    generate_address ( instruction );
+                break;
+            case IR_LOAD_POINTER:
+                if ( !unused )
+                    generate_load_pointer ( instruction );
+                break;
+            case IR_STORE_POINTER:
+                generate_store_pointer ( instruction );
+                break;
+            case IR_PARAM:
+                // Arguments are passed by the call after them
+                break;
+            case IR_CALL:
+                generate_call ( block, i, position + 1 );
+                break;
+            case IR_PRINT_NUMBER:
+            case IR_PRINT_STRING:
+            case IR_PRINT_NEWLINE:
+                generate_print ( instruction, position + 1 );
+                break;
+            case IR_JUMP:
+                if ( instruction->targets[0] != next )
+                    JMP ( block_labels[instruction->targets[0]] );
+                break;
+            case IR_BRANCH:
+                generate_branch ( instruction, next );
+                break;
+            case IR_RETURN:
+                load_operand ( instruction->a, REG_RAX );
+                generate_epilogue ( );
+                break;
+            case IR_PHI:
+                assert ( false && "Phis must be replaced by leave_ssa before code is generated" );
+        }
+    }
+}
+
+void generate_ir_function ( const ir_function_t *ir )
+{
+    function = ir;
+    locations = malloc ( function->n_vregs * sizeof(location_t) );
+    reads = malloc ( function->n_vregs * sizeof(uint32_t) );
+    find_reachable_blocks ( );
+    uint32_t n_slots = allocate_registers ( );
+
+    // Calls are made from a frame that is a multiple of 16 bytes, so they only need padding when there are temporaries
+    // on the stack. Below %rbp are the saved registers and the slots
+    if ( n_calls > 0 && ( __builtin_popcount ( used_registers & ~CALLER_SAVED_ALLOCATABLE ) + n_slots ) % 2 != 0 )
+        n_slots++;
+
+    LABEL ( ".%s", function->symbol->name );
+    // The call pushed the return address onto the aligned stack
+    emitter.stack_depth = 8;
+    PUSHQ ( RBP );
+    MOVQ ( RSP, RBP );
+
+    // Save the callee-saved registers that are used, and make room for the spilled virtual registers
+    for ( int r = 0; r < N_ALLOCATABLE_REGISTERS; r++ )
+        if ( used_registers & ~CALLER_SAVED_ALLOCATABLE & ( UINT32_C(1) << r ) )
+            PUSHQ ( REGISTER_NAMES[ALLOCATABLE_REGISTERS[r]] );
+    emit_stack_adjust ( n_slots * 8 );
+
+    // Move the parameters that are used from where they were passed to their locations
+    move_t moves[NUM_REGISTER_PARAMS];
+    uint32_t n_moves = 0;
+    for ( vreg_t v = 1; v <= function->n_parameters && v <= NUM_REGISTER_PARAMS; v++ )
+        if ( reads[v] > 0 )
+            moves[n_moves++] = (move_t) { .to = locations[v], .from = { .reg = ARGUMENT_REGISTERS[v - 1] } };
+    parallel_move ( moves, n_moves );
+    for ( vreg_t v = NUM_REGISTER_PARAMS + 1; v <= function->n_parameters; v++ )
+        if ( reads[v] > 0 && locations[v].reg != SPILLED )
+            MOVQ ( frame_operand ( 16 + ( v - 1 - NUM_REGISTER_PARAMS ) * 8 ), REGISTER_NAMES[locations[v].reg] );
+
+    for ( uint32_t r = 0; r < n_reachable; r++ )
+    {
+        uint32_t b = reachable[r];
+        if ( r > 0 )
+            emit_label ( block_labels[b] );
+        generate_block ( b, r + 1 < n_reachable ? reachable[r + 1] : UINT32_MAX );
+    }
+
+    free ( locations );
+    free ( reads );
+    free ( reachable );
+    free ( block_labels );
+    free ( block_start );
+    free ( block_end );
+    free ( caller_saved_intervals );
+    free ( calls );
+    calls = NULL;
+    calls_capacity = 0;
+}
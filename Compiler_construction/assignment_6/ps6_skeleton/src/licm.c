@@ -0,0 +1,223 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Loop-invariant code motion. Expressions in a loop whose operands are all defined outside of it compute the same
+// value every iteration, so they are moved to the preheader: the block entering the loop, which runs once before it.
+// In SSA form an operand is invariant exactly when the block defining it is outside the loop.
+// Loops are handled from the innermost out, so expressions can move out of several loops
+
+size_t hoisted_expressions = 0;
+
+// The function being optimized
+static ir_function_t *function;
+
+// The block every virtual register is defined in. Parameters and versions never assigned are defined in the entry
+static uint32_t *defined_in;
+
+// The loops of the function, and whether each of them makes calls
+static ir_loops_t loops;
+static bool *calls;
+// The blocks every loop l moves expressions from, from first_visited[l] to first_visited[l+1]
+static uint32_t *visited;
+static uint32_t *first_visited;
+// The position of every block in reverse postorder
+static uint32_t *rank;
+
+// The global variables every loop stores to directly, not in the loops inside it, ordered by variable and then loop
+typedef struct store
+{
+    symbol_t *symbol;
+    uint32_t loop;
+} store_t;
+static store_t *stores;
+static uint32_t n_stores;
+
+static bool is_invariant ( ir_operand_t operand, uint32_t loop )
+{
+    return operand.kind != IR_OPERAND_VREG || !IR_IN_LOOP(&loops, loop, defined_in[operand.vreg]);
+}
+
+static int compare_ranks ( const void *a, const void *b )
+{
+    uint32_t x = rank[*(const uint32_t *) a], y = rank[*(const uint32_t *) b];
+    return x < y ? -1 : x > y;
+}
+
+static int compare_stores ( const void *a, const void *b )
+{
+    const store_t *x = a, *y = b;
+    if ( x->symbol != y->symbol )
+        return (uintptr_t) x->symbol < (uintptr_t) y->symbol ? -1 : 1;
+    return x->loop < y->loop ? -1 : x->loop > y->loop;
+}
+
+/* Returns whether the loop, or a loop inside it, stores to the global variable */
+static bool stores_to ( uint32_t loop, symbol_t *symbol )
+{
+    // Finds the first store to the variable by the loops from the first inside this one
+    store_t key = { symbol, loops.loops[loop].first };
+    uint32_t low = 0, high = n_stores;
+    while ( low < high )
+    {
+        uint32_t middle = low + ( high - low ) / 2;
+        if ( compare_stores ( &stores[middle], &key ) < 0 )
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < n_stores && stores[low].symbol == symbol && stores[low].loop <= loop;
+}
+
+/* Returns whether instruction can be moved out of the loop to run before it, even where the loop would not have
+ * run it. Divisions that may fault, and loads from arrays at indices that may be out of bounds, only move from the
+ * header, which runs whenever the preheader does. Loads from global variables can only move if nothing in the loop
+ * may store to them */
+static bool can_hoist ( const ir_instruction_t *instruction, uint32_t block, uint32_t loop )
+{
+    switch ( instruction->opcode )
+    {
+        case IR_NEG:
+        case IR_ADDRESS:
+            break;
+        case IR_BINARY:
+            if ( instruction->op == OP_DIV && block != loops.loops[loop].header
+                 && ( instruction->b.kind != IR_OPERAND_CONSTANT
+                      || instruction->b.constant == 0 || instruction->b.constant == -1 ) )
+                return false;
+            break;
+        case IR_LOAD_ELEMENT:
+            if ( block != loops.loops[loop].header )
+                return false;
+            // Fallthrough
+        case IR_LOAD:
+            if ( calls[loop] || stores_to ( loop, instruction->symbol ) )
+                return false;
+            break;
+        default:
+            return false;
+    }
+    return is_invariant ( instruction->a, loop ) && is_invariant ( instruction->b, loop );
+}
+
+/* Moves the invariant expressions of the loop to its preheader. They are looked for in the blocks of the loop that
+ * are not in a loop inside it with a preheader of its own: what could move out of those loops already has, to their
+ * preheaders, which are blocks of this one. The rest depends on something in them, so it stays in this loop too */
+static void hoist_from_loop ( uint32_t loop )
+{
+    uint32_t preheader = loops.loops[loop].preheader;
+    if ( preheader == UINT32_MAX )
+        return;
+
+    // Blocks are visited in reverse postorder, so the operands of an expression are moved before it.
+    // The blocks of the loop itself already are, and those of loops without a preheader are put among them
+    uint32_t *blocks = &visited[first_visited[loop]];
+    uint32_t n_blocks = first_visited[loop + 1] - first_visited[loop];
+    if ( n_blocks > loops.loops[loop].n_blocks )
+        qsort ( blocks, n_blocks, sizeof(uint32_t), compare_ranks );
+
+    for ( uint32_t i = 0; i < n_blocks; i++ )
+    {
+        uint32_t b = blocks[i];
+        ir_block_t *block = &function->blocks[b];
+        uint32_t n_kept = 0;
+        for ( uint32_t j = 0; j < block->n_instructions; j++ )
+        {
+            ir_instruction_t instruction = block->instructions[j];
+            if ( !can_hoist ( &instruction, b, loop ) )
+            {
+                block->instructions[n_kept++] = instruction;
+                continue;
+            }
+
+            ir_insert ( function, preheader, function->blocks[preheader].n_instructions - 1, instruction );
+            defined_in[instruction.dst] = preheader;
+            hoisted_expressions++;
+        }
+        block->n_instructions = n_kept;
+    }
+}
+
+void hoist_loop_invariants ( ir_function_t *ir )
+{
+    function = ir;
+    ir_find_loops ( function, &loops );
+    if ( loops.n_loops > 0 )
+    {
+        defined_in = calloc ( function->n_vregs, sizeof(uint32_t) );
+        calls = calloc ( loops.n_loops, sizeof(bool) );
+        for ( uint32_t b = 0; b < function->n_blocks; b++ )
+        {
+            const ir_block_t *block = &function->blocks[b];
+            uint32_t loop = loops.innermost[b];
+            for ( uint32_t i = 0; i < block->n_instructions; i++ )
+            {
+                const ir_instruction_t *instruction = &block->instructions[i];
+                if ( instruction->dst != NO_VREG )
+                    defined_in[instruction->dst] = b;
+                if ( loop == UINT32_MAX )
+                    continue;
+                // Calls may store to any global variable, and stores to the others are listed
+                if ( instruction->opcode == IR_CALL )
+                    calls[loop] = true;
+                else if ( instruction->opcode == IR_STORE || instruction->opcode == IR_STORE_ELEMENT )
+                {
+                    stores = realloc ( stores, ( n_stores + 1 ) * sizeof(store_t) );
+                    stores[n_stores++] = (store_t) { instruction->symbol, loop };
+                }
+            }
+        }
+        if ( n_stores > 0 )
+            qsort ( stores, n_stores, sizeof(store_t), compare_stores );
+
+        // The loops inside a loop come before it, and those around it after.
+        // The blocks of a loop without a preheader are visited by the nearest loop around it with one
+        uint32_t *hoisted_to = malloc ( loops.n_loops * sizeof(uint32_t) );
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+            if ( calls[l] && loops.loops[l].parent != UINT32_MAX )
+                calls[loops.loops[l].parent] = true;
+        for ( uint32_t l = loops.n_loops; l-- > 0; )
+        {
+            uint32_t parent = loops.loops[l].parent;
+            hoisted_to[l] = loops.loops[l].preheader != UINT32_MAX || parent == UINT32_MAX ? l : hoisted_to[parent];
+        }
+        first_visited = calloc ( loops.n_loops + 1, sizeof(uint32_t) );
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+            first_visited[hoisted_to[l] + 1] += loops.loops[l].n_blocks;
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+            first_visited[l + 1] += first_visited[l];
+        visited = malloc ( first_visited[loops.n_loops] * sizeof(uint32_t) );
+        uint32_t *n_visited = calloc ( loops.n_loops, sizeof(uint32_t) );
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+        {
+            uint32_t to = hoisted_to[l];
+            memcpy ( &visited[first_visited[to] + n_visited[to]], loops.loops[l].blocks,
+                     loops.loops[l].n_blocks * sizeof(uint32_t) );
+            n_visited[to] += loops.loops[l].n_blocks;
+        }
+        free ( hoisted_to );
+        free ( n_visited );
+
+        ir_dominators_t dominators;
+        ir_compute_dominators ( function, &dominators );
+        rank = malloc ( function->n_blocks * sizeof(uint32_t) );
+        for ( uint32_t i = 0; i < function->n_blocks; i++ )
+            rank[dominators.order[i]] = i;
+        ir_destroy_dominators ( &dominators );
+
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+            hoist_from_loop ( l );
+        free ( rank );
+        free ( defined_in );
+        free ( calls );
+        free ( visited );
+        free ( first_visited );
+        free ( stores );
+        rank = NULL;
+        visited = first_visited = NULL;
+        stores = NULL;
+        n_stores = 0;
+    }
+
+    ir_destroy_loops ( &loops );
+    function = NULL;
+}
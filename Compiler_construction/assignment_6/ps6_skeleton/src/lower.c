@@ -0,0 +1,466 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Lowering of function bodies from the syntax tree to three-address code.
+// Operands are evaluated in the same order as generator.c evaluates them,
+// since calls can print and change global variables, which makes the order observable
+
+// The function being lowered, and the block instructions are appended to
+static ir_function_t *ir;
+static uint32_t current_block;
+static uint32_t loop_depth;
+
+// Blocks are made before they are generated, such as the end of an if statement.
+// Each block is numbered in the order it is started, and the blocks are sorted by that number once lowering is done
+static uint32_t *block_order;
+static size_t block_order_capacity; // Follows the capacity of the blocks of ir, which grows by doubling
+static uint32_t blocks_started;
+
+// The block after every while loop being lowered, with the innermost last
+static uint32_t *break_targets;
+static size_t break_targets_len;
+static size_t break_targets_capacity;
+
+// The results of subexpressions that are evaluated, but not yet used by their parent
+static ir_operand_t *operand_stack;
+static size_t operand_stack_len;
+static size_t operand_stack_capacity;
+
+static walk_stack_t expression_stack;
+static walk_stack_t statement_stack;
+
+/* Makes block the one instructions are appended to */
+static void start_block ( uint32_t block )
+{
+    current_block = block;
+    block_order[block] = blocks_started++;
+}
+
+static uint32_t new_block ( uint32_t depth )
+{
+    uint32_t block = ir_new_block ( ir, depth );
+    if ( block_order_capacity != ir->blocks_capacity )
+    {
+        block_order_capacity = ir->blocks_capacity;
+        block_order = realloc ( block_order, block_order_capacity * sizeof(uint32_t) );
+    }
+    return block;
+}
+
+static ir_instruction_t* append ( ir_instruction_t instruction )
+{
+    return ir_append ( ir, current_block, instruction );
+}
+
+/* Appends an instruction writing a new temporary, and returns the temporary as an operand */
+static ir_operand_t append_value ( ir_instruction_t instruction )
+{
+    instruction.dst = ir_new_vreg ( ir );
+    append ( instruction );
+    return IR_VREG(instruction.dst);
+}
+
+static void jump ( uint32_t target )
+{
+    append ( (ir_instruction_t) { .opcode = IR_JUMP, .targets = { target } } );
+}
+
+static void push_operand ( ir_operand_t operand )
+{
+    if ( operand_stack_len == operand_stack_capacity )
+    {
+        operand_stack_capacity = operand_stack_capacity * 2 + 64;
+        operand_stack = realloc ( operand_stack, operand_stack_capacity * sizeof(ir_operand_t) );
+    }
+    operand_stack[operand_stack_len++] = operand;
+}
+
+/* Returns the symbol of a variable, which must be a parameter, a local or a global variable */
+static symbol_t* variable_symbol ( node_id_t node )
+{
+    symbol_t *symbol = NODE_SYMBOL(node);
+    switch ( symbol->type )
+    {
+        case SYMBOL_GLOBAL_VAR:
+        case SYMBOL_LOCAL_VAR:
+        case SYMBOL_PARAMETER:
+            return symbol;
+        case SYMBOL_FUNCTION:
+            fprintf ( stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name );
+            exit(EXIT_FAILURE);
+        case SYMBOL_GLOBAL_ARRAY:
+            fprintf ( stderr, "error: symbol '%s' is an array, not a variable\n", symbol->name );
+            exit(EXIT_FAILURE);
+        default: assert ( false && "Unknown variable symbol type" );
+    }
+}
+
+/* Returns the symbol of the array in an ARRAY_INDEXING node, which must be a global array */
+static symbol_t* array_symbol ( node_id_t node )
+{
+    symbol_t *symbol = NODE_SYMBOL(CHILD(node, 0));
+    if ( symbol->type != SYMBOL_GLOBAL_ARRAY ) {
+        fprintf ( stderr, "error: symbol '%s' is not an array\n", symbol->name );
+        exit (EXIT_FAILURE);
+    }
+    return symbol;
+}
+
+/* Returns the function called by a FUNCTION_CALL node, after checking the number of arguments */
+static symbol_t* called_function ( node_id_t call )
+{
+    symbol_t *symbol = NODE_SYMBOL(CHILD(call, 0));
+    node_id_t argument_list = CHILD(call, 1);
+    if ( symbol->type != SYMBOL_FUNCTION ) {
+        fprintf ( stderr, "error: '%s' is not a function\n", symbol->name );
+        exit ( EXIT_FAILURE );
+    }
+    if ( FUNC_PARAM_COUNT( symbol ) != N_CHILDREN(argument_list) )
+    {
+        fprintf ( stderr, "error: function '%s' expects '%d' arguments, but '%u' were given\n",
+                  symbol->name, FUNC_PARAM_COUNT( symbol ), N_CHILDREN(argument_list) );
+        exit(EXIT_FAILURE);
+    }
+    return symbol;
+}
+
+/* Returns the number of operands of node that are evaluated before it */
+static uint32_t evaluated_children ( node_id_t node )
+{
+    switch ( NODE_TYPE(node) )
+    {
+        case EXPRESSION:     return N_CHILDREN(node);
+        case ARRAY_INDEXING: return 1;
+        case FUNCTION_CALL:  return N_CHILDREN(CHILD(node, 1));
+        default:             return 0;
+    }
+}
+
+/* Returns the operand of node evaluated as number i. Subtractions, divisions and shifts evaluate their right
+ * operand first, and the arguments of calls are evaluated from right to left */
+static node_id_t evaluated_child ( node_id_t node, uint32_t i )
+{
+    switch ( NODE_TYPE(node) )
+    {
+        case EXPRESSION: {
+            operator_t op = NODE_DATA(node).op;
+            bool left_first = N_CHILDREN(node) == 1 || op == OP_ADD || op == OP_MUL;
+            return CHILD(node, left_first ? i : 1 - i);
+        }
+        case ARRAY_INDEXING:
+            return CHILD(node, 1);
+        case FUNCTION_CALL: {
+            node_id_t argument_list = CHILD(node, 1);
+            return CHILD(argument_list, N_CHILDREN(argument_list) - 1 - i);
+        }
+        default: assert ( false && "Node has no evaluated children" );
+    }
+}
+
+/* Appends the instructions of node, once its operands are on the operand stack, and replaces them by its result */
+static void lower_node ( node_id_t node )
+{
+    uint32_t n_operands = evaluated_children ( node );
+    ir_operand_t *operands = &operand_stack[operand_stack_len - n_operands];
+    ir_operand_t result;
+
+    switch ( NODE_TYPE(node) )
+    {
+        case NUMBER_DATA:
+            result = IR_CONSTANT(NODE_DATA(node).number);
+            break;
+        case IDENTIFIER_DATA: {
+            symbol_t *symbol = variable_symbol ( node );
+            if ( symbol->type == SYMBOL_GLOBAL_VAR )
+                result = append_value ( (ir_instruction_t) { .opcode = IR_LOAD, .symbol = symbol } );
+            else
+                result = IR_VREG(VARIABLE_VREG(symbol));
+            break;
+        }
+        case ARRAY_INDEXING:
+            result = append_value ( (ir_instruction_t) {
+                .opcode = IR_LOAD_ELEMENT, .a = operands[0], .symbol = array_symbol ( node ) } );
+            break;
+        case EXPRESSION: {
+            if ( n_operands == 1 )
+            {
+                result = append_value ( (ir_instruction_t) { .opcode = IR_NEG, .a = operands[0] } );
+                break;
+            }
+            // The operand evaluated first is deepest on the stack
+            bool left_first = evaluated_child ( node, 0 ) == CHILD(node, 0);
+            result = append_value ( (ir_instruction_t) {
+                .opcode = IR_BINARY, .op = NODE_DATA(node).op,
+                .a = operands[left_first ? 0 : 1], .b = operands[left_first ? 1 : 0] } );
+            break;
+        }
+        case FUNCTION_CALL: {
+            symbol_t *function = called_function ( node );
+            // The last argument was evaluated first
+            for ( uint32_t i = 0; i < n_operands; i++ )
+                append ( (ir_instruction_t) { .opcode = IR_PARAM, .a = operands[n_operands - 1 - i] } );
+            result = append_value ( (ir_instruction_t) { .opcode = IR_CALL, .symbol = function } );
+            break;
+        }
+        default: assert ( false && "Unknown expression type" );
+    }
+
+    operand_stack_len -= n_operands;
+    push_operand ( result );
+}
+
+/* Appends the instructions evaluating expression, and returns the operand holding its value */
+static ir_operand_t lower_expression ( node_id_t expression )
+{
+    walk_stack_t *stack = &expression_stack;
+    walk_push ( stack, expression );
+
+    while ( stack->depth > 0 )
+    {
+        walk_frame_t *frame = WALK_TOP(stack);
+        node_id_t node = frame->node;
+        if ( frame->stage < evaluated_children ( node ) )
+        {
+            walk_push ( stack, evaluated_child ( node, frame->stage++ ) );
+            continue;
+        }
+        stack->depth--;
+        lower_node ( node );
+    }
+
+    return operand_stack[--operand_stack_len];
+}
+
+/* Assigns value to a parameter or local variable */
+static void assign_variable ( vreg_t variable, ir_operand_t value )
+{
+    // A temporary made by the last instruction is written to the variable directly instead
+    ir_block_t *block = &ir->blocks[current_block];
+    if ( value.kind == IR_OPERAND_VREG && value.vreg > ir->n_variables && block->n_instructions > 0
+        && block->instructions[block->n_instructions - 1].dst == value.vreg )
+    {
+        block->instructions[block->n_instructions - 1].dst = variable;
+        return;
+    }
+    append ( (ir_instruction_t) { .opcode = IR_COPY, .dst = variable, .a = value } );
+}
+
+static void lower_assignment_statement ( node_id_t statement )
+{
+    node_id_t dest = CHILD(statement, 0);
+    ir_operand_t value = lower_expression ( CHILD(statement, 1) );
+
+    if ( NODE_TYPE(dest) == IDENTIFIER_DATA )
+    {
+        symbol_t *symbol = variable_symbol ( dest );
+        if ( symbol->type == SYMBOL_GLOBAL_VAR )
+            append ( (ir_instruction_t) { .opcode = IR_STORE, .a = value, .symbol = symbol } );
+        else
+            assign_variable ( VARIABLE_VREG(symbol), value );
+    }
+    else
+    {
+        // The value is evaluated before the index
+        ir_operand_t index = lower_expression ( CHILD(dest, 1) );
+        append ( (ir_instruction_t) {
+            .opcode = IR_STORE_ELEMENT, .a = index, .b = value, .symbol = array_symbol ( dest ) } );
+    }
+}
+
+static void lower_print_statement ( node_id_t statement )
+{
+    node_id_t print_items = CHILD(statement, 0);
+    for ( uint32_t i = 0; i < N_CHILDREN(print_items); i++ )
+    {
+        node_id_t item = CHILD(print_items, i);
+        if ( NODE_TYPE(item) == STRING_LIST_REFERENCE )
+            append ( (ir_instruction_t) { .opcode = IR_PRINT_STRING, .string_index = NODE_DATA(item).string_index } );
+        else
+            append ( (ir_instruction_t) { .opcode = IR_PRINT_NUMBER, .a = lower_expression ( item ) } );
+    }
+    append ( (ir_instruction_t) { .opcode = IR_PRINT_NEWLINE } );
+}
+
+/* Ends the current block with a branch on relation. Both sides are evaluated from left to right.
+ * A relation folded to a NUMBER_DATA by simplify_tree becomes a jump */
+static void lower_relation ( node_id_t relation, uint32_t if_true, uint32_t if_false )
+{
+    if ( NODE_TYPE(relation) == NUMBER_DATA )
+    {
+        jump ( NODE_DATA(relation).number != 0 ? if_true : if_false );
+        return;
+    }
+
+    ir_operand_t lhs = lower_expression ( CHILD(relation, 0) );
+    ir_operand_t rhs = lower_expression ( CHILD(relation, 1) );
+    append ( (ir_instruction_t) {
+        .opcode = IR_BRANCH, .op = NODE_DATA(relation).op, .a = lhs, .b = rhs, .targets = { if_true, if_false } } );
+}
+
+/* Lowers an IF_STATEMENT node, called once for each stage, starting at 0.
+ * Returns the branch to lower before the next stage, or NO_NODE once the statement is done.
+ * first_block is kept between stages, and holds the first of the blocks made for the statement */
+static node_id_t lower_if_statement ( node_id_t statement, uint32_t stage, uint32_t *first_block )
+{
+    bool has_else = N_CHILDREN(statement) > 2;
+    if ( stage == 0 )
+    {
+        // The blocks are made one after the other: then, else if there is one, and the end
+        uint32_t then_block = new_block ( loop_depth );
+        uint32_t else_block = has_else ? new_block ( loop_depth ) : 0;
+        uint32_t end_block = new_block ( loop_depth );
+        lower_relation ( CHILD(statement, 0), then_block, has_else ? else_block : end_block );
+
+        *first_block = then_block;
+        start_block ( then_block );
+        return CHILD(statement, 1);
+    }
+
+    uint32_t end_block = *first_block + ( has_else ? 2 : 1 );
+    jump ( end_block );
+    if ( stage == 1 && has_else )
+    {
+        start_block ( *first_block + 1 );
+        return CHILD(statement, 2);
+    }
+
+    start_block ( end_block );
+    return NO_NODE;
+}
+
+/* Lowers a WHILE_STATEMENT node, called once for each stage, starting at 0.
+ * Returns the body to lower before the next stage, or NO_NODE once the statement is done.
+ * first_block is kept between stages, and holds the first of the blocks made for the statement */
+static node_id_t lower_while_statement ( node_id_t statement, uint32_t stage, uint32_t *first_block )
+{
+    if ( stage == 0 )
+    {
+        // The blocks are made one after the other: the test of the relation, the body, and the end
+        uint32_t test_block = new_block ( loop_depth + 1 );
+        uint32_t body_block = new_block ( loop_depth + 1 );
+        uint32_t end_block = new_block ( loop_depth );
+        *first_block = test_block;
+
+        if ( break_targets_len == break_targets_capacity )
+        {
+            break_targets_capacity = break_targets_capacity * 2 + 16;
+            break_targets = realloc ( break_targets, break_targets_capacity * sizeof(uint32_t) );
+        }
+        break_targets[break_targets_len++] = end_block;
+
+        jump ( test_block );
+        start_block ( test_block );
+        loop_depth++;
+        lower_relation ( CHILD(statement, 0), body_block, end_block );
+        start_block ( body_block );
+        return CHILD(statement, 1);
+    }
+
+    jump ( *first_block );
+    loop_depth--;
+    break_targets_len--;
+    start_block ( *first_block + 2 );
+    return NO_NODE;
+}
+
+/* Ends the current block with a jump or return, and starts a new block for any statements after it,
+ * which can never be reached */
+static void start_unreachable_block ( void )
+{
+    start_block ( new_block ( loop_depth ) );
+}
+
+/* Lowers the given statement node, and all sub-statements.
+ * Each node on the stack is revisited once the sub-statement it asked for has been lowered */
+static void lower_statement ( node_id_t node )
+{
+    walk_stack_t *stack = &statement_stack;
+    walk_push ( stack, node );
+
+    while ( stack->depth > 0 )
+    {
+        walk_frame_t *frame = WALK_TOP(stack);
+        node_id_t statement = frame->node;
+        uint32_t stage = frame->stage++;
+        node_id_t next = NO_NODE; // A sub-statement to lower before the node's next stage
+
+        switch ( NODE_TYPE(statement) )
+        {
+            case BLOCK: {
+                node_id_t statement_list = CHILD(statement, N_CHILDREN(statement)-1);
+                if ( stage < N_CHILDREN(statement_list) )
+                    next = CHILD(statement_list, stage);
+                break;
+            }
+            case ASSIGNMENT_STATEMENT:
+                lower_assignment_statement ( statement );
+                break;
+            case PRINT_STATEMENT:
+                lower_print_statement ( statement );
+                break;
+            case RETURN_STATEMENT:
+                append ( (ir_instruction_t) { .opcode = IR_RETURN, .a = lower_expression ( CHILD(statement, 0) ) } );
+                start_unreachable_block ( );
+                break;
+            case IF_STATEMENT:
+                next = lower_if_statement ( statement, stage, &frame->data );
+                break;
+            case WHILE_STATEMENT:
+                next = lower_while_statement ( statement, stage, &frame->data );
+                break;
+            case BREAK_STATEMENT:
+                jump ( break_targets[break_targets_len - 1] );
+                start_unreachable_block ( );
+                break;
+            case FUNCTION_CALL:
+                lower_expression ( statement );
+                // The result is not used
+                ir->blocks[current_block].instructions[ir->blocks[current_block].n_instructions - 1].dst = NO_VREG;
+                break;
+            default: assert( false && "Unknown statement type" );
+        }
+
+        if ( next != NO_NODE )
+            walk_push ( stack, next );
+        else
+            stack->depth--;
+    }
+}
+
+void lower_function ( symbol_t *function, ir_function_t *result )
+{
+    symbol_table_t *symtable = function->function_symtable;
+    ir = result;
+    *ir = (ir_function_t) {
+        .symbol = function,
+        .n_variables = symtable->n_symbols,
+        .n_parameters = FUNC_PARAM_COUNT(function),
+        .n_vregs = symtable->n_symbols + 1
+    };
+    blocks_started = 0;
+    loop_depth = 0;
+    start_block ( new_block ( 0 ) );
+
+    // Local variables start out as 0
+    for ( size_t i = 0; i < symtable->n_symbols; i++ )
+        if ( symtable->symbols[i]->type == SYMBOL_LOCAL_VAR )
+            append ( (ir_instruction_t) { .opcode = IR_COPY, .dst = VARIABLE_VREG(symtable->symbols[i]), .a = IR_CONSTANT(0) } );
+
+    lower_statement ( CHILD(function->node, 2) );
+
+    // In case the function didn't return, return 0 here
+    append ( (ir_instruction_t) { .opcode = IR_RETURN, .a = IR_CONSTANT(0) } );
+    // Put the blocks in the order they were started, so the code after a statement follows the statement
+    ir_renumber_blocks ( ir, block_order );
+
+    free ( block_order );
+    free ( break_targets );
+    free ( operand_stack );
+    block_order = NULL;
+    break_targets = NULL;
+    operand_stack = NULL;
+    block_order_capacity = break_targets_len = break_targets_capacity = operand_stack_len = operand_stack_capacity = 0;
+    walk_stack_destroy ( &expression_stack );
+    walk_stack_destroy ( &statement_stack );
+    ir = NULL;
+}
@@ -13,6 +13,13 @@ int yyerror ( const char *error )
     exit ( EXIT_FAILURE );
 }
 
+// Right-nested constructs, such as long else if chains and deeply parenthesized expressions, keep a state on the
+// parser stack for every level. The stack grows as needed, so allow it to grow far beyond bison's default of 10000
+#define YYMAXDEPTH 100000000
+
+// Wraps an operator_t as the data of an EXPRESSION or RELATION node
+#define OPERATOR(o) ((node_data_t) { .op = (o) })
+
 #define N0C(type,data) \
   node_create ( (type), (data), 0 )
 #define N1C(type,data,child0) \
@@ -43,7 +50,7 @@ program :
       global_list { root = $1; }
     ;
 global_list :
-      global { $$ = N1C ( LIST, NULL, $1 ); }
+      global { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | global_list global { $$ = append_to_list_node ( $1, $2 ); }
     ;
 global :
@@ -51,10 +58,10 @@ global :
     | global_declaration { $$ = $1; }
     ;
 global_declaration :
-      VAR global_variable_list { $$ = N1C ( GLOBAL_DECLARATION, NULL, $2 ); }
+      VAR global_variable_list { $$ = N1C ( GLOBAL_DECLARATION, NO_DATA, $2 ); }
     ;
 global_variable_list :
-      global_variable { $$ = N1C ( LIST, NULL, $1 ); }
+      global_variable { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | global_variable_list ',' global_variable { $$ = append_to_list_node ( $1, $3 ); }
     ;
 global_variable :
@@ -62,26 +69,26 @@ global_variable :
     | array_indexing { $$ = $1; }
     ;
 array_indexing:
-      identifier '[' expression ']' { $$ = N2C ( ARRAY_INDEXING, NULL, $1, $3 ); }
+      identifier '[' expression ']' { $$ = N2C ( ARRAY_INDEXING, NO_DATA, $1, $3 ); }
     ;
 variable_list :
-      identifier { $$ = N1C ( LIST, NULL, $1 ); }
+      identifier { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | variable_list ',' identifier { $$ = append_to_list_node ( $1, $3 ); }
     ;
 local_declaration :
       VAR variable_list { $$ = $2; }
     ;
 local_declaration_list :
-      local_declaration { $$ = N1C ( LIST, NULL, $1 ); }
+      local_declaration { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | local_declaration_list local_declaration { $$ = append_to_list_node($1, $2); }
     ;
 parameter_list :
-     /* epsilon */ { $$ = N0C ( LIST, NULL ); }
+     /* epsilon */ { $$ = N0C ( LIST, NO_DATA ); }
     | variable_list { $$ = $1; }
     ;
 function :
       FUNC identifier '(' parameter_list ')' statement
-        { $$ = N3C ( FUNCTION, NULL, $2, $4, $6 ); }
+        { $$ = N3C ( FUNCTION, NO_DATA, $2, $4, $6 ); }
     ;
 statement :
       assignment_statement { $$ = $1; }
@@ -95,27 +102,27 @@ statement :
     ;
 block :
       OPENBLOCK local_declaration_list statement_list CLOSEBLOCK
-        { $$ = N2C ( BLOCK, NULL, $2, $3 ); }
-    | OPENBLOCK statement_list CLOSEBLOCK { $$ = N1C ( BLOCK, NULL, $2 ); }
+        { $$ = N2C ( BLOCK, NO_DATA, $2, $3 ); }
+    | OPENBLOCK statement_list CLOSEBLOCK { $$ = N1C ( BLOCK, NO_DATA, $2 ); }
     ;
 statement_list :
-      statement { $$ = N1C ( LIST, NULL, $1 ); }
+      statement { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | statement_list statement { $$ = append_to_list_node ( $1, $2 ); }
     ;
 assignment_statement :
-      identifier ':' '=' expression { $$ = N2C ( ASSIGNMENT_STATEMENT, NULL, $1, $4 ); }
-    | array_indexing ':' '=' expression { $$ = N2C ( ASSIGNMENT_STATEMENT, NULL, $1, $4 ); }
+      identifier ':' '=' expression { $$ = N2C ( ASSIGNMENT_STATEMENT, NO_DATA, $1, $4 ); }
+    | array_indexing ':' '=' expression { $$ = N2C ( ASSIGNMENT_STATEMENT, NO_DATA, $1, $4 ); }
     ;
 return_statement :
       RETURN expression
-        { $$ = N1C ( RETURN_STATEMENT, NULL, $2 ); }
+        { $$ = N1C ( RETURN_STATEMENT, NO_DATA, $2 ); }
     ;
 print_statement :
       PRINT print_list
-        { $$ = N1C ( PRINT_STATEMENT, NULL, $2 ); }
+        { $$ = N1C ( PRINT_STATEMENT, NO_DATA, $2 ); }
     ;
 print_list :
-      print_item { $$ = N1C ( LIST, NULL, $1 ); }
+      print_item { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | print_list ',' print_item { $$ = append_to_list_node ( $1, $3 ); }
     ;
 print_item :
@@ -123,43 +130,43 @@ print_item :
     | string { $$ = $1; }
     ;
 break_statement :
-      BREAK { $$ = N0C ( BREAK_STATEMENT, NULL ); }
+      BREAK { $$ = N0C ( BREAK_STATEMENT, NO_DATA ); }
     ;
 if_statement :
       IF relation THEN statement
-        { $$ = N2C ( IF_STATEMENT, NULL, $2, $4 ); }
+        { $$ = N2C ( IF_STATEMENT, NO_DATA, $2, $4 ); }
     | IF relation THEN statement ELSE statement
-        { $$ = N3C ( IF_STATEMENT, NULL, $2, $4, $6 ); }
+        { $$ = N3C ( IF_STATEMENT, NO_DATA, $2, $4, $6 ); }
     ;
 while_statement :
       WHILE relation DO statement
-        { $$ = N2C ( WHILE_STATEMENT, NULL, $2, $4 ); }
+        { $$ = N2C ( WHILE_STATEMENT, NO_DATA, $2, $4 ); }
     ;
 relation:
       expression '=' expression
-        { $$ = N2C ( RELATION, "=", $1, $3 ); }
+        { $$ = N2C ( RELATION, OPERATOR(OP_EQ), $1, $3 ); }
     | expression '!' '=' expression
-        { $$ = N2C ( RELATION, "!=", $1, $4 ); }
+        { $$ = N2C ( RELATION, OPERATOR(OP_NE), $1, $4 ); }
     | expression '<' expression
-        { $$ = N2C ( RELATION, "<", $1, $3 ); }
+        { $$ = N2C ( RELATION, OPERATOR(OP_LT), $1, $3 ); }
     | expression '>' expression
-        { $$ = N2C ( RELATION, ">", $1, $3 ); }
+        { $$ = N2C ( RELATION, OPERATOR(OP_GT), $1, $3 ); }
     ;
 expression :
       expression '+' expression
-        { $$ = N2C ( EXPRESSION, "+", $1, $3 ); }
+        { $$ = N2C ( EXPRESSION, OPERATOR(OP_ADD), $1, $3 ); }
     | expression '-' expression
-        { $$ = N2C ( EXPRESSION, "-", $1, $3 ); }
+        { $$ = N2C ( EXPRESSION, OPERATOR(OP_SUB), $1, $3 ); }
     | expression '*' expression
-        { $$ = N2C ( EXPRESSION, "*", $1, $3 ); }
+        { $$ = N2C ( EXPRESSION, OPERATOR(OP_MUL), $1, $3 ); }
     | expression '/' expression
-        { $$ = N2C ( EXPRESSION, "/", $1, $3 ); }
+        { $$ = N2C ( EXPRESSION, OPERATOR(OP_DIV), $1, $3 ); }
     | expression '<' '<' expression
-        { $$ = N2C ( EXPRESSION, "<<", $1, $4 ); }
+        { $$ = N2C ( EXPRESSION, OPERATOR(OP_SHL), $1, $4 ); }
     | expression '>' '>' expression
-        { $$ = N2C ( EXPRESSION, ">>", $1, $4 ); }
+        { $$ = N2C ( EXPRESSION, OPERATOR(OP_SHR), $1, $4 ); }
     | '-' expression %prec UMINUS
-        { $$ = N1C ( EXPRESSION, "-", $2 ); }
+        { $$ = N1C ( EXPRESSION, OPERATOR(OP_NEG), $2 ); }
     | '(' expression ')' { $$ = $2; }
     | number { $$ = $1; }
     | identifier { $$ = $1; }
@@ -167,22 +174,27 @@ expression :
     | function_call { $$ = $1; }
     ;
 function_call :
-      identifier '(' argument_list ')' { $$ = N2C ( FUNCTION_CALL, NULL, $1, $3 ); }
+      identifier '(' argument_list ')' { $$ = N2C ( FUNCTION_CALL, NO_DATA, $1, $3 ); }
 argument_list :
       expression_list { $$ = $1; }
-    | /* epsilon */   { $$ = N0C ( LIST, NULL ); }
+    | /* epsilon */   { $$ = N0C ( LIST, NO_DATA ); }
     ;
 expression_list :
-      expression { $$ = N1C ( LIST, NULL, $1 ); }
+      expression { $$ = N1C ( LIST, NO_DATA, $1 ); }
     | expression_list ',' expression { $$ = append_to_list_node ( $1, $3 ); }
     ;
-// These final three perform memory allocation to keep extra data from yytext
-identifier: IDENTIFIER { $$ = N0C ( IDENTIFIER_DATA, strdup ( yytext ) ); }
+// These final three keep extra data from yytext.
+// Identifiers and strings are interned, so every spelling is only stored once
+identifier: IDENTIFIER
+      {
+        $$ = N0C ( IDENTIFIER_DATA, ((node_data_t) { .string = intern_string ( yytext ) }) );
+      }
 number: NUMBER
       {
-        int64_t *value = malloc ( sizeof ( int64_t ) );
-        *value = strtol ( yytext, NULL, 10 );
-        $$ = N0C ( NUMBER_DATA, value );
+        $$ = N0C ( NUMBER_DATA, ((node_data_t) { .number = strtol ( yytext, NULL, 10 ) }) );
+      }
+string: STRING
+      {
+        $$ = N0C ( STRING_DATA, ((node_data_t) { .string = intern_string ( yytext ) }) );
       }
-string: STRING { $$ = N0C ( STRING_DATA, strdup ( yytext ) ); }
 %%
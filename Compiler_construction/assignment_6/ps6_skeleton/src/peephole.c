@@ -0,0 +1,525 @@
+#include "emitter.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Peephole optimization of the emitted assembly, before it is written out.
+// Both code generators emit formatted text through the macros of emit.h, so the buffer is the one place all
+// instructions pass through. It is split into records once, with the mnemonic as a number and the operands and
+// labels found, and the rules only look at those records. A table of rules is tried at every line, each looking
+// at a small window of the lines from there on. A rule that changes something may form a new pattern with the
+// lines before it, so the rules are tried again from a little further back.
+// Compiler made labels that are no longer jumped to are removed as well, which lets dead code after them go too
+
+// A piece of a line, such as an operand of an instruction
+typedef struct span
+{
+    const char *text;
+    uint32_t length;
+} span_t;
+
+typedef enum
+{
+    LINE_INSTRUCTION, // A tab, a mnemonic, and at most two operands
+    LINE_LABEL,       // A name followed by a colon
+    LINE_OTHER,       // Directives and data, which no rule looks past
+    LINE_REMOVED
+} line_kind_t;
+
+// The mnemonics the rules know about, so they compare numbers rather than text. The rest are MN_OTHER
+typedef enum
+{
+    MN_OTHER, MN_MOVQ, MN_LEAQ, MN_PUSHQ, MN_POPQ, MN_ADDQ, MN_SUBQ, MN_CMPQ, MN_TESTQ, MN_IMULQ, MN_NEGQ,
+    MN_CALL, MN_RET, MN_JMP, MN_JE, MN_JNE, MN_JL, MN_JGE, MN_JG, MN_JLE, N_MNEMONICS
+} mnemonic_t;
+
+static const char *MNEMONIC_NAMES[N_MNEMONICS] = {
+    [MN_MOVQ] = "movq", [MN_LEAQ] = "leaq", [MN_PUSHQ] = "pushq", [MN_POPQ] = "popq", [MN_ADDQ] = "addq",
+    [MN_SUBQ] = "subq", [MN_CMPQ] = "cmpq", [MN_TESTQ] = "testq", [MN_IMULQ] = "imulq", [MN_NEGQ] = "negq",
+    [MN_CALL] = "call", [MN_RET] = "ret", [MN_JMP] = "jmp", [MN_JE] = "je", [MN_JNE] = "jne", [MN_JL] = "jl",
+    [MN_JGE] = "jge", [MN_JG] = "jg", [MN_JLE] = "jle" };
+
+// The conditional jump with the opposite condition, and MN_OTHER for the other mnemonics
+static const mnemonic_t INVERTED_JUMPS[N_MNEMONICS] = {
+    [MN_JE] = MN_JNE, [MN_JNE] = MN_JE, [MN_JL] = MN_JGE, [MN_JGE] = MN_JL, [MN_JG] = MN_JLE, [MN_JLE] = MN_JG };
+
+// How instructions use the flags. Calls and returns leave them undefined, so they count as writing them
+typedef enum { FLAGS_UNKNOWN, FLAGS_KEPT, FLAGS_WRITTEN, FLAGS_READ } flags_use_t;
+static const flags_use_t FLAGS_USE[N_MNEMONICS] = {
+    [MN_MOVQ] = FLAGS_KEPT, [MN_LEAQ] = FLAGS_KEPT, [MN_PUSHQ] = FLAGS_KEPT, [MN_POPQ] = FLAGS_KEPT,
+    [MN_ADDQ] = FLAGS_WRITTEN, [MN_SUBQ] = FLAGS_WRITTEN, [MN_CMPQ] = FLAGS_WRITTEN, [MN_TESTQ] = FLAGS_WRITTEN,
+    [MN_IMULQ] = FLAGS_WRITTEN, [MN_NEGQ] = FLAGS_WRITTEN, [MN_CALL] = FLAGS_WRITTEN, [MN_RET] = FLAGS_WRITTEN,
+    [MN_JE] = FLAGS_READ, [MN_JNE] = FLAGS_READ, [MN_JL] = FLAGS_READ, [MN_JGE] = FLAGS_READ,
+    [MN_JG] = FLAGS_READ, [MN_JLE] = FLAGS_READ };
+
+// Lines are kept small, since there is one for every line of a large program
+typedef struct line
+{
+    const char *text;        // Without its newline. Points into the buffer, or to text a rule rewrote the line to
+    uint32_t length;
+    uint32_t next;           // The lines that are not removed form a list, so the rules can skip the others quickly
+    uint32_t previous;
+    int32_t label;           // The number of a .L label, or of the .L label an instruction refers to, otherwise -1
+    uint16_t operands[2][2]; // For instructions, the offset in text and length of the source and destination.
+                             // Missing operands have length 0
+    uint8_t kind;            // A line_kind_t
+    uint8_t mnemonic;        // A mnemonic_t, for instructions
+    bool replaced;           // Whether the line owns its text
+} line_t;
+
+// The lines of the buffer, in order. The list of lines that are not removed ends at NO_LINE
+static line_t *lines;
+static uint32_t n_lines;
+#define NO_LINE UINT32_MAX
+
+// For every compiler made label, the line it is on, and the number of instructions referring to it
+static uint32_t *label_lines;
+static uint32_t *label_references;
+
+// The most lines any rule looks at
+#define MAX_WINDOW 8
+
+static span_t operand ( const line_t *line, int index )
+{
+    return (span_t) { line->text + line->operands[index][0], line->operands[index][1] };
+}
+
+static bool span_equal ( span_t a, span_t b )
+{
+    return a.length == b.length && memcmp ( a.text, b.text, a.length ) == 0;
+}
+
+static bool is_register ( span_t operand )
+{
+    return operand.length > 0 && operand.text[0] == '%';
+}
+
+static bool is_immediate ( span_t operand )
+{
+    return operand.length > 0 && operand.text[0] == '$';
+}
+
+static bool is_memory ( span_t operand )
+{
+    return operand.length > 0 && !is_register ( operand ) && !is_immediate ( operand );
+}
+
+/* Returns whether the address of the memory operand is computed with the register, as its base or index */
+static bool addresses_with ( span_t memory, span_t reg )
+{
+    if ( !is_memory ( memory ) || !is_register ( reg ) )
+        return false;
+    for ( uint32_t i = 0; i + reg.length <= memory.length; i++ )
+    {
+        // %r1 is not a part of %r10
+        uint32_t end = i + reg.length;
+        if ( memcmp ( &memory.text[i], reg.text, reg.length ) == 0
+             && ( end == memory.length || !isalnum ( (unsigned char) memory.text[end] ) ) )
+            return true;
+    }
+    return false;
+}
+
+static bool is_instruction ( const line_t *line, mnemonic_t mnemonic )
+{
+    return line->kind == LINE_INSTRUCTION && line->mnemonic == mnemonic;
+}
+
+// The names of the mnemonics packed into integers, which are quicker to compare than strings
+static uint64_t packed_names[N_MNEMONICS];
+
+/* Packs up to 8 characters into an integer, one per byte */
+static uint64_t pack ( const char *text, uint32_t length )
+{
+    uint64_t packed = 0;
+    for ( uint32_t i = 0; i < length; i++ )
+        packed |= (uint64_t) (uint8_t) text[i] << ( 8 * i );
+    return packed;
+}
+
+/* Returns the number of the compiler made label .L<number> in span, or -1 if it is not one */
+static int32_t label_number ( span_t span )
+{
+    if ( span.length < 3 || span.text[0] != '.' || span.text[1] != 'L' )
+        return -1;
+    size_t number = 0;
+    for ( uint32_t i = 2; i < span.length; i++ )
+    {
+        if ( span.text[i] < '0' || span.text[i] > '9' || number >= emitter.n_labels )
+            return -1;
+        number = number * 10 + ( span.text[i] - '0' );
+    }
+    return number < emitter.n_labels ? (int32_t) number : -1;
+}
+
+/* Splits an instruction into its mnemonic and operands, and finds the label it refers to.
+ * Operands are separated by the last comma outside of parentheses,
+ * since memory operands such as (%rax, %rcx, 8) have commas of their own */
+static void parse_instruction ( line_t *line )
+{
+    const char *text = line->text;
+    uint32_t length = line->length;
+    uint32_t end = 1;
+    while ( end < length && text[end] != ' ' )
+        end++;
+
+    line->mnemonic = MN_OTHER;
+    if ( end - 1 <= sizeof(uint64_t) )
+    {
+        uint64_t packed = pack ( &text[1], end - 1 );
+        for ( mnemonic_t mnemonic = MN_OTHER + 1; mnemonic < N_MNEMONICS && line->mnemonic == MN_OTHER; mnemonic++ )
+            if ( packed_names[mnemonic] == packed )
+                line->mnemonic = mnemonic;
+    }
+
+    line->operands[0][0] = line->operands[1][0] = length;
+    line->operands[0][1] = line->operands[1][1] = 0;
+    if ( end < length )
+    {
+        uint32_t start = end + 1;
+        uint32_t comma = length;
+        int depth = 0;
+        for ( uint32_t i = start; i < length; i++ )
+        {
+            if ( text[i] == '(' )
+                depth++;
+            else if ( text[i] == ')' )
+                depth--;
+            else if ( text[i] == ',' && depth == 0 )
+                comma = i;
+        }
+        line->operands[0][0] = start;
+        line->operands[0][1] = comma - start;
+        if ( comma < length )
+        {
+            line->operands[1][0] = comma + 2;
+            line->operands[1][1] = length - comma - 2;
+        }
+    }
+    line->label = label_number ( operand ( line, 0 ) );
+}
+
+/* Splits the buffer of the emitter into lines, and counts the references to every label */
+static void split_lines ( void )
+{
+    const char *end = emitter.buffer + emitter.length;
+    n_lines = end[-1] != '\n';
+    for ( const char *p = emitter.buffer; ( p = memchr ( p, '\n', end - p ) ) != NULL; p++ )
+        n_lines++;
+    lines = malloc ( n_lines * sizeof(line_t) );
+    label_lines = malloc ( emitter.n_labels * sizeof(uint32_t) );
+    label_references = calloc ( emitter.n_labels, sizeof(uint32_t) );
+
+    const char *position = emitter.buffer;
+    for ( uint32_t i = 0; i < n_lines; i++ )
+    {
+        const char *newline = memchr ( position, '\n', end - position );
+        if ( newline == NULL )
+            newline = end;
+        line_t *line = &lines[i];
+        *line = (line_t) { .text = position, .length = newline - position, .label = -1,
+                           .next = i + 1 < n_lines ? i + 1 : NO_LINE, .previous = i > 0 ? i - 1 : NO_LINE };
+
+        // Operands are found by 16 bit offsets, so the rules leave longer lines alone
+        if ( line->length > 1 && line->length <= UINT16_MAX && position[0] == '\t' && position[1] != '.' )
+        {
+            line->kind = LINE_INSTRUCTION;
+            parse_instruction ( line );
+            if ( line->label >= 0 )
+                label_references[line->label]++;
+        }
+        else if ( line->length > 1 && position[line->length - 1] == ':' )
+        {
+            line->kind = LINE_LABEL;
+            line->label = label_number ( (span_t) { position, line->length - 1 } );
+            if ( line->label >= 0 )
+                label_lines[line->label] = i;
+        }
+        else
+            line->kind = LINE_OTHER;
+
+        position = newline + 1;
+    }
+}
+
+/* Takes a line out of the list of lines that are not removed */
+static void unlink_line ( uint32_t index )
+{
+    line_t *line = &lines[index];
+    if ( line->previous != NO_LINE )
+        lines[line->previous].next = line->next;
+    if ( line->next != NO_LINE )
+        lines[line->next].previous = line->previous;
+    line->kind = LINE_REMOVED;
+}
+
+/* Drops a reference to a label. A compiler made label nothing refers to any more is removed */
+static void drop_reference ( int32_t label )
+{
+    if ( label >= 0 && --label_references[label] == 0 )
+        unlink_line ( label_lines[label] );
+}
+
+/* Removes a line, counting it if it is an instruction */
+static void remove_line ( uint32_t index )
+{
+    line_t *line = &lines[index];
+    if ( line->kind == LINE_INSTRUCTION )
+    {
+        emitter.n_removed++;
+        drop_reference ( line->label );
+    }
+    unlink_line ( index );
+}
+
+/* Rewrites an instruction to "\t<mnemonic> <source>, <destination>", or "\t<mnemonic> <source>"
+ * if the destination is empty. The reference to a label moves along with the operands */
+static void replace_instruction ( uint32_t index, mnemonic_t mnemonic, span_t source, span_t destination )
+{
+    line_t *line = &lines[index];
+    const char *name = MNEMONIC_NAMES[mnemonic];
+    size_t length = 1 + strlen ( name ) + 1 + source.length + ( destination.length > 0 ? 2 + destination.length : 0 );
+    char *text = malloc ( length + 1 );
+    snprintf ( text, length + 1, "\t%s %.*s%s%.*s", name, (int) source.length, source.text,
+               destination.length > 0 ? ", " : "", (int) destination.length, destination.text );
+
+    if ( line->replaced )
+        free ( (char *) line->text );
+    int32_t label = line->label;
+    line->text = text;
+    line->length = length;
+    line->replaced = true;
+    parse_instruction ( line );
+    if ( line->label >= 0 )
+        label_references[line->label]++;
+    drop_reference ( label );
+}
+
+/* The rules. Each is given the indices of the lines in its window, which are not removed, and their number.
+ * It returns whether it changed anything */
+
+// jmp L followed by L, perhaps among other labels: the jump goes where the code would go anyway
+static bool jump_to_next ( const uint32_t *window, uint32_t n )
+{
+    const line_t *jump = &lines[window[0]];
+    if ( !is_instruction ( jump, MN_JMP ) )
+        return false;
+    for ( uint32_t i = 1; i < n && lines[window[i]].kind == LINE_LABEL; i++ )
+    {
+        const line_t *label = &lines[window[i]];
+        if ( span_equal ( (span_t) { label->text, label->length - 1 }, operand ( jump, 0 ) ) )
+        {
+            remove_line ( window[0] );
+            return true;
+        }
+    }
+    return false;
+}
+
+// Instructions after jmp or ret, before any label, are never run
+static bool unreachable ( const uint32_t *window, uint32_t n )
+{
+    const line_t *jump = &lines[window[0]];
+    if ( n < 2 || !( is_instruction ( jump, MN_JMP ) || is_instruction ( jump, MN_RET ) )
+         || lines[window[1]].kind != LINE_INSTRUCTION )
+        return false;
+    remove_line ( window[1] );
+    return true;
+}
+
+// jcc L1; jmp L2; L1: jumps over the jump when the condition holds, which is the same as jumping to L2 when it does not
+static bool branch_over_jump ( const uint32_t *window, uint32_t n )
+{
+    if ( n < 3 )
+        return false;
+    const line_t *branch = &lines[window[0]], *jump = &lines[window[1]], *label = &lines[window[2]];
+    if ( branch->kind != LINE_INSTRUCTION || INVERTED_JUMPS[branch->mnemonic] == MN_OTHER
+         || !is_instruction ( jump, MN_JMP ) || label->kind != LINE_LABEL
+         || branch->label < 0 || branch->label != label->label )
+        return false;
+    replace_instruction ( window[0], INVERTED_JUMPS[branch->mnemonic], operand ( jump, 0 ), operand ( jump, 1 ) );
+    remove_line ( window[1] );
+    return true;
+}
+
+// pushq A; popq B moves A to B through the stack.
+// Both move %rsp, so operands addressed with it are left alone
+static bool push_pop ( const uint32_t *window, uint32_t n )
+{
+    if ( n < 2 )
+        return false;
+    const line_t *push = &lines[window[0]], *pop = &lines[window[1]];
+    const span_t stack_pointer = { "%rsp", 4 };
+    if ( !is_instruction ( push, MN_PUSHQ ) || !is_instruction ( pop, MN_POPQ )
+         || ( is_memory ( operand ( push, 0 ) ) && is_memory ( operand ( pop, 0 ) ) )
+         || addresses_with ( operand ( push, 0 ), stack_pointer )
+         || addresses_with ( operand ( pop, 0 ), stack_pointer ) )
+        return false;
+    if ( !span_equal ( operand ( push, 0 ), operand ( pop, 0 ) ) )
+        replace_instruction ( window[0], MN_MOVQ, operand ( push, 0 ), operand ( pop, 0 ) );
+    else
+        remove_line ( window[0] );
+    remove_line ( window[1] );
+    return true;
+}
+
+// movq A, A does nothing
+static bool move_to_itself ( const uint32_t *window, uint32_t n )
+{
+    const line_t *move = &lines[window[0]];
+    if ( !is_instruction ( move, MN_MOVQ ) || !span_equal ( operand ( move, 0 ), operand ( move, 1 ) ) )
+        return false;
+    remove_line ( window[0] );
+    return true;
+}
+
+// movq A, B; movq B, A moves back what is there already, such as a value stored to the stack and reloaded.
+// That is not so if writing the register B moves the memory A, as in movq (%rax), %rax; movq %rax, (%rax).
+// movq A, M; movq M, B can move A straight to B instead, when M is memory. The first move only writes memory,
+// so the registers addressing M are the same in both
+static bool move_back ( const uint32_t *window, uint32_t n )
+{
+    if ( n < 2 )
+        return false;
+    const line_t *first = &lines[window[0]], *second = &lines[window[1]];
+    if ( !is_instruction ( first, MN_MOVQ ) || !is_instruction ( second, MN_MOVQ )
+         || !span_equal ( operand ( first, 1 ), operand ( second, 0 ) ) )
+        return false;
+    if ( span_equal ( operand ( first, 0 ), operand ( second, 1 ) )
+         && !addresses_with ( operand ( first, 0 ), operand ( first, 1 ) ) )
+    {
+        remove_line ( window[1] );
+        return true;
+    }
+    if ( is_memory ( operand ( first, 1 ) ) && !is_memory ( operand ( first, 0 ) )
+         && is_register ( operand ( second, 1 ) ) )
+    {
+        replace_instruction ( window[1], MN_MOVQ, operand ( first, 0 ), operand ( second, 1 ) );
+        return true;
+    }
+    return false;
+}
+
+// Adding or subtracting 0 only sets the flags, which is useless if they are written again before they are read
+static bool add_zero ( const uint32_t *window, uint32_t n )
+{
+    const line_t *add = &lines[window[0]];
+    span_t amount = operand ( add, 0 );
+    if ( !( is_instruction ( add, MN_ADDQ ) || is_instruction ( add, MN_SUBQ ) )
+         || amount.length != 2 || memcmp ( amount.text, "$0", 2 ) != 0 )
+        return false;
+    for ( uint32_t i = 1; i < n && lines[window[i]].kind == LINE_INSTRUCTION; i++ )
+    {
+        flags_use_t use = FLAGS_USE[lines[window[i]].mnemonic];
+        if ( use == FLAGS_WRITTEN )
+        {
+            remove_line ( window[0] );
+            return true;
+        }
+        if ( use != FLAGS_KEPT )
+            return false;
+    }
+    return false;
+}
+
+typedef bool ( *rule_t ) ( const uint32_t *window, uint32_t n );
+
+// The rules, tried in this order at every line
+static const rule_t RULES[] = {
+    jump_to_next, branch_over_jump, unreachable, push_pop, move_to_itself, move_back, add_zero };
+#define N_RULES ( sizeof(RULES) / sizeof(RULES[0]) )
+
+/* Returns the first line that is not removed */
+static uint32_t first_line ( void )
+{
+    for ( uint32_t i = 0; i < n_lines; i++ )
+        if ( lines[i].kind != LINE_REMOVED )
+            return i;
+    return NO_LINE;
+}
+
+/* Fills window with the lines that are not removed, starting at first. Returns how many there are */
+static uint32_t fill_window ( uint32_t first, uint32_t *window )
+{
+    uint32_t n = 0;
+    for ( uint32_t i = first; i != NO_LINE && n < MAX_WINDOW; i = lines[i].next )
+        window[n++] = i;
+    return n;
+}
+
+/* Writes the lines that are left into a new buffer, which replaces the one of the emitter */
+static void join_lines ( void )
+{
+    size_t capacity = emitter.capacity, length = 0;
+    char *buffer = malloc ( capacity );
+    for ( uint32_t i = 0; i < n_lines; i++ )
+    {
+        line_t *line = &lines[i];
+        if ( line->kind != LINE_REMOVED )
+        {
+            // Rewritten lines may be longer than the ones they replace
+            if ( length + line->length + 1 > capacity )
+            {
+                capacity *= 2;
+                buffer = realloc ( buffer, capacity );
+            }
+            memcpy ( &buffer[length], line->text, line->length );
+            length += line->length;
+            buffer[length++] = '\n';
+        }
+        if ( line->replaced )
+            free ( (char *) line->text );
+    }
+    free ( emitter.buffer );
+    emitter.buffer = buffer;
+    emitter.length = length;
+    emitter.capacity = capacity;
+}
+
+void peephole_optimize ( void )
+{
+    if ( emitter.length == 0 )
+        return;
+    for ( mnemonic_t mnemonic = MN_OTHER + 1; mnemonic < N_MNEMONICS; mnemonic++ )
+        packed_names[mnemonic] = pack ( MNEMONIC_NAMES[mnemonic], strlen ( MNEMONIC_NAMES[mnemonic] ) );
+    split_lines ( );
+
+    // Labels are only kept while something jumps to them
+    for ( uint32_t i = 0; i < n_lines; i++ )
+        if ( lines[i].kind == LINE_LABEL && lines[i].label >= 0 && label_references[lines[i].label] == 0 )
+            unlink_line ( i );
+
+    uint32_t window[MAX_WINDOW];
+    uint32_t i = first_line ( );
+    while ( i != NO_LINE )
+    {
+        uint32_t n = fill_window ( i, window );
+        bool changed = false;
+        for ( size_t r = 0; r < N_RULES && !changed; r++ )
+            changed = RULES[r] ( window, n );
+        if ( !changed )
+        {
+            i = lines[i].next;
+            continue;
+        }
+
+        // The change may complete a pattern starting on one of the lines before.
+        // The line itself may be gone, but its previous line is still in the list
+        uint32_t back = lines[i].kind == LINE_REMOVED ? lines[i].previous : i;
+        for ( uint32_t steps = 1; steps < MAX_WINDOW - 1 && back != NO_LINE && lines[back].previous != NO_LINE; steps++ )
+            back = lines[back].previous;
+        i = back != NO_LINE ? back : first_line ( );
+    }
+
+    join_lines ( );
+    free ( lines );
+    free ( label_lines );
+    free ( label_references );
+    lines = NULL;
+    n_lines = 0;
+}
@@ -0,0 +1,144 @@
+#include "regalloc.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+// Register sets are bitmasks, so there can be at most 32 registers
+#define MAX_REGISTERS 32
+
+static int compare_start ( const void *a, const void *b )
+{
+    const live_interval_t *lhs = a, *rhs = b;
+    if ( lhs->start != rhs->start )
+        return lhs->start < rhs->start ? -1 : 1;
+    // qsort is not stable, so break ties to keep the allocation the same on every platform
+    return lhs->id < rhs->id ? -1 : lhs->id > rhs->id;
+}
+
+uint32_t linear_scan ( live_interval_t *intervals, size_t n_intervals, uint32_t n_registers, uint32_t caller_saved )
+{
+    assert ( n_registers <= MAX_REGISTERS );
+    // qsort must not be given the NULL of a function without variables
+    if ( n_intervals == 0 )
+        return 0;
+    qsort ( intervals, n_intervals, sizeof(live_interval_t), compare_start );
+
+    // The intervals currently holding a register, sorted by increasing end
+    live_interval_t *active[MAX_REGISTERS];
+    size_t n_active = 0;
+
+    uint32_t free_registers = n_registers == MAX_REGISTERS ? UINT32_MAX : (UINT32_C(1) << n_registers) - 1;
+    uint32_t used_registers = 0;
+
+    for ( size_t i = 0; i < n_intervals; i++ )
+    {
+        live_interval_t *current = &intervals[i];
+
+        // Intervals that ended before this one starts give their registers back
+        size_t expired = 0;
+        while ( expired < n_active && active[expired]->end < current->start )
+            free_registers |= UINT32_C(1) << active[expired++]->location;
+        n_active -= expired;
+        for ( size_t j = 0; j < n_active; j++ )
+            active[j] = active[j + expired];
+
+        if ( free_registers == 0 )
+        {
+            // Spill whichever of the active intervals and this one ends last,
+            // since that frees a register for the longest time
+            if ( n_active == 0 || active[n_active - 1]->end <= current->end )
+            {
+                current->location = SPILLED;
+                continue;
+            }
+            live_interval_t *last = active[--n_active];
+            current->location = last->location;
+            last->location = SPILLED;
+        }
+        else
+        {
+            // Values live across a call prefer registers the callee preserves, so no saving is needed at the call.
+            // Other values prefer registers the caller may clobber, which need no saving in the prologue
+            uint32_t preferred = free_registers & ( current->calls > 0 ? ~caller_saved : caller_saved );
+            uint32_t chosen = __builtin_ctz ( preferred != 0 ? preferred : free_registers );
+
+            // A push and a pop at every call costs more than a memory operand at every use
+            if ( ( caller_saved & ( UINT32_C(1) << chosen ) ) && (uint64_t) current->calls * 2 > current->uses )
+            {
+                current->location = SPILLED;
+                continue;
+            }
+            current->location = chosen;
+            free_registers &= ~(UINT32_C(1) << current->location);
+        }
+        used_registers |= UINT32_C(1) << current->location;
+
+        // Insert the interval into the active list, keeping it sorted by end
+        size_t j = n_active++;
+        while ( j > 0 && active[j - 1]->end > current->end )
+        {
+            active[j] = active[j - 1];
+            j--;
+        }
+        active[j] = current;
+    }
+
+    return used_registers;
+}
+
+/* Moves the interval at index down the heap of active intervals, which keeps the one ending first on top */
+static void sift_down ( live_interval_t **heap, size_t n, size_t index )
+{
+    for ( ;; )
+    {
+        size_t smallest = index;
+        for ( size_t child = 2 * index + 1; child <= 2 * index + 2 && child < n; child++ )
+            if ( heap[child]->end < heap[smallest]->end )
+                smallest = child;
+        if ( smallest == index )
+            return;
+        live_interval_t *swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+uint32_t allocate_slots ( live_interval_t *intervals, size_t n_intervals )
+{
+    // Functions may have many more spilled values than there are registers,
+    // so the active intervals are kept in a heap, and the slots they free on a stack
+    live_interval_t **active = malloc ( n_intervals * sizeof(live_interval_t *) );
+    int32_t *free_slots = malloc ( n_intervals * sizeof(int32_t) );
+    size_t n_active = 0, n_free = 0;
+    uint32_t n_slots = 0;
+
+    for ( size_t i = 0; i < n_intervals; i++ )
+    {
+        live_interval_t *current = &intervals[i];
+        assert ( i == 0 || intervals[i - 1].start <= current->start );
+
+        // Intervals that ended before this one starts give their slots back
+        while ( n_active > 0 && active[0]->end < current->start )
+        {
+            free_slots[n_free++] = active[0]->location;
+            active[0] = active[--n_active];
+            sift_down ( active, n_active, 0 );
+        }
+        current->location = n_free > 0 ? free_slots[--n_free] : (int32_t) n_slots++;
+
+        size_t j = n_active++;
+        while ( j > 0 && active[( j - 1 ) / 2]->end > current->end )
+        {
+            active[j] = active[( j - 1 ) / 2];
+            j = ( j - 1 ) / 2;
+        }
+        active[j] = current;
+    }
+
+    free ( active );
+    free ( free_slots );
+    return n_slots;
+}
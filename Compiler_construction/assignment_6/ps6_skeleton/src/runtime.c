@@ -0,0 +1,363 @@
+#include "vslc.h"
+
+// This header defines a bunch of macros we can use to emit assembly to stdout
+#include "emit.h"
+
+// The runtime library of VSL programs, emitted along with every program, since they are assembled from one file.
+// Print statements append to a large output buffer instead of calling printf, which parses its format string and
+// locks stdout for every item. The buffer is written with write when it is full, and once main is done.
+// Like stdout, it is also written after every line when it goes to a terminal, so output shows up as it is made.
+// All routines only use caller saved registers, and are called like any other function:
+//   vsl_init            finds out whether stdout is a terminal, before anything is printed
+//   vsl_print_int       prints the integer in %rdi
+//   vsl_print_string    prints the %rsi bytes at %rdi
+//   vsl_print_newline   prints '\n'
+//   vsl_flush           writes out the buffer
+// Freestanding programs do not use the C library at all, and make system calls of Linux directly instead.
+// For them, the runtime library also has the entry point _start, and the routines main uses in place of the C library:
+//   vsl_parse_int       returns the integer the decimal string at %rdi starts with, like strtol
+//   vsl_exit            exits the process with the code in %rdi
+
+// Bytes in the output buffer
+#define OUTPUT_SIZE 65536
+bool freestanding = false;
+
+// The numbers of the Linux system calls that are used, and the ioctl request isatty makes
+#define SYS_WRITE 1
+#define SYS_IOCTL 16
+#define SYS_EXIT_GROUP 231
+#define TCGETS 0x5401
+
+// Room an integer needs in the buffer: a sign, and the 24 bytes its at most 19 digits are copied with
+#define INTEGER_ROOM 32
+
+/* Writes %rsi bytes at %rdi to stdout, calling write until all are written or it fails */
+static void generate_write ( void )
+{
+    label_t loop = new_label ( );
+    label_t done = new_label ( );
+
+    LABEL ( "vsl_write" );
+    emitter.stack_depth = 8;
+    PUSHQ ( RBX );
+    PUSHQ ( R12 );
+    int64_t padding = emit_call_padding ( 0 );
+    MOVQ ( RDI, RBX );
+    MOVQ ( RSI, R12 );
+    emit_label ( loop );
+    EMIT ( "testq %s, %s", R12, R12 );
+    JCC ( "jle", done );
+    EMIT ( "movl $1, %%edi" );
+    MOVQ ( RBX, RSI );
+    MOVQ ( R12, RDX );
+    if ( freestanding )
+    {
+        EMIT ( "movl $%d, %%eax", SYS_WRITE );
+        EMIT ( "syscall" );
+    }
+    else
+        CALL ( "write" );
+    // Nothing more can be done if writing fails, so the rest is dropped
+    EMIT ( "testq %s, %s", RAX, RAX );
+    JCC ( "jle", done );
+    ADDQ ( RAX, RBX );
+    SUBQ ( RAX, R12 );
+    JMP ( loop );
+    emit_label ( done );
+    emit_stack_adjust ( -padding );
+    POPQ ( R12 );
+    POPQ ( RBX );
+    RET;
+}
+
+static void generate_flush ( void )
+{
+    LABEL ( "vsl_flush" );
+    EMIT ( "leaq vsl_output(%s), %s", RIP, RDI );
+    EMIT ( "movq vsl_output_length(%s), %s", RIP, RSI );
+    EMIT ( "movq $0, vsl_output_length(%s)", RIP );
+    EMIT ( "jmp vsl_write" );
+}
+
+/* Flushes the buffer if it has less than room bytes left, leaving the used length in RCX.
+ * The register saved, unless it is NULL, is kept across the flush */
+static void generate_make_room ( int64_t room, const char *saved )
+{
+    label_t enough = new_label ( );
+    emitter.stack_depth = 8;
+    EMIT ( "movq vsl_output_length(%s), %s", RIP, RCX );
+    EMIT ( "cmpq $%ld, %s", OUTPUT_SIZE - room, RCX );
+    JCC ( "jbe", enough );
+    if ( saved )
+        PUSHQ ( saved );
+    int64_t padding = emit_call_padding ( 0 );
+    CALL ( "vsl_flush" );
+    emit_stack_adjust ( -padding );
+    if ( saved )
+        POPQ ( saved );
+    EMIT ( "xorl %%ecx, %%ecx" );
+    emit_label ( enough );
+}
+
+/* Formats the integer in %rdi without dividing. The digits are made two at a time, from the remainder after
+ * dividing by 100 with a multiply-high, looked up in a table of the pairs "00" to "99". They are written backwards
+ * into the red zone below %rsp, and then copied to the buffer with three 8-byte moves, whatever their number */
+static void generate_print_int ( void )
+{
+    label_t pairs = new_label ( );
+    label_t last = new_label ( );
+
+    LABEL ( "vsl_print_int" );
+    generate_make_room ( INTEGER_ROOM, RDI );
+    EMIT ( "leaq vsl_output(%s), %s", RIP, RSI );
+    ADDQ ( RCX, RSI );
+
+    // The magnitude, as unsigned, so INT64_MIN is 2^63. The '-' is always written, and only kept if it is needed
+    MOVQ ( RDI, RAX );
+    NEGQ ( RAX );
+    EMIT ( "cmovsq %s, %s", RDI, RAX );
+    EMIT ( "movb $'-', (%s)", RSI );
+    EMIT ( "shrq $63, %s", RDI );
+    ADDQ ( RDI, RSI );
+
+    // R8 is the first digit written so far, and R9 is the end of the digits
+    EMIT ( "leaq -8(%s), %s", RSP, R8 );
+    MOVQ ( R8, R9 );
+    EMIT ( "leaq vsl_digit_pairs(%s), %s", RIP, R10 );
+    // n / 100 is the high half of (n / 4) * 0x28F5C28F5C28F5C3, shifted right by 2
+    EMIT ( "movabsq $0x28F5C28F5C28F5C3, %s", RCX );
+    emit_label ( pairs );
+    EMIT ( "cmpq $100, %s", RAX );
+    JCC ( "jb", last );
+    MOVQ ( RAX, RDI );
+    EMIT ( "shrq $2, %s", RAX );
+    EMIT ( "mulq %s", RCX );
+    EMIT ( "shrq $2, %s", RDX );
+    EMIT ( "imulq $100, %s, %s", RDX, RAX );
+    SUBQ ( RAX, RDI );
+    EMIT ( "movzwl (%s, %s, 2), %%eax", R10, RDI );
+    SUBQ ( "$2", R8 );
+    EMIT ( "movw %%ax, (%s)", R8 );
+    MOVQ ( RDX, RAX );
+    JMP ( pairs );
+
+    // The last one or two digits. A single digit is written as a pair with a leading '0', which is then skipped
+    emit_label ( last );
+    EMIT ( "movzwl (%s, %s, 2), %%edx", R10, RAX );
+    SUBQ ( "$2", R8 );
+    EMIT ( "movw %%dx, (%s)", R8 );
+    EMIT ( "cmpq $10, %s", RAX );
+    EMIT ( "adcq $0, %s", R8 );
+
+    for ( int offset = 0; offset < 24; offset += 8 )
+    {
+        EMIT ( "movq %d(%s), %s", offset, R8, RAX );
+        EMIT ( "movq %s, %d(%s)", RAX, offset, RSI );
+    }
+    SUBQ ( R8, R9 );
+    ADDQ ( R9, RSI );
+    EMIT ( "leaq vsl_output(%s), %s", RIP, RAX );
+    SUBQ ( RAX, RSI );
+    EMIT ( "movq %s, vsl_output_length(%s)", RSI, RIP );
+    RET;
+}
+
+static void generate_print_string ( void )
+{
+    label_t copy = new_label ( );
+
+    LABEL ( "vsl_print_string" );
+    // A flush is only needed if the string does not fit, and strings longer than the buffer are written directly
+    emitter.stack_depth = 8;
+    EMIT ( "movq vsl_output_length(%s), %s", RIP, RCX );
+    EMIT ( "leaq (%s, %s), %s", RCX, RSI, RAX );
+    EMIT ( "cmpq $%d, %s", OUTPUT_SIZE, RAX );
+    JCC ( "jbe", copy );
+    PUSHQ ( RDI );
+    PUSHQ ( RSI );
+    int64_t padding = emit_call_padding ( 0 );
+    CALL ( "vsl_flush" );
+    emit_stack_adjust ( -padding );
+    POPQ ( RSI );
+    POPQ ( RDI );
+    EMIT ( "xorl %%ecx, %%ecx" );
+    EMIT ( "cmpq $%d, %s", OUTPUT_SIZE, RSI );
+    JCC ( "jbe", copy );
+    EMIT ( "jmp vsl_write" );
+
+    emit_label ( copy );
+    EMIT ( "leaq vsl_output(%s), %s", RIP, RAX );
+    EMIT ( "leaq (%s, %s), %s", RAX, RCX, RDX );
+    ADDQ ( RSI, RCX );
+    EMIT ( "movq %s, vsl_output_length(%s)", RCX, RIP );
+    MOVQ ( RSI, RCX );
+    MOVQ ( RDI, RSI );
+    MOVQ ( RDX, RDI );
+    EMIT ( "rep movsb" );
+    RET;
+}
+
+static void generate_print_newline ( void )
+{
+    LABEL ( "vsl_print_newline" );
+    generate_make_room ( 1, NULL );
+    EMIT ( "leaq vsl_output(%s), %s", RIP, RAX );
+    EMIT ( "movb $'\\n', (%s, %s)", RAX, RCX );
+    EMIT ( "incq %s", RCX );
+    EMIT ( "movq %s, vsl_output_length(%s)", RCX, RIP );
+    EMIT ( "cmpl $0, vsl_line_buffered(%s)", RIP );
+    EMIT ( "jne vsl_flush" );
+    RET;
+}
+
+static void generate_init ( void )
+{
+    LABEL ( "vsl_init" );
+    if ( freestanding )
+    {
+        // What isatty does: stdout is a terminal if it has terminal settings, which are read into the red zone
+        EMIT ( "movl $%d, %%eax", SYS_IOCTL );
+        EMIT ( "movl $1, %%edi" );
+        EMIT ( "movl $%d, %%esi", TCGETS );
+        EMIT ( "leaq -64(%s), %s", RSP, RDX );
+        EMIT ( "syscall" );
+        EMIT ( "testq %s, %s", RAX, RAX );
+        EMIT ( "sete %%al" );
+        EMIT ( "movzbl %%al, %%eax" );
+        EMIT ( "movl %%eax, vsl_line_buffered(%s)", RIP );
+        RET;
+        return;
+    }
+    emitter.stack_depth = 8;
+    int64_t padding = emit_call_padding ( 0 );
+    EMIT ( "movl $1, %%edi" );
+    CALL ( "isatty" );
+    EMIT ( "movl %%eax, vsl_line_buffered(%s)", RIP );
+    emit_stack_adjust ( -padding );
+    RET;
+}
+
+/* Calls main with argc and argv, as the C library would. The stack is aligned to 16 bytes at _start,
+ * where the kernel has put argc, followed by the pointers of argv */
+static void generate_start ( void )
+{
+    LABEL ( "_start" );
+    emitter.stack_depth = 0;
+    EMIT ( "xorl %%ebp, %%ebp" ); // Marks the outermost frame
+    EMIT ( "movq (%s), %s", RSP, RDI );
+    EMIT ( "leaq 8(%s), %s", RSP, RSI );
+    CALL ( "main" );
+    EMIT ( "hlt" ); // main never returns
+}
+
+/* Skips leading white space and reads an optional sign, followed by decimal digits, up to the first other character.
+ * Like strtol, numbers that do not fit in 64 bits saturate to the largest or smallest one */
+static void generate_parse_int ( void )
+{
+    label_t space = new_label ( );
+    label_t skip = new_label ( );
+    label_t sign = new_label ( );
+    label_t digits = new_label ( );
+    label_t next = new_label ( );
+    label_t overflow = new_label ( );
+    label_t done = new_label ( );
+    label_t in_range = new_label ( );
+
+    LABEL ( "vsl_parse_int" );
+    emit_label ( space );
+    EMIT ( "movzbl (%s), %%edx", RDI );
+    EMIT ( "cmpl $' ', %%edx" );
+    JCC ( "je", skip );
+    EMIT ( "leal -9(%%rdx), %%eax" ); // '\t' to '\r'
+    EMIT ( "cmpl $4, %%eax" );
+    JCC ( "ja", sign );
+    emit_label ( skip );
+    EMIT ( "incq %s", RDI );
+    JMP ( space );
+
+    // RCX is 1 if the number is negative. A sign is skipped by adding whether there was one to the pointer.
+    // R8 becomes 1 if the number does not fit
+    emit_label ( sign );
+    EMIT ( "xorl %%eax, %%eax" );
+    EMIT ( "xorl %%ecx, %%ecx" );
+    EMIT ( "xorl %%r8d, %%r8d" );
+    EMIT ( "cmpl $'-', %%edx" );
+    EMIT ( "sete %%cl" );
+    EMIT ( "cmpl $'+', %%edx" );
+    EMIT ( "sete %%dl" );
+    EMIT ( "orb %%cl, %%dl" );
+    EMIT ( "movzbl %%dl, %%edx" );
+    ADDQ ( RDX, RDI );
+
+    // The value is kept negative, since the smallest number has no positive counterpart
+    emit_label ( digits );
+    EMIT ( "movzbl (%s), %%edx", RDI );
+    EMIT ( "subl $'0', %%edx" );
+    EMIT ( "cmpl $9, %%edx" );
+    JCC ( "ja", done );
+    EMIT ( "imulq $10, %s, %s", RAX, RAX );
+    JCC ( "jo", overflow );
+    SUBQ ( RDX, RAX ); // value * 10 - digit
+    JCC ( "jo", overflow );
+    emit_label ( next );
+    EMIT ( "incq %s", RDI );
+    JMP ( digits );
+    emit_label ( overflow );
+    EMIT ( "movl $1, %%r8d" );
+    JMP ( next );
+
+    // Negating the smallest number overflows as well, which only matters if it was not negative
+    emit_label ( done );
+    MOVQ ( RAX, RDX );
+    NEGQ ( RDX );
+    EMIT ( "seto %%r9b" );
+    EMIT ( "orb %%r9b, %%r8b" );
+    EMIT ( "testl %%ecx, %%ecx" );
+    EMIT ( "cmoveq %s, %s", RDX, RAX );
+    EMIT ( "testb %%r8b, %%r8b" );
+    JCC ( "je", in_range );
+    EMIT ( "movabsq $0x7FFFFFFFFFFFFFFF, %s", RAX );
+    ADDQ ( RCX, RAX ); // The largest number plus one wraps around to the smallest
+    emit_label ( in_range );
+    RET;
+}
+
+static void generate_exit ( void )
+{
+    LABEL ( "vsl_exit" );
+    EMIT ( "movl $%d, %%eax", SYS_EXIT_GROUP );
+    EMIT ( "syscall" );
+}
+
+void generate_runtime ( void )
+{
+    DIRECTIVE ( ".section %s", ASM_STRING_SECTION );
+    char digit_pairs[201];
+    for ( int i = 0; i < 100; i++ )
+    {
+        digit_pairs[2 * i] = '0' + i / 10;
+        digit_pairs[2 * i + 1] = '0' + i % 10;
+    }
+    digit_pairs[200] = '\0';
+    DIRECTIVE ( "vsl_digit_pairs: .ascii \"%s\"", digit_pairs );
+
+    DIRECTIVE ( ".section %s", ASM_BSS_SECTION );
+    DIRECTIVE ( ".align 8" );
+    DIRECTIVE ( "vsl_output_length: \t.zero 8" );
+    DIRECTIVE ( "vsl_line_buffered: \t.zero 8" );
+    DIRECTIVE ( "vsl_output: \t.zero %d", OUTPUT_SIZE );
+
+    DIRECTIVE ( ".text" );
+    generate_init ( );
+    generate_print_int ( );
+    generate_print_string ( );
+    generate_print_newline ( );
+    generate_flush ( );
+    generate_write ( );
+    if ( freestanding )
+    {
+        generate_start ( );
+        generate_parse_int ( );
+        generate_exit ( );
+    }
+}
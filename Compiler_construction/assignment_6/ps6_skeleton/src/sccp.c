@@ -0,0 +1,405 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Sparse conditional constant propagation, as described by Wegman and Zadeck.
+// Every virtual register starts out unknown, and is only lowered to a constant or to varying.
+// Blocks are only visited once an edge leading to them is found to be taken, so values coming from branches that
+// are never taken do not stop a phi from being constant, and branches on constants only take one way
+
+typedef enum { VALUE_UNKNOWN, VALUE_CONSTANT, VALUE_VARYING } value_kind_t;
+
+typedef struct value
+{
+    value_kind_t kind;
+    int64_t constant;
+} value_t;
+
+// An instruction reading a virtual register
+typedef struct { uint32_t block, index; } use_t;
+
+// The function being optimized
+static ir_function_t *function;
+
+static value_t *values;
+static bool *block_taken;
+static bool (*edge_taken)[2];  // Whether each of the targets of the terminator of every block is taken
+
+// The uses of every virtual register, from uses[first_use[v]] to uses[first_use[v+1]]
+static use_t *uses;
+static uint32_t *first_use;
+
+// The edges found to be taken, as a block and the index of the target, and the virtual registers whose value
+// was lowered, that have not been visited yet
+static uint32_t (*edge_list)[2];
+static size_t n_listed_edges;
+static vreg_t *vreg_list;
+static size_t n_listed_vregs;
+static size_t vreg_list_capacity;
+
+/* Builds the lists of uses */
+static void find_uses ( void )
+{
+    first_use = calloc ( function->n_vregs + 1, sizeof(uint32_t) );
+    // Counted in the first pass, and recorded in the second
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        uint32_t *filled = pass == 0 ? NULL : calloc ( function->n_vregs, sizeof(uint32_t) );
+        for ( uint32_t b = 0; b < function->n_blocks; b++ )
+        {
+            const ir_block_t *block = &function->blocks[b];
+            for ( uint32_t i = 0; i < block->n_instructions; i++ )
+            {
+                const ir_instruction_t *instruction = &block->instructions[i];
+                bool is_phi = instruction->opcode == IR_PHI;
+                uint32_t n_operands = is_phi ? instruction->n_arguments : 2;
+                for ( uint32_t o = 0; o < n_operands; o++ )
+                {
+                    ir_operand_t operand = is_phi ? instruction->arguments[o].value
+                                                  : o == 0 ? instruction->a : instruction->b;
+                    if ( operand.kind != IR_OPERAND_VREG )
+                        continue;
+                    if ( pass == 0 )
+                        first_use[operand.vreg + 1]++;
+                    else
+                        uses[first_use[operand.vreg] + filled[operand.vreg]++] = (use_t) { b, i };
+                }
+            }
+        }
+
+        if ( pass == 0 )
+        {
+            for ( vreg_t v = 0; v < function->n_vregs; v++ )
+                first_use[v + 1] += first_use[v];
+            uses = malloc ( ( first_use[function->n_vregs] + 1 ) * sizeof(use_t) );
+        }
+        free ( filled );
+    }
+}
+
+static value_t operand_value ( ir_operand_t operand )
+{
+    if ( operand.kind == IR_OPERAND_CONSTANT )
+        return (value_t) { VALUE_CONSTANT, operand.constant };
+    return values[operand.vreg];
+}
+
+/* Returns the greatest value below both a and b */
+static value_t meet ( value_t a, value_t b )
+{
+    if ( a.kind == VALUE_UNKNOWN )
+        return b;
+    if ( b.kind == VALUE_UNKNOWN )
+        return a;
+    if ( a.kind == VALUE_CONSTANT && b.kind == VALUE_CONSTANT && a.constant == b.constant )
+        return a;
+    return (value_t) { VALUE_VARYING };
+}
+
+/* Lowers the value of vreg, and lists it to have its uses visited again if it changed */
+static void set_value ( vreg_t vreg, value_t value )
+{
+    value_t old = values[vreg];
+    if ( old.kind == value.kind && ( old.kind != VALUE_CONSTANT || old.constant == value.constant ) )
+        return;
+    // Values only move down, since every value is the meet of what was found so far
+    assert ( old.kind < value.kind || ( old.kind == VALUE_CONSTANT && value.kind == VALUE_VARYING ) );
+    values[vreg] = value;
+
+    if ( n_listed_vregs == vreg_list_capacity )
+    {
+        vreg_list_capacity = vreg_list_capacity * 2 + 64;
+        vreg_list = realloc ( vreg_list, vreg_list_capacity * sizeof(vreg_t) );
+    }
+    vreg_list[n_listed_vregs++] = vreg;
+}
+
+/* Marks target t of the terminator of block as taken */
+static void take_edge ( uint32_t block, uint32_t t )
+{
+    if ( edge_taken[block][t] )
+        return;
+    edge_taken[block][t] = true;
+    edge_list[n_listed_edges][0] = block;
+    edge_list[n_listed_edges++][1] = t;
+}
+
+/* Returns whether the edge from predecessor to block is taken */
+static bool is_edge_taken ( uint32_t predecessor, uint32_t block )
+{
+    const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[predecessor]);
+    for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        if ( last->targets[t] == block && edge_taken[predecessor][t] )
+            return true;
+    return false;
+}
+
+/* Finds the value of the instruction at index in block from its operands, or which way it goes */
+static void visit_instruction ( uint32_t block, uint32_t index )
+{
+    const ir_instruction_t *instruction = &function->blocks[block].instructions[index];
+    value_t a = instruction->a.kind == IR_OPERAND_NONE ? (value_t) { VALUE_VARYING } : operand_value ( instruction->a );
+    value_t b = instruction->b.kind == IR_OPERAND_NONE ? (value_t) { VALUE_VARYING } : operand_value ( instruction->b );
+
+    switch ( instruction->opcode )
+    {
+        case IR_PHI: {
+            // Only the values coming along taken edges count
+            value_t value = { VALUE_UNKNOWN };
+            for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+                if ( is_edge_taken ( instruction->arguments[j].block, block ) )
+                    value = meet ( value, operand_value ( instruction->arguments[j].value ) );
+            set_value ( instruction->dst, value );
+            break;
+        }
+        case IR_COPY:
+            set_value ( instruction->dst, a );
+            break;
+        case IR_NEG:
+            if ( a.kind == VALUE_CONSTANT )
+                set_value ( instruction->dst, (value_t) { VALUE_CONSTANT, (int64_t) ( 0 - (uint64_t) a.constant ) } );
+            else if ( a.kind == VALUE_VARYING )
+                set_value ( instruction->dst, a );
+            break;
+        case IR_BINARY: {
+            int64_t result;
+            if ( a.kind == VALUE_VARYING || b.kind == VALUE_VARYING )
+                set_value ( instruction->dst, (value_t) { VALUE_VARYING } );
+            else if ( a.kind == VALUE_CONSTANT && b.kind == VALUE_CONSTANT )
+            {
+                if ( ir_fold_binary ( instruction->op, a.constant, b.constant, &result ) )
+                    set_value ( instruction->dst, (value_t) { VALUE_CONSTANT, result } );
+                else
+                    set_value ( instruction->dst, (value_t) { VALUE_VARYING } );
+            }
+            break;
+        }
+        case IR_LOAD:
+        case IR_LOAD_ELEMENT:
+        case IR_ADDRESS:
+        case IR_LOAD_POINTER:
+        case IR_CALL:
+            if ( instruction->dst != NO_VREG )
+                set_value ( instruction->dst, (value_t) { VALUE_VARYING } );
+            break;
+        case IR_JUMP:
+            take_edge ( block, 0 );
+            break;
+        case IR_BRANCH:
+            if ( a.kind == VALUE_CONSTANT && b.kind == VALUE_CONSTANT )
+                take_edge ( block, ir_relation_holds ( instruction->op, a.constant, b.constant ) ? 0 : 1 );
+            else if ( a.kind == VALUE_VARYING || b.kind == VALUE_VARYING )
+            {
+                take_edge ( block, 0 );
+                take_edge ( block, 1 );
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Finds the values of every virtual register, and which edges are taken */
+static void propagate ( void )
+{
+    block_taken[0] = true;
+    for ( uint32_t i = 0; i < function->blocks[0].n_instructions; i++ )
+        visit_instruction ( 0, i );
+
+    while ( n_listed_edges > 0 || n_listed_vregs > 0 )
+    {
+        while ( n_listed_edges > 0 )
+        {
+            n_listed_edges--;
+            uint32_t from = edge_list[n_listed_edges][0];
+            uint32_t target = IR_TERMINATOR(&function->blocks[from])->targets[edge_list[n_listed_edges][1]];
+            const ir_block_t *block = &function->blocks[target];
+            if ( !block_taken[target] )
+            {
+                block_taken[target] = true;
+                for ( uint32_t i = 0; i < block->n_instructions; i++ )
+                    visit_instruction ( target, i );
+            }
+            else
+            {
+                // Only the phis can change, since they have a new edge to take values from
+                for ( uint32_t i = 0; i < block->n_instructions && block->instructions[i].opcode == IR_PHI; i++ )
+                    visit_instruction ( target, i );
+            }
+        }
+
+        if ( n_listed_vregs > 0 )
+        {
+            vreg_t vreg = vreg_list[--n_listed_vregs];
+            for ( uint32_t u = first_use[vreg]; u < first_use[vreg + 1]; u++ )
+                if ( block_taken[uses[u].block] )
+                    visit_instruction ( uses[u].block, uses[u].index );
+        }
+    }
+}
+
+/* Replaces operand by its value, if that is a constant */
+static void replace_constant ( ir_operand_t *operand )
+{
+    if ( operand->kind == IR_OPERAND_VREG && values[operand->vreg].kind == VALUE_CONSTANT )
+        *operand = IR_CONSTANT(values[operand->vreg].constant);
+}
+
+/* Rewrites the blocks that are taken, with the constants in place of the virtual registers holding them.
+ * Instructions computing constants are removed, and branches only going one way become jumps */
+static void rewrite ( void )
+{
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        if ( !block_taken[b] )
+            continue;
+        ir_block_t *block = &function->blocks[b];
+        uint32_t n_kept = 0;
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            ir_instruction_t *instruction = &block->instructions[i];
+            switch ( instruction->opcode )
+            {
+                case IR_PHI:
+                case IR_COPY:
+                case IR_NEG:
+                case IR_BINARY:
+                    if ( values[instruction->dst].kind != VALUE_CONSTANT )
+                        break;
+                    if ( instruction->opcode == IR_PHI )
+                        free ( instruction->arguments );
+                    continue;
+                case IR_BRANCH:
+                    if ( edge_taken[b][0] && edge_taken[b][1] )
+                        break;
+                    uint32_t taken = edge_taken[b][0] ? 0 : 1;
+                    ir_remove_phi_arguments ( function, instruction->targets[1 - taken], b );
+                    *instruction = (ir_instruction_t) { .opcode = IR_JUMP, .targets = { instruction->targets[taken] } };
+                    break;
+                default:
+                    break;
+            }
+
+            if ( instruction->opcode == IR_PHI )
+                for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+                    replace_constant ( &instruction->arguments[j].value );
+            replace_constant ( &instruction->a );
+            replace_constant ( &instruction->b );
+            block->instructions[n_kept++] = *instruction;
+        }
+        block->n_instructions = n_kept;
+    }
+}
+
+/* Replaces every phi choosing between one value and itself by that value, once arguments have been removed */
+static void remove_trivial_phis ( void )
+{
+    ir_operand_t *replacement = malloc ( function->n_vregs * sizeof(ir_operand_t) );
+    for ( vreg_t v = 0; v < function->n_vregs; v++ )
+        replacement[v] = IR_VREG(v);
+
+    // A replaced phi can make others trivial, so the phis are checked until nothing changes
+    bool changed = true;
+    bool replaced_any = false;
+    while ( changed )
+    {
+        changed = false;
+        for ( uint32_t b = 0; b < function->n_blocks; b++ )
+        {
+            ir_block_t *block = &function->blocks[b];
+            for ( uint32_t i = 0; i < block->n_instructions && block->instructions[i].opcode == IR_PHI; i++ )
+            {
+                ir_instruction_t *phi = &block->instructions[i];
+                if ( replacement[phi->dst].kind != IR_OPERAND_VREG || replacement[phi->dst].vreg != phi->dst )
+                    continue;
+                ir_operand_t value = IR_NO_OPERAND;
+                bool trivial = true;
+                for ( uint32_t j = 0; j < phi->n_arguments && trivial; j++ )
+                {
+                    ir_operand_t argument = phi->arguments[j].value;
+                    while ( argument.kind == IR_OPERAND_VREG && replacement[argument.vreg].kind == IR_OPERAND_VREG
+                            && replacement[argument.vreg].vreg != argument.vreg )
+                        argument = replacement[argument.vreg];
+                    if ( argument.kind == IR_OPERAND_VREG && replacement[argument.vreg].kind == IR_OPERAND_CONSTANT )
+                        argument = replacement[argument.vreg];
+                    if ( argument.kind == IR_OPERAND_VREG && argument.vreg == phi->dst )
+                        continue;
+                    if ( value.kind == IR_OPERAND_NONE )
+                        value = argument;
+                    else
+                        trivial = value.kind == argument.kind && ( value.kind == IR_OPERAND_VREG
+                                  ? value.vreg == argument.vreg : value.constant == argument.constant );
+                }
+                if ( trivial && value.kind != IR_OPERAND_NONE )
+                {
+                    replacement[phi->dst] = value;
+                    changed = replaced_any = true;
+                }
+            }
+        }
+    }
+
+    if ( replaced_any )
+    {
+        for ( uint32_t b = 0; b < function->n_blocks; b++ )
+        {
+            ir_block_t *block = &function->blocks[b];
+            uint32_t n_kept = 0;
+            for ( uint32_t i = 0; i < block->n_instructions; i++ )
+            {
+                ir_instruction_t *instruction = &block->instructions[i];
+                bool is_phi = instruction->opcode == IR_PHI;
+                if ( is_phi && ( replacement[instruction->dst].kind != IR_OPERAND_VREG
+                                 || replacement[instruction->dst].vreg != instruction->dst ) )
+                {
+                    free ( instruction->arguments );
+                    continue;
+                }
+                uint32_t n_operands = is_phi ? instruction->n_arguments : 2;
+                for ( uint32_t o = 0; o < n_operands; o++ )
+                {
+                    ir_operand_t *operand = is_phi ? &instruction->arguments[o].value
+                                                   : o == 0 ? &instruction->a : &instruction->b;
+                    // Replacements were followed to the end when they were made, except through later phis
+                    while ( operand->kind == IR_OPERAND_VREG && ( replacement[operand->vreg].kind != IR_OPERAND_VREG
+                            || replacement[operand->vreg].vreg != operand->vreg ) )
+                        *operand = replacement[operand->vreg];
+                }
+                block->instructions[n_kept++] = *instruction;
+            }
+            block->n_instructions = n_kept;
+        }
+    }
+    free ( replacement );
+}
+
+void propagate_constants ( ir_function_t *ir )
+{
+    function = ir;
+    uint32_t n_blocks = function->n_blocks;
+    values = calloc ( function->n_vregs, sizeof(value_t) );
+    block_taken = calloc ( n_blocks, sizeof(bool) );
+    edge_taken = calloc ( n_blocks, sizeof(*edge_taken) );
+    edge_list = malloc ( 2 * n_blocks * sizeof(*edge_list) );
+    find_uses ( );
+
+    // Parameters hold whatever the caller passed
+    for ( vreg_t v = 1; v <= function->n_parameters; v++ )
+        values[v] = (value_t) { VALUE_VARYING };
+
+    propagate ( );
+    rewrite ( );
+    ir_remove_unreachable_blocks ( function );
+    remove_trivial_phis ( );
+    ir_compute_predecessors ( function );
+
+    free ( values );
+    free ( block_taken );
+    free ( edge_taken );
+    free ( edge_list );
+    free ( uses );
+    free ( first_use );
+    free ( vreg_list );
+    vreg_list = NULL;
+    n_listed_edges = n_listed_vregs = vreg_list_capacity = 0;
+    function = NULL;
+}
@@ -0,0 +1,911 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Conversion of the parameters and local variables of a function to static single assignment form,
+// as described by Cytron et al. Every assignment to a variable makes a new version of it,
+// and where versions from different paths meet, a phi chooses between them.
+// Phis are only placed where the variable is live, so the form is pruned.
+// Temporaries are only assigned once by the lowering, and are left as they are
+
+// The function being converted
+static ir_function_t *function;
+
+// The variables used in a block before they are assigned in it, and so may be live in more than one block.
+// Only these can need phis, and only these are in the bitsets below
+static uint32_t *nonlocal_index;
+static vreg_t *nonlocal_variables;
+static uint32_t n_nonlocals;
+
+// The blocks every block is in the dominance frontier of: the blocks where its dominance ends,
+// from frontier[first_frontier[b]] to frontier[first_frontier[b+1]]
+static uint32_t *frontier;
+static uint32_t *first_frontier;
+
+// The phis to place, as pairs of a block and a variable, in order of the variables
+static uint32_t (*phis)[2];
+static size_t n_phis;
+static size_t phis_capacity;
+
+// The version of every variable at the point of the renaming walk, and the versions replaced by it,
+// so they can be restored when the walk leaves a block
+static vreg_t *current_version;
+typedef struct { vreg_t variable, previous; } replaced_version_t;
+static replaced_version_t *replaced;
+static size_t n_replaced;
+static size_t replaced_capacity;
+static uint32_t versions_capacity;
+
+#define NOT_NONLOCAL UINT32_MAX
+
+/* Returns whether operand reads a parameter or local variable */
+static bool is_variable ( ir_operand_t operand )
+{
+    return operand.kind == IR_OPERAND_VREG && operand.vreg <= function->n_variables;
+}
+
+/* Finds the variables that are used in a block before they are assigned in it */
+static void find_nonlocal_variables ( void )
+{
+    uint32_t n_variables = function->n_variables;
+    nonlocal_index = malloc ( ( n_variables + 1 ) * sizeof(uint32_t) );
+    nonlocal_variables = malloc ( ( n_variables + 1 ) * sizeof(vreg_t) );
+    // The last block every variable was assigned in. Parameters are assigned when the entry is entered
+    uint32_t *assigned_in = malloc ( ( n_variables + 1 ) * sizeof(uint32_t) );
+    for ( vreg_t v = 0; v <= n_variables; v++ )
+    {
+        nonlocal_index[v] = NOT_NONLOCAL;
+        assigned_in[v] = UINT32_MAX;
+    }
+    n_nonlocals = 0;
+
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            const ir_operand_t *operands[2] = { &instruction->a, &instruction->b };
+            for ( int o = 0; o < 2; o++ )
+            {
+                if ( !is_variable ( *operands[o] ) )
+                    continue;
+                vreg_t v = operands[o]->vreg;
+                if ( assigned_in[v] != b && nonlocal_index[v] == NOT_NONLOCAL )
+                {
+                    nonlocal_index[v] = n_nonlocals;
+                    nonlocal_variables[n_nonlocals++] = v;
+                }
+            }
+            if ( instruction->dst != NO_VREG && instruction->dst <= n_variables )
+                assigned_in[instruction->dst] = b;
+        }
+    }
+    free ( assigned_in );
+}
+
+/* Finds the dominance frontiers. A block with several predecessors is in the frontier of every block
+ * dominating one of its predecessors, up to but not including its immediate dominator */
+static void find_dominance_frontiers ( const ir_dominators_t *dominators )
+{
+    uint32_t n_blocks = function->n_blocks;
+    first_frontier = calloc ( n_blocks + 1, sizeof(uint32_t) );
+    // The last block added to the frontier of every block, so it is not added twice
+    uint32_t *last_added = malloc ( n_blocks * sizeof(uint32_t) );
+
+    // The frontiers are counted first, and then filled in
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        uint32_t *filled = pass == 0 ? NULL : calloc ( n_blocks, sizeof(uint32_t) );
+        for ( uint32_t b = 0; b < n_blocks; b++ )
+            last_added[b] = UINT32_MAX;
+
+        for ( uint32_t b = 0; b < n_blocks; b++ )
+        {
+            const ir_block_t *block = &function->blocks[b];
+            if ( block->n_predecessors < 2 )
+                continue;
+            for ( uint32_t p = 0; p < block->n_predecessors; p++ )
+            {
+                for ( uint32_t runner = block->predecessors[p]; runner != dominators->idom[b];
+                      runner = dominators->idom[runner] )
+                {
+                    if ( last_added[runner] == b )
+                        continue;
+                    last_added[runner] = b;
+                    if ( pass == 0 )
+                        first_frontier[runner + 1]++;
+                    else
+                        frontier[first_frontier[runner] + filled[runner]++] = b;
+                }
+            }
+        }
+
+        if ( pass == 0 )
+        {
+            for ( uint32_t b = 0; b < n_blocks; b++ )
+                first_frontier[b + 1] += first_frontier[b];
+            frontier = malloc ( ( first_frontier[n_blocks] + 1 ) * sizeof(uint32_t) );
+        }
+        free ( filled );
+    }
+    free ( last_added );
+}
+
+static void add_phi ( uint32_t block, vreg_t variable )
+{
+    if ( n_phis == phis_capacity )
+    {
+        phis_capacity = phis_capacity * 2 + 64;
+        phis = realloc ( phis, phis_capacity * sizeof(*phis) );
+    }
+    phis[n_phis][0] = block;
+    phis[n_phis++][1] = variable;
+}
+
+/* Finds where the nonlocal variables need phis: at the blocks in the iterated dominance frontier of their
+ * assignments, where they are live. Liveness is found for the nonlocal variables only */
+static void find_phis ( const ir_dominators_t *dominators )
+{
+    uint32_t n_blocks = function->n_blocks;
+    size_t words = BITSET_WORDS(n_nonlocals);
+    // Per block: the variables used before they are assigned, those assigned, and those live when it is entered
+    bitset_word_t *sets = calloc ( 3 * n_blocks * words, sizeof(bitset_word_t) );
+    #define USED(b) ( &sets[( 3 * (size_t) (b) + 0 ) * words] )
+    #define ASSIGNED(b) ( &sets[( 3 * (size_t) (b) + 1 ) * words] )
+    #define LIVE_IN(b) ( &sets[( 3 * (size_t) (b) + 2 ) * words] )
+
+    // Parameters are assigned in the entry
+    for ( vreg_t v = 1; v <= function->n_parameters; v++ )
+        if ( nonlocal_index[v] != NOT_NONLOCAL )
+            BITSET_ADD ( ASSIGNED(0), nonlocal_index[v] );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            const ir_operand_t *operands[2] = { &instruction->a, &instruction->b };
+            for ( int o = 0; o < 2; o++ )
+            {
+                if ( !is_variable ( *operands[o] ) )
+                    continue;
+                uint32_t n = nonlocal_index[operands[o]->vreg];
+                if ( n != NOT_NONLOCAL && !BITSET_HAS ( ASSIGNED(b), n ) )
+                    BITSET_ADD ( USED(b), n );
+            }
+            if ( instruction->dst != NO_VREG && instruction->dst <= function->n_variables
+                 && nonlocal_index[instruction->dst] != NOT_NONLOCAL )
+                BITSET_ADD ( ASSIGNED(b), nonlocal_index[instruction->dst] );
+        }
+    }
+
+    // Successors mostly come later in reverse postorder, so the blocks are visited backwards
+    bool changed = true;
+    while ( changed )
+    {
+        changed = false;
+        for ( uint32_t i = n_blocks; i-- > 0; )
+        {
+            uint32_t b = dominators->order[i];
+            const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[b]);
+            for ( size_t w = 0; w < words; w++ )
+            {
+                bitset_word_t out = 0;
+                for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+                    out |= LIVE_IN(last->targets[t])[w];
+                bitset_word_t in = USED(b)[w] | ( out & ~ASSIGNED(b)[w] );
+                changed |= in != LIVE_IN(b)[w];
+                LIVE_IN(b)[w] = in;
+            }
+        }
+    }
+
+    // The blocks assigning every variable, grouped by variable
+    uint32_t *first_assignment = calloc ( n_nonlocals + 1, sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        for ( size_t w = 0; w < words; w++ )
+            for ( bitset_word_t bits = ASSIGNED(b)[w]; bits != 0; bits &= bits - 1 )
+                first_assignment[w * 64 + __builtin_ctzll ( bits ) + 1]++;
+    for ( uint32_t n = 0; n < n_nonlocals; n++ )
+        first_assignment[n + 1] += first_assignment[n];
+    uint32_t *assignments = malloc ( ( first_assignment[n_nonlocals] + 1 ) * sizeof(uint32_t) );
+    uint32_t *filled = calloc ( n_nonlocals + 1, sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        for ( size_t w = 0; w < words; w++ )
+            for ( bitset_word_t bits = ASSIGNED(b)[w]; bits != 0; bits &= bits - 1 )
+            {
+                uint32_t n = w * 64 + __builtin_ctzll ( bits );
+                assignments[first_assignment[n] + filled[n]++] = b;
+            }
+
+    // A phi is an assignment too, so the blocks given phis are added to the work list.
+    // The marks hold the variable that last gave the block a phi, or put it on the work list
+    uint32_t *has_phi = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *was_listed = malloc ( n_blocks * sizeof(uint32_t) );
+    uint32_t *work_list = malloc ( n_blocks * sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        has_phi[b] = was_listed[b] = NOT_NONLOCAL;
+    for ( uint32_t n = 0; n < n_nonlocals; n++ )
+    {
+        uint32_t n_listed = 0;
+        for ( uint32_t i = first_assignment[n]; i < first_assignment[n + 1]; i++ )
+        {
+            work_list[n_listed++] = assignments[i];
+            was_listed[assignments[i]] = n;
+        }
+        while ( n_listed > 0 )
+        {
+            uint32_t b = work_list[--n_listed];
+            for ( uint32_t i = first_frontier[b]; i < first_frontier[b + 1]; i++ )
+            {
+                uint32_t d = frontier[i];
+                if ( has_phi[d] == n || !BITSET_HAS ( LIVE_IN(d), n ) )
+                    continue;
+                has_phi[d] = n;
+                add_phi ( d, nonlocal_variables[n] );
+                if ( was_listed[d] != n )
+                {
+                    was_listed[d] = n;
+                    work_list[n_listed++] = d;
+                }
+            }
+        }
+    }
+    #undef USED
+    #undef ASSIGNED
+    #undef LIVE_IN
+
+    free ( sets );
+    free ( first_assignment );
+    free ( assignments );
+    free ( filled );
+    free ( has_phi );
+    free ( was_listed );
+    free ( work_list );
+}
+
+/* Puts the phis found by find_phis at the start of their blocks. Every argument is the variable itself,
+ * until the renaming gives it the version coming from that predecessor */
+static void insert_phis ( void )
+{
+    uint32_t n_blocks = function->n_blocks;
+    uint32_t *first_phi = calloc ( n_blocks + 1, sizeof(uint32_t) );
+    for ( size_t i = 0; i < n_phis; i++ )
+        first_phi[phis[i][0] + 1]++;
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+        first_phi[b + 1] += first_phi[b];
+    // Sorted by block, keeping the order of the variables
+    vreg_t *variables = malloc ( ( n_phis + 1 ) * sizeof(vreg_t) );
+    uint32_t *filled = calloc ( n_blocks, sizeof(uint32_t) );
+    for ( size_t i = 0; i < n_phis; i++ )
+        variables[first_phi[phis[i][0]] + filled[phis[i][0]]++] = phis[i][1];
+
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        uint32_t n_block_phis = first_phi[b + 1] - first_phi[b];
+        if ( n_block_phis == 0 )
+            continue;
+        ir_block_t *block = &function->blocks[b];
+        block->capacity = block->n_instructions + n_block_phis;
+        ir_instruction_t *instructions = malloc ( block->capacity * sizeof(ir_instruction_t) );
+        memcpy ( &instructions[n_block_phis], block->instructions, block->n_instructions * sizeof(ir_instruction_t) );
+        for ( uint32_t i = 0; i < n_block_phis; i++ )
+        {
+            vreg_t variable = variables[first_phi[b] + i];
+            ir_phi_argument_t *arguments = malloc ( block->n_predecessors * sizeof(ir_phi_argument_t) );
+            for ( uint32_t p = 0; p < block->n_predecessors; p++ )
+                arguments[p] = (ir_phi_argument_t) { .block = block->predecessors[p], .value = IR_VREG(variable) };
+            instructions[i] = (ir_instruction_t) {
+                .opcode = IR_PHI, .dst = variable, .n_arguments = block->n_predecessors, .arguments = arguments };
+        }
+        free ( block->instructions );
+        block->instructions = instructions;
+        block->n_instructions += n_block_phis;
+    }
+
+    free ( first_phi );
+    free ( variables );
+    free ( filled );
+}
+
+/* Returns the variable a virtual register is a version of, or NO_VREG for temporaries */
+static vreg_t variable_of ( vreg_t vreg )
+{
+    if ( vreg <= function->n_variables )
+        return vreg;
+    return vreg < versions_capacity ? function->versions[vreg] : NO_VREG;
+}
+
+/* Makes a new version of variable, the one assigned from here on */
+static vreg_t new_version ( vreg_t variable )
+{
+    vreg_t version = ir_new_vreg ( function );
+    if ( version >= versions_capacity )
+    {
+        uint32_t old_capacity = versions_capacity;
+        versions_capacity = versions_capacity * 2 + 64;
+        if ( versions_capacity <= version )
+            versions_capacity = version + 64;
+        function->versions = realloc ( function->versions, versions_capacity * sizeof(vreg_t) );
+        memset ( &function->versions[old_capacity], 0, ( versions_capacity - old_capacity ) * sizeof(vreg_t) );
+    }
+    function->versions[version] = variable;
+
+    if ( n_replaced == replaced_capacity )
+    {
+        replaced_capacity = replaced_capacity * 2 + 64;
+        replaced = realloc ( replaced, replaced_capacity * sizeof(replaced_version_t) );
+    }
+    replaced[n_replaced++] = (replaced_version_t) { variable, current_version[variable] };
+    current_version[variable] = version;
+    return version;
+}
+
+static void rename_operand ( ir_operand_t *operand )
+{
+    if ( !is_variable ( *operand ) )
+        return;
+    assert ( current_version[operand->vreg] != NO_VREG && "Variable is used before it is assigned" );
+    operand->vreg = current_version[operand->vreg];
+}
+
+/* Renames the variables read and assigned in block to their versions,
+ * and gives the phis of its successors the versions leaving it */
+static void rename_block ( uint32_t b )
+{
+    ir_block_t *block = &function->blocks[b];
+    for ( uint32_t i = 0; i < block->n_instructions; i++ )
+    {
+        ir_instruction_t *instruction = &block->instructions[i];
+        if ( instruction->opcode != IR_PHI )
+        {
+            rename_operand ( &instruction->a );
+            rename_operand ( &instruction->b );
+        }
+        if ( instruction->dst != NO_VREG && instruction->dst <= function->n_variables )
+            instruction->dst = new_version ( instruction->dst );
+    }
+
+    const ir_instruction_t *last = IR_TERMINATOR(block);
+    for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+    {
+        ir_block_t *successor = &function->blocks[last->targets[t]];
+        for ( uint32_t i = 0; i < successor->n_instructions && successor->instructions[i].opcode == IR_PHI; i++ )
+        {
+            ir_instruction_t *phi = &successor->instructions[i];
+            vreg_t variable = variable_of ( phi->dst );
+            for ( uint32_t j = 0; j < phi->n_arguments; j++ )
+            {
+                if ( phi->arguments[j].block != b )
+                    continue;
+                assert ( current_version[variable] != NO_VREG && "Variable is used before it is assigned" );
+                phi->arguments[j].value = IR_VREG(current_version[variable]);
+            }
+        }
+    }
+}
+
+/* Renames every variable in a walk of the dominator tree. The version of a variable reaching a block
+ * is the one assigned last in the block or the blocks dominating it */
+static void rename_variables ( const ir_dominators_t *dominators )
+{
+    current_version = calloc ( function->n_variables + 1, sizeof(vreg_t) );
+    // Parameters start out as themselves
+    for ( vreg_t v = 1; v <= function->n_parameters; v++ )
+        current_version[v] = v;
+
+    // Every block on the stack, with the number of its children visited so far, and the length of
+    // the list of replaced versions when it was entered
+    uint32_t (*stack)[3] = malloc ( function->n_blocks * sizeof(*stack) );
+    uint32_t depth = 0;
+    stack[depth][0] = 0;
+    stack[depth][1] = 0;
+    stack[depth++][2] = n_replaced;
+    rename_block ( 0 );
+    while ( depth > 0 )
+    {
+        uint32_t b = stack[depth - 1][0];
+        uint32_t child = dominators->first_child[b] + stack[depth - 1][1]++;
+        if ( child < dominators->first_child[b + 1] )
+        {
+            uint32_t c = dominators->children[child];
+            stack[depth][0] = c;
+            stack[depth][1] = 0;
+            stack[depth++][2] = n_replaced;
+            rename_block ( c );
+            continue;
+        }
+
+        depth--;
+        while ( n_replaced > stack[depth][2] )
+        {
+            n_replaced--;
+            current_version[replaced[n_replaced].variable] = replaced[n_replaced].previous;
+        }
+    }
+    free ( stack );
+    function->n_versions = function->n_vregs < versions_capacity ? function->n_vregs : versions_capacity;
+}
+
+void build_ssa ( ir_function_t *ir )
+{
+    function = ir;
+    ir_remove_unreachable_blocks ( function );
+    ir_compute_predecessors ( function );
+    ir_dominators_t dominators;
+    ir_compute_dominators ( function, &dominators );
+
+    find_nonlocal_variables ( );
+    if ( n_nonlocals > 0 )
+    {
+        find_dominance_frontiers ( &dominators );
+        find_phis ( &dominators );
+        insert_phis ( );
+    }
+    versions_capacity = 0;
+    rename_variables ( &dominators );
+    function->in_ssa = true;
+
+    ir_destroy_dominators ( &dominators );
+    free ( nonlocal_index );
+    free ( nonlocal_variables );
+    free ( frontier );
+    free ( first_frontier );
+    free ( phis );
+    free ( current_version );
+    free ( replaced );
+    nonlocal_index = nonlocal_variables = frontier = first_frontier = current_version = NULL;
+    phis = NULL;
+    replaced = NULL;
+    n_phis = phis_capacity = n_replaced = replaced_capacity = 0;
+    function = NULL;
+}
+
+/* Leaving SSA form. The versions of most variables can be joined again, and the other phis become copies */
+
+// A copy from a phi argument to the phi, done as if at once with the other copies on the same edge
+typedef struct { vreg_t dst; ir_operand_t value; } parallel_copy_t;
+static parallel_copy_t *copies;
+static size_t n_copies;
+static size_t copies_capacity;
+
+/* Appends copy to the end of block, before its jump */
+static void append_copy ( uint32_t block, vreg_t dst, ir_operand_t value )
+{
+    ir_block_t *b = &function->blocks[block];
+    ir_instruction_t jump = b->instructions[--b->n_instructions];
+    assert ( jump.opcode == IR_JUMP );
+    ir_append ( function, block, (ir_instruction_t) { .opcode = IR_COPY, .dst = dst, .a = value } );
+    ir_append ( function, block, jump );
+}
+
+/* Appends the pending copies to block in an order where no copy overwrites a value another one still reads.
+ * Copies that form a cycle, such as swaps, are broken up with a new temporary */
+static void sequentialize_copies ( uint32_t block )
+{
+    while ( n_copies > 0 )
+    {
+        bool progress = false;
+        for ( size_t i = 0; i < n_copies; )
+        {
+            parallel_copy_t copy = copies[i];
+            bool blocked = false;
+            for ( size_t j = 0; j < n_copies && !blocked; j++ )
+                blocked = j != i && copies[j].value.kind == IR_OPERAND_VREG && copies[j].value.vreg == copy.dst;
+            if ( blocked )
+            {
+                i++;
+                continue;
+            }
+            if ( copy.value.kind != IR_OPERAND_VREG || copy.value.vreg != copy.dst )
+                append_copy ( block, copy.dst, copy.value );
+            copies[i] = copies[--n_copies];
+            progress = true;
+        }
+
+        if ( !progress )
+        {
+            // Every copy left overwrites a value another one reads, so one value is saved first
+            vreg_t saved = copies[0].dst;
+            vreg_t temporary = ir_new_vreg ( function );
+            append_copy ( block, temporary, IR_VREG(saved) );
+            for ( size_t j = 0; j < n_copies; j++ )
+                if ( copies[j].value.kind == IR_OPERAND_VREG && copies[j].value.vreg == saved )
+                    copies[j].value = IR_VREG(temporary);
+        }
+    }
+}
+
+/* Gives every edge from a block with several successors, to a block with phis, a block of its own, so the copies for the phis can be placed on the edge alone.
+ * The new blocks are placed right before the block with the phis */
+static void split_critical_edges ( void )
+{
+    uint32_t n_original = function->n_blocks;
+    // The block every new block jumps to
+    uint32_t *split_target = NULL;
+
+    for ( uint32_t b = 0; b < n_original; b++ )
+    {
+        if ( function->blocks[b].instructions[0].opcode != IR_PHI )
+            continue;
+        for ( uint32_t p = 0; p < function->blocks[b].n_predecessors; p++ )
+        {
+            uint32_t predecessor = function->blocks[b].predecessors[p];
+            if ( IR_TERMINATOR(&function->blocks[predecessor])->opcode != IR_BRANCH )
+                continue;
+
+            uint32_t depth_before = function->blocks[predecessor].loop_depth;
+            uint32_t depth_after = function->blocks[b].loop_depth;
+            uint32_t split = ir_new_block ( function, depth_before < depth_after ? depth_before : depth_after );
+            ir_append ( function, split, (ir_instruction_t) { .opcode = IR_JUMP, .targets = { b } } );
+            split_target = realloc ( split_target, function->blocks_capacity * sizeof(uint32_t) );
+            split_target[split] = b;
+
+            ir_instruction_t *branch = IR_TERMINATOR(&function->blocks[predecessor]);
+            for ( uint32_t t = 0; t < 2; t++ )
+                if ( branch->targets[t] == b )
+                    branch->targets[t] = split;
+            ir_block_t *block = &function->blocks[b];
+            for ( uint32_t i = 0; i < block->n_instructions && block->instructions[i].opcode == IR_PHI; i++ )
+                for ( uint32_t j = 0; j < block->instructions[i].n_arguments; j++ )
+                    if ( block->instructions[i].arguments[j].block == predecessor )
+                        block->instructions[i].arguments[j].block = split;
+        }
+    }
+
+    if ( function->n_blocks == n_original )
+        return;
+    // The new blocks were made in the order of the blocks they jump to
+    uint32_t *new_index = malloc ( function->n_blocks * sizeof(uint32_t) );
+    uint32_t position = 0;
+    uint32_t split = n_original;
+    for ( uint32_t b = 0; b < n_original; b++ )
+    {
+        while ( split < function->n_blocks && split_target[split] == b )
+            new_index[split++] = position++;
+        new_index[b] = position++;
+    }
+    ir_renumber_blocks ( function, new_index );
+    free ( new_index );
+    free ( split_target );
+}
+
+void ir_set_version ( ir_function_t *function, vreg_t vreg, vreg_t variable )
+{
+    if ( vreg >= function->n_versions )
+    {
+        function->versions = realloc ( function->versions, ( vreg + 1 ) * sizeof(vreg_t) );
+        memset ( &function->versions[function->n_versions], 0, ( vreg + 1 - function->n_versions ) * sizeof(vreg_t) );
+        function->n_versions = vreg + 1;
+    }
+    function->versions[vreg] = variable;
+}
+
+/* Returns the variable vreg is a version of, or NO_VREG if it is a temporary. Parameters are their first version */
+static vreg_t version_of ( vreg_t vreg )
+{
+    if ( vreg <= function->n_variables )
+        return vreg;
+    return vreg < function->n_versions ? function->versions[vreg] : NO_VREG;
+}
+
+// The block every version is assigned in, and its bit in the live sets if it is used in other blocks too
+static uint32_t *assigned_block;
+static uint32_t *global_index;
+static vreg_t *global_versions;
+static uint32_t n_global_versions;
+
+// Marks the versions live at the point of the walk through a block, and counts them for every variable.
+// The marks and counts are only valid when they hold the stamp of the block
+static uint32_t *live_stamp;
+static uint32_t *count_stamp;
+static uint32_t *live_versions;
+// The variables with two versions live at once
+static bool *interferes;
+
+static void note_global_use ( vreg_t vreg, uint32_t block )
+{
+    if ( version_of ( vreg ) == NO_VREG || assigned_block[vreg] == block || global_index[vreg] != NOT_NONLOCAL )
+        return;
+    global_index[vreg] = n_global_versions;
+    global_versions[n_global_versions++] = vreg;
+}
+
+static void mark_live ( vreg_t vreg, uint32_t stamp )
+{
+    vreg_t variable = version_of ( vreg );
+    if ( variable == NO_VREG || live_stamp[vreg] == stamp )
+        return;
+    live_stamp[vreg] = stamp;
+    if ( count_stamp[variable] != stamp )
+    {
+        count_stamp[variable] = stamp;
+        live_versions[variable] = 0;
+    }
+    live_versions[variable]++;
+}
+
+/* Notes the assignment of vreg, and whether another version of its variable is live there */
+static void mark_assigned ( vreg_t vreg, uint32_t stamp )
+{
+    vreg_t variable = version_of ( vreg );
+    if ( variable == NO_VREG )
+        return;
+    bool live = live_stamp[vreg] == stamp;
+    uint32_t others = ( count_stamp[variable] == stamp ? live_versions[variable] : 0 ) - live;
+    if ( others > 0 )
+        interferes[variable] = true;
+    if ( live )
+    {
+        live_stamp[vreg] = 0;
+        live_versions[variable]--;
+    }
+}
+
+/* Finds the variables where no two versions are ever live at once. Most are like that, unless optimizations
+ * moved their uses, and all versions of such a variable can be given the same virtual register again.
+ * Liveness across blocks is found for the versions used in other blocks than where they are assigned,
+ * and the blocks are then walked backwards to see which versions are live at every assignment */
+static void find_interfering_variables ( void )
+{
+    uint32_t n_blocks = function->n_blocks;
+    uint32_t n_vregs = function->n_vregs;
+    assigned_block = malloc ( n_vregs * sizeof(uint32_t) );
+    global_index = malloc ( n_vregs * sizeof(uint32_t) );
+    global_versions = malloc ( n_vregs * sizeof(vreg_t) );
+    n_global_versions = 0;
+    for ( vreg_t v = 0; v < n_vregs; v++ )
+    {
+        assigned_block[v] = 0; // Parameters are assigned in the entry
+        global_index[v] = NOT_NONLOCAL;
+    }
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+            if ( block->instructions[i].dst != NO_VREG )
+                assigned_block[block->instructions[i].dst] = b;
+    }
+
+    // Phi arguments are used at the end of the predecessor they come from
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->opcode == IR_PHI )
+            {
+                for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+                    if ( instruction->arguments[j].value.kind == IR_OPERAND_VREG )
+                        note_global_use ( instruction->arguments[j].value.vreg, instruction->arguments[j].block );
+                continue;
+            }
+            if ( instruction->a.kind == IR_OPERAND_VREG )
+                note_global_use ( instruction->a.vreg, b );
+            if ( instruction->b.kind == IR_OPERAND_VREG )
+                note_global_use ( instruction->b.vreg, b );
+        }
+    }
+
+    size_t words = BITSET_WORDS(n_global_versions);
+    // Per block: the versions used in it and assigned elsewhere, those assigned in it, the phi arguments
+    // leaving it, and those live when it is entered
+    bitset_word_t *sets = calloc ( 4 * n_blocks * words + 1, sizeof(bitset_word_t) );
+    #define USED(b) ( &sets[( 4 * (size_t) (b) + 0 ) * words] )
+    #define ASSIGNED(b) ( &sets[( 4 * (size_t) (b) + 1 ) * words] )
+    #define PHI_USED(b) ( &sets[( 4 * (size_t) (b) + 2 ) * words] )
+    #define LIVE_IN(b) ( &sets[( 4 * (size_t) (b) + 3 ) * words] )
+    for ( uint32_t g = 0; g < n_global_versions; g++ )
+        BITSET_ADD ( ASSIGNED(assigned_block[global_versions[g]]), g );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        const ir_block_t *block = &function->blocks[b];
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->opcode == IR_PHI )
+            {
+                for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+                {
+                    const ir_phi_argument_t *argument = &instruction->arguments[j];
+                    if ( argument->value.kind == IR_OPERAND_VREG && global_index[argument->value.vreg] != NOT_NONLOCAL )
+                        BITSET_ADD ( PHI_USED(argument->block), global_index[argument->value.vreg] );
+                }
+                continue;
+            }
+            const ir_operand_t *operands[2] = { &instruction->a, &instruction->b };
+            for ( int o = 0; o < 2; o++ )
+                if ( operands[o]->kind == IR_OPERAND_VREG && global_index[operands[o]->vreg] != NOT_NONLOCAL
+                     && assigned_block[operands[o]->vreg] != b )
+                    BITSET_ADD ( USED(b), global_index[operands[o]->vreg] );
+        }
+    }
+
+    bool changed = true;
+    while ( changed )
+    {
+        changed = false;
+        for ( uint32_t b = n_blocks; b-- > 0; )
+        {
+            const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[b]);
+            for ( size_t w = 0; w < words; w++ )
+            {
+                bitset_word_t out = PHI_USED(b)[w];
+                for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+                    out |= LIVE_IN(last->targets[t])[w];
+                bitset_word_t in = USED(b)[w] | ( out & ~ASSIGNED(b)[w] );
+                changed |= in != LIVE_IN(b)[w];
+                LIVE_IN(b)[w] = in;
+            }
+        }
+    }
+
+    live_stamp = calloc ( n_vregs, sizeof(uint32_t) );
+    // Temporaries with versions are their own variable, so these are indexed by any virtual register
+    count_stamp = calloc ( n_vregs, sizeof(uint32_t) );
+    live_versions = calloc ( n_vregs, sizeof(uint32_t) );
+    interferes = calloc ( n_vregs, sizeof(bool) );
+    for ( uint32_t b = 0; b < n_blocks; b++ )
+    {
+        uint32_t stamp = b + 1;
+        const ir_block_t *block = &function->blocks[b];
+        const ir_instruction_t *last = IR_TERMINATOR(block);
+
+        // The versions live when the block is left: those live into its successors, and its phi arguments
+        for ( size_t w = 0; w < words; w++ )
+        {
+            bitset_word_t out = 0;
+            for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+                out |= LIVE_IN(last->targets[t])[w];
+            for ( ; out != 0; out &= out - 1 )
+                mark_live ( global_versions[w * 64 + __builtin_ctzll ( out )], stamp );
+        }
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+        {
+            const ir_block_t *successor = &function->blocks[last->targets[t]];
+            for ( uint32_t i = 0; i < successor->n_instructions && successor->instructions[i].opcode == IR_PHI; i++ )
+                for ( uint32_t j = 0; j < successor->instructions[i].n_arguments; j++ )
+                {
+                    const ir_phi_argument_t *argument = &successor->instructions[i].arguments[j];
+                    if ( argument->block == b && argument->value.kind == IR_OPERAND_VREG )
+                        mark_live ( argument->value.vreg, stamp );
+                }
+        }
+
+        // Phis are assigned at once, when the block is entered, so they are checked after the other instructions
+        for ( uint32_t i = block->n_instructions; i-- > 0; )
+        {
+            const ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->opcode == IR_PHI )
+                break;
+            if ( instruction->dst != NO_VREG )
+                mark_assigned ( instruction->dst, stamp );
+            if ( instruction->a.kind == IR_OPERAND_VREG )
+                mark_live ( instruction->a.vreg, stamp );
+            if ( instruction->b.kind == IR_OPERAND_VREG )
+                mark_live ( instruction->b.vreg, stamp );
+        }
+        for ( uint32_t i = 0; i < block->n_instructions && block->instructions[i].opcode == IR_PHI; i++ )
+            mark_assigned ( block->instructions[i].dst, stamp );
+    }
+    #undef USED
+    #undef ASSIGNED
+    #undef PHI_USED
+    #undef LIVE_IN
+
+    free ( sets );
+    free ( assigned_block );
+    free ( global_index );
+    free ( global_versions );
+    free ( live_stamp );
+    free ( count_stamp );
+    free ( live_versions );
+}
+
+static void coalesce_operand ( ir_operand_t *operand )
+{
+    if ( operand->kind != IR_OPERAND_VREG )
+        return;
+    vreg_t variable = version_of ( operand->vreg );
+    if ( variable != NO_VREG && !interferes[variable] )
+        operand->vreg = variable;
+}
+
+/* Gives all versions of the variables without interfering versions the virtual register of the variable.
+ * Their phis then only choose between the variable and constants, and those choosing the variable are removed */
+static void coalesce_versions ( void )
+{
+    find_interfering_variables ( );
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        ir_block_t *block = &function->blocks[b];
+        uint32_t n_kept = 0;
+        for ( uint32_t i = 0; i < block->n_instructions; i++ )
+        {
+            ir_instruction_t *instruction = &block->instructions[i];
+            if ( instruction->dst != NO_VREG )
+            {
+                ir_operand_t dst = IR_VREG(instruction->dst);
+                coalesce_operand ( &dst );
+                instruction->dst = dst.vreg;
+            }
+            if ( instruction->opcode != IR_PHI )
+            {
+                coalesce_operand ( &instruction->a );
+                coalesce_operand ( &instruction->b );
+                block->instructions[n_kept++] = *instruction;
+                continue;
+            }
+
+            bool chooses = false;
+            for ( uint32_t j = 0; j < instruction->n_arguments; j++ )
+            {
+                ir_operand_t *value = &instruction->arguments[j].value;
+                coalesce_operand ( value );
+                chooses |= value->kind != IR_OPERAND_VREG || value->vreg != instruction->dst;
+            }
+            if ( chooses )
+                block->instructions[n_kept++] = *instruction;
+            else
+                free ( instruction->arguments );
+        }
+        block->n_instructions = n_kept;
+    }
+    free ( interferes );
+    interferes = NULL;
+}
+
+void leave_ssa ( ir_function_t *ir )
+{
+    if ( !ir->in_ssa )
+        return;
+    function = ir;
+    ir_compute_predecessors ( function );
+    coalesce_versions ( );
+    split_critical_edges ( );
+
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        ir_block_t *block = &function->blocks[b];
+        uint32_t n_block_phis = 0;
+        while ( n_block_phis < block->n_instructions && block->instructions[n_block_phis].opcode == IR_PHI )
+            n_block_phis++;
+        if ( n_block_phis == 0 )
+            continue;
+
+        // Every phi has an argument for every predecessor, in the same order
+        const ir_instruction_t *first = &block->instructions[0];
+        for ( uint32_t j = 0; j < first->n_arguments; j++ )
+        {
+            uint32_t predecessor = first->arguments[j].block;
+            for ( uint32_t i = 0; i < n_block_phis; i++ )
+            {
+                const ir_instruction_t *phi = &function->blocks[b].instructions[i];
+                assert ( phi->arguments[j].block == predecessor );
+                if ( n_copies == copies_capacity )
+                {
+                    copies_capacity = copies_capacity * 2 + 16;
+                    copies = realloc ( copies, copies_capacity * sizeof(parallel_copy_t) );
+                }
+                copies[n_copies++] = (parallel_copy_t) { phi->dst, phi->arguments[j].value };
+            }
+            sequentialize_copies ( predecessor );
+            // Appending may have moved the instructions of the predecessor, but not of this block
+            first = &function->blocks[b].instructions[0];
+        }
+
+        block = &function->blocks[b];
+        for ( uint32_t i = 0; i < n_block_phis; i++ )
+            free ( block->instructions[i].arguments );
+        block->n_instructions -= n_block_phis;
+        memmove ( block->instructions, &block->instructions[n_block_phis],
+                  block->n_instructions * sizeof(ir_instruction_t) );
+    }
+
+    free ( copies );
+    copies = NULL;
+    n_copies = copies_capacity = 0;
+    ir->in_ssa = false;
+    function = NULL;
+}
@@ -0,0 +1,135 @@
+#define STATS_IMPLEMENTATION
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// What was measured for each phase
+typedef struct phase_stats
+{
+    bool ran;
+    double wall_seconds;
+    double cpu_seconds;
+    size_t allocations;   // Number of calls to the allocation functions
+    size_t bytes;         // Bytes requested by those calls
+    long peak_rss_kb;     // Peak resident set size of the process when the phase ended
+} phase_stats_t;
+
+static phase_stats_t phases[N_PHASES];
+
+// The phase currently being measured, N_PHASES when there is none, and when it started
+static phase_t current_phase = N_PHASES;
+static double phase_wall_start;
+static double phase_cpu_start;
+
+static double read_clock ( clockid_t clock )
+{
+    struct timespec ts;
+    clock_gettime ( clock, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb ( void )
+{
+    struct rusage usage;
+    getrusage ( RUSAGE_SELF, &usage );
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // macOS reports bytes
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+void stats_begin_phase ( phase_t phase )
+{
+    stats_end_phase ( );
+    current_phase = phase;
+    phases[phase].ran = true;
+    phase_wall_start = read_clock ( CLOCK_MONOTONIC );
+    phase_cpu_start = read_clock ( CLOCK_PROCESS_CPUTIME_ID );
+}
+
+void stats_end_phase ( void )
+{
+    if ( current_phase == N_PHASES )
+        return;
+
+    phase_stats_t *stats = &phases[current_phase];
+    stats->wall_seconds += read_clock ( CLOCK_MONOTONIC ) - phase_wall_start;
+    stats->cpu_seconds += read_clock ( CLOCK_PROCESS_CPUTIME_ID ) - phase_cpu_start;
+    stats->peak_rss_kb = peak_rss_kb ( );
+    current_phase = N_PHASES;
+}
+
+void stats_print ( const stats_counts_t *counts )
+{
+    stats_end_phase ( );
+
+    phase_stats_t total = { 0 };
+    fprintf ( stderr, "\n == COMPILATION STATISTICS == \n" );
+    fprintf ( stderr, "%-10s %10s %10s %12s %14s %14s\n",
+              "phase", "wall ms", "cpu ms", "allocations", "bytes", "peak rss KB" );
+    for ( phase_t phase = 0; phase < N_PHASES; phase++ )
+    {
+        phase_stats_t *stats = &phases[phase];
+        if ( !stats->ran )
+            continue;
+
+        fprintf ( stderr, "%-10s %10.2f %10.2f %12zu %14zu %14ld\n", PHASE_NAMES[phase],
+                  stats->wall_seconds * 1e3, stats->cpu_seconds * 1e3,
+                  stats->allocations, stats->bytes, stats->peak_rss_kb );
+
+        total.wall_seconds += stats->wall_seconds;
+        total.cpu_seconds += stats->cpu_seconds;
+        total.allocations += stats->allocations;
+        total.bytes += stats->bytes;
+    }
+    fprintf ( stderr, "%-10s %10.2f %10.2f %12zu %14zu %14ld\n", "total",
+              total.wall_seconds * 1e3, total.cpu_seconds * 1e3,
+              total.allocations, total.bytes, peak_rss_kb ( ) );
+
+    fprintf ( stderr, "\n%-18s %12zu\n", "nodes", counts->nodes );
+    fprintf ( stderr, "%-18s %12zu\n", "symbols", counts->symbols );
+    fprintf ( stderr, "%-18s %12zu\n", "strings", counts->strings );
+    fprintf ( stderr, "%-18s %12zu\n", "interned strings", counts->interned_strings );
+    fprintf ( stderr, "%-18s %12zu\n", "labels", counts->labels );
+    fprintf ( stderr, "%-18s %12zu\n", "instructions", counts->instructions );
+    fprintf ( stderr, "%-18s %12zu\n", "assembly bytes", counts->assembly_bytes );
+    fprintf ( stderr, "%-18s %12zu\n", "hoisted from loops", counts->hoisted_expressions );
+    fprintf ( stderr, "%-18s %12zu\n", "peephole removed", counts->peephole_removed );
+}
+
+// Counts an allocation of size bytes towards the current phase, if any
+static void count_allocation ( size_t size )
+{
+    if ( current_phase == N_PHASES )
+        return;
+    phases[current_phase].allocations++;
+    phases[current_phase].bytes += size;
+}
+
+void* stats_malloc ( size_t size )
+{
+    count_allocation ( size );
+    return malloc ( size );
+}
+
+void* stats_calloc ( size_t count, size_t size )
+{
+    count_allocation ( count * size );
+    return calloc ( count, size );
+}
+
+void* stats_realloc ( void *pointer, size_t size )
+{
+    count_allocation ( size );
+    return realloc ( pointer, size );
+}
+
+void* stats_aligned_alloc ( size_t alignment, size_t size )
+{
+    count_allocation ( size );
+    return aligned_alloc ( alignment, size );
+}
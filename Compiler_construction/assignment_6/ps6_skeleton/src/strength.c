@@ -0,0 +1,147 @@
+#include "vslc.h"
+
+// This header defines a bunch of macros we can use to emit assembly to stdout
+#include "emit.h"
+
+// Multiplication and division by constants, with cheaper instructions than imulq and idivq.
+// Both code generators use these, with their own registers
+
+// The factors leaq can multiply a register by, as the index scaled by 2, 4 or 8 added to the base
+static const int64_t LEA_FACTORS[] = { 3, 5, 9 };
+
+// Multiplications by constants take at most this many instructions, which are no slower than imulq together
+#define MAX_MULTIPLY_STEPS 2
+
+/* Finds how to multiply by factor in place: by the leaq factors in lea[], then shifting left by *shift,
+ * and negating if *negate. Returns the number of instructions, or 0 if there is no way within MAX_MULTIPLY_STEPS */
+static int multiplication_steps ( int64_t factor, int64_t lea[2], int *n_lea, int *shift, bool *negate )
+{
+    if ( factor == 0 || factor == INT64_MIN )
+        return 0;
+    *negate = factor < 0;
+    uint64_t rest = factor < 0 ? -(uint64_t) factor : (uint64_t) factor;
+    *shift = __builtin_ctzll ( rest );
+    rest >>= *shift;
+    *n_lea = 0;
+    for ( int i = 0; i < 3 && rest > 1; )
+    {
+        if ( rest % LEA_FACTORS[i] != 0 )
+        {
+            i++;
+            continue;
+        }
+        if ( *n_lea == 2 )
+            return 0;
+        lea[(*n_lea)++] = LEA_FACTORS[i];
+        rest /= LEA_FACTORS[i];
+    }
+    if ( rest != 1 )
+        return 0;
+    int steps = *n_lea + ( *shift > 0 ) + *negate;
+    return steps <= MAX_MULTIPLY_STEPS ? steps : 0;
+}
+
+bool multiplies_in_place ( int64_t factor )
+{
+    int64_t lea[2];
+    int n_lea, shift;
+    bool negate;
+    return factor != 1 && multiplication_steps ( factor, lea, &n_lea, &shift, &negate ) > 0;
+}
+
+void emit_multiplication ( const char *reg, int64_t factor )
+{
+    int64_t lea[2];
+    int n_lea, shift;
+    bool negate;
+    int steps = multiplication_steps ( factor, lea, &n_lea, &shift, &negate );
+    assert ( steps > 0 );
+    for ( int i = 0; i < n_lea; i++ )
+        EMIT ( "leaq (%s, %s, %ld), %s", reg, reg, lea[i] - 1, reg );
+    if ( shift > 0 )
+        SAL ( immediate_operand ( shift ), reg );
+    if ( negate )
+        NEGQ ( reg );
+}
+
+/* Finds the magic number and shift of a divisor, at least 2 and not a power of two, such that x / divisor is
+ * the high 64 bits of x * magic, plus x if magic is negative, shifted right by shift, and rounded towards zero.
+ * This is the method of Hacker's Delight, chapter 10, for 64 bits */
+static void division_magic ( uint64_t divisor, int64_t *magic, int *shift )
+{
+    const uint64_t two63 = UINT64_C(1) << 63;
+    // The largest multiple of divisor, minus one, below 2^63
+    uint64_t limit = two63 - 1 - ( two63 % divisor );
+    int p = 63;
+    uint64_t q1 = two63 / limit, r1 = two63 - q1 * limit;
+    uint64_t q2 = two63 / divisor, r2 = two63 - q2 * divisor;
+    uint64_t delta;
+    do
+    {
+        p++;
+        // q1 and r1 are the quotient and remainder of 2^p / limit, and q2 and r2 those of 2^p / divisor
+        q1 *= 2;
+        r1 *= 2;
+        if ( r1 >= limit )
+        {
+            q1++;
+            r1 -= limit;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if ( r2 >= divisor )
+        {
+            q2++;
+            r2 -= divisor;
+        }
+        delta = divisor - r2;
+    } while ( q1 < delta || ( q1 == delta && r1 == 0 ) );
+    *magic = (int64_t) ( q2 + 1 );
+    *shift = p - 64;
+}
+
+bool divides_without_idivq ( int64_t divisor )
+{
+    // idivq faults for these, which the generated code must do as well
+    return divisor != 0 && divisor != -1;
+}
+
+void emit_division ( const char *dividend, int64_t divisor )
+{
+    assert ( divides_without_idivq ( divisor ) );
+    uint64_t magnitude = divisor < 0 ? -(uint64_t) divisor : (uint64_t) divisor;
+
+    if ( ( magnitude & ( magnitude - 1 ) ) == 0 )
+    {
+        // Shifting right rounds down, so negative dividends are first biased by 2^k - 1, the sign bits shifted down
+        int k = __builtin_ctzll ( magnitude );
+        MOVQ ( dividend, RDX );
+        if ( k > 0 )
+        {
+            SAR ( immediate_operand ( 63 ), RDX );
+            emit_immediate ( "shrq", 64 - k, RDX );
+            ADDQ ( dividend, RDX );
+            SAR ( immediate_operand ( k ), RDX );
+        }
+    }
+    else
+    {
+        int64_t magic;
+        int shift;
+        division_magic ( magnitude, &magic, &shift );
+        // The one operand imulq multiplies by RAX, and places the high 64 bits of the product in RDX
+        MOVQ_IMM ( magic, RAX );
+        emit_instruction ( "imulq", dividend, NULL );
+        if ( magic < 0 )
+            ADDQ ( dividend, RDX );
+        if ( shift > 0 )
+            SAR ( immediate_operand ( shift ), RDX );
+        // The quotient is one too low when it is negative, so its sign bit is added
+        MOVQ ( RDX, RAX );
+        emit_immediate ( "shrq", 63, RAX );
+        ADDQ ( RAX, RDX );
+    }
+
+    if ( divisor < 0 )
+        NEGQ ( RDX );
+}
@@ -1,10 +1,13 @@
 #include "symbol_table.h"
 #include "symbols.h"
+#include "intern.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "stats.h"
+
 static insert_result_t symbol_hashmap_insert ( symbol_hashmap_t *hashmap, symbol_t *symbol );
 
 // ================== Symbol table code =================
@@ -28,6 +31,13 @@ insert_result_t symbol_table_insert ( symbol_table_t *table, struct symbol *symb
     if ( symbol_hashmap_insert ( table->hashmap, symbol ) == INSERT_COLLISION )
         return INSERT_COLLISION;
 
+    symbol_table_append ( table, symbol );
+    return INSERT_OK;
+}
+
+// Adds a symbol to the list of the symbol table only
+void symbol_table_append ( symbol_table_t *table, struct symbol *symbol )
+{
     // If the table is full, resize the list
     if ( table->n_symbols + 1 >= table->capacity )
     {
@@ -38,8 +48,6 @@ insert_result_t symbol_table_insert ( symbol_table_t *table, struct symbol *symb
     table->symbols[table->n_symbols] = symbol;
     symbol->sequence_number = table->n_symbols;
     table->n_symbols++;
-
-    return INSERT_OK;
 }
 
 // Destroys the given symbol table, its hashmap, and all the symbols it owns
@@ -54,11 +62,54 @@ void symbol_table_destroy ( symbol_table_t *table )
 
 // ==================== Hashmap code ====================
 
+// The hashmap is a Swiss table. Every bucket has a one byte control tag,
+// which is either CONTROL_EMPTY, or the lowest 7 bits of the hash of the name in the bucket.
+// Buckets are probed in aligned groups of GROUP_WIDTH, where all the tags of a group are checked at once,
+// so names only need to be compared when their tags match.
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY ((uint8_t) 0x80)
+
+// The top bits of the hash choose the first group to probe, the lowest 7 bits become the tag
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t) ((hash) & 0x7F))
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// Returns a bitmask with bit i set if control[i] == tag, for the GROUP_WIDTH tags starting at control
+static inline uint32_t group_match ( const uint8_t *control, uint8_t tag )
+{
+    __m128i group = _mm_load_si128 ( (const __m128i *) control );
+    return _mm_movemask_epi8 ( _mm_cmpeq_epi8 ( group, _mm_set1_epi8 ( tag ) ) );
+}
+
+// Returns a bitmask with bit i set if bucket i of the group is empty. Only empty tags have the high bit set
+static inline uint32_t group_match_empty ( const uint8_t *control )
+{
+    return _mm_movemask_epi8 ( _mm_load_si128 ( (const __m128i *) control ) );
+}
+#else
+// Portable fallbacks, checking one tag at a time
+static inline uint32_t group_match ( const uint8_t *control, uint8_t tag )
+{
+    uint32_t mask = 0;
+    for ( int i = 0; i < GROUP_WIDTH; i++ )
+        mask |= (uint32_t) ( control[i] == tag ) << i;
+    return mask;
+}
+
+static inline uint32_t group_match_empty ( const uint8_t *control )
+{
+    return group_match ( control, CONTROL_EMPTY );
+}
+#endif
+
 // Initializes a hashmap with 0 buckets. Will be resized upon first insertion
 symbol_hashmap_t* symbol_hashmap_init()
 {
     symbol_hashmap_t *result = malloc ( sizeof(symbol_hashmap_t) );
     *result = (symbol_hashmap_t) {
+        .control = NULL,
         .buckets = NULL,
         .n_buckets = 0,
         .n_entries = 0,
@@ -67,101 +118,112 @@ symbol_hashmap_t* symbol_hashmap_init()
     return result;
 }
 
-// Calculates a naive 64-bit hash of the given string
-static uint64_t hash_string ( const char* string )
+// Finds the first empty bucket in the probe sequence of the given hash.
+// Groups are visited in triangular steps, which reaches every group since the number of groups is a power of two
+static size_t symbol_hashmap_find_empty ( const symbol_hashmap_t *hashmap, uint64_t hash )
 {
-    assert( string != NULL );
-    uint64_t hash = 31;
-    for (const char *c = string; *c != '\0'; c++)
-        hash = hash * 257 + *c;
-    return hash;
+    size_t group_mask = hashmap->n_buckets / GROUP_WIDTH - 1;
+    size_t group = HASH_GROUP(hash) & group_mask;
+    for ( size_t step = 1; ; step++ )
+    {
+        uint32_t empty = group_match_empty ( &hashmap->control[group * GROUP_WIDTH] );
+        if ( empty != 0 )
+            return group * GROUP_WIDTH + __builtin_ctz ( empty );
+        group = ( group + step ) & group_mask;
+    }
 }
 
-// Allocates a larger list of buckets, and inserts all hashmap entries again
+// Allocates a larger list of buckets, and places all hashmap entries again.
+// Names are interned, so their hashes are read from the intern pool instead of being recomputed
 static void symbol_hashmap_resize ( symbol_hashmap_t *hashmap, size_t new_capacity )
 {
+    uint8_t *old_control = hashmap->control;
     symbol_t **old_buckets = hashmap->buckets;
     size_t old_capacity = hashmap->n_buckets;
 
-    // Use calloc, since it initalizes the memory to 0, aka NULL entries
-    hashmap->buckets = calloc ( new_capacity, sizeof(symbol_t*) );
+    // The control bytes must be aligned, so a whole group can be loaded with one instruction
+    hashmap->control = aligned_alloc ( GROUP_WIDTH, new_capacity );
+    memset ( hashmap->control, CONTROL_EMPTY, new_capacity );
+    hashmap->buckets = malloc ( new_capacity * sizeof(symbol_t*) );
     hashmap->n_buckets = new_capacity;
-    hashmap->n_entries = 0;
 
-    // Now re-insert all entries from the old buckets
-    for (int i = 0; i < old_capacity; i++ )
+    // Every name in the old buckets is unique, so they can be placed without comparing names
+    for ( size_t i = 0; i < old_capacity; i++ )
     {
-        if (old_buckets[i] != NULL)
-            symbol_hashmap_insert ( hashmap, old_buckets[i] );
+        if ( old_control[i] == CONTROL_EMPTY )
+            continue;
+        uint64_t hash = INTERNED_HASH ( old_buckets[i]->name );
+        size_t bucket = symbol_hashmap_find_empty ( hashmap, hash );
+        hashmap->control[bucket] = HASH_TAG(hash);
+        hashmap->buckets[bucket] = old_buckets[i];
     }
 
+    free ( old_control );
     free ( old_buckets );
 }
 
-// Performs insertion into the hashmap.
-// The hashmap uses open addressing, with up to one entry per bucket.
-// If our first choice of bucket is full, we look at the next bucket, until we find room.
-static insert_result_t symbol_hashmap_insert ( symbol_hashmap_t *hashmap, symbol_t *symbol )
+// Looks for the name in the hashmap itself, not its backups. Returns NULL if it is not there
+static symbol_t* symbol_hashmap_find ( const symbol_hashmap_t *hashmap, const char *name, uint64_t hash )
 {
-    // Make sure that the fill ratio of the hashmap never exeeds 1/2
-    int new_size = hashmap->n_entries + 1;
-    if ( new_size*2 > hashmap->n_buckets )
-        symbol_hashmap_resize ( hashmap, hashmap->n_buckets*2 + 8 );
+    if ( hashmap->n_buckets == 0 )
+        return NULL;
 
-    // Now calculate the position of the new entry
-    uint64_t hash = hash_string ( symbol->name );
-    size_t bucket = hash % hashmap->n_buckets;
-
-    // Iterate until we find an empty bucket
-    while ( hashmap->buckets[bucket] != NULL )
+    uint8_t tag = HASH_TAG(hash);
+    size_t group_mask = hashmap->n_buckets / GROUP_WIDTH - 1;
+    size_t group = HASH_GROUP(hash) & group_mask;
+    for ( size_t step = 1; ; step++ )
     {
-        // Check if the existing entry is a name collision
-        if ( strcmp(hashmap->buckets[bucket]->name, symbol->name) == 0 )
-            return INSERT_COLLISION; // An entry with the same name already exists
-        // Go to the next bucket
-        bucket = (bucket + 1) % hashmap->n_buckets;
+        const uint8_t *control = &hashmap->control[group * GROUP_WIDTH];
+
+        // Only buckets with a matching tag can hold the name. Interned names are equal only if they are the same pointer
+        for ( uint32_t match = group_match ( control, tag ); match != 0; match &= match - 1 )
+        {
+            symbol_t *symbol = hashmap->buckets[group * GROUP_WIDTH + __builtin_ctz ( match )];
+            if ( symbol->name == name )
+                return symbol;
+        }
+
+        // The hashmap never removes entries, so an empty bucket in the group ends the probe sequence
+        if ( group_match_empty ( control ) != 0 )
+            return NULL;
+
+        group = ( group + step ) & group_mask;
     }
+}
 
-    // We found an emoty bucket, insert the symbol here
+// Performs insertion into the hashmap.
+// If the name is already in the hashmap, INSERT_COLLISION is returned
+static insert_result_t symbol_hashmap_insert ( symbol_hashmap_t *hashmap, symbol_t *symbol )
+{
+    uint64_t hash = INTERNED_HASH ( symbol->name );
+    if ( symbol_hashmap_find ( hashmap, symbol->name, hash ) != NULL )
+        return INSERT_COLLISION; // An entry with the same name already exists
+
+    // Make sure that the fill ratio of the hashmap never exceeds 7/8,
+    // which guarantees that every probe sequence reaches an empty bucket
+    if ( ( hashmap->n_entries + 1 ) * 8 > hashmap->n_buckets * 7 )
+        symbol_hashmap_resize ( hashmap, hashmap->n_buckets == 0 ? GROUP_WIDTH : hashmap->n_buckets * 2 );
+
+    size_t bucket = symbol_hashmap_find_empty ( hashmap, hash );
+    hashmap->control[bucket] = HASH_TAG(hash);
     hashmap->buckets[bucket] = symbol;
     hashmap->n_entries++;
     return INSERT_OK; // We successfully inserted a new symbol
 }
 
-// Performs lookup in the hashmap.
-// Hashes the given string, and checks if the resulting bucket contains the item.
-// Since the hashmap uses open addressing, the entry can also be in the next bucket,
-// so we iterate until we either find the item, or find an empty bucket.
-//
+// Performs lookup in the hashmap, using the hash stored with the interned name.
 // If the key isn't found in this hashmap, but we have a backup, lookup continues there.
 // Otherwise, NULL is returned.
 symbol_t * symbol_hashmap_lookup ( symbol_hashmap_t *hashmap, const char* name )
 {
-    uint64_t hash = hash_string ( name );
+    uint64_t hash = INTERNED_HASH ( name );
 
     // Loop through the linked list of hashmaps and backup hashmaps
-    while ( hashmap != NULL )
+    for ( ; hashmap != NULL; hashmap = hashmap->backup )
     {
-        // Skip any hashmaps with 0 buckets
-        if ( hashmap->n_buckets == 0 )
-        {
-            hashmap = hashmap->backup;
-            continue;
-        }
-
-        size_t bucket = hash % hashmap->n_buckets;
-        while ( hashmap->buckets[bucket] != NULL )
-        {
-            // Check if the entry in the bucket has a matching name
-            if ( strcmp ( hashmap->buckets[bucket]->name, name ) == 0 )
-                return hashmap->buckets[bucket];
-
-            // Otherwise keep iterating until we find a hit, or an empty bucket
-            bucket = (bucket + 1) % hashmap->n_buckets;
-        }
-
-        // No entry with the required name existed in the hashmap, so go to the backup
-        hashmap = hashmap->backup;
+        symbol_t *symbol = symbol_hashmap_find ( hashmap, name, hash );
+        if ( symbol != NULL )
+            return symbol;
     }
 
     // The entry was never found, and we are all out of backups
@@ -170,6 +232,7 @@ symbol_t * symbol_hashmap_lookup ( symbol_hashmap_t *hashmap, const char* name )
 
 void symbol_hashmap_destroy ( symbol_hashmap_t *hashmap )
 {
+    free ( hashmap->control );
     free ( hashmap->buckets );
     free ( hashmap );
 }
@@ -6,10 +6,34 @@ char **string_list;
 size_t string_list_len;
 size_t string_list_capacity;
 
+/* Names are resolved through one binding per interned name, pointing to the innermost symbol with that name in scope.
+ * The symbol remembers the binding it shadows, so each name has its own stack of bindings.
+ * Every bound symbol is also pushed to the undo log, so leaving a scope
+ * restores the shadowed bindings of exactly the symbols it declared.
+ */
+static symbol_t **bindings; // Indexed by the INTERNED_ID of a name
+static symbol_t **undo_log;
+static size_t undo_log_len;
+static size_t undo_log_capacity;
+
+/* A scope of local names */
+typedef struct
+{
+    size_t undo_log_start; // The length of the undo log when the scope was entered
+    size_t first_symbol;   // The number of symbols in the function's symbol table when the scope was entered
+} scope_t;
+
+/* Function bodies are walked without recursion. The stacks are kept between functions, and freed by create_tables */
+static walk_stack_t bind_stack;
+static scope_t *scope_stack;
+static size_t scope_stack_len;
+static size_t scope_stack_capacity;
+
 static void find_globals ( void );
-static void bind_names ( symbol_table_t *local_symbols, node_t *root );
-static void push_local_scope ( symbol_table_t *local_symbols );
-static void pop_local_scope ( symbol_table_t *local_symbols );
+static void bind_names ( symbol_table_t *local_symbols, node_id_t root );
+static void bind_symbol ( symbol_t *symbol );
+static scope_t push_local_scope ( symbol_table_t *local_symbols );
+static void pop_local_scope ( scope_t scope );
 static void print_symbol_table ( symbol_table_t *table, int nesting );
 static void destroy_symbol_tables ( void );
 
@@ -29,14 +53,34 @@ void create_tables ( void )
     // Create a global symbol table, and make symbols for all globals
     find_globals ();
 
+    // Every name in the program was interned by the parser, so the bindings can be sized once.
+    // The globals are in scope everywhere, and are never unbound
+    bindings = calloc ( intern_pool_size ( ), sizeof(symbol_t*) );
+    for ( int i = 0; i < global_symbols->n_symbols; i++ )
+        bind_symbol ( global_symbols->symbols[i] );
+
     // For all functions, we want to fill their local symbol tables,
     // and bind all names found in the function body
     for ( int i = 0; i < global_symbols->n_symbols; i++ )
     {
         symbol_t *symbol = global_symbols->symbols[i];
-        if ( symbol->type == SYMBOL_FUNCTION )
-            bind_names ( symbol->function_symtable, symbol->node->children[2] );
+        if ( symbol->type != SYMBOL_FUNCTION )
+            continue;
+
+        // The parameters, which are the only symbols in the table so far, are in scope in the whole body
+        symbol_table_t *function_symtable = symbol->function_symtable;
+        scope_t scope = push_local_scope ( function_symtable );
+        for ( int j = 0; j < function_symtable->n_symbols; j++ )
+            bind_symbol ( function_symtable->symbols[j] );
+
+        bind_names ( function_symtable, CHILD(symbol->node, 2) );
+        pop_local_scope ( scope );
     }
+
+    walk_stack_destroy ( &bind_stack );
+    free ( scope_stack );
+    scope_stack = NULL;
+    scope_stack_len = scope_stack_capacity = 0;
 }
 
 /* Prints the global symbol table, and the local symbol tables for each function.
@@ -78,28 +122,28 @@ void destroy_tables ( void )
 static void find_globals ( void )
 {
     global_symbols = symbol_table_init ( );
-    for ( int i = 0; i < root->n_children; i++ )
+    for ( int i = 0; i < N_CHILDREN(root); i++ )
     {
-        node_t *node = root->children[i];
-        if ( node->type == GLOBAL_DECLARATION )
+        node_id_t node = CHILD(root, i);
+        if ( NODE_TYPE(node) == GLOBAL_DECLARATION )
         {
-            node_t *global_variable_list = node->children[0];
-            for ( int j = 0; j < global_variable_list->n_children; j++ )
+            node_id_t global_variable_list = CHILD(node, 0);
+            for ( int j = 0; j < N_CHILDREN(global_variable_list); j++ )
             {
-                node_t *var = global_variable_list->children[j];
+                node_id_t var = CHILD(global_variable_list, j);
                 char* name;
                 symtype_t symtype;
 
                 // The global variable list can both contain arrays and normal variables.
-                if ( var->type == ARRAY_INDEXING )
+                if ( NODE_TYPE(var) == ARRAY_INDEXING )
                 {
-                    name = var->children[0]->data;
+                    name = NODE_DATA(CHILD(var, 0)).string;
                     symtype = SYMBOL_GLOBAL_ARRAY;
                 }
                 else
                 {
-                    assert ( var->type == IDENTIFIER_DATA );
-                    name = var->data;
+                    assert ( NODE_TYPE(var) == IDENTIFIER_DATA );
+                    name = NODE_DATA(var).string;
                     symtype = SYMBOL_GLOBAL_VAR;
                 }
 
@@ -110,24 +154,23 @@ static void find_globals ( void )
                                           .function_symtable = NULL );
             }
         }
-        else if ( node->type == FUNCTION )
+        else if ( NODE_TYPE(node) == FUNCTION )
         {
-            // Functions have their own local symbol table. We make it now, and add the function parameters
+            // Functions have their own local symbol table. We make it now, and add the function parameters.
+            // Its hashmap only holds the parameters, local variables are resolved through the bindings
             symbol_table_t *function_symtable = symbol_table_init ( );
-            // We let the global hashmap be the backup of the local scope
-            function_symtable->hashmap->backup = global_symbols->hashmap;
 
-            node_t *parameters = node->children[1];
-            for ( int j = 0; j < parameters->n_children; j++ ) {
+            node_id_t parameters = CHILD(node, 1);
+            for ( int j = 0; j < N_CHILDREN(parameters); j++ ) {
                 CREATE_AND_INSERT_SYMBOL( function_symtable,
-                                          .name = parameters->children[j]->data,
+                                          .name = NODE_DATA(CHILD(parameters, j)).string,
                                           .type = SYMBOL_PARAMETER,
-                                          .node = parameters->children[j],
+                                          .node = CHILD(parameters, j),
                                           .function_symtable = NULL );
             }
 
             CREATE_AND_INSERT_SYMBOL( global_symbols,
-                                      .name = node->children[0]->data,
+                                      .name = NODE_DATA(CHILD(node, 0)).string,
                                       .type = SYMBOL_FUNCTION,
                                       .node = node,
                                       .function_symtable = function_symtable );
@@ -139,90 +182,145 @@ static void find_globals ( void )
     }
 }
 
-/* A recursive function that traverses the body of a function, and:
+/* Traverses the body of a function in order, using an explicit stack, and:
  *  - Adds variable declarations to the function's local symbol table.
- *  - Pushes and pops local variable scopes when entering blocks.
+ *  - Pushes and pops local variable scopes when entering and leaving blocks.
  *  - Binds identifiers to the symbol it references.
  *  - Moves STRING_DATA nodes' data into the global string list,
  *    and replaces the node with a STRING_LIST_REFERENCE node.
- *    This node's data is the string's position in the list casted to a void*
+ *    This node's data is the string's position in the list
  */
-static void bind_names ( symbol_table_t *local_symbols, node_t *node )
+static void bind_names ( symbol_table_t *local_symbols, node_id_t root )
 {
-    switch ( node->type )
+    walk_stack_t *stack = &bind_stack;
+    walk_push ( stack, root );
+
+    while ( stack->depth > 0 )
     {
-        // Can either be a variable in an expression, or the name of a function in a function call
-        // Either way, we wish to associate it with its symbol
-        case IDENTIFIER_DATA: {
-            symbol_t* symbol = symbol_hashmap_lookup ( local_symbols->hashmap, node->data );
-            if ( symbol == NULL ) {
-                fprintf ( stderr, "error: unrecognized symbol '%s'\n", (char*)node->data );
-                exit ( EXIT_FAILURE );
+        walk_frame_t frame = *WALK_TOP(stack);
+        stack->depth--;
+        node_id_t node = frame.node;
+
+        switch ( NODE_TYPE(node) )
+        {
+            // Can either be a variable in an expression, or the name of a function in a function call
+            // Either way, we wish to associate it with its symbol
+            case IDENTIFIER_DATA: {
+                symbol_t* symbol = bindings[INTERNED_ID(NODE_DATA(node).string)];
+                if ( symbol == NULL ) {
+                    fprintf ( stderr, "error: unrecognized symbol '%s'\n", NODE_DATA(node).string );
+                    exit ( EXIT_FAILURE );
+                }
+                NODE_SYMBOL(node) = symbol;
+                break;
             }
-            node->symbol = symbol;
-            break;
-        }
 
-        // Blocks may contain a list of declarations.
-        // In such cases, a scope gets pushed, the declarations get added, and the name binding continues in the body
-        case BLOCK:
-            if ( node->n_children == 2 )
-            {
-                push_local_scope ( local_symbols );
-                // Iterate through all declarations in the delcaration list
-                node_t *decl_list = node->children[0];
-                for (int i = 0; i < decl_list->n_children; i++ )
+            // Blocks may contain a list of declarations.
+            // In such cases, a scope gets pushed, the declarations get added, and the name binding continues in the body.
+            // A second frame for the block, at stage 1, pops the scope again once the body is done
+            case BLOCK:
+                if ( N_CHILDREN(node) == 2 && frame.stage == 1 )
                 {
-                    // Each declaration can have one or more IDENTIFIER_DATA nodes
-                    node_t *declaration = decl_list->children[i];
-                    for (int j = 0; j < declaration->n_children; j++ )
+                    pop_local_scope ( scope_stack[--scope_stack_len] );
+                }
+                else if ( N_CHILDREN(node) == 2 )
+                {
+                    if ( scope_stack_len == scope_stack_capacity )
                     {
-                        CREATE_AND_INSERT_SYMBOL( local_symbols,
-                                          .name = declaration->children[j]->data,
-                                          .type = SYMBOL_LOCAL_VAR,
-                                          .node = declaration->children[j],
-                                          .function_symtable = local_symbols );
+                        scope_stack_capacity = scope_stack_capacity * 2 + 64;
+                        scope_stack = realloc ( scope_stack, scope_stack_capacity * sizeof(scope_t) );
                     }
+                    scope_t scope = push_local_scope ( local_symbols );
+                    scope_stack[scope_stack_len++] = scope;
+
+                    // Iterate through all declarations in the delcaration list
+                    node_id_t decl_list = CHILD(node, 0);
+                    for (int i = 0; i < N_CHILDREN(decl_list); i++ )
+                    {
+                        // Each declaration can have one or more IDENTIFIER_DATA nodes
+                        node_id_t declaration = CHILD(decl_list, i);
+                        for (int j = 0; j < N_CHILDREN(declaration); j++ )
+                        {
+                            char *name = NODE_DATA(CHILD(declaration, j)).string;
+
+                            // Local variables added to the table since the scope was entered belong to this scope,
+                            // since any nested scopes are entered later
+                            symbol_t *outer = bindings[INTERNED_ID(name)];
+                            if ( outer != NULL && outer->type == SYMBOL_LOCAL_VAR && outer->sequence_number >= scope.first_symbol )
+                            {
+                                fprintf ( stderr, "error: symbol '%s' already defined\n", name );
+                                exit ( EXIT_FAILURE );
+                            }
+
+                            symbol_t *symbol = malloc ( sizeof(symbol_t) );
+                            *symbol = (symbol_t) {
+                                .name = name,
+                                .type = SYMBOL_LOCAL_VAR,
+                                .node = CHILD(declaration, j),
+                                .function_symtable = local_symbols
+                            };
+                            symbol_table_append ( local_symbols, symbol );
+                            bind_symbol ( symbol );
+                        }
+                    }
+                    walk_push ( stack, node )->stage = 1;
+                    walk_push ( stack, CHILD(node, 1) );
+                } else {
+                    // If the block only contains statements, and no declaration list, there is no need to make a scope
+                    walk_push ( stack, CHILD(node, 0) );
                 }
-                bind_names ( local_symbols, node->children[1] );
-                pop_local_scope ( local_symbols );
-            } else {
-                // If the block only contains statements, and no declaration list, there is no need to make a scope
-                bind_names ( local_symbols, node->children[0] );
+                break;
+
+            // Strings get inserted into the global string list
+            // The STRING_DATA node gets replaced by a STRING_LIST_REFERENCE node
+            case STRING_DATA: {
+                size_t position = add_string ( NODE_DATA(node).string );
+                NODE_TYPE(node) = STRING_LIST_REFERENCE;
+                NODE_DATA(node).string_index = position;
+                break;
             }
-            break;
-
-        // Strings get inserted into the global string list
-        // The STRING_DATA node gets replaced by a STRING_LIST_REFERENCE node
-        case STRING_DATA: {
-            size_t position = add_string ( node->data );
-            node->type = STRING_LIST_REFERENCE;
-            node->data = (void*) position;
-            break;
+
+            // For all other nodes, visit its children. They are pushed last to first, so the first is visited first
+            default:
+                for ( int i = N_CHILDREN(node) - 1; i >= 0; i-- )
+                    walk_push ( stack, CHILD(node, i) );
+                break;
         }
+    }
+}
 
-        // For all other nodes, recurse through its children
-        default:
-            for (int i = 0; i < node->n_children; i++)
-                bind_names ( local_symbols, node->children[i] );
-            break;
+/* Makes the symbol the binding of its name, shadowing the previous binding, and logs it so it can be undone */
+static void bind_symbol ( symbol_t *symbol )
+{
+    if ( undo_log_len == undo_log_capacity )
+    {
+        undo_log_capacity = undo_log_capacity * 2 + 64;
+        undo_log = realloc ( undo_log, undo_log_capacity * sizeof(symbol_t*) );
     }
+    undo_log[undo_log_len++] = symbol;
+
+    symbol_t **binding = &bindings[INTERNED_ID(symbol->name)];
+    symbol->shadowed = *binding;
+    *binding = symbol;
 }
 
-/* Creates a new empty hashmap for the symbol table, using the outer scope's hashmap as backup */
-static void push_local_scope ( symbol_table_t *table )
+/* Enters a new scope. Symbols bound from now on are unbound again by pop_local_scope */
+static scope_t push_local_scope ( symbol_table_t *table )
 {
-    symbol_hashmap_t *hashmap = symbol_hashmap_init ( );
-    hashmap->backup = table->hashmap;
-    table->hashmap = hashmap;
+    return (scope_t) {
+        .undo_log_start = undo_log_len,
+        .first_symbol = table->n_symbols
+    };
 }
 
-/* Destroys the hashmap, and replaces it with the outer scope's hashmap */
-static void pop_local_scope ( symbol_table_t *table )
+/* Leaves the scope, restoring the bindings shadowed by its symbols, most recent first */
+static void pop_local_scope ( scope_t scope )
 {
-    symbol_hashmap_t *hashmap = table->hashmap;
-    table->hashmap = hashmap->backup;
-    symbol_hashmap_destroy ( hashmap );
+    while ( undo_log_len > scope.undo_log_start )
+    {
+        symbol_t *symbol = undo_log[--undo_log_len];
+        bindings[INTERNED_ID(symbol->name)] = symbol->shadowed;
+    }
 }
 
 /* Prints the given symbol table, with sequence number, symbol names and types.
@@ -253,10 +351,17 @@ static void destroy_symbol_tables ( void )
     }
     // Then destroy the global symbol table
     symbol_table_destroy ( global_symbols );
+
+    // Finally the name bindings
+    free ( bindings );
+    free ( undo_log );
+    bindings = NULL;
+    undo_log = NULL;
+    undo_log_len = undo_log_capacity = 0;
 }
 
 /* Adds the given string to the global string list, resizing if needed.
- * Takes ownership of the string, and returns its position in the string list.
+ * The string itself stays owned by the intern pool. Returns its position in the string list.
  */
 static size_t add_string ( char *string )
 {
@@ -275,10 +380,8 @@ static void print_string_list ( void )
         printf ( "%ld: %s\n", i, string_list[i] );
 }
 
-/* Frees all strings in the global string list, and the string list itself */
+/* Frees the global string list. The strings themselves are freed along with the intern pool */
 static void destroy_string_list ( void )
 {
-    for ( int i = 0; i < string_list_len; i++ )
-        free ( string_list[i] );
     free ( string_list );
 }
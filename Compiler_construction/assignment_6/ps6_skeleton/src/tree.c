@@ -1,13 +1,14 @@
 #define NODETYPES_IMPLEMENTATION
 #include "vslc.h"
+#include "ir.h"
 
-// Global root for abstract syntax tree
-node_t *root;
+// Global syntax tree, and the root of the abstract syntax tree
+syntax_tree_t syntax_tree;
+node_id_t root;
 
 // Declarations of internal functions, defined further down
-static void node_print ( node_t *node, int nesting );
-static void destroy_subtree ( node_t *discard );
-static node_t* simplify_subtree ( node_t *node );
+static void node_print ( node_id_t node, int nesting );
+static node_id_t simplify_subtree ( node_id_t node );
 
 // Outputs the entire syntax tree to the terminal
 void print_syntax_tree ( void )
@@ -18,11 +19,18 @@ void print_syntax_tree ( void )
         node_print ( root, 0 );
 }
 
-// Cleans up the entire syntax tree
+// Cleans up the entire syntax tree, by freeing its columns.
+// Strings referenced by the tree are owned by the intern pool
 void destroy_syntax_tree ( void )
 {
-    destroy_subtree ( root );
-    root = NULL;
+    free ( syntax_tree.type );
+    free ( syntax_tree.first_child );
+    free ( syntax_tree.n_children );
+    free ( syntax_tree.data );
+    free ( syntax_tree.symbol );
+    free ( syntax_tree.child_list );
+    syntax_tree = (syntax_tree_t) { 0 };
+    root = NO_NODE;
 }
 
 // Modifies the syntax tree, performing constant folding where possible
@@ -31,234 +39,334 @@ void simplify_tree ( void )
     root = simplify_subtree( root );
 }
 
-// Initialize a node with type, data, and children
-node_t* node_create ( node_type_t type, void *data, size_t n_children, ... )
+// Makes room for one more node in every column, doubling the capacity when full
+static node_id_t allocate_node ( void )
+{
+    if ( syntax_tree.n_nodes == syntax_tree.node_capacity )
+    {
+        uint32_t capacity = syntax_tree.node_capacity * 2 + 64;
+        syntax_tree.type = realloc ( syntax_tree.type, capacity * sizeof(uint8_t) );
+        syntax_tree.first_child = realloc ( syntax_tree.first_child, capacity * sizeof(uint32_t) );
+        syntax_tree.n_children = realloc ( syntax_tree.n_children, capacity * sizeof(uint32_t) );
+        syntax_tree.data = realloc ( syntax_tree.data, capacity * sizeof(node_data_t) );
+        syntax_tree.symbol = realloc ( syntax_tree.symbol, capacity * sizeof(struct symbol*) );
+        syntax_tree.node_capacity = capacity;
+    }
+
+    // Index 0 is reserved for NO_NODE
+    if ( syntax_tree.n_nodes == 0 )
+        syntax_tree.n_nodes = 1;
+
+    return syntax_tree.n_nodes++;
+}
+
+// Reserves a contiguous range of count entries at the end of the child list, returns its start
+static uint32_t allocate_children ( uint32_t count )
 {
-    node_t* result = malloc ( sizeof ( node_t ) );
+    uint32_t start = syntax_tree.child_list_len;
+    if ( start + count > syntax_tree.child_list_capacity )
+    {
+        uint32_t capacity = syntax_tree.child_list_capacity * 2 + 64;
+        while ( capacity < start + count )
+            capacity *= 2;
+        syntax_tree.child_list = realloc ( syntax_tree.child_list, capacity * sizeof(node_id_t) );
+        syntax_tree.child_list_capacity = capacity;
+    }
+    syntax_tree.child_list_len += count;
+    return start;
+}
 
-    // Initialize every field in the struct
-    *result = (node_t) {
-        .type = type,
-        .n_children = n_children,
-        .children = (node_t **) malloc ( n_children * sizeof ( node_t * ) ),
+// Initialize a node with type, data, and children
+node_id_t node_create ( node_type_t type, node_data_t data, size_t n_children, ... )
+{
+    node_id_t result = allocate_node ( );
 
-        .data = data,
-        .symbol = NULL,
-    };
+    // Initialize every column for the new node
+    NODE_TYPE(result) = type;
+    NODE_DATA(result) = data;
+    NODE_SYMBOL(result) = NULL;
+    N_CHILDREN(result) = n_children;
+    syntax_tree.first_child[result] = allocate_children ( n_children );
 
     // Read each child node from the va_list
     va_list child_list;
     va_start ( child_list, n_children );
     for ( size_t i = 0; i < n_children; i++ )
-        result->children[i] = va_arg ( child_list, node_t * );
+        CHILD(result, i) = va_arg ( child_list, node_id_t );
     va_end ( child_list );
 
     return result;
 }
 
 // Append an element to the given LIST node, returns the list node
-node_t* append_to_list_node ( node_t* list_node, node_t* element )
+node_id_t append_to_list_node ( node_id_t list_node, node_id_t element )
 {
-    assert ( list_node->type == LIST );
-
-    // Calculate the minimum size of the new allocation
-    size_t min_allocation_size = list_node->n_children + 1;
+    assert ( NODE_TYPE(list_node) == LIST );
 
-    // Round up to the next power of two
-    size_t new_allocation_size = 1;
-    while ( new_allocation_size < min_allocation_size )
-        new_allocation_size *= 2;
-
-    // Resize the allocation
-    list_node->children = realloc ( list_node->children, new_allocation_size * sizeof(node_t *) );
+    // The capacity of a list's range of children is always n_children rounded up to a power of two,
+    // since lists are created with 0 or 1 children, and only grow by doubling.
+    // The range is therefore full exactly when n_children is 0 or a power of two.
+    uint32_t n_children = N_CHILDREN(list_node);
+    if ( ( n_children & ( n_children - 1 ) ) == 0 )
+    {
+        uint32_t old_start = syntax_tree.first_child[list_node];
+        uint32_t new_capacity = n_children == 0 ? 1 : n_children * 2;
+
+        if ( old_start + n_children == syntax_tree.child_list_len )
+        {
+            // The range is at the end of the child list, so it can grow in place
+            allocate_children ( new_capacity - n_children );
+        }
+        else
+        {
+            // Move the range to the end of the child list. The old range is left unused
+            uint32_t new_start = allocate_children ( new_capacity );
+            memcpy ( &syntax_tree.child_list[new_start], &syntax_tree.child_list[old_start],
+                     n_children * sizeof(node_id_t) );
+            syntax_tree.first_child[list_node] = new_start;
+        }
+    }
 
     // Insert the new element and increase child count by 1
-    list_node->children[list_node->n_children] = element;
-    list_node->n_children++;
+    CHILD(list_node, n_children) = element;
+    N_CHILDREN(list_node)++;
 
     return list_node;
 }
 
-// Prints out the given node and all its children recursively
-static void node_print ( node_t *node, int nesting )
+// Prints out the given node, with the given indentation
+static void node_print_one ( node_id_t node, int nesting )
 {
     printf ( "%*s", nesting, "" );
 
-    if ( node == NULL )
+    if ( node == NO_NODE )
     {
         printf ( "(NULL)\n");
         return;
     }
 
-    printf ( "%s", node_strings[node->type] );
+    node_type_t type = NODE_TYPE(node);
+    printf ( "%s", node_strings[type] );
 
     // For nodes with extra data, print the data with the correct type
-    if ( node->type == IDENTIFIER_DATA ||
-         node->type == EXPRESSION ||
-         node->type == RELATION ||
-         node->type == STRING_DATA)
+    if ( type == IDENTIFIER_DATA || type == STRING_DATA )
+    {
+        printf ( "(%s)", NODE_DATA(node).string );
+    }
+    else if ( type == EXPRESSION || type == RELATION )
     {
-        printf ( "(%s)", (char *) node->data );
+        printf ( "(%s)", OPERATOR_NAMES[NODE_DATA(node).op] );
     }
-    else if ( node->type == NUMBER_DATA )
+    else if ( type == NUMBER_DATA )
     {
-        printf ( "(%ld)", *(int64_t *) node->data );
+        printf ( "(%ld)", NODE_DATA(node).number );
     }
-    else if ( node->type == STRING_LIST_REFERENCE )
+    else if ( type == STRING_LIST_REFERENCE )
     {
         // Prints the index of the string in the string_list
-        printf ( "(%zu)", (size_t) node->data );
+        printf ( "(%zu)", NODE_DATA(node).string_index );
     }
 
     // If the node has a symbol, print that as well
-    if ( node->symbol )
+    if ( NODE_SYMBOL(node) )
     {
-        printf ( " %s(%zu)", SYMBOL_TYPE_NAMES[node->symbol->type], node->symbol->sequence_number );
+        printf ( " %s(%zu)", SYMBOL_TYPE_NAMES[NODE_SYMBOL(node)->type], NODE_SYMBOL(node)->sequence_number );
     }
 
     putchar ( '\n' );
-
-    // Recursively print children, with some more indentation
-    for ( size_t i = 0; i < node->n_children; i++ )
-        node_print ( node->children[i], nesting + 1 );
 }
 
-// Frees the memory owned by the given node, but does not touch its children
-static void node_finalize ( node_t *discard )
+// Prints out the given node and all its children, each child indented one more than its parent
+static void node_print ( node_id_t node, int nesting )
 {
-    if ( discard == NULL )
-        return;
+    walk_stack_t stack = { 0 };
+    walk_push ( &stack, node );
 
-    // Only free data if the data field is owned by the node
-    switch ( discard->type )
+    while ( stack.depth > 0 )
     {
-        case IDENTIFIER_DATA:
-        case NUMBER_DATA:
-        case STRING_DATA:
-            free ( discard->data );
-        default:
-            break;
-    }
-    free ( discard->children );
-    free ( discard );
-}
+        walk_frame_t *frame = WALK_TOP(&stack);
+        node_id_t current = frame->node;
 
-// Recursively frees the memory owned by the given node, and all its children
-static void destroy_subtree ( node_t *discard )
-{
-    if ( discard == NULL )
-        return;
+        // Print the node the first time it is visited, then visit the children one by one
+        if ( frame->stage == 0 )
+            node_print_one ( current, nesting + stack.depth - 1 );
+
+        if ( current != NO_NODE && frame->stage < N_CHILDREN(current) )
+            walk_push ( &stack, CHILD(current, frame->stage++) );
+        else
+            stack.depth--;
+    }
 
-     for ( size_t i = 0; i < discard->n_children; i++ )
-        destroy_subtree ( discard->children[i] );
-     node_finalize ( discard );
+    walk_stack_destroy ( &stack );
 }
 
-// Recursively replaces EXPRESSION nodes representing mathematical operations
-// where all operands are known integer constants
-static node_t* constant_fold_node ( node_t *node )
+// Replaces EXPRESSION nodes representing mathematical operations
+// where all operands are known integer constants.
+// The node is turned into a NUMBER_DATA node in place, so no new node is needed
+static node_id_t constant_fold_node ( node_id_t node )
 {
     // Only continue if the node is an expression
-    if ( node->type != EXPRESSION )
+    if ( NODE_TYPE(node) != EXPRESSION )
         return node;
 
     // Only continue if all children are NUMBER_DATA
-    for ( size_t i = 0; i < node->n_children; i++ ) {
-        if ( node->children[i]->type != NUMBER_DATA )
+    for ( uint32_t i = 0; i < N_CHILDREN(node); i++ ) {
+        if ( NODE_TYPE(CHILD(node, i)) != NUMBER_DATA )
             return node;
     }
 
-    char* op = node->data;
-    int64_t* result = malloc ( sizeof(int64_t) );
+    int64_t lhs = NODE_DATA(CHILD(node, 0)).number;
+    int64_t rhs = N_CHILDREN(node) == 2 ? NODE_DATA(CHILD(node, 1)).number : 0;
+    int64_t result;
 
-    if ( node->n_children == 1 ) {
-        int64_t operand = *(int64_t*) node->children[0]->data;
+    // Computed as the generated code would, wrapping around. Divisions that fault are left for the program to do
+    if ( NODE_DATA(node).op == OP_NEG )
+        result = (int64_t) -(uint64_t) lhs;
+    else if ( !ir_fold_binary ( NODE_DATA(node).op, lhs, rhs, &result ) )
+        return node;
 
-        if ( strcmp ( op, "-" ) == 0 )
-            *result = -operand;
-        else
-            assert ( false && "Unknown unary operator" );
-    }
-    else if ( node->n_children == 2 ) {
-        int64_t lhs = *(int64_t*) node->children[0]->data;
-        int64_t rhs = *(int64_t*) node->children[1]->data;
-
-        if ( strcmp ( op, "+" ) == 0 )
-            *result = lhs + rhs;
-        else if ( strcmp ( op, "-" ) == 0 )
-            *result = lhs - rhs;
-        else if ( strcmp ( op, "*" ) == 0 )
-            *result = lhs * rhs;
-        else if ( strcmp ( op, "/" ) == 0 )
-            *result = lhs / rhs;
-        else if ( strcmp ( op, "<<" ) == 0 )
-            *result = lhs << rhs;
-        else if ( strcmp ( op, ">>" ) == 0 )
-            *result = lhs >> rhs;
-        else
-            assert ( false && "Unknown binary operator" );
+    // The old children are simply left unreferenced in the syntax tree
+    NODE_TYPE(node) = NUMBER_DATA;
+    NODE_DATA(node).number = result;
+    N_CHILDREN(node) = 0;
+    return node;
+}
+
+// Replaces RELATION nodes where both operands are NUMBER_DATA by the NUMBER_DATA 1 if it holds, or 0 if not
+static node_id_t constant_fold_relation ( node_id_t node )
+{
+    if ( NODE_TYPE(node) != RELATION ||
+         NODE_TYPE(CHILD(node, 0)) != NUMBER_DATA ||
+         NODE_TYPE(CHILD(node, 1)) != NUMBER_DATA )
+        return node;
+
+    int64_t lhs = NODE_DATA(CHILD(node, 0)).number;
+    int64_t rhs = NODE_DATA(CHILD(node, 1)).number;
+    bool holds;
+    switch ( NODE_DATA(node).op )
+    {
+        case OP_EQ: holds = lhs == rhs; break;
+        case OP_NE: holds = lhs != rhs; break;
+        case OP_LT: holds = lhs < rhs; break;
+        case OP_GT: holds = lhs > rhs; break;
+        default: assert ( false && "Unknown relation operator" );
     }
-    else
-        assert ( false && "Unknown expression type" );
 
-    // Clean up the old subtree
-    destroy_subtree ( node );
+    NODE_TYPE(node) = NUMBER_DATA;
+    NODE_DATA(node).number = holds;
+    N_CHILDREN(node) = 0;
+    return node;
+}
 
-    return node_create ( NUMBER_DATA, result, 0);
+// Returns a BLOCK node with no statements, which does nothing
+static node_id_t empty_block ( void )
+{
+    return node_create ( BLOCK, NO_DATA, 1, node_create ( LIST, NO_DATA, 0 ) );
 }
 
-// Recursively replaces multiplication and division by powers of two, with bitshifts
-static node_t* peephole_optimize_node ( node_t* node )
+// Replaces IF_STATEMENT nodes where the relation has been folded, by the branch that is always taken,
+// and WHILE_STATEMENT nodes whose relation never holds, by nothing.
+// A WHILE_STATEMENT whose relation always holds keeps the NUMBER_DATA 1 as its condition, and only ends by break
+static node_id_t eliminate_dead_branch ( node_id_t node )
 {
-    if ( node->type != EXPRESSION ||
-         node->n_children != 2 ||
-         node->children[1]->type != NUMBER_DATA )
+    node_type_t type = NODE_TYPE(node);
+    if ( ( type != IF_STATEMENT && type != WHILE_STATEMENT ) || NODE_TYPE(CHILD(node, 0)) != NUMBER_DATA )
         return node;
 
-    char* op = node->data;
-    char* new_op;
+    bool holds = NODE_DATA(CHILD(node, 0)).number != 0;
+    if ( type == WHILE_STATEMENT )
+        return holds ? node : empty_block ( );
+    if ( holds )
+        return CHILD(node, 1);
+    return N_CHILDREN(node) > 2 ? CHILD(node, 2) : empty_block ( );
+}
 
-    if ( strcmp ( op, "*" ) == 0 )
-        new_op = "<<";
-    else if ( strcmp ( op, "/" ) == 0 )
-        new_op = ">>";
-    else
+// Replaces multiplication by powers of two, with bitshifts.
+// Division is left to the code generators, since shifting right rounds negative numbers down instead of towards zero
+static node_id_t peephole_optimize_node ( node_id_t node )
+{
+    if ( NODE_TYPE(node) != EXPRESSION ||
+         N_CHILDREN(node) != 2 ||
+         NODE_TYPE(CHILD(node, 1)) != NUMBER_DATA )
         return node;
 
-    int64_t rhs = *(int64_t *) node->children[1]->data;
+    operator_t op = NODE_DATA(node).op;
+    if ( op != OP_MUL && op != OP_DIV )
+        return node;
 
-    // Multiplication and division by 1 is a no-op, return the LHS and destroy the rest
-    if ( rhs == 1 ) {
-        node_t* lhs_node = node->children[0];
-        node->children[0] = NULL;
-        destroy_subtree ( node );
-        return lhs_node;
-    }
+    int64_t rhs = NODE_DATA(CHILD(node, 1)).number;
+
+    // Multiplication and division by 1 is a no-op, return the LHS and drop the rest
+    if ( rhs == 1 )
+        return CHILD(node, 0);
 
     // Only works for positive powers of two
-    if ( rhs <= 0 || __builtin_popcount(rhs) != 1 )
+    if ( op == OP_DIV || rhs <= 0 || __builtin_popcountll(rhs) != 1 )
         return node;
 
-    int powerOfTwo = 1;
-    while (rhs >> powerOfTwo != 1)
-        powerOfTwo += 1;
-
-    node->data = new_op;
-    *(int64_t*)node->children[1]->data = powerOfTwo;
+    NODE_DATA(node).op = OP_SHL;
+    NODE_DATA(CHILD(node, 1)).number = __builtin_ctzll(rhs);
     return node;
 }
 
-static node_t* simplify_subtree( node_t* node )
+// Simplifies every node below node, children before their parents, and returns what node was replaced by
+static node_id_t simplify_subtree ( node_id_t node )
 {
-    if ( node == NULL )
+    if ( node == NO_NODE )
         return node;
 
-    // First visit all children
-    for ( size_t i = 0; i < node->n_children; i++ )
-        node->children[i] = simplify_subtree ( node->children[i] );
+    walk_stack_t stack = { 0 };
+    walk_push ( &stack, node );
+
+    while ( true )
+    {
+        // First visit all children
+        walk_frame_t *frame = WALK_TOP(&stack);
+        if ( frame->stage < N_CHILDREN(frame->node) )
+        {
+            node_id_t child = CHILD(frame->node, frame->stage++);
+            if ( child != NO_NODE )
+                walk_push ( &stack, child );
+            continue;
+        }
+
+        node_id_t simplified = frame->node;
+        simplified = constant_fold_node ( simplified );
+        simplified = constant_fold_relation ( simplified );
+        simplified = eliminate_dead_branch ( simplified );
+        simplified = peephole_optimize_node ( simplified );
+        stack.depth--;
+
+        if ( stack.depth == 0 )
+        {
+            walk_stack_destroy ( &stack );
+            return simplified;
+        }
+
+        // Replace the child in the parent, which is the child visited last
+        walk_frame_t *parent = WALK_TOP(&stack);
+        CHILD(parent->node, parent->stage - 1) = simplified;
+    }
+}
 
-    node = constant_fold_node ( node );
-    node = peephole_optimize_node ( node );
+// Size of the stack the first time a frame is pushed
+#define WALK_STACK_INITIAL_CAPACITY 256
 
-    return node;
+walk_frame_t* walk_push ( walk_stack_t *stack, node_id_t node )
+{
+    if ( stack->depth == stack->capacity )
+    {
+        stack->capacity = stack->capacity == 0 ? WALK_STACK_INITIAL_CAPACITY : stack->capacity * 2;
+        stack->frames = realloc ( stack->frames, stack->capacity * sizeof(walk_frame_t) );
+    }
+
+    walk_frame_t *frame = &stack->frames[stack->depth++];
+    *frame = (walk_frame_t) { .node = node, .stage = 0, .data = 0 };
+    return frame;
+}
+
+void walk_stack_destroy ( walk_stack_t *stack )
+{
+    free ( stack->frames );
+    *stack = (walk_stack_t) { 0 };
 }
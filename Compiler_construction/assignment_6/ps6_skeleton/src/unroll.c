@@ -0,0 +1,441 @@
+#include "vslc.h"
+#include "ir.h"
+
+// Loop unrolling and rotation, done on three-address code before it is put in SSA form.
+// A while loop tests its relation in a header at the top, so every iteration jumps back to the header and then
+// branches past it. Rotation puts a copy of the test in front of the loop, as a guard skipping it, and moves the
+// header after the body, so it branches straight back while the relation holds.
+// Unrolling goes first: a loop counting towards a limit by a constant step gets a second loop, running several copies
+// of the body for every test while at least that many iterations are left. The original loop runs the rest.
+// Temporaries are only used in the statement making them, so every copy of a block gets temporaries of its own
+
+int unroll_factor = 4;
+
+// The most instructions the copies of an unrolled body may have together
+#define UNROLL_BUDGET 128
+
+// The function being transformed
+static ir_function_t *function;
+
+// The blocks in the order they are placed in once done, as a list starting at the entry.
+// New blocks are placed among them as they are made
+static uint32_t *next_placed;
+static uint32_t *previous_placed;
+static uint32_t placed_capacity; // Follows the capacity of the blocks of the function, which grows by doubling
+
+// The temporary every temporary of the blocks being copied is replaced by, and the temporaries replaced so far
+static vreg_t *copy_of;
+static uint32_t copy_of_len;
+static vreg_t *replaced;
+static uint32_t n_replaced;
+static uint32_t replaced_capacity;
+
+// The loops of the function. They and the predecessors only cover the blocks there were when they were found.
+// The blocks made since are outside the loops not handled yet, and never jump to their headers
+static ir_loops_t loops;
+
+/* Starts the layout in the order the blocks are in */
+static void start_layout ( void )
+{
+    placed_capacity = function->blocks_capacity;
+    next_placed = malloc ( placed_capacity * sizeof(uint32_t) );
+    previous_placed = malloc ( placed_capacity * sizeof(uint32_t) );
+    for ( uint32_t b = 0; b < function->n_blocks; b++ )
+    {
+        next_placed[b] = b + 1 < function->n_blocks ? b + 1 : UINT32_MAX;
+        previous_placed[b] = b > 0 ? b - 1 : UINT32_MAX;
+    }
+}
+
+/* Places block right after the block after */
+static void place_after ( uint32_t after, uint32_t block )
+{
+    if ( placed_capacity != function->blocks_capacity )
+    {
+        placed_capacity = function->blocks_capacity;
+        next_placed = realloc ( next_placed, placed_capacity * sizeof(uint32_t) );
+        previous_placed = realloc ( previous_placed, placed_capacity * sizeof(uint32_t) );
+    }
+    next_placed[block] = next_placed[after];
+    previous_placed[block] = after;
+    if ( next_placed[after] != UINT32_MAX )
+        previous_placed[next_placed[after]] = block;
+    next_placed[after] = block;
+}
+
+static void unplace ( uint32_t block )
+{
+    next_placed[previous_placed[block]] = next_placed[block];
+    if ( next_placed[block] != UINT32_MAX )
+        previous_placed[next_placed[block]] = previous_placed[block];
+}
+
+/* Moves the blocks to the order of the layout */
+static void finish_layout ( void )
+{
+    uint32_t *new_index = malloc ( function->n_blocks * sizeof(uint32_t) );
+    uint32_t position = 0;
+    for ( uint32_t b = 0; b != UINT32_MAX; b = next_placed[b] )
+        new_index[b] = position++;
+    assert ( position == function->n_blocks );
+    ir_renumber_blocks ( function, new_index );
+    free ( new_index );
+    free ( next_placed );
+    free ( previous_placed );
+    next_placed = previous_placed = NULL;
+    placed_capacity = 0;
+}
+
+/* Starts a copy of some blocks, where no temporaries have been replaced yet */
+static void start_copy ( void )
+{
+    for ( uint32_t i = 0; i < n_replaced; i++ )
+        copy_of[replaced[i]] = NO_VREG;
+    n_replaced = 0;
+    if ( copy_of_len < function->n_vregs )
+    {
+        copy_of = realloc ( copy_of, function->n_vregs * sizeof(vreg_t) );
+        memset ( &copy_of[copy_of_len], 0, ( function->n_vregs - copy_of_len ) * sizeof(vreg_t) );
+        copy_of_len = function->n_vregs;
+    }
+}
+
+static ir_operand_t copy_operand ( ir_operand_t operand )
+{
+    if ( operand.kind == IR_OPERAND_VREG && operand.vreg > function->n_variables && copy_of[operand.vreg] != NO_VREG )
+        operand.vreg = copy_of[operand.vreg];
+    return operand;
+}
+
+/* Appends a copy of instruction to block, where the temporary it writes, if any, is replaced by a new one.
+ * Returns where the copy was placed, which is valid until the next append */
+static ir_instruction_t* append_copy ( uint32_t block, ir_instruction_t instruction )
+{
+    instruction.a = copy_operand ( instruction.a );
+    instruction.b = copy_operand ( instruction.b );
+    if ( instruction.dst > function->n_variables )
+    {
+        if ( n_replaced == replaced_capacity )
+        {
+            replaced_capacity = replaced_capacity * 2 + 16;
+            replaced = realloc ( replaced, replaced_capacity * sizeof(vreg_t) );
+        }
+        replaced[n_replaced++] = instruction.dst;
+        copy_of[instruction.dst] = ir_new_vreg ( function );
+        instruction.dst = copy_of[instruction.dst];
+    }
+    return ir_append ( function, block, instruction );
+}
+
+/* Makes the blocks outside the loop that go to its header go to target instead */
+static void enter_loop_at ( uint32_t l, uint32_t target )
+{
+    const ir_loop_t *loop = &loops.loops[l];
+    const ir_block_t *header = &function->blocks[loop->header];
+    for ( uint32_t p = 0; p < header->n_predecessors; p++ )
+    {
+        if ( IR_IN_LOOP(&loops, l, header->predecessors[p]) )
+            continue;
+        ir_instruction_t *last = IR_TERMINATOR(&function->blocks[header->predecessors[p]]);
+        for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+            if ( last->targets[t] == loop->header )
+                last->targets[t] = target;
+    }
+}
+
+/* Returns whether the operand has the same value in every iteration of the loop: a constant, a variable never assigned
+ * in it, or a temporary, which the header only computes from those */
+static bool is_invariant ( ir_operand_t operand, const uint32_t *assignments )
+{
+    return operand.kind != IR_OPERAND_VREG || operand.vreg > function->n_variables || assignments[operand.vreg] == 0;
+}
+
+/* Finds how much the loop counter is stepped by in every iteration, if it is assigned once, by adding or subtracting
+ * a constant, in a block every iteration runs. Returns 0 otherwise */
+static int64_t find_step ( const ir_loop_t *loop, vreg_t counter, const ir_dominators_t *dominators )
+{
+    for ( uint32_t i = 1; i < loop->n_blocks; i++ )
+    {
+        const ir_block_t *block = &function->blocks[loop->blocks[i]];
+        for ( uint32_t j = 0; j < block->n_instructions; j++ )
+        {
+            const ir_instruction_t *instruction = &block->instructions[j];
+            if ( instruction->dst != counter )
+                continue;
+            if ( instruction->opcode != IR_BINARY )
+                return 0;
+            int64_t step;
+            if ( instruction->op == OP_ADD && instruction->a.kind == IR_OPERAND_VREG && instruction->a.vreg == counter
+                 && instruction->b.kind == IR_OPERAND_CONSTANT )
+                step = instruction->b.constant;
+            else if ( instruction->op == OP_ADD && instruction->b.kind == IR_OPERAND_VREG
+                      && instruction->b.vreg == counter && instruction->a.kind == IR_OPERAND_CONSTANT )
+                step = instruction->a.constant;
+            else if ( instruction->op == OP_SUB && instruction->a.kind == IR_OPERAND_VREG
+                      && instruction->a.vreg == counter && instruction->b.kind == IR_OPERAND_CONSTANT
+                      && instruction->b.constant != INT64_MIN )
+                step = -instruction->b.constant;
+            else
+                return 0;
+
+            // The step is taken on the way to every jump back to the header
+            for ( uint32_t k = 1; k < loop->n_blocks; k++ )
+            {
+                const ir_instruction_t *last = IR_TERMINATOR(&function->blocks[loop->blocks[k]]);
+                for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+                    if ( last->targets[t] == loop->header && !IR_DOMINATES(dominators, loop->blocks[i], loop->blocks[k]) )
+                        return 0;
+            }
+            return step;
+        }
+    }
+    return 0;
+}
+
+static int compare_blocks ( const void *a, const void *b )
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Unrolls the loop if it counts towards a limit by a constant step, and returns whether it did */
+static bool unroll_loop ( uint32_t l, uint32_t factor, uint32_t *assignments, const ir_dominators_t *dominators )
+{
+    const ir_loop_t *loop = &loops.loops[l];
+    const ir_block_t *header = &function->blocks[loop->header];
+    uint32_t depth = header->loop_depth;
+    uint32_t n_body = loop->n_blocks - 1;
+    // Copying the body must not make too much code, and a body with loops of its own is left alone
+    if ( n_body == 0 || loop->header == 0 || loop->first != l )
+        return false;
+
+    uint32_t body_size = 0;
+    for ( uint32_t i = 1; i < loop->n_blocks; i++ )
+    {
+        const ir_block_t *block = &function->blocks[loop->blocks[i]];
+        if ( block->loop_depth != depth )
+            return false;
+        body_size += block->n_instructions;
+    }
+    if ( (uint64_t) body_size * factor > UNROLL_BUDGET )
+        return false;
+
+    memset ( assignments, 0, ( function->n_variables + 1 ) * sizeof(uint32_t) );
+    for ( uint32_t i = 0; i < loop->n_blocks; i++ )
+    {
+        const ir_block_t *block = &function->blocks[loop->blocks[i]];
+        for ( uint32_t j = 0; j < block->n_instructions; j++ )
+            if ( block->instructions[j].dst != NO_VREG && block->instructions[j].dst <= function->n_variables )
+                assignments[block->instructions[j].dst]++;
+    }
+
+    // The header must test counter < limit or counter > limit, where the limit is computed from invariant operands
+    const ir_instruction_t *test = IR_TERMINATOR(header);
+    if ( test->opcode != IR_BRANCH || ( test->op != OP_LT && test->op != OP_GT )
+         || !IR_IN_LOOP(&loops, l, test->targets[0]) || IR_IN_LOOP(&loops, l, test->targets[1]) )
+        return false;
+    for ( uint32_t i = 0; i + 1 < header->n_instructions; i++ )
+    {
+        const ir_instruction_t *instruction = &header->instructions[i];
+        if ( ( instruction->opcode != IR_COPY && instruction->opcode != IR_NEG && instruction->opcode != IR_BINARY )
+             || instruction->dst <= function->n_variables
+             || !is_invariant ( instruction->a, assignments ) || !is_invariant ( instruction->b, assignments ) )
+            return false;
+    }
+    ir_operand_t counter = test->a, limit = test->b;
+    operator_t op = test->op;
+    if ( counter.kind != IR_OPERAND_VREG || counter.vreg > function->n_variables || assignments[counter.vreg] != 1 )
+    {
+        counter = test->b;
+        limit = test->a;
+        op = op == OP_LT ? OP_GT : OP_LT;
+    }
+    if ( counter.kind != IR_OPERAND_VREG || counter.vreg > function->n_variables || assignments[counter.vreg] != 1
+         || !is_invariant ( limit, assignments ) )
+        return false;
+
+    // The counter must move towards the limit, and the copies may go (factor - 1) steps further without overflowing
+    int64_t step = find_step ( loop, counter.vreg, dominators );
+    if ( step == 0 || ( step > 0 ) != ( op == OP_LT ) || step == INT64_MIN
+         || ( step > 0 ? step : -step ) > INT64_MAX / ( factor - 1 ) )
+        return false;
+    int64_t span = step * ( factor - 1 );
+    // Copies run while counter op limit - span, and if the limit is too close to the end of the range for that,
+    // only the original loop runs
+    int64_t closest = op == OP_LT ? INT64_MIN + span : INT64_MAX + span;
+    if ( limit.kind == IR_OPERAND_CONSTANT && ir_relation_holds ( op, limit.constant, closest ) )
+        return false;
+
+    // The blocks of the body are numbered in the order they are in, which the copies keep
+    uint32_t *body_index = malloc ( loops.n_blocks * sizeof(uint32_t) );
+    uint32_t *body_blocks = malloc ( n_body * sizeof(uint32_t) );
+    memcpy ( body_blocks, &loop->blocks[1], n_body * sizeof(uint32_t) );
+    qsort ( body_blocks, n_body, sizeof(uint32_t), compare_blocks );
+    for ( uint32_t b = 0; b < loops.n_blocks; b++ )
+        body_index[b] = UINT32_MAX;
+    for ( uint32_t i = 0; i < n_body; i++ )
+        body_index[body_blocks[i]] = i;
+    uint32_t entry = body_index[test->targets[0]];
+    uint32_t header_block = loop->header;
+    uint32_t header_depth = depth > 0 ? depth - 1 : 0;
+
+    // new_blocks holds the check of the limit if there is one, the test of the unrolled loop, and the copies
+    uint32_t *new_blocks = malloc ( ( 2 + factor * n_body ) * sizeof(uint32_t) );
+    uint32_t n_new = 0;
+    uint32_t check = UINT32_MAX;
+    if ( limit.kind == IR_OPERAND_CONSTANT )
+        limit = IR_CONSTANT(limit.constant - span);
+    else
+    {
+        check = ir_new_block ( function, header_depth );
+        new_blocks[n_new++] = check;
+        start_copy ( );
+        for ( uint32_t i = 0; i + 1 < function->blocks[header_block].n_instructions; i++ )
+            append_copy ( check, function->blocks[header_block].instructions[i] );
+        ir_operand_t original = copy_operand ( limit );
+        limit = IR_VREG(ir_new_vreg ( function ));
+        ir_append ( function, check, (ir_instruction_t) {
+            .opcode = IR_BINARY, .op = OP_SUB, .dst = limit.vreg, .a = original, .b = IR_CONSTANT(span) } );
+        ir_append ( function, check, (ir_instruction_t) {
+            .opcode = IR_BRANCH, .op = op, .a = original, .b = IR_CONSTANT(closest),
+            .targets = { header_block, UINT32_MAX } } );
+    }
+    uint32_t unrolled_test = ir_new_block ( function, depth );
+    new_blocks[n_new++] = unrolled_test;
+    if ( check != UINT32_MAX )
+        IR_TERMINATOR(&function->blocks[check])->targets[1] = unrolled_test;
+    uint32_t *copies = &new_blocks[n_new];
+    for ( uint32_t i = 0; i < factor * n_body; i++ )
+        new_blocks[n_new++] = ir_new_block ( function, function->blocks[body_blocks[i % n_body]].loop_depth );
+
+    ir_append ( function, unrolled_test, (ir_instruction_t) {
+        .opcode = IR_BRANCH, .op = op, .a = counter, .b = limit, .targets = { copies[entry], header_block } } );
+
+    // Every copy goes on to the next instead of the header, and the last to the test of the unrolled loop
+    for ( uint32_t c = 0; c < factor; c++ )
+    {
+        start_copy ( );
+        for ( uint32_t i = 0; i < n_body; i++ )
+        {
+            uint32_t copy = copies[c * n_body + i];
+            const ir_block_t *block = &function->blocks[body_blocks[i]];
+            ir_instruction_t *last = NULL;
+            for ( uint32_t j = 0; j < block->n_instructions; j++ )
+                last = append_copy ( copy, block->instructions[j] );
+            for ( uint32_t t = 0; t < IR_N_TARGETS(last->opcode); t++ )
+            {
+                uint32_t target = last->targets[t];
+                if ( target == header_block )
+                    last->targets[t] = c + 1 < factor ? copies[( c + 1 ) * n_body + entry] : unrolled_test;
+                else if ( target < loops.n_blocks && body_index[target] != UINT32_MAX )
+                    last->targets[t] = copies[c * n_body + body_index[target]];
+            }
+        }
+    }
+
+    enter_loop_at ( l, new_blocks[0] );
+    for ( uint32_t i = 0; i < n_new; i++ )
+        place_after ( previous_placed[header_block], new_blocks[i] );
+    free ( body_index );
+    free ( body_blocks );
+    free ( new_blocks );
+    return true;
+}
+
+void unroll_loops ( ir_function_t *ir )
+{
+    if ( unroll_factor < 2 )
+        return;
+    function = ir;
+    ir_remove_unreachable_blocks ( function );
+    ir_compute_predecessors ( function );
+    ir_find_loops ( function, &loops );
+    if ( loops.n_loops > 0 )
+    {
+        // Only the innermost loops are unrolled, so the loops do not overlap, and the dominators of their blocks stay
+        ir_dominators_t dominators;
+        ir_compute_dominators ( function, &dominators );
+        uint32_t *assignments = malloc ( ( function->n_variables + 1 ) * sizeof(uint32_t) );
+        start_layout ( );
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+            unroll_loop ( l, unroll_factor, assignments, &dominators );
+        finish_layout ( );
+        ir_destroy_dominators ( &dominators );
+        free ( assignments );
+    }
+
+    ir_destroy_loops ( &loops );
+    free ( copy_of );
+    free ( replaced );
+    copy_of = replaced = NULL;
+    copy_of_len = n_replaced = replaced_capacity = 0;
+    function = NULL;
+}
+
+/* Rotates the loop if its header tests whether to leave it. end is the last block of the loop besides the header */
+static void rotate_loop ( uint32_t l, uint32_t end )
+{
+    uint32_t header = loops.loops[l].header;
+    const ir_instruction_t *test = IR_TERMINATOR(&function->blocks[header]);
+    if ( header == 0 || loops.loops[l].size < 2 || test->opcode != IR_BRANCH
+         || IR_IN_LOOP(&loops, l, test->targets[0]) == IR_IN_LOOP(&loops, l, test->targets[1]) )
+        return;
+    uint32_t body = IR_IN_LOOP(&loops, l, test->targets[0]) ? test->targets[0] : test->targets[1];
+
+    // The guard is a copy of the header, entering the loop through a new preheader
+    uint32_t depth = function->blocks[header].loop_depth;
+    uint32_t guard = ir_new_block ( function, depth > 0 ? depth - 1 : 0 );
+    uint32_t preheader = ir_new_block ( function, depth > 0 ? depth - 1 : 0 );
+    start_copy ( );
+    ir_instruction_t *last = NULL;
+    for ( uint32_t i = 0; i < function->blocks[header].n_instructions; i++ )
+        last = append_copy ( guard, function->blocks[header].instructions[i] );
+    for ( uint32_t t = 0; t < 2; t++ )
+        if ( last->targets[t] == body )
+            last->targets[t] = preheader;
+    ir_append ( function, preheader, (ir_instruction_t) { .opcode = IR_JUMP, .targets = { body } } );
+    enter_loop_at ( l, guard );
+
+    // The guard takes the place of the header, which goes after the last block of the loop
+    place_after ( previous_placed[header], guard );
+    place_after ( guard, preheader );
+    unplace ( header );
+    place_after ( end, header );
+}
+
+void rotate_loops ( ir_function_t *ir )
+{
+    function = ir;
+    ir_remove_unreachable_blocks ( function );
+    ir_compute_predecessors ( function );
+    ir_find_loops ( function, &loops );
+    if ( loops.n_loops > 0 )
+    {
+        // Inner loops are rotated first. That only changes the jumps to their own headers,
+        // so the loops around them are still found from the same blocks.
+        // The last block of a loop is the last of its own and those of the loops inside it, which come before it
+        uint32_t *end = calloc ( loops.n_loops, sizeof(uint32_t) );
+        start_layout ( );
+        for ( uint32_t l = 0; l < loops.n_loops; l++ )
+        {
+            const ir_loop_t *loop = &loops.loops[l];
+            for ( uint32_t i = 1; i < loop->n_blocks; i++ )
+                if ( loop->blocks[i] > end[l] )
+                    end[l] = loop->blocks[i];
+            if ( loop->parent != UINT32_MAX && end[l] > end[loop->parent] )
+                end[loop->parent] = end[l];
+            if ( loop->parent != UINT32_MAX && loop->header > end[loop->parent] )
+                end[loop->parent] = loop->header;
+            rotate_loop ( l, end[l] );
+        }
+        finish_layout ( );
+        free ( end );
+    }
+
+    ir_destroy_loops ( &loops );
+    free ( copy_of );
+    free ( replaced );
+    copy_of = replaced = NULL;
+    copy_of_len = n_replaced = replaced_capacity = 0;
+    function = NULL;
+}
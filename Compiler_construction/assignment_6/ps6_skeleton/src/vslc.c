@@ -1,20 +1,34 @@
 #include "vslc.h"
 
+#include <errno.h>
 #include <getopt.h>
 
 /* Command line option parsing for the main function */
 static void options ( int argc, char **argv );
+/* Returns the value of an option taking an integer, which must be all of text, and from min to max */
+static int integer_option ( char option, const char *text, int min, int max );
+/* Turns on the code generation option given as -fNAME */
+static void feature_option ( const char *name );
+/* Measures the size of the program for --stats */
+static void count_program ( stats_counts_t *counts );
 static bool
     print_full_tree = false,
     print_tree_after_simplify = false,
     print_symbol_table_contents = false,
-    print_generated_program = false;
+    print_generated_program = false,
+    print_intermediate_code = false,
+    print_stats = false;
+// 0 generates code straight from the syntax tree, and higher levels go through three-address code in SSA form
+static int optimization_level = 1;
+static const char *output_file = NULL; // Where generated assembly goes, NULL means stdout
 
 /* Entry point */
 int main ( int argc, char **argv )
 {
     options ( argc, argv );
 
+    // Every phase is measured, and the results are printed if --stats is given. See stats.c
+    stats_begin_phase ( PHASE_PARSE );
     yyparse ();       // Generated from grammar/bison, constructs syntax tree
     yylex_destroy (); // Free buffers used by flex
 
@@ -22,21 +36,67 @@ int main ( int argc, char **argv )
     if ( print_full_tree )
         print_syntax_tree ();
 
+    stats_begin_phase ( PHASE_SIMPLIFY );
     simplify_tree ();
     if ( print_tree_after_simplify )
         print_syntax_tree ();
 
     // Operations in symbols.c
+    stats_begin_phase ( PHASE_SYMBOLS );
     create_tables ();
     if ( print_symbol_table_contents )
         print_tables ();
 
+    // Lowering to three-address code and optimizing it counts as code generation, also when it is only printed
+    if ( print_intermediate_code || print_generated_program )
+        stats_begin_phase ( PHASE_CODEGEN );
+
+    // Operations in lower.c and ir.c
+    if ( print_intermediate_code )
+        print_ir_program ( optimization_level );
+
     // Operations in generator.c
     if ( print_generated_program )
-        generate_program ();
+    {
+        generate_program ( optimization_level );
+        peephole_optimize ( );         // In peephole.c
+        emitter_write ( output_file ); // In emitter.c
+    }
+    stats_counts_t counts;
+    count_program ( &counts );
 
+    stats_begin_phase ( PHASE_TEARDOWN );
+    emitter_destroy ();         // In emitter.c
     destroy_tables ();          // In symbols.c
     destroy_syntax_tree ();     // In tree.c
+    destroy_intern_pool ();     // In intern.c
+    stats_end_phase ();
+
+    if ( print_stats )
+        stats_print ( &counts );
+}
+
+static void count_program ( stats_counts_t *counts )
+{
+    *counts = (stats_counts_t) {
+        .nodes = syntax_tree.n_nodes > 0 ? syntax_tree.n_nodes - 1 : 0, // Index 0 is not a node
+        .symbols = global_symbols->n_symbols,
+        .strings = string_list_len,
+        .interned_strings = intern_pool_size ( ),
+        .labels = emitter.n_labels,
+        .instructions = emitter.n_instructions,
+        .assembly_bytes = emitter.n_written,
+        .hoisted_expressions = hoisted_expressions,
+        .peephole_removed = emitter.n_removed
+    };
+
+    // Every function has its own table of parameters and local variables
+    for ( size_t i = 0; i < global_symbols->n_symbols; i++ )
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if ( symbol->type == SYMBOL_FUNCTION )
+            counts->symbols += symbol->function_symtable->n_symbols;
+    }
 }
 
 static const char *usage =
@@ -48,13 +108,32 @@ static const char *usage =
 "\t-t\tOutput the abstract syntax tree\n"
 "\t-T\tOutput the abstract syntax tree after simplification\n"
 "\t-s\tOutput the symbol table contents\n"
-"\t-c\tCompile and generate assembly output\n";
+"\t-i\tOutput the three-address code of each function\n"
+"\t-c\tCompile and generate assembly output\n"
+"\t-O LEVEL\tOptimization level. 0 generates code straight from the syntax tree,\n"
+"\t\tand 1, the default, generates it from three-address code in SSA form\n"
+"\t-u FACTOR\tUnroll loops counting by a constant step FACTOR times, 4 by default, and at most 64. 1 turns it off\n"
+"\t-o FILE\tWrite the generated assembly to FILE instead of stdout. Requires -c\n"
+"\t-ffreestanding\tGenerate a program that does not use the C library, to be linked with -nostdlib -static.\n"
+"\t\tIt starts at _start and makes system calls of Linux directly\n"
+"\t--stats\tPrint the time and memory used by each phase, and the size of the program, to stderr\n";
+
+// Each copy of a loop body is a separate copy of its code, so larger factors only make programs larger
+#define MAX_UNROLL_FACTOR 64
+
+// Long options without a short form use values outside the range of characters
+#define OPTION_STATS 256
+static const struct option long_options[] = {
+    { "help",  no_argument, NULL, 'h' },
+    { "stats", no_argument, NULL, OPTION_STATS },
+    { NULL,    0,           NULL, 0 }
+};
 
 
 static void options ( int argc, char **argv )
 {
     int o;
-    while ( (o=getopt(argc,argv,"htTsc")) != -1 )
+    while ( (o=getopt_long(argc,argv,"htTsicO:u:o:f:",long_options,NULL)) != -1 )
     {
         switch ( o )
         {
@@ -67,7 +146,13 @@ static void options ( int argc, char **argv )
             case 't':   print_full_tree = true;             break;
             case 'T':   print_tree_after_simplify  = true;  break;
             case 's':   print_symbol_table_contents = true; break;
+            case 'i':   print_intermediate_code = true;     break;
             case 'c':   print_generated_program = true;     break;
+            case 'O':   optimization_level = integer_option ( 'O', optarg, 0, 1 );              break;
+            case 'u':   unroll_factor = integer_option ( 'u', optarg, 1, MAX_UNROLL_FACTOR );   break;
+            case 'o':   output_file = optarg;               break;
+            case 'f':   feature_option ( optarg );          break;
+            case OPTION_STATS: print_stats = true;          break;
         }
     }
 
@@ -76,4 +161,38 @@ static void options ( int argc, char **argv )
         fprintf ( stderr, "%s: invalid positional argument '%s'\n", argv[0], argv[optind] );
         exit ( EXIT_FAILURE );
     }
+
+    // Only the generated assembly goes to the file, so it would never be created without -c
+    if ( output_file != NULL && !print_generated_program )
+    {
+        fprintf ( stderr, "%s: -o requires -c\n", argv[0] );
+        exit ( EXIT_FAILURE );
+    }
+}
+
+static int integer_option ( char option, const char *text, int min, int max )
+{
+    char *end;
+    errno = 0;
+    long value = strtol ( text, &end, 10 );
+    if ( end == text || *end != '\0' || errno == ERANGE || value < min || value > max )
+    {
+        fprintf ( stderr, "vslc: invalid value '%s' for -%c, expected a number from %d to %d\n", text, option, min, max );
+        exit ( EXIT_FAILURE );
+    }
+    return (int) value;
+}
+
+static void feature_option ( const char *name )
+{
+    if ( strcmp ( name, "freestanding" ) != 0 )
+    {
+        fprintf ( stderr, "vslc: unknown option '-f%s'\n", name );
+        exit ( EXIT_FAILURE );
+    }
+#ifdef __APPLE__
+    fprintf ( stderr, "vslc: -ffreestanding makes system calls of Linux, and is not supported on macOS\n" );
+    exit ( EXIT_FAILURE );
+#endif
+    freestanding = true;
 }
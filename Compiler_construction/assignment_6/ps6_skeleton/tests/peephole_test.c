@@ -0,0 +1,68 @@
+// Tests of the rules in peephole.c on assembly written by hand, for patterns the code generators
+// do not happen to emit today. Each case is optimized on its own, and must come out as expected.
+//
+// Usage: peephole_test. Prints the cases that fail, and exits with 1 if there are any
+
+#include "emitter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+typedef struct peephole_case
+{
+    const char *name;
+    const char *input;
+    const char *expected;
+} peephole_case_t;
+
+static const peephole_case_t CASES[] = {
+    { "move back to the register the load clobbers",
+      "\tmovq (%rax), %rax\n\tmovq %rax, (%rax)\n",
+      "\tmovq (%rax), %rax\n\tmovq %rax, (%rax)\n" },
+    { "move back to an indexed address",
+      "\tmovq 8(%rcx, %rdx, 8), %rdx\n\tmovq %rdx, 8(%rcx, %rdx, 8)\n",
+      "\tmovq 8(%rcx, %rdx, 8), %rdx\n\tmovq %rdx, 8(%rcx, %rdx, 8)\n" },
+    { "move back to an address with another register",
+      "\tmovq -8(%rbp), %rax\n\tmovq %rax, -8(%rbp)\n",
+      "\tmovq -8(%rbp), %rax\n" },
+    { "move back to an address with a longer register name",
+      "\tmovq (%r10), %r1\n\tmovq %r1, (%r10)\n",
+      "\tmovq (%r10), %r1\n" },
+    { "move back to a register that addresses the store",
+      "\tmovq %rax, (%rax)\n\tmovq (%rax), %rax\n",
+      "\tmovq %rax, (%rax)\n" },
+    { "reload through the register that was stored",
+      "\tmovq %rax, (%rax)\n\tmovq (%rax), %rcx\n",
+      "\tmovq %rax, (%rax)\n\tmovq %rax, %rcx\n" },
+    { "push and pop with the stack pointer",
+      "\tpushq %rax\n\tpopq 8(%rsp)\n",
+      "\tpushq %rax\n\tpopq 8(%rsp)\n" },
+    { "push and pop of registers",
+      "\tpushq %rax\n\tpopq %rcx\n",
+      "\tmovq %rax, %rcx\n" },
+};
+#define N_CASES ( sizeof(CASES) / sizeof(CASES[0]) )
+
+int main ( void )
+{
+    int failed = 0;
+    for ( size_t i = 0; i < N_CASES; i++ )
+    {
+        emitter.length = 0;
+        emit_format ( "%s", CASES[i].input );
+        peephole_optimize ( );
+
+        if ( emitter.length != strlen ( CASES[i].expected )
+             || memcmp ( emitter.buffer, CASES[i].expected, emitter.length ) != 0 )
+        {
+            printf ( "FAIL: %s\nexpected:\n%sgot:\n%.*s", CASES[i].name, CASES[i].expected,
+                     (int) emitter.length, emitter.buffer );
+            failed = 1;
+        }
+    }
+    emitter_destroy ( );
+
+    if ( !failed )
+        printf ( "All %zu peephole cases passed\n", N_CASES );
+    return failed;
+}
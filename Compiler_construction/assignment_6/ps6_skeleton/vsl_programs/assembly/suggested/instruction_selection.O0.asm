@@ -0,0 +1,126 @@
+.text
+.main:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	movq %rdi, %rbx
+	movq %rsi, %r12
+	movq %rbx, %rdi
+	call .add_immediates
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .compare_immediates
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .shifts
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	movq %r12, %rsi
+	call .scaled
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	movq %r12, %rsi
+	call .indexing
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq $0, %rax
+	leaq -16(%rbp), %rsp
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+.add_immediates:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	addq $5, %rdi
+	subq $7, %rdi
+	addq $2147483647, %rdi
+	movq $2147483648, %rsi
+	addq %rsi, %rdi
+	movq $2147483649, %rsi
+	subq %rsi, %rdi
+	addq $-2147483648, %rdi
+	movq %rdi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.compare_immediates:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	cmpq $100, %r10
+	jge .L1
+	movq $1, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.L1:
+	cmpq $-2147483648, %r10
+	jle .L4
+	movq $2, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.L4:
+	movq $4294967296, %rdi
+	cmpq %rdi, %r10
+	jne .L7
+	movq $3, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.L7:
+	movq $4, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.shifts:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	salq $10, %rdi
+	salq $31, %rdi
+	leaq (%rdi, %r10, 8), %rdi
+	movq %rdi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.scaled:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	movq %rsi, %r11
+	leaq (%r10, %r11, 8), %rdi
+	movq %rdi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.indexing:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	movq %rsi, %r11
+	leaq .arr(%rip), %rdi
+	movq %r11, (%rdi, %r10, 8)
+	leaq .arr(%rip), %rdi
+	movq (%rdi, %r10, 8), %rdi
+	addq $1, %rdi
+	leaq .arr(%rip), %rsi
+	movq %rdi, 8(%rsi, %r10, 8)
+	leaq .arr(%rip), %rdi
+	movq 8(%rdi, %r10, 8), %rdi
+	movq %rdi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
@@ -0,0 +1,137 @@
+.text
+.main:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	movq %rdi, %rbx
+	movq %rsi, %r12
+	movq %rbx, %rdi
+	call .add_immediates
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .compare_immediates
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .shifts
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	movq %r12, %rsi
+	call .scaled
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	movq %r12, %rsi
+	call .indexing
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq $0, %rax
+	leaq -16(%rbp), %rsp
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+.add_immediates:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %rsi
+	addq $5, %rsi
+	subq $7, %rsi
+	addq $2147483647, %rsi
+	movq $2147483648, %rcx
+	addq %rcx, %rsi
+	movq $2147483649, %rcx
+	subq %rcx, %rsi
+	addq $-2147483648, %rsi
+	movq %rsi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.compare_immediates:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %rsi
+	cmpq $100, %rsi
+	jge .L4
+	movq $1, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.L4:
+	cmpq $-2147483648, %rsi
+	jle .L6
+	movq $2, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.L6:
+	movq $4294967296, %rcx
+	cmpq %rcx, %rsi
+	jne .L8
+	movq $3, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.L8:
+	movq $4, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.shifts:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %rsi
+	salq $3, %rdi
+	salq $10, %rsi
+	salq $31, %rsi
+	addq %rdi, %rsi
+	movq %rsi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.scaled:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rsi, %rax
+	movq %rdi, %rsi
+	movq %rax, %rdi
+	salq $3, %rdi
+	addq %rdi, %rsi
+	movq %rsi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.indexing:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rsi, %rax
+	movq %rdi, %rsi
+	movq %rax, %rdi
+	leaq .arr(%rip), %rax
+	movq %rdi, (%rax, %rsi, 8)
+	leaq .arr(%rip), %rax
+	movq (%rax, %rsi, 8), %rdi
+	addq $1, %rdi
+	leaq 1(%rsi), %r8
+	leaq .arr(%rip), %rax
+	movq %rdi, (%rax, %r8, 8)
+	addq $1, %rsi
+	leaq .arr(%rip), %rax
+	movq (%rax, %rsi, 8), %rsi
+	movq %rsi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
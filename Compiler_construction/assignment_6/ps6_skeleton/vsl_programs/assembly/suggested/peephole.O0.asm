@@ -0,0 +1,111 @@
+.text
+.main:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	subq $8, %rsp
+	movq %rdi, %rbx
+	call .zeros
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .loop
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	subq $8, %rsp
+	subq $8, %rsp
+	movq %rbx, %rdi
+	call .zeros
+	addq $8, %rsp
+	movq %rax, %rdi
+	pushq %rdi
+	movq $5, %rdi
+	pushq %rdi
+	movq $4, %rdi
+	pushq %rdi
+	movq $3, %rdi
+	pushq %rdi
+	movq $2, %rdi
+	pushq %rdi
+	movq $1, %rdi
+	pushq %rdi
+	movq %rbx, %rdi
+	popq %rsi
+	popq %rdx
+	popq %rcx
+	popq %r8
+	popq %r9
+	call .seven
+	addq $16, %rsp
+	movq %rax, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq $0, %rax
+	leaq -8(%rbp), %rsp
+	popq %rbx
+	popq %rbp
+	ret
+.zeros:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	movq %r10, %r11
+	movq $0, %rdi
+	movq %r11, %rsi
+	imulq %r10, %rsi
+	subq %rsi, %rdi
+	movq %rdi, %r10
+	movq $0, %rdi
+	subq .g(%rip), %rdi
+	movq %rdi, .g(%rip)
+	leaq (%r11, %r10, 1), %rdi
+	addq .g(%rip), %rdi
+	movq %rdi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.loop:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %r10
+	movq $0, %r11
+.L0:
+	addq $1, %r11
+	cmpq %r10, %r11
+	jle .L0
+	movq %r11, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.seven:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	movq %rdi, %r10
+	movq %rsi, %r11
+	movq %rdx, %rbx
+	movq %rcx, %r12
+	movq %r8, %r13
+	movq %r9, %r14
+	movq 16(%rbp), %r15
+	leaq (%r10, %r11, 1), %rdi
+	addq %rbx, %rdi
+	addq %r12, %rdi
+	addq %r13, %rdi
+	addq %r14, %rdi
+	addq %r15, %rdi
+	movq %rdi, %rax
+	leaq -40(%rbp), %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
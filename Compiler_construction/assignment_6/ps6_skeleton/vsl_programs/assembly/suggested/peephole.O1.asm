@@ -0,0 +1,92 @@
+.text
+.main:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	subq $8, %rsp
+	movq %rdi, %rbx
+	call .zeros
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .loop
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq %rbx, %rdi
+	call .zeros
+	movq %rax, %rsi
+	subq $8, %rsp
+	pushq %rsi
+	movq %rbx, %rdi
+	movq $5, %r9
+	movq $4, %r8
+	movq $3, %rcx
+	movq $2, %rdx
+	movq $1, %rsi
+	call .seven
+	addq $16, %rsp
+	movq %rax, %rsi
+	movq %rsi, %rdi
+	call vsl_print_int
+	call vsl_print_newline
+	movq $0, %rax
+	leaq -8(%rbp), %rsp
+	popq %rbx
+	popq %rbp
+	ret
+.zeros:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %rsi
+	imulq %rdi, %rsi
+	negq %rsi
+	movq .g(%rip), %r8
+	negq %r8
+	movq %r8, .g(%rip)
+	addq %rdi, %rsi
+	movq .g(%rip), %rdi
+	addq %rdi, %rsi
+	movq %rsi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.loop:
+	pushq %rbp
+	movq %rsp, %rbp
+	movq %rdi, %rsi
+	movq $0, %rdi
+.L3:
+	addq $1, %rdi
+	cmpq %rsi, %rdi
+	jle .L3
+	movq %rdi, %rax
+	movq %rbp, %rsp
+	popq %rbp
+	ret
+.seven:
+	pushq %rbp
+	movq %rsp, %rbp
+	pushq %rbx
+	movq %r8, %r10
+	movq %r9, %r11
+	movq %rdx, %r8
+	movq %rcx, %r9
+	movq %rsi, %rax
+	movq %rdi, %rsi
+	movq %rax, %rdi
+	movq 16(%rbp), %rbx
+	addq %rdi, %rsi
+	addq %r8, %rsi
+	addq %r9, %rsi
+	addq %r10, %rsi
+	addq %r11, %rsi
+	addq %rbx, %rsi
+	movq %rsi, %rax
+	leaq -8(%rbp), %rsp
+	popq %rbx
+	popq %rbp
+	ret
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+import os
+import sys
+import argparse
+import tempfile
+import subprocess
+
+USAGE = """
+Measures the compile throughput of vslc on large programs from generate-program.py.
+
+Each program is compiled with `vslc -c --stats` several times, and the fastest run is reported,
+with the time of each phase, and lines, nodes and bytes of assembly per second.
+""".strip()
+
+GENERATOR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "generate-program.py")
+
+# The programs of the suite, as arguments to generate-program.py
+SUITE = [
+    ("functions",   ["functions", "--functions", "20000"]),
+    ("expressions", ["expressions", "--functions", "2000", "--chain", "64", "--nesting", "32"]),
+    ("wide",        ["wide", "--functions", "200", "--locals", "2000", "--statements", "50"]),
+    ("strings",     ["strings", "--functions", "2000", "--statements", "100"]),
+    ("shadowing",   ["shadowing", "--functions", "200", "--shadow-depth", "200"]),
+    ("loops",       ["loops", "--functions", "4", "--loop-depth", "8000"]),
+    ("mixed",       ["mixed", "--functions", "10000"]),
+]
+
+PHASES = ["parse", "simplify", "symbols", "codegen", "teardown"]
+
+
+def error(text):
+    print(f"{sys.argv[0]}: error: {text}")
+    sys.exit(1)
+
+
+def parse_stats(stderr):
+    """Reads the phase table and counts printed by vslc --stats"""
+    phases = {}
+    counts = {}
+    for line in stderr.splitlines():
+        fields = line.split()
+        if len(fields) == 6 and fields[0] in PHASES + ["total"]:
+            phases[fields[0]] = float(fields[1])
+        elif len(fields) >= 2 and fields[-1].isdigit():
+            counts[" ".join(fields[:-1])] = int(fields[-1])
+    return phases, counts
+
+
+def compile_program(vslc, vsl_file):
+    with open(vsl_file, "rb") as vsl_fd:
+        proc = subprocess.run([vslc, "-c", "--stats", "-o", os.devnull], stdin=vsl_fd,
+                              capture_output=True, text=True, check=False)
+    if proc.returncode != 0:
+        error(f"vslc failed on {vsl_file}:\n{proc.stderr}")
+    return parse_stats(proc.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=USAGE, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--vslc", default="../build/vslc", help="the compiler to measure (default ../build/vslc)")
+    parser.add_argument("--repeat", type=int, default=3, help="compilations of each program (default 3)")
+    parser.add_argument("--scale", type=float, default=1.0, help="multiplies the number of functions (default 1)")
+    parser.add_argument("programs", nargs="*", help="only run these programs of the suite")
+    args = parser.parse_args()
+
+    if not os.path.isfile(args.vslc):
+        error(f"file not found: {args.vslc}")
+
+    suite = [(name, gen_args) for name, gen_args in SUITE if not args.programs or name in args.programs]
+
+    header = f"{'program':<12} {'lines':>9} {'nodes':>10} {'asm KB':>9}"
+    header += "".join(f" {phase + ' ms':>12}" for phase in PHASES)
+    header += f" {'total ms':>10} {'lines/s':>11} {'nodes/s':>11} {'asm MB/s':>9}"
+    print(header)
+
+    with tempfile.TemporaryDirectory() as directory:
+        for name, gen_args in suite:
+            gen_args = list(gen_args)
+            index = gen_args.index("--functions") + 1
+            gen_args[index] = str(max(1, int(int(gen_args[index]) * args.scale)))
+
+            vsl_file = os.path.join(directory, f"{name}.vsl")
+            with open(vsl_file, "w") as vsl_fd:
+                subprocess.run([sys.executable, GENERATOR] + gen_args, stdout=vsl_fd, check=True)
+            with open(vsl_file, "rb") as vsl_fd:
+                lines = sum(1 for _ in vsl_fd)
+
+            runs = [compile_program(args.vslc, vsl_file) for _ in range(args.repeat)]
+            phases, counts = min(runs, key=lambda run: run[0]["total"])
+
+            seconds = phases["total"] / 1000
+            row = f"{name:<12} {lines:>9} {counts['nodes']:>10} {counts['assembly bytes'] // 1024:>9}"
+            row += "".join(f" {phases.get(phase, 0):>12.1f}" for phase in PHASES)
+            row += f" {phases['total']:>10.1f} {lines / seconds:>11.0f} {counts['nodes'] / seconds:>11.0f}"
+            row += f" {counts['assembly bytes'] / seconds / 1e6:>9.1f}"
+            print(row, flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+
+import sys
+import random
+import argparse
+
+USAGE = """
+Generates a large, valid VSL program, and prints it to stdout.
+The same arguments and seed always give the same program.
+
+Each SHAPE stresses a different part of vslc:
+  functions   many small functions calling each other
+  expressions long operator chains and deeply parenthesized expressions
+  wide        blocks declaring many local variables
+  strings     many print statements with string literals
+  shadowing   deeply nested blocks that redeclare the same names
+  loops       deeply nested while loops
+  mixed       a bit of everything
+""".strip()
+
+SHAPES = ["functions", "expressions", "wide", "strings", "shadowing", "loops", "mixed"]
+
+# Operators that are safe to chain with any operands. Division is only done by non-zero constants
+OPERATORS = ["+", "-", "*"]
+RELATIONS = ["=", "!=", "<", ">"]
+
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.lines = []
+
+    def emit(self, depth, text):
+        self.lines.append("    " * depth + text)
+
+    def operand(self, names):
+        if not names or self.rng.random() < 0.3:
+            return str(self.rng.randint(0, 1000))
+        return self.rng.choice(names)
+
+    def chain(self, names, length):
+        """A left associative chain of length operands"""
+        parts = [self.operand(names)]
+        for _ in range(length - 1):
+            parts.append(self.rng.choice(OPERATORS))
+            parts.append(self.operand(names))
+        return " ".join(parts)
+
+    def nested(self, names, depth):
+        """An expression nested depth parentheses deep"""
+        expression = self.operand(names)
+        for _ in range(depth):
+            op = self.rng.choice(OPERATORS + ["/"])
+            if op == "/":
+                expression = f"({expression}) / {self.rng.randint(1, 9)}"
+            else:
+                expression = f"{self.operand(names)} {op} ({expression})"
+        return expression
+
+    def relation(self, names):
+        return f"{self.operand(names)} {self.rng.choice(RELATIONS)} {self.operand(names)}"
+
+    def statements(self, depth, names, count, callable_functions):
+        """count simple statements, using the variables in names"""
+        args = self.args
+        for _ in range(count):
+            kind = self.rng.randrange(6)
+            target = self.rng.choice(names)
+            if kind == 0:
+                self.emit(depth, f"{target} := {self.chain(names, args.chain)}")
+            elif kind == 1:
+                self.emit(depth, f"{target} := {self.nested(names, args.nesting)}")
+            elif kind == 2:
+                self.emit(depth, f"if {self.relation(names)} then {target} := {target} + 1 "
+                                 f"else {target} := {target} - 1")
+            elif kind == 3:
+                self.emit(depth, f"while {target} > 0 do {target} := {target} - {self.rng.randint(1, 5)}")
+            elif kind == 4 and callable_functions:
+                name, n_params = self.rng.choice(callable_functions)
+                call_args = ", ".join(self.operand(names) for _ in range(n_params))
+                self.emit(depth, f"{target} := {name}({call_args})")
+            else:
+                self.emit(depth, f"print \"{target} is\", {target}")
+
+    def function(self, index, n_params, n_locals, n_statements, callable_functions):
+        params = [f"p{i}" for i in range(n_params)]
+        local_names = [f"v{i}" for i in range(n_locals)]
+        self.emit(0, f"func f{index}({', '.join(params)}) begin")
+        for i in range(0, len(local_names), 8):
+            self.emit(1, "var " + ", ".join(local_names[i:i + 8]))
+        if not local_names:
+            # A block needs at least one statement, and the statements need a variable
+            self.emit(1, "var v0")
+            local_names = ["v0"]
+        self.statements(1, params + local_names, n_statements, callable_functions)
+        self.emit(1, f"return {self.chain(params + local_names, 3)}")
+        self.emit(0, "end")
+
+    def shadowing_function(self, index):
+        """Nests blocks shadow_depth deep, each redeclaring x and y, and using names from all levels"""
+        args = self.args
+        self.emit(0, f"func f{index}() begin")
+        self.emit(1, "var x, y")
+        self.emit(1, "x := 1")
+        depth = 1
+        for level in range(args.shadow_depth):
+            self.emit(depth, "begin")
+            depth += 1
+            self.emit(depth, f"var x, y, z{level}")
+            self.emit(depth, f"x := {level}")
+            self.emit(depth, f"z{level} := x + {self.rng.randint(0, 9)}")
+        for level in reversed(range(args.shadow_depth)):
+            self.emit(depth, f"y := x + z{level}")
+            depth -= 1
+            self.emit(depth, "end")
+        self.emit(1, "return x")
+        self.emit(0, "end")
+
+    def loops_function(self, index):
+        """Nests while loops loop_depth deep, all counting with the same variable.
+        The indentation stops growing at 8 levels, so the program does not grow with the square of the depth"""
+        args = self.args
+        self.emit(0, f"func f{index}(n) begin")
+        self.emit(1, "var i, s")
+        self.emit(1, "i := 0")
+        self.emit(1, "s := 0")
+        for level in range(args.loop_depth):
+            self.emit(min(level + 1, 8), "while i < n do begin")
+            self.emit(min(level + 2, 8), f"s := s + i * {self.rng.randint(1, 9)}")
+        for level in reversed(range(args.loop_depth)):
+            self.emit(min(level + 2, 8), "i := i + 1")
+            self.emit(min(level + 1, 8), "end")
+        self.emit(1, "return s")
+        self.emit(0, "end")
+
+    def strings_function(self, index, n_prints):
+        self.emit(0, f"func f{index}() begin")
+        self.emit(1, "var i")
+        self.emit(1, "i := 0")
+        for i in range(n_prints):
+            self.emit(1, f"print \"string number {index}.{i} with some text\", i")
+        self.emit(1, "return i")
+        self.emit(0, "end")
+
+    def generate(self):
+        args = self.args
+        shape = args.shape
+        n = args.functions
+
+        self.emit(0, f"// Generated by generate-program.py {' '.join(sys.argv[1:])}")
+        self.emit(0, "var g0, g1, g2, table[64]")
+
+        # The first function is the entry point of a VSL program
+        self.emit(0, "func main() begin")
+        self.emit(1, "return 0")
+        self.emit(0, "end")
+
+        # Functions may only call functions declared before them, which keeps the call graph acyclic.
+        # Only the most recent ones are called, to keep call sites spread out
+        callable_functions = []
+        for index in range(n):
+            kind = shape if shape != "mixed" else SHAPES[index % 5]
+            if kind == "functions":
+                n_params = self.rng.randint(0, 8)
+                self.function(index, n_params, 2, args.statements, callable_functions[-16:])
+                callable_functions.append((f"f{index}", n_params))
+            elif kind == "expressions":
+                self.function(index, 2, 2, args.statements, [])
+            elif kind == "wide":
+                self.function(index, 2, args.locals, args.statements, [])
+            elif kind == "strings":
+                self.strings_function(index, args.statements)
+            elif kind == "loops":
+                self.loops_function(index)
+            else:
+                self.shadowing_function(index)
+
+        return "\n".join(self.lines) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=USAGE, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("shape", choices=SHAPES)
+    parser.add_argument("--functions", type=int, default=1000, help="number of functions (default 1000)")
+    parser.add_argument("--statements", type=int, default=20, help="statements per function (default 20)")
+    parser.add_argument("--chain", type=int, default=8, help="operands in each operator chain (default 8)")
+    parser.add_argument("--nesting", type=int, default=4, help="parenthesis depth of nested expressions (default 4)")
+    parser.add_argument("--locals", type=int, default=200, help="locals per function in wide blocks (default 200)")
+    parser.add_argument("--shadow-depth", type=int, default=50, help="block nesting depth for shadowing (default 50)")
+    parser.add_argument("--loop-depth", type=int, default=50, help="while loop nesting depth for loops (default 50)")
+    parser.add_argument("--seed", type=int, default=1, help="random seed (default 1)")
+    args = parser.parse_args()
+
+    sys.stdout.write(Generator(args).generate())
+
+
+if __name__ == "__main__":
+    main()